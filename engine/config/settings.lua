@@ -41,6 +41,8 @@ settings.default_settings = {
         build_type      = { index = 1, value = 1, ptype = "combo", plist = buildtypes },
         build_relative  = { index = 2, value = false, ptype = "check" },
         build_bytecode  = { index = 3, value = true, ptype = "check" },
+        build_archive   = { index = 4, value = true, ptype = "check" },        -- Pack assets into <project>.pak
+        archive_compress = { index = 5, value = false, ptype = "check" },      -- zlib text entries (smaller pak, slower start)
     },
 
     project = {
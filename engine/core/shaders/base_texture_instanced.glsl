@@ -0,0 +1,61 @@
+@ctype mat4 hmm_mat4
+
+@vs vs
+// One entry per instance. Same layout as the base_texture vs_params block, so the
+// bins can copy each geometry's uniform data straight into the instance buffer.
+struct sb_instance {
+    mat4 mvp;
+    vec4 base_color_factor;
+};
+
+layout(binding=0) readonly buffer instances {
+    sb_instance inst[];
+};
+
+layout(binding=0) uniform vs_inst_params {
+    int instance_base;
+};
+
+layout(location=0) in vec3 position;
+layout(location=1) in vec2 texcoord;
+layout(location=2) in vec3 normal;
+
+out vec2 uv;
+out vec4 base_color_out;
+
+void main() {
+    sb_instance i = inst[instance_base + gl_InstanceIndex];
+    uv = texcoord;
+    base_color_out = i.base_color_factor;
+    gl_Position = i.mvp * vec4(position, 1.0);
+    vec3 cam = vec3(0.707, 0.0, 0.707);
+    base_color_out *= clamp( dot( normal, cam), 0.5, 1.0);
+}
+@end
+
+@fs fs
+// Same layout as base_texture fs_params (renamed so the generated ctypes do not clash)
+layout(binding=1) uniform fs_inst_params {
+    float alpha_cutoff;
+    int alpha_mode; // 0=opaque, 1=mask, 2=blend
+};
+
+layout(location=0) in vec2 uv;
+layout(location=1) in vec4 base_color_out;
+
+layout(binding=0) uniform texture2D base_color_tex;
+layout(binding=0) uniform sampler base_color_smp;
+
+out vec4 frag_color;
+
+void main() {
+    vec4 color = texture(sampler2D(base_color_tex, base_color_smp), uv) * base_color_out;
+
+    if (alpha_mode == 1 && color.a < alpha_cutoff)
+        discard;
+
+    frag_color = color;
+}
+@end
+
+@program base_texture_instanced vs fs
@@ -0,0 +1,61 @@
+@ctype mat4 hmm_mat4
+
+@vs vs
+// Same layout as the base_texture vs_params block (renamed so the generated ctypes do not clash).
+// Positions are USHORT4N relative to the mesh aabb. The dequantize offset/scale is folded into
+// mvp on the cpu, so position is used as is (w is stored as 1.0).
+layout(binding=0, std140) uniform vs_quant_params {
+    mat4 mvp;
+    vec4 base_color_factor;
+};
+
+layout(location=0) in vec4 position;
+layout(location=1) in vec2 texcoord;    // HALF2 or USHORT2N, arrives as float
+layout(location=2) in vec2 normal;      // Octahedral SHORT2N
+
+out vec2 uv;
+out vec4 base_color_out;
+
+vec3 oct_decode(vec2 e) {
+    vec3 n = vec3(e.xy, 1.0 - abs(e.x) - abs(e.y));
+    float t = max(-n.z, 0.0);
+    n.x += (n.x >= 0.0) ? -t : t;
+    n.y += (n.y >= 0.0) ? -t : t;
+    return normalize(n);
+}
+
+void main() {
+    uv = texcoord;
+    base_color_out = base_color_factor;
+    gl_Position = mvp * vec4(position.xyz, 1.0);
+    vec3 cam = vec3(0.707, 0.0, 0.707);
+    base_color_out *= clamp( dot( oct_decode(normal), cam), 0.5, 1.0);
+}
+@end
+
+@fs fs
+// Same layout as base_texture fs_params
+layout(binding=1) uniform fs_quant_params {
+    float alpha_cutoff;
+    int alpha_mode; // 0=opaque, 1=mask, 2=blend
+};
+
+layout(location=0) in vec2 uv;
+layout(location=1) in vec4 base_color_out;
+
+layout(binding=0) uniform texture2D base_color_tex;
+layout(binding=0) uniform sampler base_color_smp;
+
+out vec4 frag_color;
+
+void main() {
+    vec4 color = texture(sampler2D(base_color_tex, base_color_smp), uv) * base_color_out;
+
+    if (alpha_mode == 1 && color.a < alpha_cutoff)
+        discard;
+
+    frag_color = color;
+}
+@end
+
+@program base_texture_quantized vs fs
@@ -0,0 +1,191 @@
+-- --------------------------------------------------------------------------------------
+-- Native worker threads for batch jobs (image decode and the like).
+--   LuaJIT cannot call into one lua_State from several threads, so every worker gets its
+--   own lua_State (from the LuaJIT api the executable exports) running the job body, and
+--   talks to the caller only through cdata it is handed. Threads live for one run() call:
+--   run() starts one thread per arg, joins them all and returns. Long lived threads (a pool
+--   waiting on a condition variable, for example) use spawn() and join() directly.
+--
+--   The body is Lua source returning function(arg, now), arg being a void * and now() a wall
+--   clock in ms. It runs in a fresh state, so it can only use ffi, the cdefs passed with it
+--   and plain Lua. An error in the body ends that job only: join() and run() hand back the
+--   message, bodies that want to report per item failures write them into their arg.
+--   Where threads are not available (Windows, missing exports) the same body runs on the
+--   calling thread, one arg after another.
+-- --------------------------------------------------------------------------------------
+
+local ffi           = require("ffi")
+
+local tinsert       = table.insert
+
+-- --------------------------------------------------------------------------------------
+
+local workers   = {
+    threads     = 4,        -- How many args callers split a batch into (one thread each)
+    available   = false,    -- Set when pthreads and the lua api can be reached
+}
+
+-- --------------------------------------------------------------------------------------
+
+ffi.cdef[[
+typedef struct lua_State lua_State;
+lua_State *luaL_newstate(void);
+void luaL_openlibs(lua_State *L);
+int luaL_loadstring(lua_State *L, const char *s);
+int lua_pcall(lua_State *L, int nargs, int nresults, int errfunc);
+void lua_pushlstring(lua_State *L, const char *s, size_t l);
+void lua_getfield(lua_State *L, int idx, const char *k);
+ptrdiff_t lua_tointeger(lua_State *L, int idx);
+const char *lua_tolstring(lua_State *L, int idx, size_t *len);
+void lua_close(lua_State *L);
+
+int pthread_create(uintptr_t *thread, const void *attr, void *(*start)(void *), void *arg);
+int pthread_join(uintptr_t thread, void **retval);
+
+typedef struct worker_timespec { int64_t tv_sec; long tv_nsec; } worker_timespec;
+int clock_gettime(int clk_id, worker_timespec *tp);
+]]
+
+local CLOCK_MONOTONIC = (ffi.os == "OSX") and 6 or 1
+local LUA_GLOBALSINDEX = -10002
+local pt    = nil
+
+if(ffi.os ~= "Windows") then
+    local ok = pcall(function() return ffi.C.luaL_newstate and ffi.C.lua_close end)
+    if(ok) then
+        -- pthread is in libc on newer glibc and macOS, older glibc has it separate
+        if(pcall(function() return ffi.C.pthread_create end)) then
+            pt = ffi.C
+        else
+            local okp, lib = pcall(ffi.load, "pthread")
+            if(okp) then pt = lib end
+        end
+    end
+    workers.available = (pt ~= nil)
+end
+
+-- --------------------------------------------------------------------------------------
+-- Bootstrap for a worker state: cdefs, body, then a C callback wrapping the job function.
+--   The callback belongs to the worker state and is freed with it. An error must not leave
+--   the callback (it would abort the process), it is kept in worker_error for join().
+local bootstrap = [[
+local ffi = require("ffi")
+local cdefs, body = ...
+ffi.cdef("typedef struct { int64_t tv_sec; long tv_nsec; } timespec_t; int clock_gettime(int, timespec_t *);")
+if(#cdefs > 0) then ffi.cdef(cdefs) end
+local ts = ffi.new("timespec_t[1]")
+local clk = (ffi.os == "OSX") and 6 or 1
+local function now()
+    ffi.C.clock_gettime(clk, ts)
+    return tonumber(ts[0].tv_sec) * 1000.0 + tonumber(ts[0].tv_nsec) / 1000000.0
+end
+local job = assert(loadstring(body))()
+worker_callback = ffi.cast("void *(*)(void *)", function(arg)
+    local ok, err = pcall(job, arg, now)
+    if(not ok) then worker_error = tostring(err) end
+    return nil
+end)
+return tonumber(ffi.cast("intptr_t", worker_callback))
+]]
+
+-- --------------------------------------------------------------------------------------
+-- Milliseconds from a monotonic clock (wall time, os.clock counts cpu time of all threads)
+local ts = ffi.new("worker_timespec[1]")
+workers.now = function()
+
+    if(ffi.os == "Windows") then return os.clock() * 1000.0 end
+    ffi.C.clock_gettime(CLOCK_MONOTONIC, ts)
+    return tonumber(ts[0].tv_sec) * 1000.0 + tonumber(ts[0].tv_nsec) / 1000000.0
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function new_state(cdefs, body)
+
+    local L = ffi.C.luaL_newstate()
+    if(L == nil) then return nil, "cannot create lua state" end
+    ffi.C.luaL_openlibs(L)
+    if(ffi.C.luaL_loadstring(L, bootstrap) ~= 0) then
+        local err = ffi.string(ffi.C.lua_tolstring(L, -1, nil))
+        ffi.C.lua_close(L)
+        return nil, err
+    end
+    ffi.C.lua_pushlstring(L, cdefs, #cdefs)
+    ffi.C.lua_pushlstring(L, body, #body)
+    if(ffi.C.lua_pcall(L, 2, 1, 0) ~= 0) then
+        local err = ffi.string(ffi.C.lua_tolstring(L, -1, nil))
+        ffi.C.lua_close(L)
+        return nil, err
+    end
+    local start = ffi.cast("void *(*)(void *)", ffi.C.lua_tointeger(L, -1))
+    return L, start
+end
+
+-- --------------------------------------------------------------------------------------
+-- Start one thread running body with arg. Returns a handle for join(), or nil and an error.
+--   Only when workers.available.
+workers.spawn = function(cdefs, body, arg)
+
+    local L, start = new_state(cdefs, body)
+    if(L == nil) then return nil, start end
+    local tid = ffi.new("uintptr_t[1]")
+    if(pt.pthread_create(tid, nil, start, ffi.cast("void *", arg)) ~= 0) then
+        ffi.C.lua_close(L)
+        return nil, "pthread_create failed"
+    end
+    return { L = L, tid = tid, arg = arg }
+end
+
+-- Wait for a spawned thread to return and free its state. Returns the error of its body, if any.
+workers.join = function(thread)
+    pt.pthread_join(thread.tid[0], nil)
+    local L = thread.L
+    ffi.C.lua_getfield(L, LUA_GLOBALSINDEX, "worker_error")
+    local err = ffi.C.lua_tolstring(L, -1, nil)
+    err = (err ~= nil) and ffi.string(err) or nil
+    ffi.C.lua_close(L)
+    return err
+end
+
+local function run_here(job, arg, i, errors)
+    local ok, err = pcall(job, ffi.cast("void *", arg), workers.now)
+    if(not ok) then errors[i] = tostring(err) end
+end
+
+-- --------------------------------------------------------------------------------------
+-- Run body once per arg (cdata pointers the caller keeps alive), in parallel when possible.
+--   cdefs are the declarations body needs that the calling state already has.
+--   Returns the number of threads used (0 means it ran on the calling thread) and a table of
+--   errors by arg index (empty when every body returned).
+workers.run = function(cdefs, body, args)
+
+    local errors = {}
+    if(workers.available and workers.threads > 1 and #args > 1) then
+        local running = {}
+        for i, arg in ipairs(args) do
+            local thread, err = workers.spawn(cdefs, body, arg)
+            if(thread == nil) then
+                pprint("[Error workers.run] "..err)
+                break
+            end
+            tinsert(running, thread)
+        end
+        for i, thread in ipairs(running) do errors[i] = workers.join(thread) end
+        -- Anything that did not get a thread runs here
+        if(#running < #args) then
+            local job = assert(loadstring(body))()
+            for i = #running + 1, #args do run_here(job, args[i], i, errors) end
+        end
+        return #running, errors
+    end
+
+    local job = assert(loadstring(body))()
+    for i, arg in ipairs(args) do run_here(job, arg, i, errors) end
+    return 0, errors
+end
+
+-- --------------------------------------------------------------------------------------
+
+return workers
+
+-- --------------------------------------------------------------------------------------
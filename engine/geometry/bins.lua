@@ -13,6 +13,35 @@
 -- 
 --  Notes: Initially the shader order id, will not be managed or used. To be implemented later if
 --         needed (which is expected)
+--
+--  sort keys
+--    Each bin_state carries a packed 64 bit sort key built from the bin priority, pipeline id, 
+--    bindings id, material id and depth. Every frame the visible states of a bin are radix sorted 
+--    on this key so draws sharing a pipeline and bindings are submitted together, and the submit 
+--    loop skips any pipeline or bindings apply that is already current.
+--    Opaque style bins sort:   priority | pipeline | bindings | material | depth (front to back)
+--    Transparent bins sort:    priority | depth (back to front) | pipeline | bindings | material
+--
+--  instancing
+--    Once a bin is sorted, runs of states with the same pipeline, bindings, draw range and fs params
+--    are collapsed into one instanced draw. Each member's vs params block is copied into a per frame
+--    storage buffer and the run is drawn with the geometry's instanced pipeline (inst_pip), which 
+--    reads its per instance data from that buffer. States without an inst_pip are drawn as before.
+--    Bins are prepared once per frame (before any pass) because the instance buffer can only be 
+--    updated once per frame.
+--
+--  culling
+--    Geometry added with an aabb gets world space bounds in the culling module (SoA arrays).
+--    Before a camera's bins are prepared, all bounds are tested against that camera's frustum 
+--    and the CULLED flag (0x02) is written into each state. Draw lists are therefore prepared 
+--    per camera and bin. Set camera.cull = false to disable culling for a camera.
+--
+--  compiled passes
+--    A pass whose bins rarely change can be compiled (pass_compile). Its visible states are 
+--    flattened once into a bin_cmd array with the pipeline/bindings applies already decided, and 
+--    render just replays that array. The array is rebuilt when one of its bins changes through 
+--    bin_add_geom, bin_remove, bin_clear or bin_set_func. Visibility flags written directly to a 
+--    bin_state are not seen, call bin_mark_dirty for those. Compiled passes are not culled.
 -- 
 --
 --  bin default priority ranges. 
@@ -50,6 +79,8 @@ local hmm       = require("hmm")
 local hutils    = require("hmm_utils")
 
 local utils     = require("lua.utils")
+local meshes    = require("lua.geometry.meshes")
+local culling   = require("lua.geometry.culling")
 
 local cammgr    = require("lua.engine.camera_manager")
 
@@ -58,8 +89,15 @@ local ffi       = require("ffi")
 -- ---------------------------------------------------------------------------------------------------
 
 local tinsert   = table.insert
+local tremove   = table.remove
 local tcount    = table.getn
 
+local band      = bit.band
+local bor       = bit.bor
+local lshift    = bit.lshift
+local rshift    = bit.rshift
+local floor     = math.floor
+
 -- ---------------------------------------------------------------------------------------------------
 
 local bintype = {
@@ -109,15 +147,73 @@ typedef struct bin_state {
 
     sg_pipeline     pip;
     sg_bindings*    bind;
+    sg_pipeline     inst_pip;       // Instanced variant of pip, id 0 if the geometry has none
 
     uint8_t         state;          // Visibility, and other important flags
+    int             cull_id;        // Slot in the culling bounds arrays, -1 if never culled
     int             offset; 
     int             count;
     int             instances;
+
+    uint16_t        bind_id;        // Small id for the bindings (sort key only)
+    uint16_t        material;       // Material id (sort key only)
+    float           depth;          // Normalized view depth 0..1. Owner updates this per frame.
+    union {
+        uint64_t    sortkey;        // Packed: priority | pipeline | bindings | material | depth
+        struct { uint32_t key_lo, key_hi; };
+    };
 } bin_state;
 
+// Per pass submission counters. Reset at the start of each pass render.
+typedef struct bin_pass_stats {
+    int             draws;
+    int             pipelines;          // sg_apply_pipeline calls made
+    int             bindings;           // sg_apply_bindings calls made
+    int             uniforms;           // sg_apply_uniforms calls made
+    int             skipped_pipelines;  // redundant pipeline applies avoided
+    int             skipped_bindings;   // redundant bindings applies avoided
+    int             instanced_draws;    // draws that were collapsed runs
+    int             instances;          // states drawn through those instanced draws
+    int             triangles;          // triangles submitted (all instances)
+} bin_pass_stats;
+
+// Frustum culling results for a camera, from the last render
+typedef struct bin_cull_stats {
+    int             culled;         // visible states rejected by the frustum test
+    int             drawn;          // visible states that passed
+} bin_cull_stats;
+
+// A prepared draw for a bin. Built once per frame from the sorted states.
+typedef struct bin_draw {
+    bin_state       *ds;            // State to draw, or the first state of an instanced run
+    int             instances;      // Run length if collapsed into an instanced draw, else 0
+    int             instance_base;  // First instance of the run in the frame instance buffer
+} bin_draw;
+
+// A command in a compiled pass. The apply flags are worked out when the pass is compiled.
+typedef struct bin_cmd {
+    uint8_t         flags;          // BIN_CMD_* below
+    int             bin;            // Bin id for BIN_CMD_FUNCS
+    sg_pipeline     pip;
+    sg_bindings     *bind;
+    sg_range        *vs_params;
+    sg_range        *fs_params;
+    int             offset;
+    int             count;
+    int             instances;
+    int             first;          // Instanced runs: first member in the compiled state list, else -1
+    int             instance_base;  // Instanced runs: refreshed every frame
+} bin_cmd;
 ]]
 
+local BIN_CMD_PIPELINE  = 0x01
+local BIN_CMD_BINDINGS  = 0x02
+local BIN_CMD_FUNCS     = 0x04
+local BIN_CMD_DRAW      = 0x08
+
+-- The key halves are accessed through the union above, this needs little endian.
+assert(ffi.abi("le"), "[bins] sort keys require a little endian target")
+
 -- ---------------------------------------------------------------------------------------------------
 -- A table (like a class) to handle the main singleton of bins. 
 --     Note: This could be extended to have multiple bins if needed.
@@ -128,34 +224,521 @@ local bin_mgr       = {}
 bin_mgr.init = function() 
 
     bin_mgr.bins        = utils.deepcopy(default_bins)
+    bin_mgr.bin_funcs   = { }       -- Per bin callbacks, run before the bin geometry is drawn
+    bin_mgr.bin_free    = { }       -- Per bin slots emptied by bin_remove, reused by bin_add_geom
+    bin_mgr.bin_geoms   = { }       -- bin_state -> geometry that added it, for bin_remove
     bin_mgr.passes      = { }
+    bin_mgr.pass_stats  = { }       -- bin_pass_stats[1] per passid
     bin_mgr.cameras     = { }
 
+    bin_mgr.bind_ids    = { }       -- bindings address -> small id
+    bin_mgr.bind_count  = 0
+    bin_mgr.material_ids = { }      -- material table -> small id
+    bin_mgr.material_count = 0
+
+    bin_mgr.bin_draws   = { }       -- prepared draw lists per camera and bin, rebuilt every frame
+    bin_mgr.prepared    = { }       -- camera id -> { binid -> draws } for the current frame
+    bin_mgr.bin_gens    = { }       -- binid -> change counter, compiled passes rebuild when it moves
+    bin_mgr.frame_id    = 0
+    bin_mgr.cull_stats  = { }       -- bin_cull_stats[1] per camera id
+    bin_mgr.inst_binds  = { }       -- bindings address -> copy with the instance buffer bound
+    bin_mgr.instancing  = sg.sg_query_features().storage_buffer
+    bin_mgr.instance_min = 2        -- shortest run worth collapsing
+
+    culling.init()
+
     for k,v in pairs(bintype) do 
         bin_mgr[k] = v
     end
 end
 
 -- ---------------------------------------------------------------------------------------------------
--- TODO: Need to deal with this. Will become a fast lookup for numerous items
-local cache = {}
+-- Sort key helpers. 
+--   Ids only need to be unique enough to group draws. The submit loop compares the real pipeline 
+--   and bindings so a wrapped id can only cost an extra apply, never a wrong one.
+
+local function get_bind_id(bind)
+    if(bind == nil) then return 0 end
+    local addr = tonumber(ffi.cast("uintptr_t", bind))
+    local id = bin_mgr.bind_ids[addr]
+    if(id == nil) then 
+        bin_mgr.bind_count = bin_mgr.bind_count + 1
+        id = band(bin_mgr.bind_count, 0x3FFF)
+        bin_mgr.bind_ids[addr] = id
+    end
+    return id
+end
+
+local function get_material_id(material)
+    if(material == nil) then return 0 end
+    if(type(material) == "number") then return band(material, 0xFFFF) end
+    local id = bin_mgr.material_ids[material]
+    if(id == nil) then 
+        bin_mgr.material_count = bin_mgr.material_count + 1
+        id = band(bin_mgr.material_count, 0xFFFF)
+        bin_mgr.material_ids[material] = id
+    end
+    return id
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Pack the sort key for a state in a bin. Called per frame for visible states (depth moves).
+local function bin_make_key(ds, binid)
+
+    local prio  = band(rshift(binid, 12), 0x0F)
+    local pip   = band(ds.pip.id, 0x3FFF)           -- slot index of the pipeline handle
+    local d     = ds.depth
+    if(d < 0.0) then d = 0.0 elseif(d > 1.0) then d = 1.0 end
+    local depth = floor(d * 0xFFFF)
+
+    if(binid == bintype.BTYPE_TRANSPARENT) then 
+        ds.key_hi = bor(lshift(prio, 28), lshift(0xFFFF - depth, 12), band(pip, 0x0FFF))
+        ds.key_lo = bor(lshift(ds.bind_id, 16), ds.material)
+    else
+        ds.key_hi = bor(lshift(prio, 28), lshift(pip, 14), ds.bind_id)
+        ds.key_lo = bor(lshift(ds.material, 16), depth)
+    end
+end
+
+bin_mgr.make_key = bin_make_key
+
+-- ---------------------------------------------------------------------------------------------------
+-- Per frame scratch for sorting. Grows to the largest bin seen, never shrinks.
+local sort_size     = 0
+local sort_states   = nil       -- bin_state* gathered from a bin
+local sort_lo       = nil       -- key halves copied out of the states
+local sort_hi       = nil
+local sort_idx_a    = nil       -- index ping pong buffers for the radix passes
+local sort_idx_b    = nil
+local sort_counts   = ffi.new("int32_t[256]")
+
+local function sort_reserve(n)
+    if(n <= sort_size) then return end
+    local size = 64
+    while(size < n) do size = size * 2 end
+    sort_states = ffi.new("bin_state *[?]", size)
+    sort_lo     = ffi.new("uint32_t[?]", size)
+    sort_hi     = ffi.new("uint32_t[?]", size)
+    sort_idx_a  = ffi.new("int32_t[?]", size)
+    sort_idx_b  = ffi.new("int32_t[?]", size)
+    sort_size   = size
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- LSD radix sort of the gathered keys, 8 bits per pass. Passes where every key has the same digit 
+--   are skipped, which is most of them in a typical bin (priority and often pipeline are constant).
+--   Small lists use an insertion sort instead. Returns the sorted index array.
+local function sort_keys(n)
+
+    local src, dst = sort_idx_a, sort_idx_b
+    for i = 0, n-1 do src[i] = i end
+
+    if(n < 32) then 
+        for i = 1, n-1 do 
+            local k = src[i]
+            local hi, lo = sort_hi[k], sort_lo[k]
+            local j = i - 1
+            while(j >= 0) do 
+                local o = src[j]
+                local ohi = sort_hi[o]
+                if(ohi < hi or (ohi == hi and sort_lo[o] <= lo)) then break end
+                src[j + 1] = o
+                j = j - 1
+            end
+            src[j + 1] = k
+        end
+        return src
+    end
+
+    local counts = sort_counts
+    for pass = 0, 7 do 
+        local keys  = sort_lo
+        if(pass >= 4) then keys = sort_hi end
+        local shift = (pass % 4) * 8
+
+        ffi.fill(counts, 256 * 4)
+        for i = 0, n-1 do 
+            local d = band(rshift(keys[i], shift), 0xFF)
+            counts[d] = counts[d] + 1
+        end
+
+        if(counts[band(rshift(keys[0], shift), 0xFF)] ~= n) then 
+            local sum = 0
+            for d = 0, 255 do 
+                local c = counts[d]
+                counts[d] = sum
+                sum = sum + c
+            end
+            for i = 0, n-1 do 
+                local k = src[i]
+                local d = band(rshift(keys[k], shift), 0xFF)
+                dst[counts[d]] = k
+                counts[d] = counts[d] + 1
+            end
+            src, dst = dst, src
+        end
+    end
+    return src
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Collect the visible states of a bin into the sort scratch, refreshing their keys.
+--   mask selects the flags tested, 0x03 (visible and not culled) unless given.
+local function bin_gather(binlist, binid, mask)
+
+    mask = mask or 0x03
+    local count = #binlist
+    sort_reserve(count)
+    local n = 0
+    for i = 1, count do 
+        local ptr = binlist[i]
+        -- false: a removed slot
+        if(ptr) then 
+            local ds = ptr[0]
+            if(band(ds.state, mask) == 0x01) then 
+                bin_make_key(ds, binid)
+                sort_states[n] = ptr
+                sort_lo[n] = ds.key_lo
+                sort_hi[n] = ds.key_hi
+                n = n + 1
+            end
+        end
+    end
+    return n
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Per frame instance data. The cpu scratch is filled while preparing bins, then uploaded in one 
+--   sg_update_buffer. The storage buffer is recreated when the scratch outgrows it.
+local inst_scratch      = nil
+local inst_scratch_size = 0
+local inst_used         = 0
+local inst_buffer       = nil
+local inst_capacity     = 0
+local inst_upload       = ffi.new("sg_range[1]")
+local inst_uniform      = ffi.new("int32_t[4]")     -- vs_inst_params, padded to std140
+local inst_range        = ffi.new("sg_range[1]")
+inst_range[0].ptr       = inst_uniform
+inst_range[0].size      = ffi.sizeof(inst_uniform)
+
+local function inst_reserve(bytes)
+    if(inst_used + bytes <= inst_scratch_size) then return end
+    local size = math.max(inst_scratch_size, 65536)
+    while(size < inst_used + bytes) do size = size * 2 end
+    local scratch = ffi.new("uint8_t[?]", size)
+    if(inst_used > 0) then ffi.copy(scratch, inst_scratch, inst_used) end
+    inst_scratch        = scratch
+    inst_scratch_size   = size
+end
+
+local function inst_flush()
+    if(inst_used == 0) then return end
+    if(inst_capacity < inst_scratch_size) then 
+        if(inst_buffer) then sg.sg_destroy_buffer(inst_buffer) end
+        inst_buffer     = meshes.create_buffer("bin-instances", { storage = inst_scratch_size }).sbuf
+        inst_capacity   = inst_scratch_size
+        -- Compiled passes hold on to their instance bindings
+        for addr, ib in pairs(bin_mgr.inst_binds) do ib[0].storage_buffers[0] = inst_buffer end
+    end
+    inst_upload[0].ptr  = inst_scratch
+    inst_upload[0].size = inst_used
+    sg.sg_update_buffer(inst_buffer, inst_upload)
+end
+
+-- The instanced draw uses a copy of the geometry bindings with the instance buffer attached.
+--   Refreshed on use so changes to the source bindings are picked up.
+local function inst_bindings(bind)
+    local addr = tonumber(ffi.cast("uintptr_t", bind))
+    local ib = bin_mgr.inst_binds[addr]
+    if(ib == nil) then 
+        ib = ffi.new("sg_bindings[1]")
+        bin_mgr.inst_binds[addr] = ib
+    end
+    ffi.copy(ib, bind, ffi.sizeof("sg_bindings"))
+    ib[0].storage_buffers[0] = inst_buffer
+    return ib
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+local function same_params(a, b)
+    if(a == b) then return true end
+    if(a == nil or b == nil or a.size ~= b.size) then return false end
+    local pa = ffi.cast("const uint8_t *", a.ptr)
+    local pb = ffi.cast("const uint8_t *", b.ptr)
+    for i = 0, tonumber(a.size) - 1 do 
+        if(pa[i] ~= pb[i]) then return false end
+    end
+    return true
+end
+
+local function can_batch(a, b)
+    if(b.pip.id ~= a.pip.id or b.bind ~= a.bind) then return false end
+    if(b.offset ~= a.offset or b.count ~= a.count or b.instances ~= 1) then return false end
+    if(b.vs_params == nil or b.vs_params.size ~= a.vs_params.size) then return false end
+    return same_params(a.fs_params, b.fs_params)
+end
+
+-- End (exclusive) of the run of sorted states starting at i that can share one instanced draw
+local function run_end(order, i, n)
+    local ds = sort_states[order[i]]
+    local j = i + 1
+    if(bin_mgr.instancing and ds.inst_pip.id ~= 0 and ds.vs_params ~= nil and ds.instances == 1) then 
+        while(j < n and can_batch(ds, sort_states[order[j]])) do j = j + 1 end
+    end
+    return j
+end
+
+-- Copy the vs params of count states into the frame instance data, aligned to the stride.
+--   states is indexed from first, through order if given. Returns the base instance.
+local function inst_copy(states, order, first, count)
+    local stride = tonumber(states[order and order[first] or first].vs_params.size)
+    inst_reserve((count + 1) * stride)
+    local base = math.ceil(inst_used / stride)
+    local ptr = inst_scratch + base * stride
+    for k = first, first + count - 1 do 
+        local ds = states[order and order[k] or k]
+        ffi.copy(ptr, ds.vs_params.ptr, stride)
+        ptr = ptr + stride
+    end
+    inst_used = (base + count) * stride
+    return base
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Gather, sort and collapse a bin into its draw list for this frame and camera.
+local function bin_prepare(cameraid, binid, binlist)
+
+    local key = cameraid * 0x10000 + binid
+    local draws = bin_mgr.bin_draws[key]
+    if(draws == nil) then 
+        draws = { list = nil, size = 0, count = 0 }
+        bin_mgr.bin_draws[key] = draws
+    end
+    draws.count = 0
+
+    local n = bin_gather(binlist, binid)
+    if(n == 0) then return draws end
+    if(draws.size < n) then 
+        local size = 64
+        while(size < n) do size = size * 2 end
+        draws.list = ffi.new("bin_draw[?]", size)
+        draws.size = size
+    end
+
+    local order = sort_keys(n)
+    local list  = draws.list
+    local m     = 0
+    local i     = 0
+    while(i < n) do 
+        local j = run_end(order, i, n)
+        local run = j - i
+        if(run >= bin_mgr.instance_min) then 
+            list[m].ds              = sort_states[order[i]]
+            list[m].instances       = run
+            list[m].instance_base   = inst_copy(sort_states, order, i, run)
+            m = m + 1
+        else
+            for k = i, j-1 do 
+                list[m].ds          = sort_states[order[k]]
+                list[m].instances   = 0
+                m = m + 1
+            end
+        end
+        i = j
+    end
+    draws.count = m
+    return draws
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Uniform storage
+--   Geometry uniform blocks are copied into a preallocated arena instead of living in one ffi.new 
+--   per geometry. Blocks are carved from large 16 byte aligned chunks and recycled through per 
+--   size free lists when the geometry is removed from its bin. The sg_range views that point at 
+--   them come from fixed blocks of ranges, so a bin_state can hold the address safely.
+--   A separate per frame region hands out transient uniform blocks (frame_uniforms) which are 
+--   only valid until the next render.
+
+local UNIFORM_ALIGN     = 16            -- std140 block sizes are multiples of 16
+local ARENA_CHUNK       = 256 * 1024
+local RANGE_BLOCK       = 1024
+
+local arena = {
+    chunks      = {},       -- uint8_t[] chunks, kept for the life of the bins
+    ptr         = nil,      -- carve position in the current chunk
+    left        = 0,        -- bytes left in the current chunk
+    free        = {},       -- block size -> released blocks
+    used        = 0,        -- bytes held by live blocks
+}
+
+local ranges = {
+    blocks      = {},       -- sg_range[RANGE_BLOCK] blocks
+    free        = {},       -- released sg_range pointers
+    used        = 0,
+}
+
+local frame = {
+    buf         = nil,      -- uint8_t[] for this frame's transient blocks
+    base        = nil,      -- aligned start of buf
+    size        = 0,
+    used        = 0,
+    ranges      = nil,      -- sg_range[] handed out this frame
+    nranges     = 0,
+    count       = 0,
+    retired     = {},       -- outgrown buffers, kept until the frame ends
+}
+
+local function align_ptr(buf)
+    local addr = tonumber(ffi.cast("uintptr_t", buf))
+    local pad = (UNIFORM_ALIGN - addr % UNIFORM_ALIGN) % UNIFORM_ALIGN
+    return ffi.cast("uint8_t *", buf) + pad
+end
+
+local function uniform_alloc(size)
+    size = band(size + UNIFORM_ALIGN - 1, -UNIFORM_ALIGN)
+    local list = arena.free[size]
+    local ptr = list and tremove(list)
+    if(ptr == nil) then 
+        if(arena.left < size) then 
+            local bytes = math.max(ARENA_CHUNK, size)
+            local chunk = ffi.new("uint8_t[?]", bytes + UNIFORM_ALIGN)
+            tinsert(arena.chunks, chunk)
+            arena.ptr   = align_ptr(chunk)
+            arena.left  = bytes
+        end
+        ptr = arena.ptr
+        arena.ptr   = arena.ptr + size
+        arena.left  = arena.left - size
+    end
+    arena.used = arena.used + size
+    return ptr
+end
+
+local function uniform_release(ptr, size)
+    size = band(size + UNIFORM_ALIGN - 1, -UNIFORM_ALIGN)
+    local list = arena.free[size]
+    if(list == nil) then 
+        list = {}
+        arena.free[size] = list
+    end
+    tinsert(list, ffi.cast("uint8_t *", ptr))
+    arena.used = arena.used - size
+end
+
+local function range_alloc(ptr, size)
+    local r = tremove(ranges.free)
+    if(r == nil) then 
+        local block = ffi.new("sg_range[?]", RANGE_BLOCK)
+        tinsert(ranges.blocks, block)
+        for i = RANGE_BLOCK-1, 1, -1 do tinsert(ranges.free, block + i) end
+        r = block + 0
+    end
+    r.ptr   = ptr
+    r.size  = size
+    ranges.used = ranges.used + 1
+    return r
+end
+
+local function range_release(r)
+    if(r == nil) then return end
+    uniform_release(r.ptr, tonumber(r.size))
+    r.ptr   = nil
+    r.size  = 0
+    tinsert(ranges.free, r)
+    ranges.used = ranges.used - 1
+end
+
+-- Copy a params block (ctype array or pointer) into the arena. Returns its range and a pointer 
+--   of the same ctype to the arena copy, which the owner then updates in place.
+local function params_alloc(params)
+    local size  = ffi.sizeof(params[0])
+    local ptr   = uniform_alloc(size)
+    ffi.copy(ptr, params, size)
+    -- params + 0 decays an array to its element pointer type
+    return range_alloc(ptr, size), ffi.cast(ffi.typeof(params + 0), ptr)
+end
+
+-- Copy an arena block back into the owner's own params and point the owner at them again
+local function params_restore(geom, key, source, range)
+    if(range == nil or geom[source] == nil) then return end
+    ffi.copy(geom[source], range.ptr, tonumber(range.size))
+    geom[key] = geom[source]
+end
+
+-- Start of frame: everything carved last frame is released in one step
+local function frame_reset()
+    frame.used  = 0
+    frame.count = 0
+    if(#frame.retired > 0) then frame.retired = {} end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Transient uniform block for this frame only (eg. bin funcs, per frame overrides of a state).
+--   Returns an aligned uint8_t pointer to size bytes and an sg_range for it.
+bin_mgr.frame_uniforms = function(size)
+
+    local bytes = band(size + UNIFORM_ALIGN - 1, -UNIFORM_ALIGN)
+    if(frame.used + bytes > frame.size) then 
+        local newsize = math.max(frame.size * 2, 64 * 1024)
+        while(newsize < frame.used + bytes) do newsize = newsize * 2 end
+        -- Earlier blocks this frame still point into the old buffer
+        if(frame.buf) then tinsert(frame.retired, frame.buf) end
+        frame.buf   = ffi.new("uint8_t[?]", newsize + UNIFORM_ALIGN)
+        frame.base  = align_ptr(frame.buf)
+        frame.size  = newsize
+        frame.used  = 0
+    end
+    if(frame.count >= frame.nranges) then 
+        if(frame.ranges) then tinsert(frame.retired, frame.ranges) end
+        frame.nranges   = math.max(frame.nranges * 2, 256)
+        frame.ranges    = ffi.new("sg_range[?]", frame.nranges)
+        frame.count     = 0
+    end
+
+    local ptr = frame.base + frame.used
+    frame.used = frame.used + bytes
+    local r = frame.ranges + frame.count
+    frame.count = frame.count + 1
+    r.ptr   = ptr
+    r.size  = size
+    return ptr, r
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Bytes and ranges held by geometry uniform blocks (live), and the arena footprint.
+bin_mgr.get_uniform_stats = function()
+    return {
+        used        = arena.used,
+        ranges      = ranges.used,
+        chunks      = #arena.chunks,
+        range_blocks = #ranges.blocks,
+        frame_used  = frame.used,
+    }
+end
 
+-- ---------------------------------------------------------------------------------------------------
+-- Uniform params are copied into the uniform arena. geom.vs_params and geom.fs_params are 
+--   replaced with pointers to the arena copies, so updates to them reach the bins. The caller's 
+--   own blocks are kept in geom.vs_source and geom.fs_source. bin_remove copies the arena values 
+--   back into them and points geom.vs_params and geom.fs_params at them again, so a removed 
+--   geometry never writes into a block that has been handed to another one.
+--   A geometry can only be in one bin at a time.
+--   Returns the bin id, the state and its index in the bin (stable until it is removed).
 bin_mgr.bin_add_geom = function(geom) 
 
+    assert(geom.bin_state == nil, "[render bin_add] Geometry is already in a bin, bin_remove it first.")
+
     local vs_range      = nil
     if(geom.vs_params) then 
-        vs_range = ffi.new("sg_range[1]")
-        vs_range[0].ptr     = geom.vs_params
-        vs_range[0].size    = ffi.sizeof(ffi.typeof(geom.vs_params[0]))
-        tinsert(cache, vs_range)
+        geom.vs_source = geom.vs_params
+        vs_range, geom.vs_params = params_alloc(geom.vs_source)
     end
 
     local fs_range      = nil
     if(geom.fs_params) then 
-        fs_range = ffi.new("sg_range[1]")
-        fs_range[0].ptr     = geom.fs_params
-        fs_range[0].size    = ffi.sizeof(geom.fs_params[0])
-        tinsert(cache, fs_range)
+        geom.fs_source = geom.fs_params
+        fs_range, geom.fs_params = params_alloc(geom.fs_source)
     end
 
     local dstate = ffi.new("bin_state[1]",{})
@@ -166,7 +749,12 @@ bin_mgr.bin_add_geom = function(geom)
 
     dstate[0].pip       = geom.pip
     dstate[0].bind      = geom.bind
+    if(geom.inst_pip) then dstate[0].inst_pip = geom.inst_pip end
     dstate[0].state     = 0
+    dstate[0].cull_id   = -1
+    if(geom.aabb) then 
+        dstate[0].cull_id = culling.add(dstate, geom.aabb, geom.transform)
+    end
 
     dstate[0].offset    = geom.offset or 0
     -- Assert will prob be temporary. Will capture this upstream. 
@@ -174,20 +762,36 @@ bin_mgr.bin_add_geom = function(geom)
     dstate[0].count     = geom.count or 0
     dstate[0].instances = geom.instances or 1
 
+    dstate[0].bind_id   = get_bind_id(geom.bind)
+    dstate[0].material  = get_material_id(geom.material)
+    dstate[0].depth     = geom.depth or 0.0
+
     local bin_slot      = bintype.BTYPE_OPAQUE 
     if(geom.bintype) then bin_slot = geom.bintype end
+    bin_make_key(dstate[0], bin_slot)
+    bin_mgr.bin_mark_dirty(bin_slot)
     
-    -- Insert into known bin slot
+    -- Insert into known bin slot, reusing a removed one first
     local thebin = bin_mgr.bins[bin_slot]
+    local index = 1
     if(thebin) then 
-        tinsert(bin_mgr.bins[bin_slot], dstate )
+        local free = bin_mgr.bin_free[bin_slot]
+        index = free and tremove(free)
+        if(index) then 
+            thebin[index] = dstate
+        else
+            tinsert(thebin, dstate )
+            index = #thebin
+        end
 
     -- Insert into newly created bin slot
     else 
         bin_mgr.bins[bin_slot] = { dstate }
     end
+    bin_mgr.bin_geoms[dstate] = geom
+    geom.bin_state      = dstate
 
-    return bin_slot, dstate
+    return bin_slot, dstate, index
 end
 
 -- ---------------------------------------------------------------------------------------------------
@@ -234,9 +838,18 @@ bin_mgr.pass_add = function(pdata, index, front, attach)
         passid = tcount(bin_mgr.passes) + 1
     end
     bin_mgr.passes[passid] = binpass
+    bin_mgr.pass_stats[passid] = ffi.new("bin_pass_stats[1]")
     return passid
 end
 
+-- ---------------------------------------------------------------------------------------------------
+-- State change counters from the last render of a pass (bin_pass_stats)
+bin_mgr.get_pass_stats = function(passid)
+    local stats = bin_mgr.pass_stats[passid]
+    if(stats) then return stats[0] end
+    return nil
+end
+
 -- ---------------------------------------------------------------------------------------------------
 
 bin_mgr.add_offscreen_buffers = function(w, h)
@@ -313,28 +926,99 @@ bin_mgr.add_pass = function( newcam, attachid, bin_target)
 end
 
 -- ---------------------------------------------------------------------------------------------------
--- Need a way to order passes on submission
+-- Functions are kept apart from the geometry so the bins stay bin_state arrays. 
+--   Note: functions used to share the index space with the geometry and run in between it. Since 
+--   geometry in a bin is drawn in sort key order that position has no meaning any more: all the 
+--   functions of a bin run, in index order, before its geometry. Something that has to draw 
+--   between two sets of geometry goes in a bin of its own, with a priority between theirs.
 bin_mgr.bin_set_func = function(bid, func, index)
 
-    if(index) then 
-        bin_mgr.bins[bid][index] = func
-    else
-        bin_mgr.bins[bid][1] = func
+    local funcs = bin_mgr.bin_funcs[bid]
+    if(funcs == nil) then 
+        funcs = {}
+        bin_mgr.bin_funcs[bid] = funcs
     end
+    funcs[index or 1] = func
+    bin_mgr.bin_mark_dirty(bid)
 end
 
 -- ---------------------------------------------------------------------------------------------------
 
+-- Slots are not compacted, so the indices of the other states in the bin stay valid. The emptied 
+--   slot is left false and handed to the next bin_add_geom for the bin.
 bin_mgr.bin_remove = function(bid, index) 
     local bin = bin_mgr.bins[bid]
-    if(bin) then bin[index] = nil end
+    if(bin and bin[index]) then 
+        local dstate = bin[index]
+        local ds = dstate[0]
+        culling.remove(ds.cull_id)
+        ds.cull_id = -1
+        local geom = bin_mgr.bin_geoms[dstate]
+        if(geom) then 
+            params_restore(geom, "vs_params", "vs_source", ds.vs_params)
+            params_restore(geom, "fs_params", "fs_source", ds.fs_params)
+            geom.bin_state = nil
+            bin_mgr.bin_geoms[dstate] = nil
+        end
+        range_release(ds.vs_params)
+        range_release(ds.fs_params)
+        ds.vs_params = nil
+        ds.fs_params = nil
+        ds.state = 0x00
+        bin[index] = false
+        local free = bin_mgr.bin_free[bid]
+        if(free == nil) then 
+            free = {}
+            bin_mgr.bin_free[bid] = free
+        end
+        tinsert(free, index)
+        bin_mgr.bin_mark_dirty(bid)
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Change the draw range of a state (eg. LOD switches). Compiled passes using the bin are rebuilt.
+bin_mgr.bin_set_range = function(bid, dstate, offset, count)
+    local ds = dstate[0]
+    if(ds.offset == offset and ds.count == count) then return end
+    ds.offset = offset
+    ds.count = count
+    bin_mgr.bin_mark_dirty(bid)
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Update (or start tracking) the world bounds of a state. aabb is local, tform the model matrix.
+bin_mgr.bin_set_bounds = function(dstate, aabb, tform)
+    local id = dstate[0].cull_id
+    if(id < 0) then 
+        dstate[0].cull_id = culling.add(dstate, aabb, tform)
+    else
+        culling.set_bounds(id, aabb, tform)
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Culled and drawn counts for a camera from the last render (bin_cull_stats)
+bin_mgr.get_cull_stats = function(cameraid)
+    local stats = bin_mgr.cull_stats[cameraid]
+    if(stats) then return stats[0] end
+    return nil
 end
 
 -- ---------------------------------------------------------------------------------------------------
 
 bin_mgr.bin_clear = function(bid, index) 
     local bin = bin_mgr.bins[bid]
-    if(bin) then bin[index][0].state = 0x00 end
+    if(bin and bin[index]) then 
+        bin[index][0].state = 0x00 
+        bin_mgr.bin_mark_dirty(bid)
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Flag a bin as changed so compiled passes using it are rebuilt on the next render
+bin_mgr.bin_mark_dirty = function(bid)
+    bin_mgr.bin_gens[bid] = (bin_mgr.bin_gens[bid] or 0) + 1
 end
 
 -- ---------------------------------------------------------------------------------------------------
@@ -343,6 +1027,305 @@ bin_mgr.update = function(dt)
 
 end
 
+-- ---------------------------------------------------------------------------------------------------
+-- Submit a prepared draw list. Pipeline and bindings are only applied when they differ from 
+--   what is current. A pipeline change always re-applies bindings (sokol requires it).
+local function bin_submit(draws, stats, last_pip, last_bind)
+
+    local list = draws.list
+    for i = 0, draws.count-1 do 
+        local dr    = list[i]
+        local ds    = dr.ds
+        local run   = dr.instances
+
+        local pip = ds.pip
+        if(run > 0) then pip = ds.inst_pip end
+        if(pip.id ~= last_pip) then 
+            sg.sg_apply_pipeline(pip)
+            stats.pipelines = stats.pipelines + 1
+            last_pip = pip.id
+            last_bind = nil
+        else
+            stats.skipped_pipelines = stats.skipped_pipelines + 1
+        end
+
+        local bind = ds.bind
+        if(run > 0) then bind = inst_bindings(bind) end
+        if(last_bind == nil or bind ~= last_bind) then 
+            sg.sg_apply_bindings(bind)
+            stats.bindings = stats.bindings + 1
+            last_bind = bind
+        else
+            stats.skipped_bindings = stats.skipped_bindings + 1
+        end
+
+        if(run > 0) then 
+            inst_uniform[0] = dr.instance_base
+            sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_VS, inst_range)
+            stats.uniforms = stats.uniforms + 1
+        elseif(ds.vs_params ~= nil) then 
+            sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_VS, ds.vs_params)
+            stats.uniforms = stats.uniforms + 1
+        end
+        if(ds.fs_params ~= nil) then 
+            sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_FS, ds.fs_params)
+            stats.uniforms = stats.uniforms + 1
+        end
+
+        if(run > 0) then 
+            sg.sg_draw(ds.offset, ds.count, run)
+            stats.instanced_draws = stats.instanced_draws + 1
+            stats.instances = stats.instances + run
+            stats.triangles = stats.triangles + floor(ds.count / 3) * run
+        else
+            sg.sg_draw(ds.offset, ds.count, ds.instances)
+            stats.triangles = stats.triangles + floor(ds.count / 3) * ds.instances
+        end
+        stats.draws = stats.draws + 1
+    end
+    return last_pip, last_bind
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Compiled passes
+
+local function cmd_reserve(compiled, n)
+    if(compiled.size >= n) then return end
+    local size = math.max(compiled.size * 2, 64)
+    while(size < n) do size = size * 2 end
+    local cmds = ffi.new("bin_cmd[?]", size)
+    if(compiled.count > 0) then ffi.copy(cmds, compiled.cmds, compiled.count * ffi.sizeof("bin_cmd")) end
+    compiled.cmds = cmds
+    compiled.size = size
+end
+
+local function state_reserve(compiled, n)
+    if(compiled.nstates >= n) then return end
+    local size = math.max(compiled.nstates * 2, 64)
+    while(size < n) do size = size * 2 end
+    local states = ffi.new("bin_state *[?]", size)
+    if(compiled.states_used > 0) then ffi.copy(states, compiled.states, compiled.states_used * ffi.sizeof("bin_state *")) end
+    compiled.states = states
+    compiled.nstates = size
+end
+
+-- Flatten the visible states of every bin in a pass into its command array. Applies are 
+--   decided here with the same rules as bin_submit, and the expected stats are kept for replay.
+local function pass_compile(pass)
+
+    local compiled = pass.compiled
+    compiled.count = 0
+    compiled.states_used = 0
+    compiled.ninst = 0
+    local stats = compiled.stats[0]
+    ffi.fill(stats, ffi.sizeof("bin_pass_stats"))
+    local last_pip, last_bind = 0, nil
+
+    for bi, binid in ipairs(pass.binlist) do
+        compiled.gens[binid] = bin_mgr.bin_gens[binid] or 0
+
+        local funcs = bin_mgr.bin_funcs[binid]
+        if(funcs and next(funcs)) then 
+            cmd_reserve(compiled, compiled.count + 1)
+            local c = compiled.cmds[compiled.count]
+            ffi.fill(c, ffi.sizeof("bin_cmd"))
+            c.flags = BIN_CMD_FUNCS
+            c.bin   = binid
+            compiled.count = compiled.count + 1
+            last_pip, last_bind = 0, nil
+        end
+
+        local binlist = bin_mgr.bins[binid]
+        local n = 0
+        if(binlist) then n = bin_gather(binlist, binid, 0x01) end
+        if(n > 0) then 
+            local order = sort_keys(n)
+            cmd_reserve(compiled, compiled.count + n)
+            local i = 0
+            while(i < n) do 
+                local j = run_end(order, i, n)
+                local run = j - i
+                if(run < bin_mgr.instance_min) then j = i + 1 end
+
+                local ds = sort_states[order[i]]
+                local c = compiled.cmds[compiled.count]
+                c.flags     = BIN_CMD_DRAW
+                c.bin       = binid
+                c.vs_params = ds.vs_params
+                c.fs_params = ds.fs_params
+                c.offset    = ds.offset
+                c.count     = ds.count
+                c.first     = -1
+                c.instance_base = 0
+
+                if(run >= bin_mgr.instance_min) then 
+                    state_reserve(compiled, compiled.states_used + run)
+                    for k = i, j-1 do compiled.states[compiled.states_used + k - i] = sort_states[order[k]] end
+                    c.first     = compiled.states_used
+                    c.instances = run
+                    c.pip       = ds.inst_pip
+                    c.bind      = inst_bindings(ds.bind)
+                    compiled.states_used = compiled.states_used + run
+                    compiled.ninst = compiled.ninst + 1
+                    stats.instanced_draws = stats.instanced_draws + 1
+                    stats.instances = stats.instances + run
+                else
+                    c.instances = ds.instances
+                    c.pip       = ds.pip
+                    c.bind      = ds.bind
+                end
+
+                if(c.pip.id ~= last_pip) then 
+                    c.flags = bor(c.flags, BIN_CMD_PIPELINE)
+                    stats.pipelines = stats.pipelines + 1
+                    last_pip = c.pip.id
+                    last_bind = nil
+                else
+                    stats.skipped_pipelines = stats.skipped_pipelines + 1
+                end
+                if(last_bind == nil or c.bind ~= last_bind) then 
+                    c.flags = bor(c.flags, BIN_CMD_BINDINGS)
+                    stats.bindings = stats.bindings + 1
+                    last_bind = c.bind
+                else
+                    stats.skipped_bindings = stats.skipped_bindings + 1
+                end
+                if(c.first >= 0 or c.vs_params ~= nil) then stats.uniforms = stats.uniforms + 1 end
+                if(c.fs_params ~= nil) then stats.uniforms = stats.uniforms + 1 end
+                stats.draws = stats.draws + 1
+                stats.triangles = stats.triangles + floor(c.count / 3) * c.instances
+
+                compiled.count = compiled.count + 1
+                i = j
+            end
+        end
+    end
+    compiled.valid = true
+end
+
+-- True when a compiled pass needs rebuilding
+local function pass_stale(pass)
+    local compiled = pass.compiled
+    if(compiled.valid ~= true) then return true end
+    for bi, binid in ipairs(pass.binlist) do
+        if(compiled.gens[binid] ~= (bin_mgr.bin_gens[binid] or 0)) then return true end
+    end
+    return false
+end
+
+-- Per frame: copy the instanced runs' params into the frame instance data
+local function pass_instances(compiled)
+    if(compiled.ninst == 0) then return end
+    local cmds = compiled.cmds
+    for i = 0, compiled.count-1 do 
+        local c = cmds[i]
+        if(c.first >= 0) then 
+            c.instance_base = inst_copy(compiled.states, nil, c.first, c.instances)
+        end
+    end
+end
+
+-- Replay a compiled pass. No comparisons, the flags already say what to apply.
+local function pass_replay(compiled, w, h)
+    local cmds = compiled.cmds
+    for i = 0, compiled.count-1 do 
+        local c = cmds[i]
+        local flags = c.flags
+        if(flags == BIN_CMD_FUNCS) then 
+            local funcs = bin_mgr.bin_funcs[c.bin]
+            if(funcs) then 
+                for fi = 1, table.maxn(funcs) do 
+                    if(funcs[fi]) then funcs[fi](w, h) end
+                end
+            end
+        else
+            if(band(flags, BIN_CMD_PIPELINE) ~= 0) then sg.sg_apply_pipeline(c.pip) end
+            if(band(flags, BIN_CMD_BINDINGS) ~= 0) then sg.sg_apply_bindings(c.bind) end
+            if(c.first >= 0) then 
+                inst_uniform[0] = c.instance_base
+                sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_VS, inst_range)
+            elseif(c.vs_params ~= nil) then 
+                sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_VS, c.vs_params)
+            end
+            if(c.fs_params ~= nil) then sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_FS, c.fs_params) end
+            sg.sg_draw(c.offset, c.count, c.instances)
+        end
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Compile a pass into a flat command list (enable = true) or go back to per frame preparation.
+bin_mgr.pass_compile = function(passid, enable)
+    local pass = bin_mgr.passes[passid]
+    if(pass == nil) then return end
+    if(enable == false) then 
+        pass.compiled = nil
+        return
+    end
+    pass.compiled = { 
+        cmds = nil, size = 0, count = 0,
+        states = nil, nstates = 0, states_used = 0,
+        ninst = 0, gens = {}, valid = false,
+        stats = ffi.new("bin_pass_stats[1]"),
+    }
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Cull and prepare every bin used by an active camera this frame, then upload the instance data.
+local function bins_prepare()
+
+    inst_used = 0
+    frame_reset()
+    bin_mgr.frame_id = bin_mgr.frame_id + 1
+    local prepared = bin_mgr.prepared
+    for ci, cameraid in ipairs(bin_mgr.cameras) do
+        if(cammgr.is_active(cameraid)) then 
+            local cam_name = cammgr.cameras_active[cameraid]
+            local camera = cammgr.get(cam_name)
+
+            local stats = bin_mgr.cull_stats[cameraid]
+            if(stats == nil) then 
+                stats = ffi.new("bin_cull_stats[1]")
+                bin_mgr.cull_stats[cameraid] = stats
+            end
+            if(camera.cull == false) then 
+                culling.clear()
+                stats[0].culled, stats[0].drawn = 0, 0
+            else
+                stats[0].culled, stats[0].drawn = culling.cull(cammgr.get_view_proj(cam_name))
+            end
+
+            local cam_prepared = prepared[cameraid]
+            if(cam_prepared == nil) then 
+                cam_prepared = {}
+                prepared[cameraid] = cam_prepared
+            else
+                for binid in pairs(cam_prepared) do cam_prepared[binid] = nil end
+            end
+            for pi, passid in ipairs(camera.passes) do
+                local pass = bin_mgr.passes[passid]
+                local compiled = pass.compiled
+                if(compiled) then 
+                    if(compiled.frame ~= bin_mgr.frame_id) then 
+                        if(pass_stale(pass)) then pass_compile(pass) end
+                        pass_instances(compiled)
+                        compiled.frame = bin_mgr.frame_id
+                    end
+                elseif(pass.binlist) then 
+                    for bi, binid in ipairs(pass.binlist) do
+                        local binlist = bin_mgr.bins[binid]
+                        if(binlist and cam_prepared[binid] == nil) then 
+                            cam_prepared[binid] = bin_prepare(cameraid, binid, binlist)
+                        end
+                    end
+                end
+            end
+        end
+    end
+    inst_flush()
+    return prepared
+end
+
 -- ---------------------------------------------------------------------------------------------------
 
 bin_mgr.render = function(w, h) 
@@ -350,6 +1333,8 @@ bin_mgr.render = function(w, h)
     -- Not initialized or no geometry?
     if(bin_mgr.bins == nil) then return end 
 
+    local prepared = bins_prepare()
+
     -- NOTE: Each active camera renders its associated binlists. 
     --       Thus multiple cameras can target they same scene objects if needed 
     --       Also, it is the camera that determine offscreen rendering or "special" rendering conditions
@@ -378,34 +1363,32 @@ bin_mgr.render = function(w, h)
                     sg.sg_begin_pass(pass.pass)
                     cammgr.apply( cam_name )
 
-                    -- Go through the bins for this pass! 
-                    for bi, binid in ipairs(pass.binlist) do
-
-                        -- Fetch the bin from the pool
-                        local binlist = bin_mgr.bins[binid]
+                    local stats = bin_mgr.pass_stats[passid][0]
+                    ffi.fill(stats, ffi.sizeof("bin_pass_stats"))
+                    local last_pip, last_bind = 0, nil
 
-                        if(binlist) then 
-
-                            for bli, bin in pairs(binlist) do
-                            
-                                if(type(bin) == "function") then
-                                    bin(w, h)
-                                else
-                                    if(bit.band(bin[0].state, 0x01) == 1) then 
-
-                                        sg.sg_apply_pipeline(bin[0].pip)
-                                        sg.sg_apply_bindings(bin[0].bind)
-                                    
-                                        if(bin[0].vs_params ~= nil) then 
-                                            sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_VS, bin[0].vs_params)
-                                        end
-                                        if(bin[0].fs_params ~= nil) then 
-                                            sg.sg_apply_uniforms(sg.SG_SHADERSTAGE_FS, bin[0].fs_params)
-                                        end
-                                        
-                                        sg.sg_draw(bin[0].offset, bin[0].count, bin[0].instances)
-                                    end
+                    -- Compiled passes replay their command list instead of walking the bins
+                    local compiled = pass.compiled
+                    if(compiled and compiled.valid) then 
+                        pass_replay(compiled, w, h)
+                        ffi.copy(stats, compiled.stats, ffi.sizeof("bin_pass_stats"))
+                    else
+                        -- Go through the bins for this pass! 
+                        for bi, binid in ipairs(pass.binlist) do
+
+                            -- Bin functions do their own applies, so current state is unknown after them
+                            local funcs = bin_mgr.bin_funcs[binid]
+                            if(funcs) then 
+                                for fi = 1, table.maxn(funcs) do 
+                                    if(funcs[fi]) then funcs[fi](w, h) end
                                 end
+                                last_pip, last_bind = 0, nil
+                            end
+
+                            -- Fetch the prepared draws for the bin
+                            local draws = prepared[cameraid][binid]
+                            if(draws and draws.count > 0) then 
+                                last_pip, last_bind = bin_submit(draws, stats, last_pip, last_bind)
                             end
                         end
                     end
@@ -0,0 +1,193 @@
+-- ---------------------------------------------------------------------------------------------------
+-- culling
+--    World space bounds for bin states, kept as struct-of-arrays in FFI float arrays so the
+--    frustum test is one tight loop over contiguous memory.
+--
+--    Each registered bin_state gets a slot (bin_state.cull_id). Bounds are stored as center and
+--    half extents. The owner updates them with set_bounds when the geometry moves.
+--
+--    cull() tests every live slot against a view projection frustum and writes the result into
+--    the bin_state flags: CULLED (0x02) is set when outside, cleared when inside. The visibility
+--    bit (0x01) stays owned by the game code. Bins draw states with (state & 0x03) == 0x01.
+-- ---------------------------------------------------------------------------------------------------
+
+local ffi       = require("ffi")
+
+local band      = bit.band
+local bor       = bit.bor
+local abs       = math.abs
+local sqrt      = math.sqrt
+
+-- ---------------------------------------------------------------------------------------------------
+
+local culling = {
+    CULLED      = 0x02,
+
+    count       = 0,        -- highest slot in use + 1
+    size        = 0,        -- allocated slots
+    free        = {},       -- released slots for reuse
+
+    states      = nil,      -- bin_state*[size], NULL for free slots
+    cx = nil, cy = nil, cz = nil,       -- world center
+    ex = nil, ey = nil, ez = nil,       -- world half extents
+}
+
+-- Frustum planes (a, b, c, d) x 6, rebuilt for each cull
+local planes    = ffi.new("float[24]")
+
+-- ---------------------------------------------------------------------------------------------------
+
+local function grow(size)
+
+    local function regrow(old, ctype, elemsize)
+        local arr = ffi.new(ctype, size)
+        if(old ~= nil and culling.count > 0) then
+            ffi.copy(arr, old, culling.count * elemsize)
+        end
+        return arr
+    end
+
+    local fsize     = ffi.sizeof("float")
+    culling.states  = regrow(culling.states, "bin_state *[?]", ffi.sizeof("bin_state *"))
+    culling.cx      = regrow(culling.cx, "float[?]", fsize)
+    culling.cy      = regrow(culling.cy, "float[?]", fsize)
+    culling.cz      = regrow(culling.cz, "float[?]", fsize)
+    culling.ex      = regrow(culling.ex, "float[?]", fsize)
+    culling.ey      = regrow(culling.ey, "float[?]", fsize)
+    culling.ez      = regrow(culling.ez, "float[?]", fsize)
+    culling.size    = size
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+culling.init = function(capacity)
+
+    culling.count   = 0
+    culling.free    = {}
+    culling.states  = nil
+    grow(capacity or 1024)
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Store bounds for a slot. aabb is { min = {x,y,z}, max = {x,y,z} } in local space, and the
+--   optional model matrix (hmm_mat4) takes it to world space (center/extent transform).
+culling.set_bounds = function(id, aabb, tform)
+
+    local hx = (aabb.max.x - aabb.min.x) * 0.5
+    local hy = (aabb.max.y - aabb.min.y) * 0.5
+    local hz = (aabb.max.z - aabb.min.z) * 0.5
+    local mx = aabb.min.x + hx
+    local my = aabb.min.y + hy
+    local mz = aabb.min.z + hz
+
+    if(tform) then
+        local e = tform.Elements
+        culling.cx[id] = e[0][0] * mx + e[1][0] * my + e[2][0] * mz + e[3][0]
+        culling.cy[id] = e[0][1] * mx + e[1][1] * my + e[2][1] * mz + e[3][1]
+        culling.cz[id] = e[0][2] * mx + e[1][2] * my + e[2][2] * mz + e[3][2]
+        culling.ex[id] = abs(e[0][0]) * hx + abs(e[1][0]) * hy + abs(e[2][0]) * hz
+        culling.ey[id] = abs(e[0][1]) * hx + abs(e[1][1]) * hy + abs(e[2][1]) * hz
+        culling.ez[id] = abs(e[0][2]) * hx + abs(e[1][2]) * hy + abs(e[2][2]) * hz
+    else
+        culling.cx[id], culling.cy[id], culling.cz[id] = mx, my, mz
+        culling.ex[id], culling.ey[id], culling.ez[id] = hx, hy, hz
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Register a bin_state (pointer) and return its slot
+culling.add = function(dstate, aabb, tform)
+
+    local id = table.remove(culling.free)
+    if(id == nil) then
+        if(culling.count >= culling.size) then grow(culling.size * 2) end
+        id = culling.count
+        culling.count = culling.count + 1
+    end
+    culling.states[id] = dstate
+    culling.set_bounds(id, aabb, tform)
+    return id
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+culling.remove = function(id)
+
+    if(id < 0 or id >= culling.count or culling.states[id] == nil) then return end
+    culling.states[id] = nil
+    table.insert(culling.free, id)
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Gribb/Hartmann plane extraction from a column major view projection (GL clip space).
+--   Planes are normalized so the extent test is in world units.
+local function extract_planes(vp)
+
+    local e = vp.Elements
+    for i = 0, 2 do
+        for s = 0, 1 do
+            local sign = 1 - s * 2
+            local p = (i * 2 + s) * 4
+            local a = e[0][3] + sign * e[0][i]
+            local b = e[1][3] + sign * e[1][i]
+            local c = e[2][3] + sign * e[2][i]
+            local d = e[3][3] + sign * e[3][i]
+            local len = sqrt(a * a + b * b + c * c)
+            if(len > 0.0) then len = 1.0 / len end
+            planes[p], planes[p + 1], planes[p + 2], planes[p + 3] = a * len, b * len, c * len, d * len
+        end
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Test all slots against the frustum of vp and write the CULLED flag.
+--   Returns the number of visible states culled and drawn.
+culling.cull = function(vp)
+
+    extract_planes(vp)
+    local states = culling.states
+    local cx, cy, cz = culling.cx, culling.cy, culling.cz
+    local ex, ey, ez = culling.ex, culling.ey, culling.ez
+    local culled, drawn = 0, 0
+
+    for i = 0, culling.count - 1 do
+        local ds = states[i]
+        if(ds ~= nil) then
+            local x, y, z = cx[i], cy[i], cz[i]
+            local hx, hy, hz = ex[i], ey[i], ez[i]
+            local inside = true
+            for p = 0, 20, 4 do
+                local a, b, c = planes[p], planes[p + 1], planes[p + 2]
+                local d = a * x + b * y + c * z + planes[p + 3]
+                local r = abs(a) * hx + abs(b) * hy + abs(c) * hz
+                if(d + r < 0.0) then inside = false; break end
+            end
+
+            if(inside) then
+                ds.state = band(ds.state, 0xFD)
+                if(band(ds.state, 0x01) == 0x01) then drawn = drawn + 1 end
+            else
+                ds.state = bor(ds.state, 0x02)
+                if(band(ds.state, 0x01) == 0x01) then culled = culled + 1 end
+            end
+        end
+    end
+    return culled, drawn
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Clear the CULLED flag on everything (cameras that do not cull)
+culling.clear = function()
+
+    local states = culling.states
+    for i = 0, culling.count - 1 do
+        local ds = states[i]
+        if(ds ~= nil) then ds.state = band(ds.state, 0xFD) end
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+return culling
+
+-- ---------------------------------------------------------------------------------------------------
@@ -0,0 +1,450 @@
+-- ---------------------------------------------------------------------------------------------------
+-- lod
+--    Import time LOD chains and render time selection.
+--
+--    simplify    Quadric error edge collapse on an index list. Vertices only ever collapse onto
+--                other existing vertices, so every LOD shares the original vertex buffer and a LOD
+--                is just another index range. Vertices that share a position with another vertex
+--                (uv/normal seams) are locked, open borders only collapse along the border.
+--    build       Builds the chain for a loader primdata table. All LOD index lists are appended
+--                to primdata.indices and primdata.lods gets { offset, count, error } per level.
+--                error is the accumulated collapse error relative to the mesh size.
+--    select      Picks a geom's LOD from its projected bounding sphere in a camera. A level is
+--                usable while its error covers less than lod.pixel_error pixels. Going coarser
+--                needs the error to drop below (1 - lod.hysteresis) of that, so geoms near a
+--                threshold do not flip every frame.
+-- ---------------------------------------------------------------------------------------------------
+
+local ffi       = require("ffi")
+
+local meshopt   = require("lua.geometry.meshopt")
+local bins      = require("lua.geometry.bins")
+local cammgr    = require("lua.engine.camera_manager")
+
+local tinsert   = table.insert
+local floor     = math.floor
+local sqrt      = math.sqrt
+local max       = math.max
+local rshift    = bit.rshift
+
+-- ---------------------------------------------------------------------------------------------------
+
+local lod = {
+    levels          = 4,        -- LOD0 plus up to 3 simplified levels
+    ratio           = 0.5,      -- triangle count of each level relative to the previous one
+    min_triangles   = 256,      -- smaller meshes do not get a chain
+    pixel_error     = 1.0,      -- allowed screen space error in pixels
+    hysteresis      = 0.25,     -- fraction of pixel_error a coarser level must be under to switch
+
+    -- Per frame counters (begin_frame resets them)
+    stats           = { geoms = 0, full_triangles = 0, triangles = 0, switches = 0 },
+}
+
+local BORDER_WEIGHT     = 10.0
+local SORT_BITS         = 11
+
+-- ---------------------------------------------------------------------------------------------------
+-- Quadrics are 10 doubles: a2 ab ac ad b2 bc bd c2 cd d2
+
+local function quadric_add_plane(q, o, a, b, c, d, w)
+    q[o]     = q[o]     + w * a * a
+    q[o + 1] = q[o + 1] + w * a * b
+    q[o + 2] = q[o + 2] + w * a * c
+    q[o + 3] = q[o + 3] + w * a * d
+    q[o + 4] = q[o + 4] + w * b * b
+    q[o + 5] = q[o + 5] + w * b * c
+    q[o + 6] = q[o + 6] + w * b * d
+    q[o + 7] = q[o + 7] + w * c * c
+    q[o + 8] = q[o + 8] + w * c * d
+    q[o + 9] = q[o + 9] + w * d * d
+end
+
+local function quadric_eval(q, o, x, y, z)
+    return q[o] * x * x + 2.0 * q[o + 1] * x * y + 2.0 * q[o + 2] * x * z + 2.0 * q[o + 3] * x
+         + q[o + 4] * y * y + 2.0 * q[o + 5] * y * z + 2.0 * q[o + 6] * y
+         + q[o + 7] * z * z + 2.0 * q[o + 8] * z + q[o + 9]
+end
+
+-- Unnormalized face normal of triangle a b c (vertex ids) from positions p with stride vsize
+local function face_normal(p, vsize, a, b, c)
+    a, b, c = a * vsize, b * vsize, c * vsize
+    local ux, uy, uz = p[b] - p[a], p[b + 1] - p[a + 1], p[b + 2] - p[a + 2]
+    local vx, vy, vz = p[c] - p[a], p[c + 1] - p[a + 1], p[c + 2] - p[a + 2]
+    return uy * vz - uz * vy, uz * vx - ux * vz, ux * vy - uy * vx
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Simplify an index list towards target_count indices. positions is a float array with vsize
+--   floats per vertex. Stops early when the next collapse would cost more than max_error
+--   (world units). Returns a new uint32_t index array, its count and the largest collapse error.
+lod.simplify = function(indices, icount, positions, vsize, vcount, target_count, max_error)
+
+    local p         = ffi.cast("float *", positions)
+    local limit     = (max_error or math.huge)
+    limit           = limit * limit
+    local n         = icount - icount % 3
+    local idx       = ffi.new("uint32_t[?]", n)
+    for i = 0, n - 1 do idx[i] = indices[i] end
+
+    -- Vertices sharing a position are seams and stay put
+    local locked    = ffi.new("uint8_t[?]", vcount)
+    local groups    = {}
+    for v = 0, vcount - 1 do
+        local key = ffi.string(p + v * vsize, 12)
+        local first = groups[key]
+        if(first) then
+            locked[v], locked[first] = 1, 1
+        else
+            groups[key] = v
+        end
+    end
+    groups = nil
+
+    -- Half edges without a twin are open borders
+    local edges     = {}
+    for i = 0, n - 1, 3 do
+        for k = 0, 2 do
+            local a, b = idx[i + k], idx[i + (k + 1) % 3]
+            edges[a * vcount + b] = true
+        end
+    end
+    local border    = ffi.new("uint8_t[?]", vcount)
+    local quadrics  = ffi.new("double[?]", vcount * 10)
+    for i = 0, n - 1, 3 do
+        local a, b, c = idx[i], idx[i + 1], idx[i + 2]
+        local nx, ny, nz = face_normal(p, vsize, a, b, c)
+        local len = sqrt(nx * nx + ny * ny + nz * nz)
+        if(len > 0.0) then
+            local w = len * 0.5
+            nx, ny, nz = nx / len, ny / len, nz / len
+            local d = -(nx * p[a * vsize] + ny * p[a * vsize + 1] + nz * p[a * vsize + 2])
+            quadric_add_plane(quadrics, a * 10, nx, ny, nz, d, w)
+            quadric_add_plane(quadrics, b * 10, nx, ny, nz, d, w)
+            quadric_add_plane(quadrics, c * 10, nx, ny, nz, d, w)
+
+            for k = 0, 2 do
+                local e0, e1 = idx[i + k], idx[i + (k + 1) % 3]
+                if(edges[e1 * vcount + e0] == nil) then
+                    border[e0], border[e1] = 1, 1
+                    -- Plane through the edge, perpendicular to the face
+                    local o0, o1 = e0 * vsize, e1 * vsize
+                    local ex, ey, ez = p[o1] - p[o0], p[o1 + 1] - p[o0 + 1], p[o1 + 2] - p[o0 + 2]
+                    local mx, my, mz = ey * nz - ez * ny, ez * nx - ex * nz, ex * ny - ey * nx
+                    local ml = sqrt(mx * mx + my * my + mz * mz)
+                    if(ml > 0.0) then
+                        mx, my, mz = mx / ml, my / ml, mz / ml
+                        local md = -(mx * p[o0] + my * p[o0 + 1] + mz * p[o0 + 2])
+                        local bw = (ex * ex + ey * ey + ez * ez) * BORDER_WEIGHT
+                        quadric_add_plane(quadrics, e0 * 10, mx, my, mz, md, bw)
+                        quadric_add_plane(quadrics, e1 * 10, mx, my, mz, md, bw)
+                    end
+                end
+            end
+        end
+    end
+
+    local remap     = ffi.new("uint32_t[?]", vcount)
+    local vlock     = ffi.new("uint8_t[?]", vcount)
+    local valence   = ffi.new("int32_t[?]", vcount)
+    local offsets   = ffi.new("int32_t[?]", vcount + 1)
+    local fill      = ffi.new("int32_t[?]", vcount)
+    local adj       = ffi.new("int32_t[?]", n)
+    local cu        = ffi.new("uint32_t[?]", n)
+    local cv        = ffi.new("uint32_t[?]", n)
+    local cost      = ffi.new("float[?]", n)
+    local cbits     = ffi.cast("uint32_t *", cost)
+    local order     = ffi.new("int32_t[?]", n)
+    local hist      = ffi.new("int32_t[?]", 2 ^ SORT_BITS + 1)
+    local result_error = 0.0
+
+    -- Cost of moving u onto v (plus v's own error there)
+    local function collapse_cost(u, v)
+        local o = v * vsize
+        local x, y, z = p[o], p[o + 1], p[o + 2]
+        return quadric_eval(quadrics, u * 10, x, y, z) + quadric_eval(quadrics, v * 10, x, y, z)
+    end
+
+    local function can_move(u, v)
+        if(locked[u] ~= 0) then return false end
+        if(border[u] ~= 0) then
+            -- Only along a border edge onto another border vertex
+            if(border[v] == 0) then return false end
+            local uv, vu = edges[u * vcount + v], edges[v * vcount + u]
+            return (uv and not vu) or (vu and not uv)
+        end
+        return true
+    end
+
+    while(n > target_count) do
+
+        -- Triangles around each vertex
+        ffi.fill(valence, vcount * 4)
+        ffi.fill(fill, vcount * 4)
+        for i = 0, n - 1 do valence[idx[i]] = valence[idx[i]] + 1 end
+        for v = 0, vcount - 1 do offsets[v + 1] = offsets[v] + valence[v] end
+        for i = 0, n - 1 do
+            local v = idx[i]
+            adj[offsets[v] + fill[v]] = floor(i / 3)
+            fill[v] = fill[v] + 1
+        end
+
+        -- Candidate collapses, the cheaper direction of each edge
+        local m = 0
+        for i = 0, n - 1, 3 do
+            for k = 0, 2 do
+                local a, b = idx[i + k], idx[i + (k + 1) % 3]
+                if(a < b or edges[b * vcount + a] == nil) then
+                    local ca, cb = math.huge, math.huge
+                    if(can_move(a, b)) then ca = collapse_cost(a, b) end
+                    if(can_move(b, a)) then cb = collapse_cost(b, a) end
+                    if(ca < math.huge or cb < math.huge) then
+                        if(ca <= cb) then cu[m], cv[m], cost[m] = a, b, max(ca, 0.0)
+                        else cu[m], cv[m], cost[m] = b, a, max(cb, 0.0) end
+                        m = m + 1
+                    end
+                end
+            end
+        end
+        if(m == 0) then break end
+
+        -- Bucket sort on the top bits of the (positive) float costs
+        ffi.fill(hist, ffi.sizeof(hist))
+        local shift = 31 - SORT_BITS
+        for i = 0, m - 1 do
+            local h = rshift(cbits[i], shift) + 1
+            hist[h] = hist[h] + 1
+        end
+        for h = 1, 2 ^ SORT_BITS do hist[h] = hist[h] + hist[h - 1] end
+        for i = 0, m - 1 do
+            local h = rshift(cbits[i], shift)
+            order[hist[h]] = i
+            hist[h] = hist[h] + 1
+        end
+
+        for v = 0, vcount - 1 do remap[v] = v end
+        ffi.fill(vlock, vcount)
+        local remove    = (n - target_count) / 3
+        local removed   = 0
+        local collapses = 0
+
+        for oi = 0, m - 1 do
+            local ci = order[oi]
+            if(cost[ci] > limit) then break end
+            local u, v = cu[ci], cv[ci]
+            if(vlock[u] == 0 and vlock[v] == 0) then
+
+                -- Reject collapses that flip or fold a triangle around u
+                local ok, gone = true, 0
+                local uo, vo = u * vsize, v * vsize
+                for j = offsets[u], offsets[u + 1] - 1 do
+                    local t = adj[j] * 3
+                    local a, b, c = remap[idx[t]], remap[idx[t + 1]], remap[idx[t + 2]]
+                    if(a ~= b and b ~= c and a ~= c) then
+                        if(a == v or b == v or c == v) then
+                            gone = gone + 1
+                        else
+                            local nx, ny, nz = face_normal(p, vsize, a, b, c)
+                            if(a == u) then a = v elseif(b == u) then b = v else c = v end
+                            local mx, my, mz = face_normal(p, vsize, a, b, c)
+                            -- More than ~75 degrees of rotation counts as a flip (slivers fold over)
+                            local d = nx * mx + ny * my + nz * mz
+                            if(d <= 0.25 * sqrt((nx * nx + ny * ny + nz * nz) * (mx * mx + my * my + mz * mz))) then 
+                                ok = false; break 
+                            end
+                        end
+                    end
+                end
+
+                if(ok) then
+                    remap[u] = v
+                    vlock[u], vlock[v] = 1, 1
+                    for k = 0, 9 do quadrics[v * 10 + k] = quadrics[v * 10 + k] + quadrics[u * 10 + k] end
+                    if(cost[ci] > result_error) then result_error = cost[ci] end
+                    removed = removed + gone
+                    collapses = collapses + 1
+                    if(removed >= remove) then break end
+                end
+            end
+        end
+        if(collapses == 0) then break end
+
+        -- Apply the pass and drop the degenerate triangles
+        local w = 0
+        for i = 0, n - 1, 3 do
+            local a, b, c = remap[idx[i]], remap[idx[i + 1]], remap[idx[i + 2]]
+            if(a ~= b and b ~= c and a ~= c) then
+                idx[w], idx[w + 1], idx[w + 2] = a, b, c
+                w = w + 3
+            end
+        end
+        n = w
+
+        -- Border edge set follows the collapses
+        edges = {}
+        for i = 0, n - 1, 3 do
+            for k = 0, 2 do
+                edges[idx[i + k] * vcount + idx[i + (k + 1) % 3]] = true
+            end
+        end
+    end
+
+    local out = ffi.new("uint32_t[?]", max(n, 1))
+    if(n > 0) then ffi.copy(out, idx, n * 4) end
+    return out, n, sqrt(result_error)
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Build the LOD chain for a loader primdata table (indices, icount, verts, vsize, vcount).
+--   Replaces primdata.indices with all levels appended and returns primdata.lods, or nil when
+--   the mesh is too small or does not simplify.
+lod.build = function(primdata, levels)
+
+    local indices, icount = primdata.indices, primdata.icount
+    if(indices == nil or icount == nil or icount / 3 < lod.min_triangles) then return nil end
+    levels = levels or lod.levels
+
+    local vsize     = primdata.vsize or 3
+    local positions = ffi.cast("float *", primdata.verts)
+    local vcount    = primdata.vcount
+    if(vcount == nil) then
+        vcount = 0
+        for i = 0, icount - 1 do if(indices[i] >= vcount) then vcount = indices[i] + 1 end end
+    end
+
+    -- Errors are kept relative to the mesh size so selection works at any scale
+    local minx, miny, minz = math.huge, math.huge, math.huge
+    local maxx, maxy, maxz = -math.huge, -math.huge, -math.huge
+    for v = 0, vcount - 1 do
+        local o = v * vsize
+        local x, y, z = positions[o], positions[o + 1], positions[o + 2]
+        if(x < minx) then minx = x end; if(x > maxx) then maxx = x end
+        if(y < miny) then miny = y end; if(y > maxy) then maxy = y end
+        if(z < minz) then minz = z end; if(z > maxz) then maxz = z end
+    end
+    local extent = max(maxx - minx, maxy - miny, maxz - minz)
+    if(extent <= 0.0) then return nil end
+
+    local lods      = { { offset = 0, count = icount, error = 0.0 } }
+    local lists     = {}
+    local cur, curcount = indices, icount
+    local total     = icount
+    local err       = 0.0
+    for l = 2, levels do
+        local target = floor(curcount * lod.ratio / 3) * 3
+        local out, n, e = lod.simplify(cur, curcount, positions, vsize, vcount, target)
+        -- Locked seams can stop a mesh from reducing, a near copy is not worth a level
+        if(n < 3 or n > curcount * 0.9) then break end
+        meshopt.optimize_vertex_cache(out, n, vcount)
+        err = err + e / extent
+        tinsert(lods, { offset = total, count = n, error = err })
+        tinsert(lists, out)
+        total = total + n
+        cur, curcount = out, n
+    end
+    if(#lods == 1) then return nil end
+
+    -- One index buffer, same index type as the source (primdata.ictype when indices is a pointer)
+    local combined = ffi.new(primdata.ictype or ffi.typeof(indices), total)
+    ffi.copy(combined, indices, ffi.sizeof(combined) / total * icount)
+    for l = 2, #lods do
+        local list, offset = lists[l - 1], lods[l].offset
+        for i = 0, lods[l].count - 1 do combined[offset + i] = list[i] end
+    end
+
+    primdata.indices    = combined
+    primdata.icount     = total
+    primdata.isize      = ffi.sizeof(combined)
+    primdata.vcount     = vcount
+    primdata.lods       = lods
+    return lods
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+lod.begin_frame = function()
+    local stats = lod.stats
+    stats.geoms, stats.full_triangles, stats.triangles, stats.switches = 0, 0, 0, 0
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Projected size in pixels of a unit of the mesh (its aabb diagonal), for a geom drawn with the
+--   model matrix tform in camera cam. Returns nil when the camera is unknown.
+lod.screen_size = function(cam, aabb, tform)
+
+    local camera = cammgr.get(cam)
+    if(camera == nil) then return nil end
+    local mn, mx = aabb.min, aabb.max
+    local cx, cy, cz = (mn.x + mx.x) * 0.5, (mn.y + mx.y) * 0.5, (mn.z + mx.z) * 0.5
+    local dx, dy, dz = mx.x - mn.x, mx.y - mn.y, mx.z - mn.z
+    local diag = sqrt(dx * dx + dy * dy + dz * dz)
+    local scale = 1.0
+    if(tform) then
+        local e = tform.Elements
+        local wx, wy, wz = cx, cy, cz
+        cx = e[0][0] * wx + e[1][0] * wy + e[2][0] * wz + e[3][0]
+        cy = e[0][1] * wx + e[1][1] * wy + e[2][1] * wz + e[3][1]
+        cz = e[0][2] * wx + e[1][2] * wy + e[2][2] * wz + e[3][2]
+        scale = max(sqrt(e[0][0] * e[0][0] + e[0][1] * e[0][1] + e[0][2] * e[0][2]),
+                    sqrt(e[1][0] * e[1][0] + e[1][1] * e[1][1] + e[1][2] * e[1][2]),
+                    sqrt(e[2][0] * e[2][0] + e[2][1] * e[2][1] + e[2][2] * e[2][2]))
+    end
+
+    -- View depth of the center, clamped at near so close geoms get the finest level
+    local v = camera.view.Elements
+    local depth = -(v[0][2] * cx + v[1][2] * cy + v[2][2] * cz + v[3][2])
+    depth = max(depth - diag * scale * 0.5, camera.near)
+    local height = camera.viewport.Elements[3]
+    local focal = height * 0.5 / math.tan(math.rad(camera.vfov) * 0.5)
+    return diag * scale * focal / depth
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Level to use for a mesh covering pixels on screen, currently drawn at level cur
+lod.pick = function(lods, cur, pixels)
+
+    local limit = lod.pixel_error
+    -- Finest level needed now
+    local need = 1
+    for l = #lods, 1, -1 do
+        if(lods[l].error * pixels <= limit) then need = l; break end
+    end
+    if(need <= cur) then return need end
+
+    -- Coarser only once the error is well under the limit
+    local low = limit * (1.0 - lod.hysteresis)
+    for l = need, cur + 1, -1 do
+        if(lods[l].error * pixels <= low) then return l end
+    end
+    return cur
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Select the LOD of a geom (needs geom.lods, geom.aabb and a bin state) for camera cam.
+--   Updates the bin state draw range when the level changes. Returns the level (1 is full).
+lod.select = function(geom, cam, tform)
+
+    local lods = geom.lods
+    local cur = geom.lod or 1
+    local stats = lod.stats
+    stats.geoms = stats.geoms + 1
+    stats.full_triangles = stats.full_triangles + lods[1].count / 3
+
+    local pixels = lod.screen_size(cam, geom.aabb, tform)
+    local level = cur
+    if(pixels) then level = lod.pick(lods, cur, pixels) end
+
+    if(level ~= cur) then
+        geom.lod = level
+        stats.switches = stats.switches + 1
+        local range = lods[level]
+        bins.bin_set_range(geom.bindid, geom.dstate, range.offset, range.count)
+    end
+    stats.triangles = stats.triangles + lods[level].count / 3
+    return level
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+return lod
+
+-- ---------------------------------------------------------------------------------------------------
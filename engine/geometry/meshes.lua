@@ -19,6 +19,13 @@ local cgltf      	= require("ffi.sokol.cgltf")
 
 local tinsert       = table.insert
 
+local band          = bit.band
+local bor           = bit.bor
+local lshift        = bit.lshift
+local rshift        = bit.rshift
+local abs           = math.abs
+local floor         = math.floor
+
 -- --------------------------------------------------------------------------------------
 
 local shc           = require("tools.shader_compiler.shc_compile").init( "worldbuilder", false )
@@ -27,6 +34,11 @@ local shc           = require("tools.shader_compiler.shc_compile").init( "worldb
 
 local all_meshes = {
     materials   = {},           -- A material shader cache.
+    pipelines   = {},           -- desc key -> { handle, refs }, identical pipelines share a handle
+    pipeline_ids = {},          -- pipeline id -> cache entry (for release)
+    samplers    = {},           -- desc key -> { handle, refs }
+    sampler_ids = {},
+    stats       = { pipelines = 0, pipeline_refs = 0, samplers = 0, sampler_refs = 0 },
 }
 
 -- ----------------------------------------------------------------------------------------
@@ -55,49 +67,244 @@ for k,v in pairs(MESH_TYPE) do
     mesh[k]=v
 end
 
+-- ----------------------------------------------------------------------------------------
+-- Vertex streams in attribute (shader location) order and their float counts.
+--   vertices uses buffers.vsize (3 or 4).
+local vertex_streams = {
+    { key = "vertices", size = nil },
+    { key = "uvs",      size = 2 },
+    { key = "normals",  size = 3 },
+    { key = "colors",   size = 4 },
+}
+
+local function float_format(size)
+    if(size == 2) then return sg.SG_VERTEXFORMAT_FLOAT2 end
+    if(size == 4) then return sg.SG_VERTEXFORMAT_FLOAT4 end
+    return sg.SG_VERTEXFORMAT_FLOAT3
+end
+
+local function make_vertex_buffer(name, ptr, size)
+    local buffer_desc           = ffi.new("sg_buffer_desc[1]")
+    buffer_desc[0].type         = sg.SG_BUFFERTYPE_VERTEXBUFFER 
+    buffer_desc[0].data.ptr     = ptr
+    buffer_desc[0].data.size    = size
+    buffer_desc[0].label        = name
+    return sg.sg_make_buffer(buffer_desc)
+end
+
+-- ----------------------------------------------------------------------------------------
+-- Quantized vertex formats (opt in with buffers.quantize = true or a table of options)
+--   positions  USHORT4N relative to the mesh aabb, w = 1. buffs.dequant holds the offset and 
+--              scale back to model space, which the owner folds into the model matrix.
+--   normals    octahedral SHORT2N, decoded in the shader (base_texture_quantized.glsl)
+--   uvs        HALF2, or USHORT2N with quantize.uvs = "unorm16" (only used if all uvs are 0..1)
+--   colors     UBYTE4N
+--   Every quantized stream is a whole number of 32 bit words, so strides stay in words.
+--   Packing writes the first component in the low half of a word (little endian).
+
+local f32       = ffi.new("union { float f; uint32_t u; }")
+
+-- Float to half float bits, round to nearest
+local function half(v)
+    f32.f = v
+    local x = f32.u
+    local sign = band(rshift(x, 16), 0x8000)
+    local e = band(rshift(x, 23), 0xFF) - 112
+    local m = band(x, 0x7FFFFF)
+    if(e <= 0) then 
+        if(e < -10) then return sign end
+        m = bor(m, 0x800000)
+        local shift = 14 - e
+        return bor(sign, rshift(m + lshift(1, shift - 1), shift))
+    elseif(e >= 31) then 
+        return bor(sign, 0x7C00)
+    end
+    return bor(sign, lshift(e, 10), rshift(m, 13)) + band(rshift(m, 12), 1)
+end
+
+mesh.half = half
+
+local function snorm16(v)
+    if(v > 1.0) then v = 1.0 elseif(v < -1.0) then v = -1.0 end
+    return band(floor(v * 32767.0 + 0.5), 0xFFFF)
+end
+
+local function unorm(v, max)
+    if(v > 1.0) then v = 1.0 elseif(v < 0.0) then v = 0.0 end
+    return floor(v * max + 0.5)
+end
+
+local function quantize_positions(src, vcount, vsize)
+    local minx, miny, minz = math.huge, math.huge, math.huge
+    local maxx, maxy, maxz = -math.huge, -math.huge, -math.huge
+    for i = 0, (vcount - 1) * vsize, vsize do 
+        local x, y, z = src[i], src[i + 1], src[i + 2]
+        if(x < minx) then minx = x end; if(x > maxx) then maxx = x end
+        if(y < miny) then miny = y end; if(y > maxy) then maxy = y end
+        if(z < minz) then minz = z end; if(z > maxz) then maxz = z end
+    end
+    local sx, sy, sz = maxx - minx, maxy - miny, maxz - minz
+    if(sx <= 0.0) then sx = 1.0 end
+    if(sy <= 0.0) then sy = 1.0 end
+    if(sz <= 0.0) then sz = 1.0 end
+    local ix, iy, iz = 1.0 / sx, 1.0 / sy, 1.0 / sz
+
+    local out = ffi.new("uint32_t[?]", vcount * 2)
+    local o = 0
+    for i = 0, (vcount - 1) * vsize, vsize do 
+        local qx = unorm((src[i] - minx) * ix, 65535.0)
+        local qy = unorm((src[i + 1] - miny) * iy, 65535.0)
+        local qz = unorm((src[i + 2] - minz) * iz, 65535.0)
+        out[o]      = bor(qx, lshift(qy, 16))
+        out[o + 1]  = bor(qz, lshift(0xFFFF, 16))
+        o = o + 2
+    end
+    local dequant = { offset = { minx, miny, minz }, scale = { sx, sy, sz } }
+    return out, 2, sg.SG_VERTEXFORMAT_USHORT4N, dequant
+end
+
+local function quantize_normals(src, vcount)
+    local out = ffi.new("uint32_t[?]", vcount)
+    for i = 0, vcount - 1 do 
+        local x, y, z = src[i * 3], src[i * 3 + 1], src[i * 3 + 2]
+        local l1 = abs(x) + abs(y) + abs(z)
+        if(l1 > 0.0) then x, y, z = x / l1, y / l1, z / l1 end
+        if(z < 0.0) then 
+            local ox, oy = x, y
+            x = (1.0 - abs(oy)) * (ox >= 0.0 and 1.0 or -1.0)
+            y = (1.0 - abs(ox)) * (oy >= 0.0 and 1.0 or -1.0)
+        end
+        out[i] = bor(snorm16(x), lshift(snorm16(y), 16))
+    end
+    return out, 1, sg.SG_VERTEXFORMAT_SHORT2N
+end
+
+local function quantize_uvs(src, vcount, mode)
+    if(mode == "unorm16") then 
+        for i = 0, vcount * 2 - 1 do 
+            if(src[i] < 0.0 or src[i] > 1.0) then mode = nil; break end
+        end
+    end
+    local out = ffi.new("uint32_t[?]", vcount)
+    if(mode == "unorm16") then 
+        for i = 0, vcount - 1 do 
+            out[i] = bor(unorm(src[i * 2], 65535.0), lshift(unorm(src[i * 2 + 1], 65535.0), 16))
+        end
+        return out, 1, sg.SG_VERTEXFORMAT_USHORT2N
+    end
+    for i = 0, vcount - 1 do 
+        out[i] = bor(half(src[i * 2]), lshift(half(src[i * 2 + 1]), 16))
+    end
+    return out, 1, sg.SG_VERTEXFORMAT_HALF2
+end
+
+local function quantize_colors(src, vcount)
+    local out = ffi.new("uint32_t[?]", vcount)
+    for i = 0, vcount - 1 do 
+        local c = i * 4
+        out[i] = bor(unorm(src[c], 255.0), lshift(unorm(src[c + 1], 255.0), 8), 
+                     lshift(unorm(src[c + 2], 255.0), 16), lshift(unorm(src[c + 3], 255.0), 24))
+    end
+    return out, 1, sg.SG_VERTEXFORMAT_UBYTE4N
+end
+
+-- ----------------------------------------------------------------------------------------
+-- Interleave the streams into dst (stride 32 bit words per vertex) in a single pass over the 
+--   vertices. A kernel is generated for each stream layout (eg. "3,2,3") so the jit sees fixed 
+--   offsets and unrolled copies. Words are copied as uint32 so packed data stays bit exact.
+local interleave_kernels = {}
+
+local function interleave_kernel(sizes)
+    local key = table.concat(sizes, ",")
+    local kernel = interleave_kernels[key]
+    if(kernel) then return kernel end
+
+    local args, body, offset = {}, {}, 0
+    for si, size in ipairs(sizes) do 
+        tinsert(args, "s"..si)
+        for k = 0, size - 1 do 
+            tinsert(body, string.format("        d[o + %d] = s%d[i * %d + %d]", offset + k, si, size, k))
+        end
+        offset = offset + size
+    end
+    local src = "local ffi = ...\n"
+    src = src.."return function(d, stride, vertcount, "..table.concat(args, ", ")..")\n"
+    src = src.."    for i = 0, vertcount - 1 do\n        local o = i * stride\n"
+    src = src..table.concat(body, "\n").."\n    end\nend\n"
+    kernel = loadstring(src, "=interleave_"..key)(ffi)
+    interleave_kernels[key] = kernel
+    return kernel
+end
+
+local function interleave(dst, stride, streams, vertcount)
+    local sizes, srcs = {}, {}
+    for si, stream in ipairs(streams) do 
+        sizes[si] = stream.size
+        srcs[si] = ffi.cast("uint32_t *", stream.ptr)
+    end
+    local kernel = interleave_kernel(sizes)
+    kernel(ffi.cast("uint32_t *", dst), stride, vertcount, unpack(srcs))
+end
+
+mesh.interleave = interleave
+
 -- ----------------------------------------------------------------------------------------
 -- Buffer creation tool
+--   By default the streams are interleaved into one vertex buffer. 
+--   buffers.separate = true uploads each stream straight from its source array into its own 
+--   vertex buffer slot (no cpu copy). The source arrays must be contiguous and tightly packed.
+--   buffers.views = true allows plain pointers as sources (their length cannot be checked), 
+--   buffers.isize is then the index buffer size in bytes.
+--   buffers.quantize packs the streams first (see above), then interleaves or separates them.
 mesh.create_buffer     = function(name, buffers)
 
     -- Make a mesh table with the info we need to build the pipeline and bindings.
-    -- Buffers need to be interleaved with data sets, so we do this here. 
     local vertcount     = 0 
 
     local stride      = 0
     local attribs     = {}
     local float_size  = ffi.sizeof("float")
-    local offset      = 0
     local vsize       = buffers.vsize or 3
 
+    -- Collect the streams present
+    local streams     = {}
+    local dequant     = nil
+    local quantize    = buffers.quantize
+    if(quantize == true) then quantize = {} end
     if(buffers.vertices) then 
-        
         vertcount = buffers.vcount or ffi.sizeof(buffers.vertices) / (vsize * float_size)
-        stride = vsize
-        if(vsize == 4) then 
-            tinsert(attribs, { offset = offset, format = sg.SG_VERTEXFORMAT_FLOAT4 })
-        else     
-            tinsert(attribs, { offset = offset, format = sg.SG_VERTEXFORMAT_FLOAT3 })
-        end
-
-        if(buffers.uvs) then 
-            stride = stride + 2
-            offset = offset + 3 * float_size
-            tinsert(attribs, { offset = offset, format = sg.SG_VERTEXFORMAT_FLOAT2 })
-        end
-        if(buffers.normals) then 
-            stride = stride + 3
-            offset = offset + 5 * float_size
-            tinsert(attribs, { offset = offset, format = sg.SG_VERTEXFORMAT_FLOAT3 })
-        end
-        if(buffers.colors) then 
-            stride = stride + 4
-            offset = offset + 8 * float_size
-            tinsert(attribs, { offset = offset, format = sg.SG_VERTEXFORMAT_FLOAT4 })
+        for i, vs in ipairs(vertex_streams) do 
+            local src = buffers[vs.key]
+            if(src) then 
+                local size = vs.size or vsize
+                local ptr = ffi.cast("float *", src)
+                local format = float_format(size)
+                if(quantize and vertcount > 0) then 
+                    if(vs.key == "vertices") then 
+                        src, size, format, dequant = quantize_positions(ptr, vertcount, size)
+                    elseif(vs.key == "normals") then 
+                        src, size, format = quantize_normals(ptr, vertcount)
+                    elseif(vs.key == "uvs") then 
+                        src, size, format = quantize_uvs(ptr, vertcount, quantize.uvs)
+                    elseif(vs.key == "colors") then 
+                        src, size, format = quantize_colors(ptr, vertcount)
+                    end
+                    ptr = src
+                end
+                tinsert(streams, { key = vs.key, src = src, ptr = ptr, size = size })
+                if(buffers.separate) then 
+                    tinsert(attribs, { offset = 0, format = format, buffer_index = #streams - 1 })
+                else
+                    tinsert(attribs, { offset = stride * float_size, format = format })
+                end
+                stride = stride + size
+            end
         end
     end
 
     local buffs = {
         vbuf   = nil,
+        vbufs  = nil,
         vcount  = vertcount,
         ibuf   = nil,
         icount  = buffers.icount or 0,
@@ -105,63 +312,45 @@ mesh.create_buffer     = function(name, buffers)
         sbuf   = nil,
         scount  = 0,
         stride  = stride,
+        strides = nil,
         attrs   = attribs,
         depth   = {},
+        dequant = dequant,
+        vertex_bytes = vertcount * stride * float_size,
     }
 
-    local uvptr = nil
-    local nptr = nil
-    local cptr = nil
     if(buffers.vertices) then 
-        local buffer = ffi.new("float[?]", vertcount * stride)
-        local vptr = ffi.cast("float *", buffers.vertices)
-
-        if(buffers.uvs) then uvptr = ffi.cast("float *", buffers.uvs) end
-        if(buffers.normals) then nptr = ffi.cast("float *", buffers.normals) end
-        if(buffers.colors) then cptr = ffi.cast("float *", buffers.colors) end
-
-        -- Copy in interlaced! 
-        local ptr = ffi.cast("float *", buffer) 
-        for i=1, vertcount do 
-            ffi.copy(ptr, vptr,  stride * float_size)
-            vptr = vptr + vsize
-            ptr = ptr + vsize
-
-            if(buffers.uvs) then 
-                ffi.copy(ptr, uvptr, 2* float_size)
-                uvptr = uvptr + 2
-                ptr = ptr + 2
-            end
-            if(buffers.normals) then 
-                ffi.copy(ptr, nptr,  3* float_size)
-                nptr = nptr + 3
-                ptr = ptr + 3
-            end
-            if(buffers.colors) then 
-                ffi.copy(ptr, cptr,  4* float_size)
-                cptr = cptr + 4
-                ptr = ptr + 4
+        if(vertcount == 0) then return nil end
+
+        if(buffers.separate) then 
+            buffs.vbufs     = {}
+            buffs.strides   = {}
+            for si, stream in ipairs(streams) do 
+                local bytes = vertcount * stream.size * float_size
+                local avail = not buffers.views and ffi.sizeof(stream.src)
+                if(avail and avail < bytes) then 
+                    pprint("[Error mesh.create_buffer] Stream too short: "..stream.key)
+                    return nil
+                end
+                tinsert(buffs.vbufs, make_vertex_buffer(name.."-"..stream.key, stream.ptr, bytes))
+                tinsert(buffs.strides, stream.size)
             end
-        end
-        -- buffer should now have interlaced data
-        if(ffi.sizeof(buffer) > 0) then 
-            local buffer_desc           = ffi.new("sg_buffer_desc[1]")
-            buffer_desc[0].type         = sg.SG_BUFFERTYPE_VERTEXBUFFER 
-            buffer_desc[0].data.ptr     = buffer
-            buffer_desc[0].data.size    = ffi.sizeof(buffer)
-            buffer_desc[0].label        = name.."-vertices"
-            buffs.vbuf = sg.sg_make_buffer(buffer_desc)
-        else 
-            return nil         
+            buffs.vbuf = buffs.vbufs[1]
+        else
+            local buffer = ffi.new("uint32_t[?]", vertcount * stride)
+            interleave(buffer, stride, streams, vertcount)
+            -- buffer should now have interlaced data
+            buffs.vbuf = make_vertex_buffer(name.."-vertices", buffer, ffi.sizeof(buffer))
         end
     end
 
     if(buffers.indices) then
-        if(ffi.sizeof(buffers.indices) > 0) then 
+        local isize = buffers.isize or ffi.sizeof(buffers.indices)
+        if(isize > 0) then 
             local buffer_desc           = ffi.new("sg_buffer_desc[1]")
             buffer_desc[0].type         = sg.SG_BUFFERTYPE_INDEXBUFFER 
             buffer_desc[0].data.ptr     = buffers.indices
-            buffer_desc[0].data.size    = ffi.sizeof(buffers.indices)
+            buffer_desc[0].data.size    = isize
             buffer_desc[0].label        = name.."-indices"
             buffs.ibuf = sg.sg_make_buffer(buffer_desc)    
         else 
@@ -169,7 +358,16 @@ mesh.create_buffer     = function(name, buffers)
         end
     end
 
-    if(buffers.storage) then 
+    -- A number makes an empty stream storage buffer of that many bytes, updated per frame
+    if(type(buffers.storage) == "number") then 
+        local buffer_desc           = ffi.new("sg_buffer_desc[1]")
+        buffer_desc[0].type         = sg.SG_BUFFERTYPE_STORAGEBUFFER
+        buffer_desc[0].usage        = sg.SG_USAGE_STREAM
+        buffer_desc[0].size         = buffers.storage
+        buffer_desc[0].label        = name.."-storage"
+        buffs.sbuf = sg.sg_make_buffer(buffer_desc)
+        buffs.scount = buffers.storage
+    elseif(buffers.storage) then 
         if(ffi.sizeof(buffers.storage) > 0) then 
             local buffer_desc           = ffi.new("sg_buffer_desc[1]")
             buffer_desc[0].type         = sg.SG_BUFFERTYPE_STORAGEBUFFER
@@ -185,6 +383,75 @@ mesh.create_buffer     = function(name, buffers)
     return buffs
 end
 
+-- ----------------------------------------------------------------------------------------
+-- Pipeline and sampler caches
+--   The key is the raw bytes of the desc (layout, shader, depth, cull, blend, ...) with the 
+--   label cleared, so any two descs that would make the same sokol object share one handle.
+--   Descs must come from ffi.new (zero filled) so padding bytes are stable.
+--   Handles are reference counted, release them with mesh.release_pipeline/release_sampler.
+
+local function desc_key(desc, ctype)
+    local label = desc[0].label
+    desc[0].label = nil
+    local key = ffi.string(desc, ffi.sizeof(ctype))
+    desc[0].label = label
+    return key
+end
+
+local function cache_get(cache, ids, key, make, desc, statname, refname)
+    local entry = cache[key]
+    local stats = all_meshes.stats
+    if(entry == nil) then 
+        local handle = make(desc)
+        entry = { handle = handle, refs = 0, key = key }
+        cache[key] = entry
+        ids[handle.id] = entry
+        stats[statname] = stats[statname] + 1
+    end
+    entry.refs = entry.refs + 1
+    stats[refname] = stats[refname] + 1
+    return entry.handle
+end
+
+local function cache_release(cache, ids, handle, destroy, statname, refname)
+    local entry = handle and ids[handle.id]
+    if(entry == nil) then return end
+    local stats = all_meshes.stats
+    entry.refs = entry.refs - 1
+    stats[refname] = stats[refname] - 1
+    if(entry.refs <= 0) then 
+        cache[entry.key] = nil
+        ids[handle.id] = nil
+        stats[statname] = stats[statname] - 1
+        destroy(entry.handle)
+    end
+end
+
+-- pipe_desc is an sg_pipeline_desc[1]
+mesh.make_pipeline = function(pipe_desc)
+    local key = desc_key(pipe_desc, "sg_pipeline_desc")
+    return cache_get(all_meshes.pipelines, all_meshes.pipeline_ids, key, sg.sg_make_pipeline, pipe_desc, "pipelines", "pipeline_refs")
+end
+
+mesh.release_pipeline = function(pip)
+    cache_release(all_meshes.pipelines, all_meshes.pipeline_ids, pip, sg.sg_destroy_pipeline, "pipelines", "pipeline_refs")
+end
+
+-- smp_desc is an sg_sampler_desc[1]
+mesh.make_sampler = function(smp_desc)
+    local key = desc_key(smp_desc, "sg_sampler_desc")
+    return cache_get(all_meshes.samplers, all_meshes.sampler_ids, key, sg.sg_make_sampler, smp_desc, "samplers", "sampler_refs")
+end
+
+mesh.release_sampler = function(smp)
+    cache_release(all_meshes.samplers, all_meshes.sampler_ids, smp, sg.sg_destroy_sampler, "samplers", "sampler_refs")
+end
+
+-- Unique pipelines/samplers alive and the references held on them
+mesh.get_stats = function()
+    return all_meshes.stats
+end
+
 -- ----------------------------------------------------------------------------------------
 -- Create an image to be used to texture geom or render textures
 
@@ -201,7 +468,9 @@ end
 
 -- ----------------------------------------------------------------------------------------
 -- Create a material from shader and params
-mesh.material  = function(name, shaderfile, params)
+--   inst_shaderfile is an optional instanced variant of the shader (see base_texture_instanced.glsl)
+--   It is only built when the backend supports storage buffers.
+mesh.material  = function(name, shaderfile, params, inst_shaderfile)
 
     local cached = all_meshes.materials[shaderfile]
     if(cached) then return cached end
@@ -209,18 +478,25 @@ mesh.material  = function(name, shaderfile, params)
     local shader    = shc.compile(shaderfile, nil, name)
     local shd       = sg.sg_make_shader(shader)
 
-    local sampler_desc      = ffi.new("sg_sampler_desc")
-    sampler_desc.min_filter = sg.SG_FILTER_LINEAR
-    sampler_desc.mag_filter = sg.SG_FILTER_LINEAR
-    sampler_desc.wrap_u     = sg.SG_WRAP_REPEAT
-    sampler_desc.wrap_v     = sg.SG_WRAP_REPEAT
-    sampler_desc.wrap_w     = sg.SG_WRAP_REPEAT  -- only needed for 3D textures
+    local inst_shd  = nil
+    if(inst_shaderfile and sg.sg_query_features().storage_buffer) then 
+        local inst_shader = shc.compile(inst_shaderfile, nil, name.."_inst")
+        if(inst_shader) then inst_shd = sg.sg_make_shader(inst_shader) end
+    end
+
+    local sampler_desc          = ffi.new("sg_sampler_desc[1]")
+    sampler_desc[0].min_filter  = sg.SG_FILTER_LINEAR
+    sampler_desc[0].mag_filter  = sg.SG_FILTER_LINEAR
+    sampler_desc[0].wrap_u      = sg.SG_WRAP_REPEAT
+    sampler_desc[0].wrap_v      = sg.SG_WRAP_REPEAT
+    sampler_desc[0].wrap_w      = sg.SG_WRAP_REPEAT  -- only needed for 3D textures
     
-    local default_sampler = sg.sg_make_sampler(sampler_desc)
+    local default_sampler = mesh.make_sampler(sampler_desc)
 
     if(shd) then 
         local material = {
             shader          = shd, 
+            inst_shader     = inst_shd,
             params          = params,
             name            = name, 
             base_color_smp  = default_sampler,
@@ -249,7 +525,12 @@ mesh.make_mesh = function(name, buffers)
     -- One attr for each buffer
     for bi, buffer in ipairs(buffers) do
         
-        if(buffer) then 
+        -- Separate streams have a layout slot each
+        if(buffer.strides) then 
+            for si, stride in ipairs(buffer.strides) do 
+                mesh.layout.buffers[si-1].stride = stride * ffi.sizeof("float")
+            end
+        elseif(buffer) then 
             mesh.layout.buffers[bi-1].stride = buffer.stride * ffi.sizeof("float")
         end
 
@@ -265,6 +546,7 @@ mesh.make_mesh = function(name, buffers)
             for i, attr in ipairs(buffer.attrs) do
                 mesh.layout.attrs[i-1].format = attr.format
                 mesh.layout.attrs[i-1].offset = attr.offset
+                mesh.layout.attrs[i-1].buffer_index = attr.buffer_index or 0
             end
         end
 
@@ -279,6 +561,9 @@ mesh.make_mesh = function(name, buffers)
         end
 
         mesh.vbuf = buffer.vbuf
+        mesh.vbufs = buffer.vbufs
+        mesh.dequant = buffer.dequant
+        mesh.vertex_bytes = buffer.vertex_bytes
         mesh.ibuf = buffer.ibuf
         mesh.sbuf = buffer.sbuf    
     end
@@ -324,10 +609,22 @@ mesh.model     = function(name, prim, mesh, material)
     -- pipe_desc[0].sample_count           = 1
     -- pipe_desc[0].depth.pixel_format     = sg.SG_PIXELFORMAT_DEPTH
 
-    local pipeline = sg.sg_make_pipeline(pipe_desc)
+    local pipeline = mesh.make_pipeline(pipe_desc)
+
+    -- Same state with the instanced shader. The bins switch to this when they collapse draws.
+    local inst_pipeline = nil
+    if(material.inst_shader) then 
+        pipe_desc[0].shader             = material.inst_shader
+        pipe_desc[0].label              = name.."-inst-pipeline"
+        inst_pipeline = mesh.make_pipeline(pipe_desc)
+    end
     
     local binding = ffi.new("sg_bindings[1]", {})
-    binding[0].vertex_buffers[0]       = mesh.vbuf
+    if(mesh.vbufs) then 
+        for i, vbuf in ipairs(mesh.vbufs) do binding[0].vertex_buffers[i-1] = vbuf end
+    else
+        binding[0].vertex_buffers[0]   = mesh.vbuf
+    end
     if(mesh.ibuf) then binding[0].index_buffer = mesh.ibuf end
 
     local mesh_mat = prim.material
@@ -347,11 +644,21 @@ mesh.model     = function(name, prim, mesh, material)
     end
     return {
         pip     = pipeline,
+        inst_pip = inst_pipeline,
         bind    = binding,
         alpha   = { mode = prim_alpha_mode, cutoff = prim_alpha_cutoff }
     }
 end 
 
+-- ----------------------------------------------------------------------------------------
+-- Drop the cached pipeline references a model holds
+mesh.release_model = function(model)
+    mesh.release_pipeline(model.pip)
+    mesh.release_pipeline(model.inst_pip)
+    model.pip       = nil
+    model.inst_pip  = nil
+end
+
 -- ----------------------------------------------------------------------------------------
 
 return mesh 
@@ -0,0 +1,370 @@
+-- ---------------------------------------------------------------------------------------------------
+-- meshopt
+--    Import time index and vertex ordering for better gpu cache use. All of it works in place on
+--    FFI index arrays (uint16_t or uint32_t) so it can run straight on loader output.
+--
+--    optimize_vertex_cache   Forsyth style greedy triangle ordering for the post transform cache
+--    optimize_overdraw       Splits the cache ordered list into clusters at cache restarts and
+--                            orders clusters outward facing first, so early z rejects more
+--    optimize_vertex_fetch   Renumbers vertices in first use order and reorders the streams
+--    analyze_vertex_cache    FIFO cache simulation: ACMR (misses per triangle) and ATVR (misses
+--                            per vertex, 1.0 is ideal)
+--
+--    optimize(primdata) runs the three in order on a loader primdata table.
+-- ---------------------------------------------------------------------------------------------------
+
+local ffi       = require("ffi")
+
+local tinsert   = table.insert
+local floor     = math.floor
+local sqrt      = math.sqrt
+
+-- ---------------------------------------------------------------------------------------------------
+
+local meshopt = {
+    CACHE_SIZE      = 32,       -- cache size the ordering is scored for
+    FIFO_SIZE       = 16,       -- cache size used when analyzing (typical hardware)
+}
+
+-- Forsyth scoring constants
+local CACHE_DECAY_POWER     = 1.5
+local LAST_TRI_SCORE        = 0.75
+local VALENCE_BOOST_SCALE   = 2.0
+local VALENCE_BOOST_POWER   = 0.5
+local MAX_VALENCE           = 32
+
+local cache_scores      = ffi.new("float[?]", meshopt.CACHE_SIZE + 4)
+local valence_scores    = ffi.new("float[?]", MAX_VALENCE + 1)
+
+do
+    local size = meshopt.CACHE_SIZE
+    for i = 0, size + 3 do
+        if(i < 3) then
+            cache_scores[i] = LAST_TRI_SCORE
+        elseif(i < size) then
+            cache_scores[i] = math.pow(1.0 - (i - 3) / (size - 3), CACHE_DECAY_POWER)
+        else
+            cache_scores[i] = 0.0
+        end
+    end
+    valence_scores[0] = 0.0
+    for i = 1, MAX_VALENCE do
+        valence_scores[i] = VALENCE_BOOST_SCALE * math.pow(i, -VALENCE_BOOST_POWER)
+    end
+end
+
+local function vertex_score(cache_pos, valence)
+    if(valence == 0) then return -1.0 end
+    if(valence > MAX_VALENCE) then valence = MAX_VALENCE end
+    local s = valence_scores[valence]
+    if(cache_pos >= 0) then s = s + cache_scores[cache_pos] end
+    return s
+end
+
+-- Vertex count from the largest index when it is not given
+local function index_vcount(indices, icount)
+    local m = -1
+    for i = 0, icount - 1 do
+        if(indices[i] > m) then m = indices[i] end
+    end
+    return m + 1
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Reorder triangles for the vertex cache. indices is modified in place.
+meshopt.optimize_vertex_cache = function(indices, icount, vcount)
+
+    local tcount = floor(icount / 3)
+    if(tcount < 2) then return end
+    vcount = vcount or index_vcount(indices, icount)
+    local csize = meshopt.CACHE_SIZE
+
+    -- Triangle adjacency per vertex
+    local valence   = ffi.new("int32_t[?]", vcount)
+    local offsets   = ffi.new("int32_t[?]", vcount + 1)
+    for i = 0, tcount * 3 - 1 do
+        local v = indices[i]
+        valence[v] = valence[v] + 1
+    end
+    for v = 0, vcount - 1 do offsets[v + 1] = offsets[v] + valence[v] end
+    local adj       = ffi.new("int32_t[?]", tcount * 3)
+    local fill      = ffi.new("int32_t[?]", vcount)
+    for t = 0, tcount - 1 do
+        for k = 0, 2 do
+            local v = indices[t * 3 + k]
+            adj[offsets[v] + fill[v]] = t
+            fill[v] = fill[v] + 1
+        end
+    end
+
+    local cache_pos = ffi.new("int32_t[?]", vcount)
+    local vscore    = ffi.new("float[?]", vcount)
+    for v = 0, vcount - 1 do
+        cache_pos[v] = -1
+        vscore[v] = vertex_score(-1, valence[v])
+    end
+
+    local tscore    = ffi.new("float[?]", tcount)
+    local emitted   = ffi.new("uint8_t[?]", tcount)
+    local best_tri, best_score = 0, -1.0
+    for t = 0, tcount - 1 do
+        local s = vscore[indices[t * 3]] + vscore[indices[t * 3 + 1]] + vscore[indices[t * 3 + 2]]
+        tscore[t] = s
+        if(s > best_score) then best_tri, best_score = t, s end
+    end
+
+    local out       = ffi.new("uint32_t[?]", tcount * 3)
+    local cache     = ffi.new("int32_t[?]", csize + 3)
+    local ncache    = ffi.new("int32_t[?]", csize + 3)
+    local cache_len = 0
+    local scan      = 0
+
+    for o = 0, tcount - 1 do
+
+        -- Dead end: take the next unused triangle in input order
+        if(best_tri < 0) then
+            while(emitted[scan] ~= 0) do scan = scan + 1 end
+            best_tri = scan
+        end
+
+        local t = best_tri
+        emitted[t] = 1
+        local a, b, c = indices[t * 3], indices[t * 3 + 1], indices[t * 3 + 2]
+        out[o * 3], out[o * 3 + 1], out[o * 3 + 2] = a, b, c
+
+        -- Remove the triangle from its vertices' adjacency
+        for k = 0, 2 do
+            local v = indices[t * 3 + k]
+            local first = offsets[v]
+            local n = valence[v]
+            for j = first, first + n - 1 do
+                if(adj[j] == t) then
+                    adj[j] = adj[first + n - 1]
+                    break
+                end
+            end
+            valence[v] = n - 1
+        end
+
+        -- New cache: the triangle's vertices first, then the old contents
+        local len = 3
+        ncache[0], ncache[1], ncache[2] = a, b, c
+        for i = 0, cache_len - 1 do
+            local v = cache[i]
+            if(v ~= a and v ~= b and v ~= c) then
+                ncache[len] = v
+                len = len + 1
+            end
+        end
+        cache, ncache = ncache, cache
+        cache_len = len
+
+        -- Rescore the cached vertices (evicted ones drop to no cache score) and their triangles
+        best_tri, best_score = -1, -1.0
+        for i = 0, cache_len - 1 do
+            local v = cache[i]
+            local pos = i
+            if(i >= csize) then pos = -1 end
+            cache_pos[v] = pos
+            local s = vertex_score(pos, valence[v])
+            local d = s - vscore[v]
+            vscore[v] = s
+            local first = offsets[v]
+            for j = first, first + valence[v] - 1 do
+                local at = adj[j]
+                local ts = tscore[at] + d
+                tscore[at] = ts
+                if(ts > best_score) then best_tri, best_score = at, ts end
+            end
+        end
+        if(cache_len > csize) then cache_len = csize end
+    end
+
+    for i = 0, tcount * 3 - 1 do indices[i] = out[i] end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- FIFO cache simulation. Returns ACMR, ATVR and the number of vertex transforms.
+meshopt.analyze_vertex_cache = function(indices, icount, vcount, cache_size)
+
+    cache_size = cache_size or meshopt.FIFO_SIZE
+    vcount = vcount or index_vcount(indices, icount)
+    local stamp     = ffi.new("uint32_t[?]", vcount)
+    local timestamp = cache_size + 1
+    local misses    = 0
+    local used      = 0
+    local seen      = ffi.new("uint8_t[?]", vcount)
+
+    for i = 0, icount - 1 do
+        local v = indices[i]
+        if(seen[v] == 0) then
+            seen[v] = 1
+            used = used + 1
+        end
+        if(timestamp - stamp[v] > cache_size) then
+            stamp[v] = timestamp
+            timestamp = timestamp + 1
+            misses = misses + 1
+        end
+    end
+    local tcount = floor(icount / 3)
+    return misses / math.max(tcount, 1), misses / math.max(used, 1), misses
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Order clusters of a cache optimized index list outward facing first. positions is a float
+--   array with vsize floats per vertex. Clusters start where the FIFO cache misses all three
+--   vertices of a triangle, so the cache efficiency inside each cluster is kept.
+meshopt.optimize_overdraw = function(indices, icount, positions, vsize, vcount)
+
+    local tcount = floor(icount / 3)
+    if(tcount < 2) then return end
+    vsize = vsize or 3
+    vcount = vcount or index_vcount(indices, icount)
+    local cache_size = meshopt.FIFO_SIZE
+
+    -- Cluster boundaries
+    local stamp     = ffi.new("uint32_t[?]", vcount)
+    local timestamp = cache_size + 1
+    local starts    = {}
+    for t = 0, tcount - 1 do
+        local miss = 0
+        for k = 0, 2 do
+            local v = indices[t * 3 + k]
+            if(timestamp - stamp[v] > cache_size) then
+                stamp[v] = timestamp
+                timestamp = timestamp + 1
+                miss = miss + 1
+            end
+        end
+        if(t == 0 or miss == 3) then tinsert(starts, t) end
+    end
+    local nclusters = #starts
+    if(nclusters < 2) then return end
+    tinsert(starts, tcount)
+
+    -- Mesh centroid
+    local mx, my, mz = 0.0, 0.0, 0.0
+    for i = 0, icount - 1 do
+        local p = indices[i] * vsize
+        mx, my, mz = mx + positions[p], my + positions[p + 1], mz + positions[p + 2]
+    end
+    mx, my, mz = mx / icount, my / icount, mz / icount
+
+    -- Sort key per cluster: area weighted centroid offset along the cluster normal
+    local keys = {}
+    local order = {}
+    for ci = 1, nclusters do
+        local cx, cy, cz, nx, ny, nz, area = 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0
+        for t = starts[ci], starts[ci + 1] - 1 do
+            local a, b, c = indices[t * 3] * vsize, indices[t * 3 + 1] * vsize, indices[t * 3 + 2] * vsize
+            local ax, ay, az = positions[a], positions[a + 1], positions[a + 2]
+            local ux, uy, uz = positions[b] - ax, positions[b + 1] - ay, positions[b + 2] - az
+            local vx, vy, vz = positions[c] - ax, positions[c + 1] - ay, positions[c + 2] - az
+            local tx, ty, tz = uy * vz - uz * vy, uz * vx - ux * vz, ux * vy - uy * vx
+            local w = sqrt(tx * tx + ty * ty + tz * tz)
+            nx, ny, nz = nx + tx, ny + ty, nz + tz
+            cx = cx + (ax + positions[b] + positions[c]) * w
+            cy = cy + (ay + positions[b + 1] + positions[c + 1]) * w
+            cz = cz + (az + positions[b + 2] + positions[c + 2]) * w
+            area = area + w
+        end
+        local key = 0.0
+        if(area > 0.0) then
+            local inv = 1.0 / (area * 3.0)
+            cx, cy, cz = cx * inv, cy * inv, cz * inv
+            local nl = sqrt(nx * nx + ny * ny + nz * nz)
+            if(nl > 0.0) then key = ((cx - mx) * nx + (cy - my) * ny + (cz - mz) * nz) / nl end
+        end
+        keys[ci] = key
+        order[ci] = ci
+    end
+    table.sort(order, function(a, b)
+        if(keys[a] ~= keys[b]) then return keys[a] > keys[b] end
+        return a < b
+    end)
+
+    local out = ffi.new("uint32_t[?]", tcount * 3)
+    local o = 0
+    for oi = 1, nclusters do
+        local ci = order[oi]
+        for i = starts[ci] * 3, starts[ci + 1] * 3 - 1 do
+            out[o] = indices[i]
+            o = o + 1
+        end
+    end
+    for i = 0, tcount * 3 - 1 do indices[i] = out[i] end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Renumber vertices in the order the indices first use them and reorder the streams to match.
+--   streams is a list of { data = cdata VLA, size = bytes per vertex }. Each gets a new array
+--   of the same ctype in stream.data (or stream.ctype, needed when data is a plain pointer).
+--   Unreferenced vertices are dropped. Returns the new count.
+meshopt.optimize_vertex_fetch = function(indices, icount, streams, vcount)
+
+    vcount = vcount or index_vcount(indices, icount)
+    local remap = ffi.new("int32_t[?]", vcount)
+    ffi.fill(remap, vcount * 4, 0xFF)
+    local order = ffi.new("int32_t[?]", vcount)
+    local used = 0
+    for i = 0, icount - 1 do
+        local v = indices[i]
+        local r = remap[v]
+        if(r < 0) then
+            r = used
+            remap[v] = r
+            order[r] = v
+            used = used + 1
+        end
+        indices[i] = r
+    end
+
+    for si, stream in ipairs(streams) do
+        local size  = stream.size
+        local ctype = stream.ctype or ffi.typeof(stream.data)
+        -- Float arrays have several elements per vertex, struct arrays (obj Vertex[?]) have one
+        local data  = ffi.new(ctype, used * size / ffi.sizeof(ctype, 1))
+        local src   = ffi.cast("uint8_t *", stream.data)
+        local dst   = ffi.cast("uint8_t *", data)
+        for r = 0, used - 1 do
+            ffi.copy(dst + r * size, src + order[r] * size, size)
+        end
+        stream.data = data
+    end
+    return used
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Run the whole stage on a loader primdata table (indices, icount, verts, uvs, normals, vsize).
+--   The stream arrays in primdata are replaced with the reordered ones and vcount is set.
+--   primdata.views marks streams that are float pointers into loader memory, not VLAs.
+local stream_keys = { "verts", "uvs", "normals" }
+
+meshopt.optimize = function(primdata)
+
+    local indices, icount = primdata.indices, primdata.icount
+    if(indices == nil or icount == nil or icount < 6) then return end
+    local vsize  = primdata.vsize or 3
+    local vcount = index_vcount(indices, icount)
+
+    meshopt.optimize_vertex_cache(indices, icount, vcount)
+    meshopt.optimize_overdraw(indices, icount, ffi.cast("float *", primdata.verts), vsize, vcount)
+
+    local sizes = { verts = vsize * 4, uvs = 8, normals = 12 }
+    local ctype = primdata.views and "float[?]" or nil
+    local streams = {}
+    for i, key in ipairs(stream_keys) do
+        if(primdata[key]) then
+            tinsert(streams, { key = key, data = primdata[key], size = sizes[key], ctype = ctype })
+        end
+    end
+    primdata.vcount = meshopt.optimize_vertex_fetch(indices, icount, streams, vcount)
+    for i, stream in ipairs(streams) do primdata[stream.key] = stream.data end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+return meshopt
+
+-- ---------------------------------------------------------------------------------------------------
@@ -0,0 +1,616 @@
+-- ---------------------------------------------------------------------------------------------------
+-- spatial
+--    Spatial index for world entities: radius, aabb, k nearest and ray queries without looking at
+--    every object.
+--
+--    Every object gets a slot (center and half extents in FFI float arrays, like culling) and lives
+--    in one of two structures:
+--      dynamic - a hashed uniform grid. An object sits in the cell of its center, cells hash into a
+--                power of two bucket table of doubly linked slot lists, so moving an object is an
+--                O(1) unlink / link and only happens when it changes cell. Queries widen their cell
+--                range by the largest dynamic extent seen.
+--      static  - a loose octree (nodes twice their size). An object goes into the deepest node its
+--                extents fit. Nodes split once they hold spatial.split objects and are never freed.
+--
+--    Objects are updated incrementally: spatial.move for a single object, or spatial.system(index)
+--    for a tiny-ecs system that only moves entities whose "pos" was marked changed.
+--
+--    Query results go into an out table (out[1..n], entries past n are stale) and n is returned.
+-- ---------------------------------------------------------------------------------------------------
+
+local ffi       = require("ffi")
+
+local band      = bit.band
+local bxor      = bit.bxor
+local tobit     = bit.tobit
+local abs       = math.abs
+local floor     = math.floor
+local ceil      = math.ceil
+local sqrt      = math.sqrt
+local min       = math.min
+local max       = math.max
+local huge      = math.huge
+local tsort     = table.sort
+
+-- ---------------------------------------------------------------------------------------------------
+
+local spatial = {
+    DYNAMIC     = 1,
+    STATIC      = 2,
+
+    cell        = 16.0,     -- Grid cell size (ideally a couple of times the typical object size)
+    size        = 4096.0,   -- Octree root half size, static objects outside go in the root
+    depth       = 10,       -- Octree max depth
+    split       = 16,       -- Objects in an octree node before it splits
+    capacity    = 1024,     -- Initial slots
+}
+
+-- ---------------------------------------------------------------------------------------------------
+
+local function regrow(old, ctype, size, used)
+    local arr = ffi.new(ctype, size)
+    if(old ~= nil and used > 0) then ffi.copy(arr, old, used * ffi.sizeof(ffi.typeof(ctype), 1)) end
+    return arr
+end
+
+local function grow_slots(index, size)
+
+    local used = index.top
+    for i, name in ipairs({ "cx", "cy", "cz", "ex", "ey", "ez" }) do
+        index[name] = regrow(index[name], "float[?]", size, used)
+    end
+    for i, name in ipairs({ "next", "prev", "home", "ix", "iy", "iz" }) do
+        index[name] = regrow(index[name], "int32_t[?]", size, used)
+    end
+    index.kind  = regrow(index.kind, "uint8_t[?]", size, used)
+    index.stamp = regrow(index.stamp, "uint32_t[?]", size, used)
+    index.slots = size
+end
+
+local function grow_nodes(index, size)
+
+    local used = index.node_count
+    for i, name in ipairs({ "ncx", "ncy", "ncz", "nh" }) do
+        index[name] = regrow(index[name], "float[?]", size, used)
+    end
+    index.nchild = regrow(index.nchild, "int32_t[?]", size, used)
+    index.nhead  = regrow(index.nhead, "int32_t[?]", size, used)
+    index.ncount = regrow(index.ncount, "int32_t[?]", size, used)
+    index.ndepth = regrow(index.ndepth, "int32_t[?]", size, used)
+    index.node_slots = size
+end
+
+local function new_node(index, x, y, z, h)
+
+    local n = index.node_count
+    if(n >= index.node_slots) then grow_nodes(index, index.node_slots * 2) end
+    index.ncx[n], index.ncy[n], index.ncz[n], index.nh[n] = x, y, z, h
+    index.nchild[n], index.nhead[n], index.ncount[n], index.ndepth[n] = -1, -1, 0, 0
+    index.node_count = n + 1
+    return n
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+spatial.new = function(opts)
+
+    opts = opts or {}
+    local capacity = opts.capacity or spatial.capacity
+    local index = {
+        cell        = opts.cell or spatial.cell,
+        size        = opts.size or spatial.size,
+        depth       = opts.depth or spatial.depth,
+
+        top         = 0,        -- Slots below this have been used
+        slots       = 0,
+        free        = {},
+        objects     = {},       -- slot -> object
+        count       = 0,
+        query       = 0,        -- Stamp for queries that could see a slot twice
+
+        dynamic     = 0,        -- Objects in the grid
+        max_ext     = 0.0,      -- Largest dynamic half extent
+        bounds      = { huge, huge, huge, -huge, -huge, -huge },   -- Cells used so far (only grows)
+        buckets     = nil,      -- int32_t[nbuckets], first slot of each bucket
+        nbuckets    = 0,
+
+        node_count  = 0,
+        node_slots  = 0,
+    }
+    index.inv_cell = 1.0 / index.cell
+    grow_slots(index, capacity)
+    grow_nodes(index, 64)
+    new_node(index, opts.x or 0.0, opts.y or 0.0, opts.z or 0.0, index.size)
+
+    local nb = 1024
+    while(nb < capacity) do nb = nb * 2 end
+    index.buckets = ffi.new("int32_t[?]", nb)
+    ffi.fill(index.buckets, nb * 4, 0xFF)
+    index.nbuckets = nb
+    return index
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Grid
+
+local function cell_hash(index, x, y, z)
+    return band(bxor(tobit(x * 73856093), tobit(y * 19349663), tobit(z * 83492791)), index.nbuckets - 1)
+end
+
+local function grid_link(index, id)
+
+    local inv = index.inv_cell
+    local x, y, z = floor(index.cx[id] * inv), floor(index.cy[id] * inv), floor(index.cz[id] * inv)
+    local bounds = index.bounds
+    if(x < bounds[1]) then bounds[1] = x end
+    if(y < bounds[2]) then bounds[2] = y end
+    if(z < bounds[3]) then bounds[3] = z end
+    if(x > bounds[4]) then bounds[4] = x end
+    if(y > bounds[5]) then bounds[5] = y end
+    if(z > bounds[6]) then bounds[6] = z end
+    index.ix[id], index.iy[id], index.iz[id] = x, y, z
+    local b = cell_hash(index, x, y, z)
+    local head = index.buckets[b]
+    index.next[id], index.prev[id], index.home[id] = head, -1, b
+    if(head >= 0) then index.prev[head] = id end
+    index.buckets[b] = id
+end
+
+local function unlink(index, id, heads)
+
+    local nx, pv = index.next[id], index.prev[id]
+    if(pv >= 0) then index.next[pv] = nx else heads[index.home[id]] = nx end
+    if(nx >= 0) then index.prev[nx] = pv end
+end
+
+local function grid_rehash(index, nb)
+
+    index.buckets = ffi.new("int32_t[?]", nb)
+    ffi.fill(index.buckets, nb * 4, 0xFF)
+    index.nbuckets = nb
+    local kind = index.kind
+    for id = 0, index.top - 1 do
+        if(kind[id] == spatial.DYNAMIC) then grid_link(index, id) end
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Octree
+
+local octree_place
+
+-- Give a node its 8 children and push its objects down into them where they fit
+local function octree_split(index, node)
+
+    local h = index.nh[node] * 0.5
+    local cx, cy, cz = index.ncx[node], index.ncy[node], index.ncz[node]
+    local child = index.node_count
+    for i = 0, 7 do
+        local n = new_node(index, cx + ((band(i, 1) ~= 0) and h or -h),
+            cy + ((band(i, 2) ~= 0) and h or -h), cz + ((band(i, 4) ~= 0) and h or -h), h)
+        index.ndepth[n] = index.ndepth[node] + 1
+    end
+    index.nchild[node] = child
+
+    local id = index.nhead[node]
+    index.nhead[node], index.ncount[node] = -1, 0
+    while(id >= 0) do
+        local nx = index.next[id]
+        octree_place(index, id, node)
+        id = nx
+    end
+end
+
+-- Link an object into the deepest existing node below node that holds it (a child holds objects
+--   with their center inside it and half extents up to its half size). A node splits once it has
+--   more than spatial.split objects.
+octree_place = function(index, id, node)
+
+    local x, y, z = index.cx[id], index.cy[id], index.cz[id]
+    local e = max(index.ex[id], index.ey[id], index.ez[id])
+    local ncx, ncy, ncz, nh, nchild = index.ncx, index.ncy, index.ncz, index.nh, index.nchild
+    -- Outside the root: keep it there
+    if(node ~= 0 or (abs(x - ncx[0]) <= nh[0] and abs(y - ncy[0]) <= nh[0] and abs(z - ncz[0]) <= nh[0])) then
+        while(nchild[node] >= 0 and e <= nh[node] * 0.5) do
+            local octant = ((x >= ncx[node]) and 1 or 0) + ((y >= ncy[node]) and 2 or 0) + ((z >= ncz[node]) and 4 or 0)
+            node = nchild[node] + octant
+        end
+    end
+    local head = index.nhead[node]
+    index.next[id], index.prev[id], index.home[id] = head, -1, node
+    if(head >= 0) then index.prev[head] = id end
+    index.nhead[node] = id
+    local count = index.ncount[node] + 1
+    index.ncount[node] = count
+    if(count > spatial.split and nchild[node] < 0 and index.ndepth[node] < index.depth) then
+        octree_split(index, node)
+    end
+end
+
+local function octree_link(index, id)
+    octree_place(index, id, 0)
+end
+
+local function octree_unlink(index, id)
+    local node = index.home[id]
+    unlink(index, id, index.nhead)
+    index.ncount[node] = index.ncount[node] - 1
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Add an object. kind is spatial.DYNAMIC (default) or spatial.STATIC. Returns its slot.
+spatial.insert = function(index, obj, x, y, z, ex, ey, ez, kind)
+
+    kind = kind or spatial.DYNAMIC
+    local id = table.remove(index.free)
+    if(id == nil) then
+        if(index.top >= index.slots) then grow_slots(index, index.slots * 2) end
+        id = index.top
+        index.top = id + 1
+    end
+    ex = ex or 0.0
+    index.cx[id], index.cy[id], index.cz[id] = x, y, z
+    index.ex[id], index.ey[id], index.ez[id] = ex, ey or ex, ez or ex
+    index.kind[id] = kind
+    index.stamp[id] = 0
+    index.objects[id] = obj
+    index.count = index.count + 1
+
+    if(kind == spatial.DYNAMIC) then
+        index.dynamic = index.dynamic + 1
+        index.max_ext = max(index.max_ext, ex, ey or ex, ez or ex)
+        if(index.dynamic > index.nbuckets) then grid_rehash(index, index.nbuckets * 2) end
+        grid_link(index, id)
+    else
+        octree_link(index, id)
+    end
+    return id
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+spatial.remove = function(index, id)
+
+    if(id < 0 or id >= index.top) then return end
+    local kind = index.kind[id]
+    if(kind == 0) then return end
+    if(kind == spatial.DYNAMIC) then
+        unlink(index, id, index.buckets)
+        index.dynamic = index.dynamic - 1
+    else
+        octree_unlink(index, id)
+    end
+    index.kind[id] = 0
+    index.objects[id] = nil
+    index.count = index.count - 1
+    table.insert(index.free, id)
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- New center (and optionally extents) for an object. Dynamic objects only relink when they change
+--   cell, static ones are put back into the octree.
+spatial.move = function(index, id, x, y, z, ex, ey, ez)
+
+    if(id < 0 or id >= index.top or index.kind[id] == 0) then return end
+    index.cx[id], index.cy[id], index.cz[id] = x, y, z
+    if(ex) then
+        index.ex[id], index.ey[id], index.ez[id] = ex, ey or ex, ez or ex
+    end
+    if(index.kind[id] == spatial.DYNAMIC) then
+        if(ex) then index.max_ext = max(index.max_ext, ex, ey or ex, ez or ex) end
+        local inv = index.inv_cell
+        if(floor(x * inv) ~= index.ix[id] or floor(y * inv) ~= index.iy[id] or floor(z * inv) ~= index.iz[id]) then
+            unlink(index, id, index.buckets)
+            grid_link(index, id)
+        end
+    else
+        octree_unlink(index, id)
+        octree_link(index, id)
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Walk every stored object that may overlap the box (minx..maxx etc), calling test(id) for each.
+--   The grid range is widened by the largest dynamic extent. When the range has more cells than
+--   there are dynamic objects, the dynamic slots are scanned instead.
+local stack_size = 1024
+local node_stack = ffi.new("int32_t[?]", stack_size)
+
+-- Room for 8 more nodes on the traversal stack
+local function stack_reserve(sp)
+    if(sp + 8 > stack_size) then
+        stack_size = stack_size * 2
+        node_stack = regrow(node_stack, "int32_t[?]", stack_size, sp)
+    end
+end
+
+local function visit_box(index, x0, y0, z0, x1, y1, z1, test)
+
+    -- Grid
+    if(index.dynamic > 0) then
+        local m, inv = index.max_ext, index.inv_cell
+        local gx0, gy0, gz0 = floor((x0 - m) * inv), floor((y0 - m) * inv), floor((z0 - m) * inv)
+        local gx1, gy1, gz1 = floor((x1 + m) * inv), floor((y1 + m) * inv), floor((z1 + m) * inv)
+        local cells = (gx1 - gx0 + 1) * (gy1 - gy0 + 1) * (gz1 - gz0 + 1)
+        if(cells > index.dynamic) then
+            local kind = index.kind
+            for id = 0, index.top - 1 do
+                if(kind[id] == spatial.DYNAMIC) then test(id) end
+            end
+        else
+            local buckets, nxt = index.buckets, index.next
+            local ix, iy, iz = index.ix, index.iy, index.iz
+            for gz = gz0, gz1 do
+                for gy = gy0, gy1 do
+                    for gx = gx0, gx1 do
+                        local id = buckets[cell_hash(index, gx, gy, gz)]
+                        while(id >= 0) do
+                            if(ix[id] == gx and iy[id] == gy and iz[id] == gz) then test(id) end
+                            id = nxt[id]
+                        end
+                    end
+                end
+            end
+        end
+    end
+
+    -- Octree, loose bounds are twice the node half size
+    local ncx, ncy, ncz, nh = index.ncx, index.ncy, index.ncz, index.nh
+    local nchild, nhead, nxt = index.nchild, index.nhead, index.next
+    local sp = 1
+    node_stack[0] = 0
+    while(sp > 0) do
+        sp = sp - 1
+        local node = node_stack[sp]
+        local h = nh[node] * 2.0
+        if(node == 0) then h = huge end
+        local x, y, z = ncx[node], ncy[node], ncz[node]
+        if(x - h <= x1 and x + h >= x0 and y - h <= y1 and y + h >= y0 and z - h <= z1 and z + h >= z0) then
+            local id = nhead[node]
+            while(id >= 0) do
+                test(id)
+                id = nxt[id]
+            end
+            local child = nchild[node]
+            if(child >= 0) then
+                stack_reserve(sp)
+                for i = 0, 7 do node_stack[sp + i] = child + i end
+                sp = sp + 8
+            end
+        end
+    end
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Objects whose bounds overlap the box
+spatial.aabb = function(index, x0, y0, z0, x1, y1, z1, out)
+
+    local n = 0
+    local cx, cy, cz, ex, ey, ez = index.cx, index.cy, index.cz, index.ex, index.ey, index.ez
+    local objects = index.objects
+    local qx, qy, qz = (x0 + x1) * 0.5, (y0 + y1) * 0.5, (z0 + z1) * 0.5
+    local hx, hy, hz = (x1 - x0) * 0.5, (y1 - y0) * 0.5, (z1 - z0) * 0.5
+    visit_box(index, x0, y0, z0, x1, y1, z1, function(id)
+        if(abs(cx[id] - qx) <= ex[id] + hx and abs(cy[id] - qy) <= ey[id] + hy and abs(cz[id] - qz) <= ez[id] + hz) then
+            n = n + 1
+            out[n] = objects[id]
+        end
+    end)
+    return n
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Objects whose bounds touch the sphere
+spatial.radius = function(index, x, y, z, r, out)
+
+    local n = 0
+    local r2 = r * r
+    local cx, cy, cz, ex, ey, ez = index.cx, index.cy, index.cz, index.ex, index.ey, index.ez
+    local objects = index.objects
+    visit_box(index, x - r, y - r, z - r, x + r, y + r, z + r, function(id)
+        local dx = max(abs(cx[id] - x) - ex[id], 0.0)
+        local dy = max(abs(cy[id] - y) - ey[id], 0.0)
+        local dz = max(abs(cz[id] - z) - ez[id], 0.0)
+        if(dx * dx + dy * dy + dz * dz <= r2) then
+            n = n + 1
+            out[n] = objects[id]
+        end
+    end)
+    return n
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- k objects with the nearest centers (within max_dist, default unlimited), nearest first.
+--   Searches a growing radius until k centers are inside it. dist (optional table) gets the
+--   distances.
+local knn_ids, knn_d2 = {}, {}
+local function knn_less(a, b) return knn_d2[a] < knn_d2[b] end
+
+spatial.nearest = function(index, x, y, z, k, out, dist, max_dist)
+
+    if(index.count == 0 or k <= 0) then return 0 end
+    max_dist = max_dist or huge
+    local cx, cy, cz = index.cx, index.cy, index.cz
+    local r = index.cell
+    local found
+    while(true) do
+        local rr = min(r, max_dist)
+        local r2 = rr * rr
+        found = 0
+        visit_box(index, x - rr, y - rr, z - rr, x + rr, y + rr, z + rr, function(id)
+            local dx, dy, dz = cx[id] - x, cy[id] - y, cz[id] - z
+            local d2 = dx * dx + dy * dy + dz * dz
+            if(d2 <= r2) then
+                found = found + 1
+                knn_ids[found] = id
+                knn_d2[id] = d2
+            end
+        end)
+        if(found >= k or found >= index.count or rr >= max_dist) then break end
+        r = r * 2.0
+    end
+    for i = #knn_ids, found + 1, -1 do knn_ids[i] = nil end
+    tsort(knn_ids, knn_less)
+
+    local n = min(k, found)
+    for i = 1, n do
+        local id = knn_ids[i]
+        out[i] = index.objects[id]
+        if(dist) then dist[i] = sqrt(knn_d2[id]) end
+    end
+    for i = 1, found do knn_d2[knn_ids[i]] = nil end
+    return n
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- Ray against the object bounds. Direction does not need to be normalized, distances are in units
+--   of its length. Returns the nearest object and its distance, or nil.
+
+-- Slab test, entry distance or nil
+local function ray_box(ox, oy, oz, ix, iy, iz, cx, cy, cz, hx, hy, hz, tmax)
+
+    local t0, t1 = 0.0, tmax
+    local a, b = (cx - hx - ox) * ix, (cx + hx - ox) * ix
+    if(a > b) then a, b = b, a end
+    if(a == a) then t0 = max(t0, a) end
+    if(b == b) then t1 = min(t1, b) end
+    a, b = (cy - hy - oy) * iy, (cy + hy - oy) * iy
+    if(a > b) then a, b = b, a end
+    if(a == a) then t0 = max(t0, a) end
+    if(b == b) then t1 = min(t1, b) end
+    a, b = (cz - hz - oz) * iz, (cz + hz - oz) * iz
+    if(a > b) then a, b = b, a end
+    if(a == a) then t0 = max(t0, a) end
+    if(b == b) then t1 = min(t1, b) end
+    if(t0 <= t1) then return t0 end
+    return nil
+end
+
+spatial.ray = function(index, ox, oy, oz, dx, dy, dz, max_dist)
+
+    max_dist = max_dist or 1e6
+    local ix, iy, iz = 1.0 / dx, 1.0 / dy, 1.0 / dz
+    local cx, cy, cz, ex, ey, ez = index.cx, index.cy, index.cz, index.ex, index.ey, index.ez
+    local stamp = index.stamp
+    local q = index.query + 1
+    index.query = q
+    local best, best_id = max_dist, -1
+
+    local function test(id)
+        if(stamp[id] == q) then return end
+        stamp[id] = q
+        local t = ray_box(ox, oy, oz, ix, iy, iz, cx[id], cy[id], cz[id], ex[id], ey[id], ez[id], best)
+        if(t and t < best) then best, best_id = t, id end
+    end
+
+    -- Grid: 3D DDA over the cells the ray passes, each visited with the neighbours an object in
+    --   them could reach out of (max_ext). Only the part of the ray inside the box of the dynamic
+    --   objects is walked.
+    local b = index.bounds
+    local m, cell, inv = index.max_ext, index.cell, index.inv_cell
+    local t = (index.dynamic > 0) and ray_box(ox, oy, oz, ix, iy, iz,
+        (b[1] + b[4] + 1) * cell * 0.5, (b[2] + b[5] + 1) * cell * 0.5, (b[3] + b[6] + 1) * cell * 0.5,
+        (b[4] - b[1] + 1) * cell * 0.5 + m, (b[5] - b[2] + 1) * cell * 0.5 + m, (b[6] - b[3] + 1) * cell * 0.5 + m,
+        max_dist)
+    if(t) then
+        local reach = ceil(m * inv)
+        local px, py, pz = ox + dx * t, oy + dy * t, oz + dz * t
+        local gx, gy, gz = floor(px * inv), floor(py * inv), floor(pz * inv)
+        local sx, sy, sz = (dx > 0) and 1 or -1, (dy > 0) and 1 or -1, (dz > 0) and 1 or -1
+        local function first(p, g, s, i)
+            if(i == huge or i == -huge) then return huge end
+            return t + (((g + ((s > 0) and 1 or 0)) * cell) - p) * i
+        end
+        local tx, ty, tz = first(px, gx, sx, ix), first(py, gy, sy, iy), first(pz, gz, sz, iz)
+        local dtx, dty, dtz = abs(cell * ix), abs(cell * iy), abs(cell * iz)
+        local lx0, ly0, lz0 = b[1] - reach - 1, b[2] - reach - 1, b[3] - reach - 1
+        local lx1, ly1, lz1 = b[4] + reach + 1, b[5] + reach + 1, b[6] + reach + 1
+        local buckets, nxt = index.buckets, index.next
+        local cix, ciy, ciz = index.ix, index.iy, index.iz
+        local slack = (reach + 1) * cell * sqrt(3.0) / sqrt(dx * dx + dy * dy + dz * dz)
+        while(t <= best + slack) do
+            for nz = gz - reach, gz + reach do
+                for ny = gy - reach, gy + reach do
+                    for nx = gx - reach, gx + reach do
+                        local id = buckets[cell_hash(index, nx, ny, nz)]
+                        while(id >= 0) do
+                            if(cix[id] == nx and ciy[id] == ny and ciz[id] == nz) then test(id) end
+                            id = nxt[id]
+                        end
+                    end
+                end
+            end
+            if(tx <= ty and tx <= tz) then
+                t = tx; tx = tx + dtx; gx = gx + sx
+            elseif(ty <= tz) then
+                t = ty; ty = ty + dty; gy = gy + sy
+            else
+                t = tz; tz = tz + dtz; gz = gz + sz
+            end
+            if(t > max_dist or gx < lx0 or gx > lx1 or gy < ly0 or gy > ly1 or gz < lz0 or gz > lz1) then break end
+        end
+    end
+
+    -- Octree: nodes whose loose bounds the ray enters before the best hit
+    local ncx, ncy, ncz, nh = index.ncx, index.ncy, index.ncz, index.nh
+    local nchild, nhead, nxt = index.nchild, index.nhead, index.next
+    local sp = 1
+    node_stack[0] = 0
+    while(sp > 0) do
+        sp = sp - 1
+        local node = node_stack[sp]
+        local h = nh[node] * 2.0
+        if(node == 0 or ray_box(ox, oy, oz, ix, iy, iz, ncx[node], ncy[node], ncz[node], h, h, h, best)) then
+            local id = nhead[node]
+            while(id >= 0) do
+                test(id)
+                id = nxt[id]
+            end
+            local child = nchild[node]
+            if(child >= 0) then
+                stack_reserve(sp)
+                for i = 0, 7 do node_stack[sp + i] = child + i end
+                sp = sp + 8
+            end
+        end
+    end
+
+    if(best_id < 0) then return nil end
+    return index.objects[best_id], best
+end
+
+-- ---------------------------------------------------------------------------------------------------
+-- A tiny-ecs processing system keeping entities with a pos ({x, y, z}) in the index. New entities
+--   are inserted (entity.static for the octree, entity.extents or entity.radius for the bounds),
+--   after that only entities marked changed on "pos" are moved. The slot is kept in
+--   entity.spatial_id.
+spatial.system = function(index, tiny)
+
+    local system = tiny.processingSystem({ onlyChanged = "pos" })
+    system.filter = tiny.requireAll("pos")
+    function system:process(e, dt)
+        local p = e.pos
+        local ext = e.extents
+        local ex, ey, ez
+        if(ext) then ex, ey, ez = ext.x, ext.y, ext.z else ex = e.radius or 0.0 end
+        local id = e.spatial_id
+        if(id == nil) then
+            e.spatial_id = spatial.insert(index, e, p.x, p.y, p.z, ex, ey, ez, e.static and spatial.STATIC or spatial.DYNAMIC)
+        else
+            spatial.move(index, id, p.x, p.y, p.z, ex, ey, ez)
+        end
+    end
+    function system:onRemove(e)
+        if(e.spatial_id) then
+            spatial.remove(index, e.spatial_id)
+            e.spatial_id = nil
+        end
+    end
+    return system
+end
+
+-- ---------------------------------------------------------------------------------------------------
+
+return spatial
+
+-- ---------------------------------------------------------------------------------------------------
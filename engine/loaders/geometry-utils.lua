@@ -10,6 +10,8 @@ local tremove 		= table.remove
 local ffi 			= require("ffi")
 local utils 		= require("lua.utils")
 local meshes		= require("lua.geometry.meshes")
+local meshopt		= require("lua.geometry.meshopt")
+local lod 			= require("lua.geometry.lod")
 
 local sapp          = require("sokol_app")
 local slib      	= require("sokol_libs")
@@ -28,6 +30,19 @@ local geom = {
 	meshes 		= {},
 
 	all_objs    = {},
+
+	-- Quantize the vertex streams of imported meshes (see meshes.create_buffer). 
+	--   true, or a table of options eg: { uvs = "unorm16" }
+	quantize 	= false,
+
+	-- Reorder indexed meshes for the vertex cache, overdraw and vertex fetch at import 
+	--   (see meshopt.lua). Off unless set, primdata.optimize overrides it for a single mesh.
+	optimize 	= false,
+
+	-- Build a LOD chain for indexed meshes (see lod.lua). Number of levels including the full
+	--   mesh, 1 (the default) disables it. primdata.lod_levels overrides it per mesh. 
+	--   Note: the levels are appended to primdata.indices, so primdata.icount grows too.
+	lod_levels 	= 1,
 }
 
 ------------------------------------------------------------------------------------------------------------
@@ -57,32 +72,55 @@ function geom:makeGeom(name, prim, mesh, bin_target, materialdata)
 	local matdata     = materialdata or {
 		name = "default", 
 		filename = "lua/engine/shaders/base_texture_normals.glsl",
+		instanced = "lua/engine/shaders/base_texture_instanced.glsl",
 		params = {},
 	}
+	-- Uniform block ctypes generated by the shader are <name>_<vs|fs>_<block>_t
+	local vs_block    = "vs_params"
+	local fs_block    = "fs_params"
+
+	-- Quantized meshes decode their normals in the shader (no instanced variant for these yet)
+	if(materialdata == nil and mesh.dequant) then 
+		matdata.filename = "lua/engine/shaders/base_texture_quantized.glsl"
+		matdata.instanced = nil
+		vs_block    = "vs_quant_params"
+		fs_block    = "fs_quant_params"
+	end
 	
 	-- TODO: Needs to come from gltf refs
-	local material    = meshes.material(matdata.name, matdata.filename, matdata.params)
+	local material    = meshes.material(matdata.name, matdata.filename, matdata.params, matdata.instanced)
 	local prim_mat    = prim.material or { base_color = { 1, 1, 1, 1 } }
 
 	local newgeom = {}
 	newgeom.id 			= #geom.all_objs + 1
 	newgeom.model 		= meshes.model(name, prim, mesh, material)
 	newgeom.transform 	= prim.transform
+	newgeom.aabb 		= prim.aabb or mesh.aabb
+	newgeom.lods 		= mesh.lods
+	newgeom.lod 		= 1
 
 	newgeom.pip        = newgeom.model.pip 
 	newgeom.bind       = newgeom.model.bind
+	newgeom.inst_pip   = newgeom.model.inst_pip
+	newgeom.material   = material
+	if(mesh.dequant) then 
+		local dq = mesh.dequant
+		newgeom.dequant = hmm.HMM_MulM4(hmm.HMM_Translate(hmm.HMM_V3(dq.offset[1], dq.offset[2], dq.offset[3])), 
+										hmm.HMM_Scale(hmm.HMM_V3(dq.scale[1], dq.scale[2], dq.scale[3])))
+	end
 	newgeom.rx = 0
 	newgeom.ry = 0
 
 	local bcolor = prim_mat.base_color or { 1, 1, 1, 1 }
 
-	newgeom.vs_params = ffi.new(matdata.name.."_vs_params_t[1]")
+	newgeom.vs_params = ffi.new(matdata.name.."_"..vs_block.."_t[1]")
 	newgeom.vs_params[0].mvp = makeMvp(0.0, 0.0)
+	if(newgeom.dequant) then newgeom.vs_params[0].mvp = hmm.HMM_MulM4(newgeom.vs_params[0].mvp, newgeom.dequant) end
 	newgeom.vs_params[0].base_color_factor    = 	ffi.new("float [4]", {
 		bcolor[1], bcolor[2], bcolor[3], bcolor[4]
 	})
 
-	newgeom.fs_params = ffi.new(matdata.name.."_fs_params_t[1]")
+	newgeom.fs_params = ffi.new(matdata.name.."_"..fs_block.."_t[1]")
 	newgeom.fs_params[0].alpha_cutoff   = newgeom.model.alpha.cutoff or 0.0
 	newgeom.fs_params[0].alpha_mode     = newgeom.model.alpha.mode or 0
 
@@ -92,7 +130,7 @@ function geom:makeGeom(name, prim, mesh, bin_target, materialdata)
 
 	newgeom.bintype    = bin_target or bins.BTYPE_OPAQUE
 	-- Use the dstate to directly effect the runtime object 
-	newgeom.bindid, newgeom.dstate = bins.bin_add_geom(newgeom)
+	newgeom.bindid, newgeom.dstate, newgeom.binindex = bins.bin_add_geom(newgeom)
 	
 	tinsert(geom.all_objs, newgeom)
 
@@ -133,7 +171,7 @@ function geom:makeLines(name, prim, mesh, bin_target)
 
 	newgeom.bintype    = bin_target or bins.BTYPE_OPAQUE
 	-- Use the dstate to directly effect the runtime object 
-	newgeom.bindid, newgeom.dstate = bins.bin_add_geom(newgeom)
+	newgeom.bindid, newgeom.dstate, newgeom.binindex = bins.bin_add_geom(newgeom)
 	
 	tinsert(geom.all_objs, newgeom)
 
@@ -150,17 +188,34 @@ function geom:makeMesh( goname, primdata )
 	end 
 	if(type(goname) == "cdata") then goname = ffi.string(goname) end
 
+	local optimize = primdata.optimize
+	if(optimize == nil) then optimize = self.optimize end
+	if(optimize and primdata.indices) then 
+		meshopt.optimize(primdata)
+	end
+	local lods = nil
+	local levels = primdata.lod_levels or self.lod_levels
+	if(levels > 1 and primdata.indices) then 
+		lods = lod.build(primdata, levels)
+	end
+
 	local buffers 		= {}
 	buffers.itype 		= primdata.itype
 	buffers.icount 		= primdata.icount
 	buffers.vertices 	= primdata.verts
 	buffers.vcount 		= primdata.vcount 
 	buffers.vsize 		= primdata.vsize
+	buffers.separate 	= primdata.separate
+	buffers.views 		= primdata.views
+	buffers.quantize 	= primdata.quantize or self.quantize
 
 	local mcount = primdata.vcount
 	if(primdata.indices) then 
 		buffers.indices = primdata.indices
+		buffers.isize 	= primdata.isize
 		mcount = primdata.icount
+		-- The index buffer holds every LOD, draws start with the full mesh
+		if(lods) then mcount = lods[1].count end
 	end 
 	if(primdata.uvs) then 
 		buffers.uvs = primdata.uvs
@@ -184,6 +239,7 @@ function geom:makeMesh( goname, primdata )
 	geom.ctr = geom.ctr + 1
 
 	mesh.count = mcount
+	mesh.lods = lods
 
 	return mesh
 end
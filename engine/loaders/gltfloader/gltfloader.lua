@@ -11,6 +11,7 @@ local gameobject	= require("lua.engine.gameobject")
 local geom 			= require("lua.loaders.geometry-utils")
 local meshes 		= require("lua.geometry.meshes")
 local imageutils 	= require("lua.loaders.image-utils")
+local vfs 			= require("tools.vfs.vfs")
 
 local b64 			= require("lua.base64")
 local utils			= require("lua.utils")
@@ -163,6 +164,61 @@ end
 
 ------------------------------------------------------------------------------------------------------------
 
+local function get_addr(ptr, off, ctype)
+    off = off or 0
+    ctype = ctype or "uintptr_t"  -- type of element, defaults to pointer size
+    local addr = ffi.cast("uintptr_t", ptr) + off * ffi.sizeof(ctype)
+    return tonumber(addr)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Float accessor data as a pointer straight into the loaded buffer when it is tightly packed
+--   floats (no copy). Anything else (interleaved, normalized ints, sparse) is unpacked into a
+--   new float array. Views are only valid until the cgltf data is freed after upload.
+local function accessor_floats( acc )
+
+	local comps = tonumber(cgltf.cgltf_num_components(acc.type))
+	local count = tonumber(acc.count)
+	if(acc.component_type == cgltf.cgltf_component_type_r_32f and acc.normalized == 0 and 
+		acc.is_sparse == 0 and acc.buffer_view ~= nil and tonumber(acc.stride) == comps * 4) then 
+		local data = cgltf.cgltf_buffer_view_data(acc.buffer_view)
+		if(data ~= nil) then return ffi.cast("float *", data + acc.offset), count end
+	end
+	local out = ffi.new("float[?]", count * comps)
+	cgltf.cgltf_accessor_unpack_floats(acc, out, count * comps)
+	return out, count
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Index accessor data, same idea. 8 bit indices are widened to 16 bit. The mesh optimizer 
+--   reorders indices in place, so an accessor shared by several primitives is always copied
+--   (model.index_refs is counted in gltf_parse_meshes). Models parsed out of a vfs archive are
+--   read only memory, their indices are always copied too.
+local index_formats = {
+	[tonumber(cgltf.cgltf_component_type_r_8)]		= { ctype = "uint16_t", size = 2 },
+	[tonumber(cgltf.cgltf_component_type_r_8u)]		= { ctype = "uint16_t", size = 2 },
+	[tonumber(cgltf.cgltf_component_type_r_16)]		= { ctype = "uint16_t", size = 2, view = true },
+	[tonumber(cgltf.cgltf_component_type_r_16u)]	= { ctype = "uint16_t", size = 2, view = true },
+	[tonumber(cgltf.cgltf_component_type_r_32u)]	= { ctype = "uint32_t", size = 4, view = true },
+}
+
+local function accessor_indices( model, acc )
+
+	local format = index_formats[tonumber(acc.component_type)]
+	if(format == nil) then return nil end
+	local count = tonumber(acc.count)
+	if(format.view and not model.mapped and model.index_refs[get_addr(acc)] == 1 and acc.is_sparse == 0 and 
+		acc.buffer_view ~= nil and tonumber(acc.stride) == format.size) then 
+		local data = cgltf.cgltf_buffer_view_data(acc.buffer_view)
+		if(data ~= nil) then return ffi.cast(format.ctype.." *", data + acc.offset), format end
+	end
+	local out = ffi.new(format.ctype.."[?]", count)
+	cgltf.cgltf_accessor_unpack_indices(acc, out, format.size, count)
+	return out, format
+end
+
+------------------------------------------------------------------------------------------------------------
+
 function gltfloader:processdata( model, gochildname, thisnode, parent )
 
 	--print(model)
@@ -171,80 +227,46 @@ function gltfloader:processdata( model, gochildname, thisnode, parent )
 
 	if(prims == nil) then pprint("No Primitives?"); return end 
 
-	local buffer_data = nil
-	
 	-- collate all primitives (we ignore material separate prims)
 	for pid, prim in ipairs(prims) do
 
 		local verts = nil
 		local uvs = nil
 		local normals = nil
+		local vcount = nil
 		
 		local acc_idx = prim.indices
 		local indices = nil
+		local iformat = nil
 		
 		local itype = sg.SG_INDEXTYPE_UINT16
 
 		if(acc_idx) then 
-			local bv = acc_idx.buffer_view
-			local index_buffer_data = cgltf.cgltf_buffer_view_data(bv)
-
-			local ctype = tonumber(acc_idx.component_type)
-			-- Indices specific - this is default dataset for gltf (I think)
-			if(ctype == cgltf.cgltf_component_type_r_32u) then 
-				indices = ffi.new("uint32_t[?]", acc_idx.count)
-				ffi.copy(indices, index_buffer_data, acc_idx.count * 4)
-				-- geomextension.setdataintstotable( 0, , index_buffer_data, indices)
+			indices, iformat = accessor_indices(model, acc_idx)
+			if(indices == nil) then 
+				pprint("[Error] Unhandled componentType: "..tonumber(acc_idx.component_type))
+			elseif(iformat.size == 4) then 
 				itype = sg.SG_INDEXTYPE_UINT32
 				pprint("[Warning] 32 bit index buffer")
-			elseif(ctype == cgltf.cgltf_component_type_r_32f) then 
-				pprint("TODO: Support float buffers")
-			elseif(ctype == cgltf.cgltf_component_type_r_16u or ctype == cgltf.cgltf_component_type_r_16) then 
-				indices = ffi.new("uint16_t[?]", acc_idx.count)
-				ffi.copy(indices, index_buffer_data, acc_idx.count * 2)
-				-- geomextension.setdatashortstotable( 0, acc_idx.count * 2, index_buffer_data, indices)
-			elseif(ctype == cgltf.cgltf_component_type_r_8u or ctype == cgltf.cgltf_component_type_r_8) then 
-				indices = ffi.new("uint16_t[?]", acc_idx.count)
-				local ptr = index_buffer_data
-				local acount = tonumber(acc_idx.count)
-				for i=0, acount-1 do 
-					indices[i] = ptr[i]
-				end
-				itype = sg.SG_INDEXTYPE_UINT16
-				-- geomextension.setdatabytestotable( 0, acc_idx.count, index_buffer_data, indices)
-				pprint("[Warning] 8 bit index buffer")
-			else 
-				pprint("[Error] Unhandled componentType: "..ctype)
 			end
 		else 
 			pprint("[Error] No indices.")
-			-- No indices generate a tristrip from position count
-			local posidx = prim.attributes["POSITION"]
 			-- Leave indices nil. The pipeline builder will use triangles by default
-
-			-- geomextension.buildindicestotable( 0, posidx.count, 1, indices)
 		end
 
 		-- Get position accessor
 		local aabb = nil
 		local pos_attrib = prim.attributes["POSITION"]
 		if(pos_attrib) then 
-			local bv = pos_attrib.data.buffer_view
-			buffer_data = cgltf.cgltf_buffer_view_data(bv)
-
-			local length = tonumber(bv[0].size)
-			local float_count = length / ffi.sizeof("float")
-			if(model.counted[pos_attrib] == nil) then
-				model.stats.vertices = model.stats.vertices + float_count / 3
-				model.counted[pos_attrib] = true
-			end
+			local pos_acc = pos_attrib.data
+			verts, vcount = accessor_floats(pos_acc)
 
-			-- Get positions (or verts) 
-			verts = ffi.new("float[?]", float_count)
-			ffi.copy(verts, buffer_data, length)
+			local addr = get_addr(pos_acc)
+			if(model.counted[addr] == nil) then
+				model.stats.vertices = model.stats.vertices + vcount
+				model.counted[addr] = true
+			end
 
-			-- geomextension.setdataindexfloatstotable( buffer_data, verts, indices, 3)
-			local pos_acc = pos_attrib.data
 			local pmin = hmm.HMM_V3(pos_acc.min[0], pos_acc.min[1], pos_acc.min[2])
 			local pmax = hmm.HMM_V3(pos_acc.max[0], pos_acc.max[1], pos_acc.max[2]) 
 			aabb = calcAABB( aabb, pmin, pmax )
@@ -253,36 +275,15 @@ function gltfloader:processdata( model, gochildname, thisnode, parent )
 		-- Get uvs accessor
 		local tex_attrib = prim.attributes["TEXCOORD_0"]
 		if(tex_attrib) then 
-			local bv = tex_attrib.data.buffer_view
-			buffer_data = cgltf.cgltf_buffer_view_data(bv)
-
-			local length = tonumber(bv[0].size)
-
-			uvs = ffi.new("float[?]", length / ffi.sizeof("float"))
-			ffi.copy(uvs, buffer_data, length)
-			-- geomextension.setdataindexfloatstotable( buffer_data, uvs, indices, 2)
+			uvs = accessor_floats(tex_attrib.data)
 		end 
 
 		-- Get normals accessor
 		local norm_attrib = prim.attributes["NORMAL"]
 		if(norm_attrib) then 
-			local bv = norm_attrib.data.buffer_view
-			buffer_data = cgltf.cgltf_buffer_view_data(bv)
-
-			local length = tonumber(bv[0].size)
-
-			normals = ffi.new("float[?]", length/ ffi.sizeof("float"))
-			ffi.copy(normals, buffer_data, length)			
-			-- geomextension.setdataindexfloatstotable( buffer_data, normals, indices, 3)
+			normals = accessor_floats(norm_attrib.data)
 		end 
 
-		if(acc_idx) then 
-			-- Reset indicies, because our buffers are all aligned!
-
-			-- NOTE: Not sure if this is needed. Will need to check
-			-- geomextension.buildindicestotable( 0, acc_idx.count, 1, indices)
-		end
-		
 		-- 	local indices	= { 0, 1, 2, 0, 2, 3 }
 		-- 	local verts		= { -sx + offx, 0.0, sy + offy, sx + offx, 0.0, sy + offy, sx + offx, 0.0, -sy + offy, -sx + offx, 0.0, -sy + offy }
 		-- 	local uvs		= { 0.0, 0.0, uvMult, 0.0, uvMult, uvMult, 0.0, uvMult }
@@ -297,6 +298,7 @@ function gltfloader:processdata( model, gochildname, thisnode, parent )
 		prim.primmesh = primmesh
 		prim.transform = thisnode.transform
 		prim.index_count = tonumber(acc_idx.count)
+		prim.aabb = aabb
 
 		if(indices) then 
 
@@ -304,14 +306,20 @@ function gltfloader:processdata( model, gochildname, thisnode, parent )
 				itype = itype, 
 				icount = prim.index_count,
 				indices = indices, 
+				isize = prim.index_count * iformat.size,
+				ictype = iformat.ctype.."[?]",
 				verts = verts, 
+				vcount = vcount,
 				uvs = uvs, 
 				normals = normals, 
+				separate = true,		-- streams are contiguous, upload them as is
+				views = true,			-- streams may point into the cgltf buffers (see accessor_floats)
 			}
 
 			model.stats.polys = model.stats.polys + primdata.icount / 3
 			prim.mesh_buffers = geom:makeMesh( primmesh, primdata )
 			if(prim.mesh_buffers) then 
+				model.stats.vertex_bytes = model.stats.vertex_bytes + prim.mesh_buffers.vertex_bytes
 
 				prim.geom = geom:makeGeom(primmesh, prim, prim.mesh_buffers, model.bin_target)
 				tinsert(model.all_geom, prim.geom)
@@ -322,7 +330,6 @@ function gltfloader:processdata( model, gochildname, thisnode, parent )
 			pprint("Non index buffers?", prim.primmesh)
 		end
 
-		prim.aabb = aabb
 		local tfaabb = transformAABB(prim.aabb, thisnode.transform)
 		model.aabb = calcAABB(model.aabb, tfaabb.min, tfaabb.max)
 
@@ -408,6 +415,26 @@ end
 -- // parse the GLTF buffer definitions and start loading buffer blobs
 local function gltf_parse_buffers(model)
 	
+	-- External buffers in a mounted archive are used in place, cgltf must not free them
+	if(model.mapped) then 
+		local gltf = model.data[0]
+		for i=0, tonumber(gltf.buffers_count) - 1 do 
+			local buffer = gltf.buffers[i]
+			if(buffer.data == nil and buffer.uri ~= nil) then 
+				local uri = ffi.string(buffer.uri)
+				if(string.sub(uri, 1, 5) ~= "data:") then 
+					uri = string.gsub(uri, "%%(%x%x)", function(h) return string.char(tonumber(h, 16)) end)
+					local buf, size = vfs.load_file((model.basepath or "")..uri)
+					if(buf and size >= tonumber(buffer.size)) then 
+						buffer.data = ffi.cast("void *", buf)
+						buffer.data_free_method = cgltf.cgltf_data_free_method_none
+						tinsert(model.held, buf)
+					end
+				end
+			end
+		end
+	end
+
 	local options = ffi.new("cgltf_options[1]", {})
 	local result = cgltf.cgltf_load_buffers( options, model.data[0], model.filename)
 	if(result ~= cgltf.cgltf_result_success) then 
@@ -449,47 +476,48 @@ local function build_transform_for_gltf_node(node)
     end
 end
 
--- ----------hmm.----------------------------------------------------------------------------------------------
-
-local function get_addr(ptr, off, ctype)
-    off = off or 0
-    ctype = ctype or "uintptr_t"  -- type of element, defaults to pointer size
-    local addr = ffi.cast("uintptr_t", ptr) + off * ffi.sizeof(ctype)
-    return tonumber(addr)
-end
-
 -- --------------------------------------------------------------------------------------------------------
 -- Load images using our utils.
 local function gltf_parse_images(model)
 
 	local image_map = {}
 	model.images = {}
+	local jobs = {}
 	local image_count = tonumber(model.data[0].images_count)
 	for i=0, image_count -1 do 
 		local img = model.data[0].images[i]
 		local addr = get_addr(model.data[0].images, i, "cgltf_image")
-		image_map[addr] = #model.images + 1
-		local image = nil
-		local imagename = string.format("image_%04d", #model.images + 1) 
+		image_map[addr] = i + 1
+		local imagename = string.format("image_%04d", i + 1) 
 		if(img.name ~= nil) then 
 			imagename = ffi.string( img.name )
 		end
 
+		local job = { name = imagename, tid = i }
 		if(img.uri ~= nil) then 
-			local filepath = model.basepath..ffi.string(img.uri)
-			image = imageutils.loadimage(imagename, filepath, i )
+			job.path = model.basepath..ffi.string(img.uri)
 		else 
 			local bv = img.buffer_view		
-			local bufptr = nil
 			if(bv[0].data ~= nil) then 
-				bufptr = ffi.cast("uint8_t *", bv[0].data)
+				job.buf = ffi.cast("uint8_t *", bv[0].data)
 			else
-				bufptr = cgltf.cgltf_buffer_view_data(bv)
+				job.buf = cgltf.cgltf_buffer_view_data(bv)
 			end
-			image = imageutils.loadimagebuffer(imagename, bufptr, bv[0].size, i )
+			job.size = tonumber(bv[0].size)
 		end
-		tinsert(model.images, image)
-		collectgarbage("collect")
+		tinsert(jobs, job)
+	end
+
+	-- Decoded on worker threads, uploaded here. Failed images leave a hole so the indices
+	--   in image_map stay valid.
+	local images, ms = imageutils.loadimages(jobs)
+	for i, image in ipairs(images) do 
+		model.images[i] = image or nil
+		if(image) then model.stats.image_decode_ms = model.stats.image_decode_ms + image.decode_ms end
+	end
+	model.stats.image_load_ms = ms
+	if(image_count > 0) then 
+		pprint(string.format("[Info] %d images loaded in %.1f ms (decode %.1f ms)", image_count, ms, model.stats.image_decode_ms))
 	end
 
 	-- Loade images into texture slots! 
@@ -559,6 +587,7 @@ local function gltf_parse_meshes(model)
 	model.scene = {}
 	model.scene.meshes = {}
 	model.meshes_map = {}
+	model.index_refs = {}
 	local gltf = model.data[0]
 
     model.scene.num_meshes = tonumber(gltf.meshes_count)
@@ -578,6 +607,10 @@ local function gltf_parse_meshes(model)
 				type = gltf_prim.type,
 				attributes = {},
 			}
+			if(gltf_prim.indices ~= nil) then 
+				local addr = get_addr(gltf_prim.indices)
+				model.index_refs[addr] = (model.index_refs[addr] or 0) + 1
+			end
 			local attrib_count = tonumber(gltf_prim.attributes_count)
 			for i=0, attrib_count-1 do
 				local attrib = gltf_prim.attributes[i]
@@ -616,6 +649,22 @@ local function gltf_parse_nodes(model, node)
 	model.stats.nodes = model.stats.nodes + 1 
 end
 
+-- --------------------------------------------------------------------------------------------------------
+-- Free the cgltf data as soon as the meshes are uploaded. Vertex and index streams pointed straight
+--   into its buffers, so the cdata refs the scene tables hold into it are dropped as well.
+local function gltf_release(model)
+
+	for i, mesh in ipairs(model.scene.meshes) do 
+		for p, prim in ipairs(mesh.primitives) do 
+			prim.prim, prim.indices, prim.attributes = nil, nil, nil
+		end
+	end
+	local data = model.data
+	if(data[0] ~= nil) then cgltf.cgltf_free(data[0]); data[0] = nil end
+	model.data = nil
+	model.held = nil
+end
+
 -- --------------------------------------------------------------------------------------------------------
 -- A new loader method using a new loader from here: https://github.com/leonardus/lua-gltf
 function gltfloader:load( model, scene, pobj, meshname )
@@ -657,7 +706,14 @@ function gltfloader:load_gltf_asset( assetfilename, asset, disableaabb, bin_targ
 
 	local options = ffi.new("cgltf_options[1]", {})
 	local data = ffi.new("cgltf_data *[1]", {nil})
-	local result = cgltf.cgltf_parse_file(options, assetfilename, data)
+	-- Packaged builds parse from the mounted archive, the cgltf data then points into it
+	local filedata, filesize = vfs.load_file(assetfilename)
+	local result = nil
+	if(filedata) then 
+		result = cgltf.cgltf_parse(options, filedata, filesize, data)
+	else
+		result = cgltf.cgltf_parse_file(options, assetfilename, data)
+	end
 	if (result == cgltf.cgltf_result_success) then
 	
 		-- Handle autodestruction when data is made nil
@@ -677,13 +733,18 @@ function gltfloader:load_gltf_asset( assetfilename, asset, disableaabb, bin_targ
 		all_geom = {},
 		stats = {
 			vertices = 0,
+			vertex_bytes = 0,		-- vertex buffer bytes uploaded (drops with geom.quantize)
 			polys = 0,
 			textures = 0,
+			image_decode_ms = 0,	-- sum of per image decode times (across threads)
+			image_load_ms = 0,		-- wall time to decode and upload all images
 			nodes = 0,
 			primitives = 0,
 		},
 		counted = {},
 		bin_target = bin_target,
+		mapped = (filedata ~= nil),	-- cgltf buffers are archive memory (read only)
+		held = { filedata },		-- archive buffers that must live as long as the cgltf data
 	}
 
 	gltf_parse_buffers(model)
@@ -712,6 +773,14 @@ function gltfloader:load_gltf_asset( assetfilename, asset, disableaabb, bin_targ
 		asset.go = gameobject.create( nil, asset.name )
 
 		self:load( model, model.scene, asset.go, asset.name)
+		-- Everything is on the gpu now, nothing may read the cgltf buffers after this
+		gltf_release(model)
+
+		-- Identical pipeline/sampler states are shared (all loaded models, not just this one)
+		local mstats = meshes.get_stats()
+		model.stats.pipelines = mstats.pipelines
+		model.stats.pipeline_refs = mstats.pipeline_refs
+		model.stats.samplers = mstats.samplers
 
 		-- local mesh, scene = gltf:load(assetfilename, asset.go, asset.name)
 		-- go.set_position(vmath.vector3(0, -999999, 0), asset.go)
@@ -766,8 +835,8 @@ function gltfloader:load_gltf_asset( assetfilename, asset, disableaabb, bin_targ
 
 	-- model.states_tbl = states
 
-	-- This releases cgltf data
-	model.data = nil
+	-- This releases cgltf data (if the format did not already)
+	if(model.data) then gltf_release(model) end
 
 	return model
 end
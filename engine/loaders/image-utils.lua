@@ -1,12 +1,72 @@
 -------------------------------------------------------------------------------------------------
 
+local ffi 			= require("ffi")
+local stb 			= require("stb")
 local utils 		= require("lua.utils")
+local workers 		= require("lua.engine.workers")
+local vfs 			= require("tools.vfs.vfs")
+
+local tinsert 		= table.insert
 
 local imageutils = {
 	ctr 		= 0,
-	images		= 	{}
+	images		= 	{},
 }
 
+-------------------------------------------------------------------------------------------------
+-- Batch decode jobs. Shared with the worker states, so plain C types only.
+local decode_cdefs = [[
+typedef struct image_decode_job {
+	const uint8_t 	*buf;
+	int 			size;
+	const char 		*path;
+	uint8_t 		*pixels;
+	int 			width, height, channels;
+	double 			ms;
+	char 			error[128];		// Set when decoding threw (pixels stays NULL)
+} image_decode_job;
+
+typedef struct image_decode_batch {
+	image_decode_job 	*jobs;
+	int 				count, first, step;
+	void 				*load_memory;
+	void 				*load_file;
+} image_decode_batch;
+]]
+ffi.cdef(decode_cdefs)
+
+-- Runs in each worker: decode every step'th job with the stb functions it is handed. A job that
+--   throws is marked failed and the rest still decode.
+local decode_body = [[
+local ffi = require("ffi")
+local load_memory_t = "uint8_t *(*)(const uint8_t *, int, int *, int *, int *, int)"
+local load_file_t 	= "uint8_t *(*)(const char *, int *, int *, int *, int)"
+return function(arg, now)
+	local batch = ffi.cast("image_decode_batch *", arg)
+	local load_memory = ffi.cast(load_memory_t, batch.load_memory)
+	local load_file = ffi.cast(load_file_t, batch.load_file)
+	local x, y, n = ffi.new("int[1]"), ffi.new("int[1]"), ffi.new("int[1]")
+	local function decode(job)
+		if(job.path ~= nil) then 
+			job.pixels = load_file(job.path, x, y, n, 4)
+		else
+			job.pixels = load_memory(job.buf, job.size, x, y, n, 4)
+		end
+		job.width, job.height, job.channels = x[0], y[0], n[0]
+	end
+	for i = batch.first, batch.count - 1, batch.step do 
+		local job = batch.jobs[i]
+		local start = now()
+		local ok, err = pcall(decode, job)
+		if(not ok) then 
+			job.pixels = nil
+			ffi.copy(job.error, tostring(err):sub(1, 127))
+		end
+		job.ms = now() - start
+	end
+end
+]]
+
 -------------------------------------------------------------------------------------------------
 
 local function make_defaults()
@@ -36,6 +96,9 @@ local function loadimage(goname, imagefilepath, tid )
 	end
 
 	imagefilepath = utils.cleanstring( imagefilepath )
+	-- Packaged builds read the image straight out of the mounted archive
+	local buf, bufsize = vfs.load_file(imagefilepath)
+	if(buf) then return imageutils.loadimagebuffer(goname, buf, bufsize, tid) end
 	local img, info, data = renderer.load_image(imagefilepath, true)	
 	if(info == nil) then 
 		pprint("[Image Load Error] Cannot load image: "..imagefilepath) 
@@ -79,11 +142,105 @@ local function loadimagebuffer(goname, buf, bufsize, tid )
 	return res
 end 
 
+-------------------------------------------------------------------------------------------------
+-- Decode a list of images on worker threads, then make the sg images here (sokol is not
+--   thread safe). images is a list of { name, tid, path } or { name, tid, buf, size }, buffers
+--   must stay alive until this returns. Paths found in a mounted vfs archive are decoded from
+--   the archive memory. Pixels are freed as soon as sokol has copied them.
+--   An image with img set (an allocated or uninitialized sg_image) is initialized in place,
+--   so existing bindings that use the handle see the new pixels.
+--   Returns a list of results in the same order (false where decoding failed) and the total
+--   wall time in ms. Each result has decode_ms.
+local function loadimages( images )
+
+	local start 	= workers.now()
+	local count 	= #images
+	if(count == 0) then return {}, 0 end
+
+	local jobs 		= ffi.new("image_decode_job[?]", count)
+	local paths 	= {}
+	for i, image in ipairs(images) do 
+		local job = jobs[i - 1]
+		local buf, size = nil, nil
+		if(image.path) then 
+			paths[i] = utils.cleanstring( image.path )
+			buf, size = vfs.load_file(paths[i])
+		end
+		if(buf) then 
+			-- paths keeps the buffer referenced (inflated entries own their memory)
+			paths[i] = buf
+			job.buf = buf
+			job.size = size
+		elseif(image.path) then 
+			job.path = paths[i]
+		else
+			job.buf = ffi.cast("const uint8_t *", image.buf)
+			job.size = image.size
+		end
+	end
+
+	-- Each worker takes every step'th job, which spreads big and small images over the threads
+	local step 		= math.max(1, math.min(workers.threads, count))
+	local batches 	= {}
+	for t = 0, step - 1 do 
+		local batch = ffi.new("image_decode_batch[1]")
+		batch[0].jobs 			= jobs
+		batch[0].count 			= count
+		batch[0].first 			= t
+		batch[0].step 			= step
+		batch[0].load_memory 	= ffi.cast("void *", stb.stbi_load_from_memory)
+		batch[0].load_file 		= ffi.cast("void *", stb.stbi_load)
+		tinsert(batches, batch)
+	end
+	local used, errors = workers.run(decode_cdefs, decode_body, batches)
+	for t, err in pairs(errors) do 
+		pprint("[Image Load Error] Decode worker "..t.." failed: "..err)
+	end
+
+	local results = {}
+	for i, image in ipairs(images) do 
+		local job = jobs[i - 1]
+		local res = false
+		if(job.pixels == nil) then 
+			local err = ffi.string(job.error)
+			pprint("[Image Load Error] Cannot decode image: "..image.name..((#err > 0) and (" ("..err..")") or "")) 
+		else
+			local desc = ffi.new("sg_image_desc[1]")
+			desc[0].width 			= job.width
+			desc[0].height 			= job.height
+			desc[0].pixel_format 	= sg.SG_PIXELFORMAT_RGBA8
+			desc[0].sample_count 	= 1
+			desc[0].data.subimage[0][0].ptr 	= job.pixels
+			desc[0].data.subimage[0][0].size 	= job.width * job.height * 4
+
+			res = { id = image.tid, info = desc, decode_ms = job.ms }
+			if(sg.sg_isvalid() == true) then 
+				if(image.img) then 
+					sg.sg_init_image(image.img, desc)
+					res.img = image.img
+				else
+					res.img = sg.sg_make_image(desc)
+				end
+				stb.stbi_image_free(job.pixels)
+				desc[0].data.subimage[0][0].ptr = nil
+			else
+				-- No device yet, keep the pixels for a later sg_make_image(info)
+				res.data = ffi.gc(job.pixels, stb.stbi_image_free)
+			end
+			imageutils.images[image.tid] = res
+			pprint(string.format("[Info] Image decoded: %s  %dx%d  %.1f ms", image.name, job.width, job.height, job.ms))
+		end
+		tinsert(results, res)
+	end
+	return results, workers.now() - start
+end 
+
 -------------------------------------------------------------------------------------------------
 
 imageutils.make_defaults 	= make_defaults
 imageutils.loadimage 		= loadimage
 imageutils.loadimagebuffer 	= loadimagebuffer
+imageutils.loadimages 		= loadimages
 
 -------------------------------------------------------------------------------------------------
 
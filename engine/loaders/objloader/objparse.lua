@@ -0,0 +1,511 @@
+local ffi           = require("ffi")
+local dirtools      = require("tools.vfs.dirtools")
+
+local tinsert       = table.insert
+local band          = bit.band
+local bxor          = bit.bxor
+local sqrt          = math.sqrt
+
+-- --------------------------------------------------------------------------------------
+-- Byte level obj parser.
+--   The whole file is read into one buffer and scanned once. Numbers are parsed in place
+--   (no substrings) and everything goes straight into the Vertex/TexCoord/Normal/uint32_t
+--   arrays the loader uploads. Face corners (v/vt/vn) are deduplicated through an open
+--   addressing hash table, polygons are fan triangulated, and missing normals are
+--   generated (smooth, per position).
+--
+--   Results are cached next to the source as <file>.cache and reused while the source size
+--   and modified time match.
+-- --------------------------------------------------------------------------------------
+
+ffi.cdef[[
+typedef struct {
+    float x, y, z;
+} Vertex;
+
+typedef struct {
+    float x, y, z;
+} Normal;
+
+typedef struct {
+    float u, v;
+} TexCoord;
+
+typedef struct objcache_header {
+    char        magic[4];
+    uint32_t    version;
+    double      source_size;
+    double      source_modified;
+    uint32_t    vertex_count;
+    uint32_t    index_count;
+    uint32_t    trailer_size;       // text trailer (mtllib / object lines) after the arrays
+    float       aabb[6];
+} objcache_header;
+]]
+
+local objparse = {
+    cache       = true,     -- read and write <file>.cache
+}
+
+local CACHE_MAGIC       = "OBJC"
+local CACHE_VERSION     = 1
+
+-- Byte codes
+local B_NL, B_CR, B_SPACE, B_TAB    = 10, 13, 32, 9
+local B_HASH, B_SLASH, B_DOT        = 35, 47, 46
+local B_MINUS, B_PLUS               = 45, 43
+local B_0, B_9                      = 48, 57
+local B_E, B_e                      = 69, 101
+local B_v, B_t, B_n, B_f, B_o, B_m  = 118, 116, 110, 102, 111, 109
+
+-- Exact powers of ten for the float parser
+local pow10 = ffi.new("double[309]")
+for i = 0, 308 do pow10[i] = tonumber("1e"..i) end
+
+-- --------------------------------------------------------------------------------------
+-- Growable FFI arrays
+
+local function grow(arr, ctype, used, size)
+    local newarr = ffi.new(ctype, size)
+    if(used > 0) then ffi.copy(newarr, arr, used * ffi.sizeof(ctype, 1)) end
+    return newarr
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function skip_space(buf, i, n)
+    while(i < n) do
+        local c = buf[i]
+        if(c ~= B_SPACE and c ~= B_TAB) then break end
+        i = i + 1
+    end
+    return i
+end
+
+local function skip_line(buf, i, n)
+    while(i < n and buf[i] ~= B_NL) do i = i + 1 end
+    return i + 1
+end
+
+-- Float at buf[i]. Returns the value and the index after it.
+local function parse_float(buf, i, n)
+
+    i = skip_space(buf, i, n)
+    local sign = 1.0
+    local c = buf[i]
+    if(c == B_MINUS) then sign = -1.0; i = i + 1 elseif(c == B_PLUS) then i = i + 1 end
+
+    local m, e = 0.0, 0
+    while(i < n) do
+        c = buf[i]
+        if(c < B_0 or c > B_9) then break end
+        m = m * 10.0 + (c - B_0)
+        i = i + 1
+    end
+    if(i < n and buf[i] == B_DOT) then
+        i = i + 1
+        while(i < n) do
+            c = buf[i]
+            if(c < B_0 or c > B_9) then break end
+            m = m * 10.0 + (c - B_0)
+            e = e - 1
+            i = i + 1
+        end
+    end
+    if(i < n and (buf[i] == B_e or buf[i] == B_E)) then
+        i = i + 1
+        local esign, ev = 1, 0
+        c = buf[i]
+        if(c == B_MINUS) then esign = -1; i = i + 1 elseif(c == B_PLUS) then i = i + 1 end
+        while(i < n) do
+            c = buf[i]
+            if(c < B_0 or c > B_9) then break end
+            ev = ev * 10 + (c - B_0)
+            i = i + 1
+        end
+        e = e + esign * ev
+    end
+
+    if(e < 0) then
+        if(e < -308) then m = 0.0 else m = m / pow10[-e] end
+    elseif(e > 0) then
+        if(e > 308) then m = math.huge else m = m * pow10[e] end
+    end
+    return sign * m, i
+end
+
+-- Signed int at buf[i] (0 when there are no digits)
+local function parse_int(buf, i, n)
+    local sign = 1
+    if(buf[i] == B_MINUS) then sign = -1; i = i + 1 end
+    local v = 0
+    while(i < n) do
+        local c = buf[i]
+        if(c < B_0 or c > B_9) then break end
+        v = v * 10 + (c - B_0)
+        i = i + 1
+    end
+    return sign * v, i
+end
+
+-- Rest of the line as a string (names, mtllib paths)
+local function line_string(buf, i, n)
+    i = skip_space(buf, i, n)
+    local s = i
+    while(i < n and buf[i] ~= B_NL and buf[i] ~= B_CR) do i = i + 1 end
+    return ffi.string(buf + s, i - s)
+end
+
+-- --------------------------------------------------------------------------------------
+-- Parse obj text (ptr, size). Returns the obj table: mtllibs, objects, aabb, vertex_count,
+--   index_count, vertices (Vertex[?]), uvs (TexCoord[?]), normals (Normal[?]), indices (uint32_t[?])
+objparse.parse = function(ptr, size)
+
+    local buf = ffi.cast("const uint8_t *", ptr)
+    local n = size
+
+    -- Source streams
+    local pos, npos, spos = nil, 0, 0       -- float xyz
+    local tex, ntex, stex = nil, 0, 0       -- float uv
+    local nrm, nnrm, snrm = nil, 0, 0       -- float xyz
+
+    -- Output
+    local verts, uvs, norms, vpos = nil, nil, nil, nil
+    local vcount, vsize = 0, 0
+    local indices, icount, isize = nil, 0, 0
+    local missing_normals = false
+
+    -- Corner hash: key (v, vt, vn) -> output vertex
+    local hsize = 1024
+    local hmask = hsize - 1
+    local hv = ffi.new("int32_t[?]", hsize * 4)     -- v, vt, vn, output index (v = -1 empty)
+    ffi.fill(hv, hsize * 16, 0xFF)
+
+    local function hash(v, t, nn)
+        return band(bxor(v * 73856093, t * 19349663, nn * 83492791), hmask)
+    end
+
+    local function rehash()
+        local old, oldsize = hv, hsize
+        hsize = hsize * 2
+        hmask = hsize - 1
+        hv = ffi.new("int32_t[?]", hsize * 4)
+        ffi.fill(hv, hsize * 16, 0xFF)
+        for s = 0, oldsize - 1 do
+            local o = s * 4
+            if(old[o] >= 0) then
+                local h = hash(old[o], old[o + 1], old[o + 2])
+                while(hv[h * 4] >= 0) do h = band(h + 1, hmask) end
+                hv[h * 4], hv[h * 4 + 1], hv[h * 4 + 2], hv[h * 4 + 3] = old[o], old[o + 1], old[o + 2], old[o + 3]
+            end
+        end
+    end
+
+    local function corner(v, t, nn)
+        local h = hash(v, t, nn)
+        while(true) do
+            local o = h * 4
+            local kv = hv[o]
+            if(kv < 0) then break end
+            if(kv == v and hv[o + 1] == t and hv[o + 2] == nn) then return hv[o + 3] end
+            h = band(h + 1, hmask)
+        end
+
+        -- New output vertex
+        if(vcount >= vsize) then
+            local newsize = math.max(vsize * 2, 1024)
+            verts   = grow(verts, "Vertex[?]", vcount, newsize)
+            uvs     = grow(uvs, "TexCoord[?]", vcount, newsize)
+            norms   = grow(norms, "Normal[?]", vcount, newsize)
+            vpos    = grow(vpos, "int32_t[?]", vcount, newsize)
+            vsize   = newsize
+        end
+        local id = vcount
+        local po = v * 3
+        local dv = verts[id]
+        dv.x, dv.y, dv.z = pos[po], pos[po + 1], pos[po + 2]
+        vpos[id] = v
+        if(t >= 0) then uvs[id].u, uvs[id].v = tex[t * 2], tex[t * 2 + 1] end
+        if(nn >= 0) then
+            local dn = norms[id]
+            dn.x, dn.y, dn.z = nrm[nn * 3], nrm[nn * 3 + 1], nrm[nn * 3 + 2]
+        else
+            missing_normals = true
+        end
+        vcount = vcount + 1
+
+        local o = h * 4
+        hv[o], hv[o + 1], hv[o + 2], hv[o + 3] = v, t, nn, id
+        if(vcount * 2 > hsize) then rehash() end
+        return id
+    end
+
+    local obj = { mtllibs = {}, objects = {} }
+    local current = nil
+    local fsize = 64
+    local face = ffi.new("uint32_t[?]", fsize)
+
+    local i = 0
+    while(i < n) do
+        i = skip_space(buf, i, n)
+        local c = buf[i]
+        local c1 = (i + 1 < n) and buf[i + 1] or B_NL
+
+        if(c == B_v and (c1 == B_SPACE or c1 == B_TAB)) then
+            if(npos + 3 > spos) then
+                spos = math.max(spos * 2, 3072)
+                pos = grow(pos, "float[?]", npos, spos)
+            end
+            pos[npos], i = parse_float(buf, i + 1, n)
+            pos[npos + 1], i = parse_float(buf, i, n)
+            pos[npos + 2], i = parse_float(buf, i, n)
+            npos = npos + 3
+
+        elseif(c == B_v and c1 == B_t) then
+            if(ntex + 2 > stex) then
+                stex = math.max(stex * 2, 2048)
+                tex = grow(tex, "float[?]", ntex, stex)
+            end
+            tex[ntex], i = parse_float(buf, i + 2, n)
+            tex[ntex + 1], i = parse_float(buf, i, n)
+            ntex = ntex + 2
+
+        elseif(c == B_v and c1 == B_n) then
+            if(nnrm + 3 > snrm) then
+                snrm = math.max(snrm * 2, 3072)
+                nrm = grow(nrm, "float[?]", nnrm, snrm)
+            end
+            nrm[nnrm], i = parse_float(buf, i + 2, n)
+            nrm[nnrm + 1], i = parse_float(buf, i, n)
+            nrm[nnrm + 2], i = parse_float(buf, i, n)
+            nnrm = nnrm + 3
+
+        elseif(c == B_f and (c1 == B_SPACE or c1 == B_TAB)) then
+            if(current == nil) then
+                current = { name = "default", first = icount, count = 0 }
+                tinsert(obj.objects, current)
+            end
+            i = i + 1
+            local nc = 0
+            local pc, tc, nrc = npos / 3, ntex / 2, nnrm / 3
+            while(true) do
+                i = skip_space(buf, i, n)
+                if(i >= n) then break end
+                c = buf[i]
+                if(c ~= B_MINUS and (c < B_0 or c > B_9)) then break end
+                local v, t, nn
+                v, i = parse_int(buf, i, n)
+                t, nn = 0, 0
+                if(buf[i] == B_SLASH) then
+                    i = i + 1
+                    if(buf[i] ~= B_SLASH) then t, i = parse_int(buf, i, n) end
+                    if(buf[i] == B_SLASH) then nn, i = parse_int(buf, i + 1, n) end
+                end
+                -- 1 based, negative is relative to the end, 0 means not given
+                if(v < 0) then v = pc + v else v = v - 1 end
+                if(t < 0) then t = tc + t else t = t - 1 end
+                if(nn < 0) then nn = nrc + nn else nn = nn - 1 end
+                assert(v >= 0 and v < pc, "OBJ face references a missing vertex")
+                if(t >= tc) then t = -1 end
+                if(nn >= nrc) then nn = -1 end
+                -- Large n-gons grow the corner buffer
+                if(nc == fsize) then
+                    face = grow(face, "uint32_t[?]", nc, fsize * 2)
+                    fsize = fsize * 2
+                end
+                face[nc] = corner(v, t, nn)
+                nc = nc + 1
+            end
+            -- Fan triangulation
+            if(nc >= 3) then
+                local need = icount + (nc - 2) * 3
+                if(need > isize) then
+                    local newsize = math.max(isize * 2, 4096)
+                    while(newsize < need) do newsize = newsize * 2 end
+                    indices = grow(indices, "uint32_t[?]", icount, newsize)
+                    isize = newsize
+                end
+                for k = 1, nc - 2 do
+                    indices[icount], indices[icount + 1], indices[icount + 2] = face[0], face[k], face[k + 1]
+                    icount = icount + 3
+                end
+                current.count = icount - current.first
+            end
+
+        elseif(c == B_o and (c1 == B_SPACE or c1 == B_TAB)) then
+            current = { name = line_string(buf, i + 1, n), first = icount, count = 0 }
+            tinsert(obj.objects, current)
+
+        elseif(c == B_m and n - i > 7 and ffi.string(buf + i, 7) == "mtllib ") then
+            tinsert(obj.mtllibs, line_string(buf, i + 7, n))
+        end
+
+        i = skip_line(buf, i, n)
+    end
+
+    assert(npos > 0, "OBJ contains no vertices")
+
+    -- Smooth normals per position for corners that had none
+    if(missing_normals) then
+        local acc = ffi.new("double[?]", npos)
+        for t = 0, icount - 1, 3 do
+            local a, b, c = vpos[indices[t]] * 3, vpos[indices[t + 1]] * 3, vpos[indices[t + 2]] * 3
+            local e1x, e1y, e1z = pos[b] - pos[a], pos[b + 1] - pos[a + 1], pos[b + 2] - pos[a + 2]
+            local e2x, e2y, e2z = pos[c] - pos[a], pos[c + 1] - pos[a + 1], pos[c + 2] - pos[a + 2]
+            local nx, ny, nz = e1y * e2z - e1z * e2y, e1z * e2x - e1x * e2z, e1x * e2y - e1y * e2x
+            acc[a], acc[a + 1], acc[a + 2] = acc[a] + nx, acc[a + 1] + ny, acc[a + 2] + nz
+            acc[b], acc[b + 1], acc[b + 2] = acc[b] + nx, acc[b + 1] + ny, acc[b + 2] + nz
+            acc[c], acc[c + 1], acc[c + 2] = acc[c] + nx, acc[c + 1] + ny, acc[c + 2] + nz
+        end
+        for s = 0, hsize - 1 do
+            local o = s * 4
+            if(hv[o] >= 0 and hv[o + 2] < 0) then
+                local p = hv[o] * 3
+                local x, y, z = acc[p], acc[p + 1], acc[p + 2]
+                local len = sqrt(x * x + y * y + z * z)
+                if(len > 0) then x, y, z = x / len, y / len, z / len end
+                local dn = norms[hv[o + 3]]
+                dn.x, dn.y, dn.z = x, y, z
+            end
+        end
+    end
+
+    local aabb = { min = { x = pos[0], y = pos[1], z = pos[2] }, max = { x = pos[0], y = pos[1], z = pos[2] } }
+    local mn, mx = aabb.min, aabb.max
+    for p = 3, npos - 1, 3 do
+        local x, y, z = pos[p], pos[p + 1], pos[p + 2]
+        if(x < mn.x) then mn.x = x end; if(x > mx.x) then mx.x = x end
+        if(y < mn.y) then mn.y = y end; if(y > mx.y) then mx.y = y end
+        if(z < mn.z) then mn.z = z end; if(z > mx.z) then mx.z = z end
+    end
+
+    -- Trim to size (the loader and cache use sizeof)
+    obj.aabb            = aabb
+    obj.vertex_count    = vcount
+    obj.index_count     = icount
+    obj.vertices        = grow(verts, "Vertex[?]", vcount, vcount)
+    obj.uvs             = grow(uvs, "TexCoord[?]", vcount, vcount)
+    obj.normals         = grow(norms, "Normal[?]", vcount, vcount)
+    obj.indices         = grow(indices, "uint32_t[?]", icount, icount)
+    return obj
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function read_file(filename)
+    local fh = io.open(filename, "rb")
+    if(fh == nil) then return nil end
+    local data = fh:read("*a")
+    fh:close()
+    return data
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function cache_read(cachename, info)
+
+    local data = read_file(cachename)
+    local hsize = ffi.sizeof("objcache_header")
+    if(data == nil or #data < hsize) then return nil end
+
+    local ptr = ffi.cast("const uint8_t *", data)
+    local hdr = ffi.cast("const objcache_header *", ptr)
+    if(ffi.string(hdr.magic, 4) ~= CACHE_MAGIC or hdr.version ~= CACHE_VERSION) then return nil end
+    if(hdr.source_size ~= info.size or hdr.source_modified ~= info.modified) then return nil end
+
+    local vcount, icount = hdr.vertex_count, hdr.index_count
+    local sizes = { vcount * ffi.sizeof("Vertex"), vcount * ffi.sizeof("TexCoord"),
+                    vcount * ffi.sizeof("Normal"), icount * 4 }
+    if(#data ~= hsize + sizes[1] + sizes[2] + sizes[3] + sizes[4] + hdr.trailer_size) then return nil end
+
+    local obj = { mtllibs = {}, objects = {}, vertex_count = vcount, index_count = icount }
+    obj.aabb = { min = { x = hdr.aabb[0], y = hdr.aabb[1], z = hdr.aabb[2] },
+                 max = { x = hdr.aabb[3], y = hdr.aabb[4], z = hdr.aabb[5] } }
+
+    local o = hsize
+    obj.vertices    = ffi.new("Vertex[?]", vcount)
+    ffi.copy(obj.vertices, ptr + o, sizes[1]); o = o + sizes[1]
+    obj.uvs         = ffi.new("TexCoord[?]", vcount)
+    ffi.copy(obj.uvs, ptr + o, sizes[2]); o = o + sizes[2]
+    obj.normals     = ffi.new("Normal[?]", vcount)
+    ffi.copy(obj.normals, ptr + o, sizes[3]); o = o + sizes[3]
+    obj.indices     = ffi.new("uint32_t[?]", icount)
+    ffi.copy(obj.indices, ptr + o, sizes[4]); o = o + sizes[4]
+
+    local trailer = ffi.string(ptr + o, hdr.trailer_size)
+    for line in trailer:gmatch("[^\n]+") do
+        local lib = line:match("^mtllib (.*)$")
+        if(lib) then
+            tinsert(obj.mtllibs, lib)
+        else
+            local first, count, name = line:match("^o (%d+) (%d+) (.*)$")
+            if(first) then tinsert(obj.objects, { name = name, first = tonumber(first), count = tonumber(count) }) end
+        end
+    end
+    return obj
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function cache_write(cachename, info, obj)
+
+    local lines = {}
+    for i, lib in ipairs(obj.mtllibs) do tinsert(lines, "mtllib "..lib) end
+    for i, o in ipairs(obj.objects) do tinsert(lines, "o "..o.first.." "..o.count.." "..o.name) end
+    local trailer = table.concat(lines, "\n")
+
+    local hdr = ffi.new("objcache_header")
+    ffi.copy(hdr.magic, CACHE_MAGIC, 4)
+    hdr.version         = CACHE_VERSION
+    hdr.source_size     = info.size
+    hdr.source_modified = info.modified
+    hdr.vertex_count    = obj.vertex_count
+    hdr.index_count     = obj.index_count
+    hdr.trailer_size    = #trailer
+    local mn, mx = obj.aabb.min, obj.aabb.max
+    hdr.aabb[0], hdr.aabb[1], hdr.aabb[2] = mn.x, mn.y, mn.z
+    hdr.aabb[3], hdr.aabb[4], hdr.aabb[5] = mx.x, mx.y, mx.z
+
+    -- Cache folders may be read only, that just means no cache
+    local fh = io.open(cachename, "wb")
+    if(fh == nil) then return false end
+    fh:write(ffi.string(hdr, ffi.sizeof(hdr)))
+    fh:write(ffi.string(obj.vertices, ffi.sizeof(obj.vertices)))
+    fh:write(ffi.string(obj.uvs, ffi.sizeof(obj.uvs)))
+    fh:write(ffi.string(obj.normals, ffi.sizeof(obj.normals)))
+    fh:write(ffi.string(obj.indices, ffi.sizeof(obj.indices)))
+    fh:write(trailer)
+    fh:close()
+    return true
+end
+
+-- --------------------------------------------------------------------------------------
+-- Load an obj file, through the cache when it is current. use_cache overrides objparse.cache.
+objparse.load = function(filename, use_cache)
+
+    if(use_cache == nil) then use_cache = objparse.cache end
+    local info = nil
+    local cachename = filename..".cache"
+    if(use_cache) then
+        info = dirtools.get_fileinfo(filename)
+        if(info) then
+            local obj = cache_read(cachename, info)
+            if(obj) then return obj end
+        end
+    end
+
+    local data = read_file(filename)
+    if(data == nil) then
+        pprint("[Error objparse.load] Cannot open: "..tostring(filename))
+        return nil
+    end
+    local obj = objparse.parse(data, #data)
+    if(use_cache and info) then cache_write(cachename, info, obj) end
+    return obj
+end
+
+-- --------------------------------------------------------------------------------------
+
+return objparse
+
+-- --------------------------------------------------------------------------------------
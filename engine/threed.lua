@@ -12,6 +12,8 @@ local utils         = require("lua.utils")
 
 local cameramgr     = require("lua.engine.camera_manager")
 local geomutils     = require("lua.loaders.geometry-utils")
+local bins          = require("lua.geometry.bins")
+local lod           = require("lua.geometry.lod")
 
 local tinsert       = table.insert
 local tremove       = table.remove
@@ -154,6 +156,7 @@ local function render_model( dt, model_rect )
     cameramgr.update_viewport( model_rect.cam, hmm.HMM_V4(0, 0, 1024, 1024))
     cameramgr.update_scissor( model_rect.cam, hmm.HMM_V4(0, 0, 1024, 1024))
     local thiscam = cameramgr.get_id( model_rect.cam )
+    local far = cameramgr.get( model_rect.cam ).far
 
     for i, geom_id in ipairs(model_all_geom) do 
 
@@ -167,7 +170,14 @@ local function render_model( dt, model_rect )
         local pos = hmm.HMM_V3(0, 0, 0)
         local angles = hmm.HMM_V3(geom.rx, geom.ry, 0.0)
         local model = geomutils.model_matrix( geom.transform, pos, angles, sc)
-        geom.vs_params[0].mvp    = hmm.HMM_MulM4(view_proj, model)
+        local mvp       = hmm.HMM_MulM4(view_proj, model)
+        -- Clip w of the model origin is its view depth, used by the bin sort key
+        geom.dstate[0].depth     = mvp.Elements[3][3] / far
+        -- Quantized positions are in 0..1 of the mesh aabb
+        if(geom.dequant) then mvp = hmm.HMM_MulM4(mvp, geom.dequant) end
+        geom.vs_params[0].mvp    = mvp
+        if(geom.aabb) then bins.bin_set_bounds(geom.dstate, geom.aabb, model) end
+        if(geom.lods and geom.aabb) then lod.select(geom, model_rect.cam, model) end
     end
 end
 
@@ -236,6 +246,7 @@ end
 threed_renderer.render_rects = function( dt )
 
     local count = #threed_renderer.render_queue 
+    lod.begin_frame()
     -- print("queued models", count)
     for i=1, count do
         local model_rect = threed_renderer.render_queue[i]
@@ -4,6 +4,7 @@
 local ffi = require("ffi")
 local logging   = require("engine.utils.logging")
 local combine   = require("engine.utils.combine")
+local vfs       = require("tools.vfs.vfs")
 
 local dirtools = require("tools.vfs.dirtools")
 local base_path = dirtools.get_app_path("sokol%-luajit")
@@ -44,6 +45,79 @@ local function apply_config(startfile, config)
     end
 end
 
+-- ----------------------------------------------------------------------------------
+-- All files under a folder asset
+
+local function folder_files(folder)
+
+    local cmd = [[find "]]..folder..[[" -type f]]
+    if(ffi.os == "Windows") then cmd = [[dir /S /B /A-D "]]..folder..[["]] end
+    local files = {}
+    local fh = io.popen( cmd, "r" )
+    if(fh) then 
+        for line in fh:lines() do tinsert(files, (string.gsub(line, "\r$", ""))) end
+        fh:close()
+    end
+    return files
+end
+
+-- ----------------------------------------------------------------------------------
+-- Pack shaders, images, data and lua folders into one archive next to the exe. Single
+--  lua files are still combined into the exe. Names are relative to the sokol path,
+--  the same paths the project uses at runtime.
+
+local function pack_assets(config, archive)
+
+    local sokol_path = config["sokol"].sokol_path.value
+    local options = config["options"]
+    local compress = options.archive_compress and options.archive_compress.value
+    local files = {}
+    local function add(fullpath)
+        local rpath = dirtools.get_relative_path(fullpath, sokol_path)
+        if(rpath == nil) then rpath = fullpath end
+        local file = { name = rpath, path = fullpath }
+        if(not compress) then file.compress = false end
+        tinsert(files, file)
+    end
+
+    for i, group in ipairs({ "lua", "shaders", "images", "data" }) do
+        for j, v in ipairs(config["assets"][group] or {}) do 
+            if(v.folder) then 
+                for k, f in ipairs(folder_files(v.name)) do add(f) end
+            elseif(group ~= "lua") then 
+                add(v.name)
+            end
+        end
+    end
+
+    local start = os.clock()
+    local stats, err = vfs.pack(archive, files, { bytecode = options.build_bytecode and options.build_bytecode.value })
+    if(stats == nil) then 
+        logging.error(err)
+        return nil
+    end
+    logging.info(string.format("Archive %s: %d files, %d bytes (%d packed, %d compressed) in %.1f ms", 
+        archive, stats.count, stats.archive, stats.packed, stats.compressed, (os.clock() - start) * 1000.0))
+    return stats
+end
+
+-- ----------------------------------------------------------------------------------
+-- First startup chunk of a packaged exe: mount the archive beside it and load through it
+
+local function write_vfs_boot(bootfile, archivename)
+
+    local fh = io.open(bootfile, "w")
+    if(fh == nil) then 
+        logging.error("Cannot write: "..bootfile)
+        return nil
+    end
+    fh:write('local vfs = require("tools.vfs.vfs")\n')
+    fh:write('local dir = string.match(arg and arg[0] or "", "^(.*[\\\\/])") or ""\n')
+    fh:write(string.format('if(vfs.mount(dir..%q)) then vfs.install() end\n', archivename))
+    fh:close()
+    return bootfile
+end
+
 -- ----------------------------------------------------------------------------------
 -- srlua and glue for each os
 
@@ -114,6 +188,23 @@ luajit_builder.run = function( config )
             tinsert(libfiles, { name = rpath, fullpath = v.name })
         end
     end
+
+    -- Assets go into the archive, the exe mounts it before the project starts
+    local options = config["options"]
+    local bootfile = nil
+    if(options.build_archive and options.build_archive.value) then 
+        local archivename = config["project"].project_name.value..".pak"
+        if(pack_assets(config, outputfolder..archivename)) then 
+            bootfile = write_vfs_boot(outputfolder.."vfs_boot.lua", archivename)
+        end
+        if(bootfile) then 
+            local sokol_path = config["sokol"].sokol_path.value
+            tinsert(libfiles, { name = "tools/vfs/vfs.lua", fullpath = sokol_path..cmds.sep.."tools"..cmds.sep.."vfs"..cmds.sep.."vfs.lua" })
+            tinsert(libfiles, { name = "ffi/sokol/stb.lua", fullpath = sokol_path..cmds.sep.."ffi"..cmds.sep.."sokol"..cmds.sep.."stb.lua" })
+            tinsert(startfiles, 1, bootfile)
+        end
+    end
+
     local combine_out = outputfolder.."combine.out"
     combine.run( combine_out, startfiles, libfiles)
 
@@ -144,8 +235,8 @@ luajit_builder.run = function( config )
 
 
     -- Remove temp files
-    local cleanupcmd = "rm -f "..combine_out
-    if(ffi.os == "Windows") then cleanupcmd = "del /f "..combine_out end
+    local cleanupcmd = "rm -f "..combine_out.." "..(bootfile or "")
+    if(ffi.os == "Windows") then cleanupcmd = "del /f "..combine_out.." "..(bootfile or "") end
     --run_cmd(cleanupcmd)
 end
 
@@ -1,41 +1,181 @@
-
 -- Assets are loaded globally, but they can be unloaded (to conserve memory) while maintain
---   handles for instant/fast reloads. 
+--   handles for instant/fast reloads.
 -- Worlds hold asset id's and 'in-memory' asset references (handles)
--- Groups tag assets that need to be loaded/unloaded together within a world 
+-- Groups tag assets that need to be loaded/unloaded together within a world
 --   depending on the developers own criteria ie: location loading, cutscene loading etc.
+--
+-- Loading is async: load() queues the asset and returns its uid straight away, update() works
+--   through the queue (highest priority first) within a time budget each frame. Images in the
+--   queue are decoded together on worker threads. Loading a path that is already known (queued,
+--   loaded or unloaded) returns the same uid, so nothing is loaded twice.
+-- Handles are reference counted: load() and acquire() add a ref, release() drops it. When the
+--   resident bytes go over the budget, unreferenced assets are unloaded least recently used
+--   first. Unloaded assets keep their uid and their gpu handles where the type allows it (images
+--   and shaders are uninitialized, not destroyed), so a reload refills the same handle and
+--   anything bound to it keeps working. Shaders keep their compiled desc and reload without
+--   running the shader compiler.
 
-local dirtools      = require("tools.vfs.dirtools")
+local ffi           = require("ffi")
 local utils         = require("utils")
+local workers       = require("lua.engine.workers")
+local imageutils    = require("lua.loaders.image-utils")
+local gltfloader    = require("lua.loaders.gltfloader.gltfloader")
+local meshes        = require("lua.geometry.meshes")
+local bins          = require("lua.geometry.bins")
+
+local tinsert       = table.insert
+local tremove       = table.remove
 
 ------------------------------------------------------------------------------------------------------------
 
 local assetmanager = {
 
-    assets          = {},
+    assets          = {},       -- uid -> asset record
+    paths           = {},       -- path -> uid (dedupes loads)
     asset_count     = 0,
 
     -- Used for scenes to pool assets for a group
-    cache           = {},
+    cache           = {},       -- group name -> { [uid] = true }
+
+    queue           = {},       -- assets waiting for update() to load them
+    enqueued        = 0,        -- enqueue counter, orders assets of equal priority
+    update_ms       = 4.0,      -- time budget for update() (at least one asset is always loaded)
+    batch_images    = 16,       -- images decoded together per update
+
+    budget          = 512 * 1024 * 1024,    -- resident bytes before LRU unloading starts
+    resident        = 0,        -- bytes of the loaded assets (pixels, vertex data)
+    tick            = 0,        -- LRU clock, bumped on every use
+
+    stats           = { loads = 0, reloads = 0, unloads = 0, evictions = 0, dedupes = 0, failed = 0 },
 }
 
+------------------------------------------------------------------------------------------------------------
+-- Loader per type: load(asset) returns data, bytes (nil on failure). unload(asset) frees the
+--   memory. restore(asset), when present, reloads into the handles unload left behind and returns
+--   bytes. batch names a loader that takes a list of assets at once (images).
+
+local function image_bytes(res)
+    return res.info[0].width * res.info[0].height * 4
+end
+
+local function load_images(assets)
+
+    local jobs = {}
+    for i, asset in ipairs(assets) do
+        -- A restored image refills its old handle
+        local img = asset.data and asset.data.img
+        tinsert(jobs, { name = asset.name, tid = asset.uid, path = asset.path, img = img })
+    end
+    local results = imageutils.loadimages(jobs)
+    for i, asset in ipairs(assets) do
+        local res = results[i]
+        if(res) then
+            assets[i].result, assets[i].result_bytes = res, image_bytes(res)
+        end
+    end
+end
+
+local function unload_image(asset)
+    local res = asset.data
+    if(res.img and sg.sg_isvalid() == true) then sg.sg_uninit_image(res.img) end
+    res.data = nil
+    res.info = nil
+end
+
+------------------------------------------------------------------------------------------------------------
+
+-- The shader compiler does real work when it is set up, so that waits for the first shader
+local shc = nil
+local function get_shc()
+    if(shc == nil) then shc = require("tools.shader_compiler.shc_compile").init( "worldbuilder", false ) end
+    return shc
+end
+
+local function load_shader(asset)
+
+    local shc = get_shc()
+    local desc = nil
+    if(asset.type == "shc") then
+        -- Already compiled (sokol-shdc output), only needs turning into a desc
+        local fh = io.open(asset.path, "r")
+        if(fh == nil) then return nil end
+        local src = fh:read("*a")
+        fh:close()
+        desc = shc.process_shader(asset.path, src)
+    else
+        desc = shc.compile(asset.path)
+    end
+    if(desc == nil) then return nil end
+    return { shader = sg.sg_make_shader(desc), desc = desc }, 0
+end
+
+local function unload_shader(asset)
+    sg.sg_uninit_shader(asset.data.shader)
+end
+
+local function restore_shader(asset)
+    sg.sg_init_shader(asset.data.shader, asset.data.desc)
+    return 0
+end
+
+------------------------------------------------------------------------------------------------------------
+
+local function load_gltf(asset)
+
+    local model = gltfloader:load_gltf_asset(asset.path, { name = asset.name, format = asset.type }, nil, asset.bin_target)
+    if(model == nil) then return nil end
+    local bytes = model.stats.vertex_bytes
+    for i, image in pairs(model.images or {}) do
+        if(image.info) then bytes = bytes + image_bytes(image) end
+    end
+    return model, bytes
+end
+
+-- Take the model out of the bins and free its buffers and images. A reload loads the file again.
+local function unload_gltf(asset)
+
+    local model = asset.data
+    for i, geom in ipairs(model.all_geom) do
+        -- Bin slots are stable, the index from bin_add_geom still points at this state
+        local bin = bins.bins[geom.bindid]
+        if(bin and bin[geom.binindex] == geom.dstate) then bins.bin_remove(geom.bindid, geom.binindex) end
+        meshes.release_model(geom.model)
+        local bind = geom.bind and geom.bind[0]
+        if(bind) then
+            for vb = 0, 7 do
+                if(bind.vertex_buffers[vb].id ~= 0) then sg.sg_destroy_buffer(bind.vertex_buffers[vb]) end
+            end
+            if(bind.index_buffer.id ~= 0) then sg.sg_destroy_buffer(bind.index_buffer) end
+        end
+    end
+    for i, image in pairs(model.images or {}) do
+        if(image.img) then sg.sg_destroy_image(image.img) end
+    end
+end
+
 ------------------------------------------------------------------------------------------------------------
 -- This limits asset loading. Only registered supported types here.
 -- Each type will have its own loader that is used in assetmanager.load()
 -- This will grow. And is likely to change. Beware.
 
+local image_type    = { batch = load_images, unload = unload_image, restore = true }
+local shader_type   = { load = load_shader, unload = unload_shader, restore = restore_shader }
+local gltf_type     = { load = load_gltf, unload = unload_gltf }
+
 local ASSETTYPES = {
-    ["png"]       = function(filename)  end,
-    ["jpg"]       = function(filename)  end,
-    ["gltf"]      = function(filename)  end,
-    ["glb"]       = function(filename)  end,
-    ["lua"]       = function(filename)  end,
-    ["lcc"]       = function(filename)  end,
-    ["ogg"]       = function(filename)  end,
-    ["glsl"]      = function(filename)  end,
-    ["shc"]       = function(filename)  end,
+    ["png"]       = image_type,
+    ["jpg"]       = image_type,
+    ["gltf"]      = gltf_type,
+    ["glb"]       = gltf_type,
+    ["lua"]       = {},
+    ["lcc"]       = {},
+    ["ogg"]       = {},
+    ["glsl"]      = shader_type,
+    ["shc"]       = shader_type,
 }
 
+assetmanager.ASSETTYPES = ASSETTYPES
+
 ------------------------------------------------------------------------------------------------------------
 -- Reset asset manager or make a new one.
 
@@ -43,34 +183,295 @@ assetmanager.init   = function()
 
     -- May add unloading all assets before this. However lua should free the handles and release the mem
     assetmanager.assets          = {}
+    assetmanager.paths           = {}
     assetmanager.asset_count     = 0
-    assetmanager.cache           = {}   
+    assetmanager.cache           = {}
+    assetmanager.queue           = {}
+    assetmanager.resident        = 0
 end
 
 ------------------------------------------------------------------------------------------------------------
 
+local function touch(asset)
+    assetmanager.tick = assetmanager.tick + 1
+    asset.used = assetmanager.tick
+end
+
+local function enqueue(asset, priority)
 
+    if(priority and priority > asset.priority) then asset.priority = priority end
+    if(asset.state == "queued") then return end
+    asset.state = "queued"
+    assetmanager.enqueued = assetmanager.enqueued + 1
+    asset.order = assetmanager.enqueued
+    tinsert(assetmanager.queue, asset)
+end
 
+local function finish(asset, data, bytes)
+
+    if(data == nil) then
+        asset.state = "failed"
+        assetmanager.stats.failed = assetmanager.stats.failed + 1
+        pprint("[Error assetmanager] Cannot load: "..asset.path)
+    else
+        asset.data = data
+        asset.bytes = bytes or 0
+        asset.state = "loaded"
+        assetmanager.resident = assetmanager.resident + asset.bytes
+        touch(asset)
+    end
+    local waiting = asset.waiting
+    asset.waiting = {}
+    for i, callback in ipairs(waiting) do callback(asset.uid, asset.data) end
+end
 
 ------------------------------------------------------------------------------------------------------------
--- Load an asset into the pool. 
+
+local function unload_asset(asset)
+
+    if(asset.state ~= "loaded") then return end
+    local atype = ASSETTYPES[asset.type]
+    if(atype.unload) then atype.unload(asset) end
+    assetmanager.resident = assetmanager.resident - asset.bytes
+    asset.bytes = 0
+    asset.state = "unloaded"
+    -- Types without restore load from scratch next time
+    if(atype.restore == nil) then asset.data = nil end
+    assetmanager.stats.unloads = assetmanager.stats.unloads + 1
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Unload unreferenced assets, least recently used first, until resident fits the budget
+
+local function evict()
+
+    if(assetmanager.resident <= assetmanager.budget) then return end
+    local candidates = {}
+    for uid, asset in pairs(assetmanager.assets) do
+        if(asset.state == "loaded" and asset.refs == 0 and asset.bytes > 0) then tinsert(candidates, asset) end
+    end
+    table.sort(candidates, function(a, b) return a.used < b.used end)
+    for i, asset in ipairs(candidates) do
+        if(assetmanager.resident <= assetmanager.budget) then break end
+        unload_asset(asset)
+        assetmanager.stats.evictions = assetmanager.stats.evictions + 1
+    end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Load an asset into the pool.
+--   opts (all optional): priority (higher loads first), group (tag name), callback(uid, data)
+--   called once loaded, bin_target (gltf). The asset gets a reference, release() it when done.
 --   Returns: asset uid, asset name, asset type
 
-assetmanager.load   = function( filename )
+assetmanager.load   = function( filename, opts )
+
+    opts = opts or {}
+    local ext = string.match(filename, "%.([^%.\\/]+)$")
+    ext = ext and string.lower(ext)
+    if(ext == nil or ASSETTYPES[ext] == nil) then
+        pprint("[Error assetmanager.load] Unsupported asset type: "..filename)
+        return nil
+    end
+    local atype = ASSETTYPES[ext]
+    if(atype.load == nil and atype.batch == nil) then
+        pprint("[Error assetmanager.load] No loader for asset type: "..ext)
+        return nil
+    end
 
-    local assetinfo = nil
-    local path, filestr, ext = dirtools.getparts(filename)
-    ext = string.lower(ext)
-    print(path, filestr, ext)
+    local path = utils.cleanstring(filename)
+    local uid = assetmanager.paths[path]
+    local asset = uid and assetmanager.assets[uid]
+    if(asset) then
+        assetmanager.stats.dedupes = assetmanager.stats.dedupes + 1
+    else
+        assetmanager.asset_count = assetmanager.asset_count + 1
+        uid = assetmanager.asset_count
+        asset = {
+            uid         = uid,
+            path        = path,
+            name        = string.match(path, "([^\\/]+)%.[^%.\\/]+$") or path,
+            type        = ext,
+            state       = "new",
+            refs        = 0,
+            priority    = 0,
+            bytes       = 0,
+            used        = 0,
+            groups      = {},
+            waiting     = {},
+            bin_target  = opts.bin_target,
+        }
+        assetmanager.assets[uid] = asset
+        assetmanager.paths[path] = uid
+    end
 
-    if(ext and ASSETTYPES[ext]) then 
-        print("Valid asset: "..filename)
+    asset.refs = asset.refs + 1
+    if(opts.group) then assetmanager.add_to_group(opts.group, uid) end
+    -- Asking again retries a failed load
+    if(asset.state == "failed") then asset.state = asset.data and "unloaded" or "new" end
+    if(asset.state == "loaded") then
+        touch(asset)
+        if(opts.callback) then opts.callback(uid, asset.data) end
+    else
+        if(opts.callback) then tinsert(asset.waiting, opts.callback) end
+        enqueue(asset, opts.priority or 0)
     end
-    return assetinfo
+    return uid, asset.name, asset.type
+end
+
+------------------------------------------------------------------------------------------------------------
+-- The loaded data of an asset (nil while it is loading). Using an unloaded asset queues its
+--   reload at the given priority.
+
+assetmanager.get    = function( uid, priority )
+
+    local asset = assetmanager.assets[uid]
+    if(asset == nil) then return nil end
+    if(asset.state == "loaded") then
+        touch(asset)
+        return asset.data, asset
+    end
+    if(asset.state == "unloaded") then enqueue(asset, priority or 0) end
+    return nil, asset
+end
+
+------------------------------------------------------------------------------------------------------------
+
+assetmanager.acquire = function( uid )
+    local asset = assetmanager.assets[uid]
+    if(asset) then asset.refs = asset.refs + 1 end
+    return uid
+end
+
+assetmanager.release = function( uid )
+    local asset = assetmanager.assets[uid]
+    if(asset and asset.refs > 0) then asset.refs = asset.refs - 1 end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Unload now (keeps the uid, the next get() or load() reloads it)
+
+assetmanager.unload = function( uid )
+    local asset = assetmanager.assets[uid]
+    if(asset == nil) then return end
+    if(asset.state == "queued") then
+        for i, queued in ipairs(assetmanager.queue) do
+            if(queued == asset) then tremove(assetmanager.queue, i); break end
+        end
+        asset.state = asset.data and "unloaded" or "new"
+    end
+    unload_asset(asset)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Groups
+
+assetmanager.add_to_group = function( group, uid )
+    local asset = assetmanager.assets[uid]
+    if(asset == nil) then return end
+    assetmanager.cache[group] = assetmanager.cache[group] or {}
+    assetmanager.cache[group][uid] = true
+    asset.groups[group] = true
+end
+
+-- Queue every asset of the group that is not loaded
+assetmanager.load_group = function( group, priority )
+    for uid in pairs(assetmanager.cache[group] or {}) do
+        local asset = assetmanager.assets[uid]
+        if(asset.state == "new" or asset.state == "unloaded") then enqueue(asset, priority or 0) end
+    end
+end
+
+-- Unload the group's assets that nothing references (handles stay valid for load_group)
+assetmanager.unload_group = function( group )
+    for uid in pairs(assetmanager.cache[group] or {}) do
+        local asset = assetmanager.assets[uid]
+        if(asset.refs == 0) then assetmanager.unload(uid) end
+    end
+end
+
+-- True when every asset in the group is loaded
+assetmanager.group_ready = function( group )
+    for uid in pairs(assetmanager.cache[group] or {}) do
+        if(assetmanager.assets[uid].state ~= "loaded") then return false end
+    end
+    return true
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Work through the load queue. Call once a frame. Returns the number of assets still queued.
+
+assetmanager.update = function( budget_ms )
+
+    local queue = assetmanager.queue
+    if(#queue > 0) then
+        local start = workers.now()
+        budget_ms = budget_ms or assetmanager.update_ms
+        -- Stable: equal priorities load in request order
+        table.sort(queue, function(a, b)
+            if(a.priority ~= b.priority) then return a.priority > b.priority end
+            return a.order < b.order
+        end)
+
+        while(#queue > 0) do
+            local asset = tremove(queue, 1)
+            local atype = ASSETTYPES[asset.type]
+            local reload = (asset.data ~= nil)
+
+            if(atype.batch) then
+                -- Take the next queued assets of the same loader with it
+                local batch = { asset }
+                local qi = 1
+                while(qi <= #queue and #batch < assetmanager.batch_images) do
+                    if(ASSETTYPES[queue[qi].type].batch == atype.batch) then
+                        tinsert(batch, tremove(queue, qi))
+                    else
+                        qi = qi + 1
+                    end
+                end
+                atype.batch(batch)
+                for i, item in ipairs(batch) do
+                    local data = item.result
+                    -- A restored image keeps its record (and handle)
+                    if(data and item.data) then
+                        item.data.img, item.data.info, item.data.data = data.img, data.info, data.data
+                        data = item.data
+                    end
+                    if(item.data) then assetmanager.stats.reloads = assetmanager.stats.reloads + 1
+                    else assetmanager.stats.loads = assetmanager.stats.loads + 1 end
+                    finish(item, data, item.result_bytes)
+                    item.result, item.result_bytes, item.order = nil, nil, nil
+                end
+            else
+                local data, bytes = nil, nil
+                if(reload and type(atype.restore) == "function") then
+                    bytes = atype.restore(asset)
+                    data = asset.data
+                    assetmanager.stats.reloads = assetmanager.stats.reloads + 1
+                else
+                    data, bytes = atype.load(asset)
+                    assetmanager.stats.loads = assetmanager.stats.loads + 1
+                end
+                asset.order = nil
+                finish(asset, data, bytes)
+            end
+
+            if(workers.now() - start >= budget_ms) then break end
+        end
+    end
+    evict()
+    return #queue
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Load everything queued right now (loading screens, tools)
+
+assetmanager.flush = function()
+    while(assetmanager.update(math.huge) > 0) do end
 end
 
 ------------------------------------------------------------------------------------------------------------
 
 return assetmanager
 
-------------------------------------------------------------------------------------------------------------
\ No newline at end of file
+------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,127 @@
+------------------------------------------------------------------------------------------------------------
+-- Generational entity handles
+--
+-- Decription: A handle is a slot index plus the generation of that slot, packed into one number
+--             (so it can be a table key, go into json and so on). Destroying a handle bumps the
+--             generation of its slot and puts the slot on a free list, so create, destroy and
+--             lookup are O(1) and an old handle to a reused slot is detected as stale instead of
+--             finding the new owner.
+--             Generations and the free list are FFI arrays, the objects stay in a Lua table.
+------------------------------------------------------------------------------------------------------------
+
+local ffi           = require("ffi")
+
+------------------------------------------------------------------------------------------------------------
+
+local handles = {
+    capacity        = 1024,         -- Initial slots, doubled when full
+}
+
+-- handle = generation * INDEX_SPAN + index. 2^24 slots and 2^28 generations stay exact in a double.
+local INDEX_SPAN    = 16777216
+local GEN_LIMIT     = 268435456
+
+local gen_array     = ffi.typeof("uint32_t[?]")
+local link_array    = ffi.typeof("int32_t[?]")
+
+local floor         = math.floor
+
+------------------------------------------------------------------------------------------------------------
+
+handles.new = function(capacity)
+    capacity = capacity or handles.capacity
+    return {
+        capacity    = capacity,
+        generations = gen_array(capacity),     -- Current generation per slot (0: never used)
+        links       = link_array(capacity),    -- Next free slot, for slots on the free list
+        free        = -1,                      -- Head of the free list
+        top         = 0,                       -- Slots below this have been handed out
+        count       = 0,                       -- Live handles
+        objects     = {},                      -- index -> object
+    }
+end
+
+local function grow(pool)
+
+    local capacity = pool.capacity * 2
+    assert(capacity <= INDEX_SPAN, "Handle pool is full.")
+    local generations, links = gen_array(capacity), link_array(capacity)
+    ffi.copy(generations, pool.generations, pool.capacity * ffi.sizeof("uint32_t"))
+    ffi.copy(links, pool.links, pool.capacity * ffi.sizeof("int32_t"))
+    pool.generations, pool.links, pool.capacity = generations, links, capacity
+end
+
+------------------------------------------------------------------------------------------------------------
+
+handles.index = function(handle) return handle % INDEX_SPAN end
+handles.generation = function(handle) return floor(handle / INDEX_SPAN) end
+
+------------------------------------------------------------------------------------------------------------
+-- New handle for obj (reuses a freed slot first).
+handles.create = function(pool, obj)
+
+    local index = pool.free
+    if(index >= 0) then
+        pool.free = pool.links[index]
+    else
+        if(pool.top == pool.capacity) then grow(pool) end
+        index = pool.top
+        pool.top = index + 1
+    end
+    local gen = pool.generations[index]
+    if(gen == 0) then
+        gen = 1
+        pool.generations[index] = gen
+    end
+    pool.objects[index] = obj
+    pool.count = pool.count + 1
+    return gen * INDEX_SPAN + index
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Object of a handle, nil when the handle is stale or invalid.
+handles.get = function(pool, handle)
+
+    if(type(handle) ~= "number") then return nil end
+    local index = handle % INDEX_SPAN
+    if(index >= pool.top or pool.generations[index] ~= floor(handle / INDEX_SPAN)) then return nil end
+    return pool.objects[index]
+end
+
+handles.valid = function(pool, handle)
+    return handles.get(pool, handle) ~= nil
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Free a handle. Returns its object, or nil (and nothing changes) if the handle was stale.
+handles.destroy = function(pool, handle)
+
+    local obj = handles.get(pool, handle)
+    if(obj == nil) then return nil end
+    local index = handle % INDEX_SPAN
+    local gen = pool.generations[index] + 1
+    if(gen >= GEN_LIMIT) then gen = 1 end
+    pool.generations[index] = gen
+    pool.objects[index] = nil
+    pool.links[index] = pool.free
+    pool.free = index
+    pool.count = pool.count - 1
+    return obj
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Call func(handle, obj) for every live handle (slot order).
+handles.each = function(pool, func)
+
+    local objects, generations = pool.objects, pool.generations
+    for index = 0, pool.top - 1 do
+        local obj = objects[index]
+        if(obj ~= nil) then func(generations[index] * INDEX_SPAN + index, obj) end
+    end
+end
+
+------------------------------------------------------------------------------------------------------------
+
+return handles
+
+------------------------------------------------------------------------------------------------------------
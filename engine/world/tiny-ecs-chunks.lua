@@ -0,0 +1,314 @@
+------------------------------------------------------------------------------------------------------------
+-- Archetype storage for hot numeric components (tiny-ecs companion)
+--
+-- Decription: Components registered here are FFI structs. Entities with the same set of them share
+--             an archetype, which stores them in fixed size chunks with one contiguous column
+--             (array of the component struct) per component. Systems with a processChunk callback
+--             run over whole chunks instead of entity tables:
+--
+--                 chunks.component("position", "float x, y, z;")
+--                 chunks.component("velocity", "float x, y, z;")
+--                 local mover = tiny.processingSystem({ components = { "position", "velocity" } })
+--                 function mover:processChunk(chunk, count, dt)
+--                     local p, v = chunk.position, chunk.velocity
+--                     for i = 0, count - 1 do p[i].x = p[i].x + v[i].x * dt end
+--                 end
+--
+--             The entity itself stays a Lua table for cold data (names, scripts, go handles) and is
+--             added to the world as usual, so table systems keep working on it. Its chunk and slot
+--             are kept in entity._chunk / entity._slot.
+--             Structural changes (spawn, despawn, set, unset) move data between chunks, so they
+--             must not happen inside processChunk. Use world:removeEntity there, the world
+--             despawns the entity when it manages entities.
+------------------------------------------------------------------------------------------------------------
+
+local ffi           = require("ffi")
+
+local tinsert       = table.insert
+local tconcat       = table.concat
+local tsort         = table.sort
+
+------------------------------------------------------------------------------------------------------------
+
+local chunks = {
+    capacity        = 4096,     -- Entities per chunk
+    components      = {},       -- name -> { name, ctype, size, id }
+    component_list  = {},       -- registration order
+}
+
+-- Chunk fields that cannot be component names
+local reserved = { archetype = true, count = true, capacity = true, entities = true, columns = true }
+
+------------------------------------------------------------------------------------------------------------
+-- Register a hot component. decl is the struct body ("float x, y, z;"). Registering the same
+--   name again with the same declaration is a no-op.
+chunks.component = function(name, decl)
+
+    local comp = chunks.components[name]
+    if(comp) then
+        assert(comp.decl == decl, "Component already registered with another layout: "..name)
+        return comp
+    end
+    assert(reserved[name] == nil and string.match(name, "^[%a_][%w_]*$"), "Invalid component name: "..name)
+
+    local cname = "ecs_"..name
+    ffi.cdef(string.format("typedef struct %s { %s } %s;", cname, decl, cname))
+    comp = {
+        name    = name,
+        decl    = decl,
+        ctype   = cname,
+        array   = ffi.typeof(cname.."[?]"),
+        size    = ffi.sizeof(cname),
+        id      = #chunks.component_list + 1,
+    }
+    chunks.components[name] = comp
+    tinsert(chunks.component_list, comp)
+    return comp
+end
+
+------------------------------------------------------------------------------------------------------------
+
+local function archetype_key(names)
+    tsort(names)
+    return tconcat(names, "|")
+end
+
+local function new_chunk(store, archetype)
+
+    local chunk = {
+        archetype   = archetype,
+        count       = 0,
+        capacity    = store.capacity,
+        entities    = {},
+        columns     = {},
+    }
+    for i, name in ipairs(archetype.components) do
+        local col = chunks.components[name].array(store.capacity)
+        chunk[name] = col
+        chunk.columns[name] = col
+    end
+    tinsert(archetype.chunks, chunk)
+    return chunk
+end
+
+local function get_archetype(store, names)
+
+    local key = archetype_key(names)
+    local archetype = store.archetypes[key]
+    if(archetype == nil) then
+        archetype = { key = key, components = {}, set = {}, chunks = {} }
+        for i, name in ipairs(names) do
+            assert(chunks.components[name], "Unknown component: "..name)
+            tinsert(archetype.components, name)
+            archetype.set[name] = true
+        end
+        store.archetypes[key] = archetype
+        tinsert(store.archetype_list, archetype)
+        -- Cached queries have to look at the new archetype
+        store.version = store.version + 1
+    end
+    return archetype
+end
+
+-- First chunk with room (chunks are few, a scan is fine)
+local function open_chunk(store, archetype)
+
+    local list = archetype.chunks
+    for i = 1, #list do
+        if(list[i].count < list[i].capacity) then return list[i] end
+    end
+    return new_chunk(store, archetype)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Take a slot out of its chunk, the last entity of the chunk moves into it.
+local function release_slot(chunk, slot)
+
+    local last = chunk.count - 1
+    if(slot ~= last) then
+        for name, col in pairs(chunk.columns) do col[slot] = col[last] end
+        local moved = chunk.entities[last + 1]
+        chunk.entities[slot + 1] = moved
+        moved._slot = slot
+    end
+    chunk.entities[last + 1] = nil
+    chunk.count = last
+end
+
+local function claim_slot(store, archetype, entity)
+
+    local chunk = open_chunk(store, archetype)
+    local slot = chunk.count
+    chunk.count = slot + 1
+    chunk.entities[slot + 1] = entity
+    entity._chunk, entity._slot = chunk, slot
+    return chunk, slot
+end
+
+-- value: a table initializer, a cdata struct or true for zeros
+local function write_component(col, slot, comp, value)
+    if(value == true or value == nil) then
+        ffi.fill(col + slot, comp.size)
+    else
+        col[slot] = value
+    end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- A store holds the archetypes of one world. tiny.world does not make one, chunks.store(world)
+--   does on first use.
+chunks.new = function(capacity)
+    return {
+        capacity        = capacity or chunks.capacity,
+        archetypes      = {},   -- key -> archetype
+        archetype_list  = {},
+        queries         = {},   -- query key -> { version, archetypes }
+        version         = 0,
+        count           = 0,    -- Entities in the store
+    }
+end
+
+chunks.store = function(world)
+    local store = world.store
+    if(store == nil) then
+        store = chunks.new()
+        world.store = store
+    end
+    return store
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Put an entity into the store with components = { name = value, ... }. entity is the table for
+--   its cold data (a new one if nil). With a world the entity is added to it as well.
+--   Returns the entity.
+chunks.spawn = function(store, components, entity, world)
+
+    entity = entity or {}
+    assert(entity._chunk == nil, "Entity is already in a chunk store.")
+    local names = {}
+    for name in pairs(components) do tinsert(names, name) end
+    local archetype = get_archetype(store, names)
+    local chunk, slot = claim_slot(store, archetype, entity)
+    for name, value in pairs(components) do
+        write_component(chunk[name], slot, chunks.components[name], value)
+    end
+    store.count = store.count + 1
+    if(world) then world:addEntity(entity) end
+    return entity
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Drop the hot components of an entity. The table is left alone (and in its world).
+chunks.despawn = function(store, entity)
+
+    local chunk = entity._chunk
+    if(chunk == nil) then return end
+    release_slot(chunk, entity._slot)
+    entity._chunk, entity._slot = nil, nil
+    store.count = store.count - 1
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Move the entity to the archetype with names, copying the components both have.
+local function move(store, entity, names)
+
+    local src, sslot = entity._chunk, entity._slot
+    local archetype = get_archetype(store, names)
+    if(archetype == src.archetype) then return src, sslot end
+    local dst, dslot = claim_slot(store, archetype, entity)
+    for name, col in pairs(src.columns) do
+        local dcol = dst.columns[name]
+        if(dcol) then dcol[dslot] = col[sslot] end
+    end
+    -- The entity already points at dst, release_slot only fixes up whoever fills the old slot
+    release_slot(src, sslot)
+    return dst, dslot
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Add or overwrite a component on an entity in the store (moves it to another archetype when new).
+chunks.set = function(store, entity, name, value)
+
+    local chunk = entity._chunk
+    if(chunk == nil) then return chunks.spawn(store, { [name] = value }, entity) end
+    if(chunk.columns[name] == nil) then
+        local names = { name }
+        for i, n in ipairs(chunk.archetype.components) do tinsert(names, n) end
+        chunk = move(store, entity, names)
+    end
+    write_component(chunk[name], entity._slot, chunks.components[name], value)
+    return entity
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Remove a component from an entity. Removing the last one despawns it from the store.
+chunks.unset = function(store, entity, name)
+
+    local chunk = entity._chunk
+    if(chunk == nil or chunk.columns[name] == nil) then return entity end
+    local names = {}
+    for i, n in ipairs(chunk.archetype.components) do
+        if(n ~= name) then tinsert(names, n) end
+    end
+    if(#names == 0) then
+        chunks.despawn(store, entity)
+    else
+        move(store, entity, names)
+    end
+    return entity
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Pointer to a component of an entity, or nil. Only valid until the next structural change.
+chunks.get = function(entity, name)
+    local chunk = entity._chunk
+    if(chunk == nil) then return nil end
+    local col = chunk.columns[name]
+    if(col == nil) then return nil end
+    return col + entity._slot
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Archetypes that have all of required and none of rejected. Cached until a new archetype appears.
+chunks.query = function(store, required, rejected)
+
+    local key = tconcat(required or {}, "|").."#"..tconcat(rejected or {}, "|")
+    local query = store.queries[key]
+    if(query and query.version == store.version) then return query.archetypes end
+
+    local list = {}
+    for i, archetype in ipairs(store.archetype_list) do
+        local ok = true
+        for j, name in ipairs(required or {}) do
+            if(archetype.set[name] == nil) then ok = false; break end
+        end
+        if(ok and rejected) then
+            for j, name in ipairs(rejected) do
+                if(archetype.set[name]) then ok = false; break end
+            end
+        end
+        if(ok) then tinsert(list, archetype) end
+    end
+    store.queries[key] = { version = store.version, archetypes = list }
+    return list
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Call func(chunk, count, ...) on every non empty chunk matching the query.
+chunks.each = function(store, required, rejected, func, ...)
+
+    local archetypes = chunks.query(store, required, rejected)
+    for i = 1, #archetypes do
+        local list = archetypes[i].chunks
+        for j = 1, #list do
+            local chunk = list[j]
+            if(chunk.count > 0) then func(chunk, chunk.count, ...) end
+        end
+    end
+end
+
+------------------------------------------------------------------------------------------------------------
+
+return chunks
+
+------------------------------------------------------------------------------------------------------------
@@ -1,75 +1,292 @@
+------------------------------------------------------------------------------------------------------------
+-- Tiny ECS commands - editor commands from the server websocket
+--
+-- Decription: Messages are queued as they arrive and run in process_queue, once per update, within
+--             a time budget (what is left over waits for the next update). The queue is a ring
+--             buffer, so queuing and taking commands does not shift or grow tables each frame.
+--             Commands that say how (coalesce) replace a queued command with the same key, so
+--             20 moves of one entity before an update are one move. The merged command moves to
+--             the tail (the old slot is left as a hole), and a command for the same id that
+--             does not coalesce (a delete, say) stops older ones from being merged into newer
+--             ones, so commands still run in the order they came. Queued runs of a command with
+--             a batch handler are handed to it together (up to batch_max), as one operation.
+------------------------------------------------------------------------------------------------------------
 
-local utils         = require("lua.utils")
+local socket        = require("socket.core")
 
 ------------------------------------------------------------------------------------------------------------
 
 local tinsert       = table.insert
 local tconcat       = table.concat
 
+-- Milliseconds, for the time budget
+local function now()
+    return socket.gettime() * 1000.0
+end
+
+------------------------------------------------------------------------------------------------------------
+
+local commands = {
+    -- Incoming commands from the editor to respond to
+    capacity        = 1024,     -- Queue slots to start with, doubled when full
+    max_queue       = 65536,    -- Commands queued before new ones are dropped
+    update_ms       = 2.0,      -- Time budget for process_queue (at least one command always runs)
+    batch_max       = 256,      -- Commands handed to a batch handler at once
+    verbose         = false,    -- Print every queued command
+
+    -- Set by the server: entity for an id, and what to call when a command changed an entity
+    find_entity     = function( id ) return nil end,
+    entity_changed  = function( entity, component ) end,
+
+    stats           = {
+        queued      = 0,        -- Commands accepted
+        processed   = 0,        -- Commands run
+        coalesced   = 0,        -- Commands that replaced a queued one
+        dropped     = 0,        -- Commands refused (queue full)
+        rejected    = 0,        -- Unknown or malformed messages
+        batches     = 0,        -- Batch handler calls
+        depth       = 0,        -- Commands waiting
+        max_depth   = 0,
+        last_ms     = 0.0,      -- Time spent in the last process_queue
+        max_ms      = 0.0,
+        total_ms    = 0.0,
+    },
+}
+
 ------------------------------------------------------------------------------------------------------------
+-- Apply the transform fields of move messages to their entities
+local function entity_moves( msgs, n )
+
+    local find, changed = commands.find_entity, commands.entity_changed
+    for i = 1, n do
+        local msg = msgs[i]
+        local ent = find(msg.id)
+        if(ent) then
+            if(msg.pos) then ent.pos = msg.pos; changed(ent, "pos") end
+            if(msg.rot) then ent.rot = msg.rot; changed(ent, "rot") end
+            if(msg.scale) then ent.scale = msg.scale; changed(ent, "scale") end
+        end
+    end
+end
+
+local function by_id( msg ) return msg.id end
+
+------------------------------------------------------------------------------------------------------------
+-- Per command: func(msg) runs one message, batch(msgs, n) runs a run of queued messages of the
+--   command (used instead of func), coalesce(msg) returns the key of a message that a newer message
+--   with the same key replaces (nil: never coalesced).
 
 local CMDS  = {
-    TEST              = 0, 
+    TEST              = { func = function( msg ) end },
 
     -- System commands
-    INIT_CONFIG     = function( msg ) end,
-    INIT_WORLD      = function( msg ) end,
+    INIT_CONFIG     = { func = function( msg ) end },
+    INIT_WORLD      = { func = function( msg ) end },
 
     -- Assets commands
-    ASSET_LOAD      = function( msg ) end,
-    ASSET_DEL       = function( msg ) end,
+    ASSET_LOAD      = { func = function( msg ) end },
+    ASSET_DEL       = { func = function( msg ) end },
 
     -- Scene commands
-    SCENE_LOAD      = function( msg ) end,
-    SCENE_DEL       = function( msg ) end,
-    SCENE_COPY      = function( msg ) end,
+    SCENE_LOAD      = { func = function( msg ) end },
+    SCENE_DEL       = { func = function( msg ) end },
+    SCENE_COPY      = { func = function( msg ) end },
 
     -- Entity commands
-    ENTITY_NEW      = function( msg ) end,
-    ENTITY_DEL      = function( msg ) end,
-    ENTITY_COPY     = function( msg ) end,
+    ENTITY_NEW      = { func = function( msg ) end },
+    ENTITY_DEL      = { func = function( msg ) end },
+    ENTITY_COPY     = { func = function( msg ) end },
+    ENTITY_MOVE     = { batch = entity_moves, coalesce = by_id },
 
     -- Scripts commands
-    SCRIPT_LOAD     = function( msg ) end,
-    SCRIPT_NEW      = function( msg ) end,
-    SCRIPT_DEL      = function( msg ) end,
-    SCRIPT_ASSIGN   = function( msg ) end,
-    
+    SCRIPT_LOAD     = { func = function( msg ) end },
+    SCRIPT_NEW      = { func = function( msg ) end },
+    SCRIPT_DEL      = { func = function( msg ) end },
+    SCRIPT_ASSIGN   = { func = function( msg ) end },
+
     -- Performance commands
-    PERF_REALTIME   = function( msg ) end,
-    PERF_STATS      = function( msg ) end,
+    PERF_REALTIME   = { func = function( msg ) end },
+    PERF_STATS      = { func = function( msg ) end },
 }
 
+commands.CMDS = CMDS
+
 ------------------------------------------------------------------------------------------------------------
+-- Add or replace a command. opts: batch, coalesce (see CMDS).
+commands.register = function( name, func, opts )
 
-local commands = {
-    -- Incoming commands from the editor to respond to
-    queue           = {},
-}
+    opts = opts or {}
+    CMDS[name] = { func = func, batch = opts.batch, coalesce = opts.coalesce }
+end
 
 ------------------------------------------------------------------------------------------------------------
+-- Ring buffer queue: items at head .. head + count - 1 (masked), false in a slot is a hole left by
+--   a coalesced command. keys holds the coalesce key of a slot, slots maps the key back to its slot.
+--   live is count without the holes. seqs numbers the slots in arrival order, barriers holds the
+--   number of the last non coalescing command per id (nothing queued before it is merged).
 
-commands.process_command = function(ws, msg)
+local queue = {
+    items       = {},
+    keys        = {},
+    slots       = {},
+    seqs        = {},
+    barriers    = {},
+    seq         = 0,
+    head        = 0,
+    count       = 0,
+    live        = 0,
+    capacity    = commands.capacity,
+    mask        = commands.capacity - 1,
+}
+commands.queue = queue
+
+-- Full: copy the commands out without the holes, into twice the slots when there are no holes
+local function grow()
 
-    if(type(msg) == "table" and msg.cmd and CMDS[msg.cmd]) then 
-        print("Processing message...")
-        print(utils.tdump(msg))
-        -- Put them in the cmd queue for processing during update pass
-        tinsert(commands.queue, msg)
+    local items, keys, seqs = {}, {}, {}
+    local capacity = queue.capacity
+    if(queue.live == queue.count) then capacity = capacity * 2 end
+    local n = 0
+    for i = 0, queue.count - 1 do
+        local from = bit.band(queue.head + i, queue.mask)
+        local msg = queue.items[from]
+        if(msg) then
+            items[n], keys[n], seqs[n] = msg, queue.keys[from], queue.seqs[from]
+            if(keys[n] ~= nil) then queue.slots[keys[n]] = n end
+            n = n + 1
+        end
     end
+    queue.items, queue.keys, queue.seqs, queue.head, queue.count = items, keys, seqs, 0, n
+    queue.capacity, queue.mask = capacity, capacity - 1
+end
+
+local function pop()
+
+    local head = queue.head
+    local msg, key = queue.items[head], queue.keys[head]
+    queue.items[head], queue.keys[head], queue.seqs[head] = nil, nil, nil
+    if(key ~= nil) then queue.slots[key] = nil end
+    queue.head = bit.band(head + 1, queue.mask)
+    queue.count = queue.count - 1
+    if(msg) then queue.live = queue.live - 1 end
+    return msg
+end
+
+local function skip_holes()
+    while(queue.count > 0 and queue.items[queue.head] == false) do pop() end
 end
 
 ------------------------------------------------------------------------------------------------------------
+-- Queue a message (a decoded table with a cmd name). Returns true if it was queued or coalesced.
+commands.process_command = function(ws, msg)
 
-commands.process_queue = function()
+    local stats = commands.stats
+    local spec = type(msg) == "table" and msg.cmd and CMDS[msg.cmd]
+    if(not spec) then
+        stats.rejected = stats.rejected + 1
+        return false
+    end
+    if(commands.verbose) then print("[Command] "..tostring(msg.cmd)) end
+
+    -- A newer message replaces the queued one with the same key and goes to the tail, unless a
+    --   command for the same id that does not coalesce (a delete and new) came in between.
+    local key, old = nil, nil
+    local id = spec.coalesce and spec.coalesce(msg)
+    if(id ~= nil) then
+        key = msg.cmd.."\0"..tostring(id)
+        local slot = queue.slots[key]
+        if(slot and queue.seqs[slot] <= (queue.barriers[id] or 0)) then
+            queue.keys[slot], queue.slots[key], slot = nil, nil, nil
+        end
+        if(slot) then
+            -- Fields only the older message had are kept (a move of pos, then one of rot)
+            old = queue.items[slot]
+            for k, v in pairs(old) do
+                if(msg[k] == nil) then msg[k] = v end
+            end
+            queue.items[slot], queue.keys[slot], queue.slots[key] = false, nil, nil
+            queue.live = queue.live - 1
+        end
+    end
 
-    for k, msg in ipairs(commands.queue) do
-        CMDS[msg.cmd]( msg )
+    if(queue.count == queue.capacity) then
+        if(queue.capacity >= commands.max_queue and queue.live == queue.count) then
+            stats.dropped = stats.dropped + 1
+            return false
+        end
+        grow()
     end
+    queue.seq = queue.seq + 1
+    local slot = bit.band(queue.head + queue.count, queue.mask)
+    queue.items[slot], queue.keys[slot], queue.seqs[slot] = msg, key, queue.seq
+    if(key ~= nil) then
+        queue.slots[key] = slot
+    elseif(msg.id ~= nil) then
+        queue.barriers[msg.id] = queue.seq
+    end
+    queue.count = queue.count + 1
+    queue.live = queue.live + 1
+
+    if(old) then
+        stats.coalesced = stats.coalesced + 1
+    else
+        stats.queued = stats.queued + 1
+    end
+    stats.depth = queue.live
+    if(queue.live > stats.max_depth) then stats.max_depth = queue.live end
+    return true
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Run queued commands until the queue is empty or budget_ms is used up. Call once per update.
+--   Returns the number of commands still queued.
+commands.process_queue = function( budget_ms )
+
+    local stats = commands.stats
+    skip_holes()
+    if(queue.count == 0) then
+        queue.barriers = {}
+        stats.last_ms = 0.0
+        return 0
+    end
+
+    local start = now()
+    budget_ms = budget_ms or commands.update_ms
+    local batch = {}
+    repeat
+        local msg = pop()
+        local spec = CMDS[msg.cmd]
+        if(spec.batch) then
+            -- The run of the same command at the head of the queue goes as one batch
+            local n = 1
+            batch[1] = msg
+            skip_holes()
+            while(queue.count > 0 and n < commands.batch_max and queue.items[queue.head].cmd == msg.cmd) do
+                n = n + 1
+                batch[n] = pop()
+                skip_holes()
+            end
+            spec.batch(batch, n)
+            for i = 1, n do batch[i] = nil end
+            stats.batches = stats.batches + 1
+            stats.processed = stats.processed + n
+        else
+            spec.func(msg)
+            stats.processed = stats.processed + 1
+        end
+        skip_holes()
+    until(queue.count == 0 or now() - start >= budget_ms)
+
+    local ms = now() - start
+    stats.last_ms = ms
+    stats.total_ms = stats.total_ms + ms
+    if(ms > stats.max_ms) then stats.max_ms = ms end
+    stats.depth = queue.live
+    return queue.live
 end
 
 ------------------------------------------------------------------------------------------------------------
 
 return commands
 
-------------------------------------------------------------------------------------------------------------
\ No newline at end of file
+------------------------------------------------------------------------------------------------------------
@@ -0,0 +1,505 @@
+------------------------------------------------------------------------------------------------------------
+-- Binary delta replication of tiny-ecs worlds (tiny-ecs-server companion)
+--
+-- Decription: Builds compact binary frames of what changed in a world, per client, for editor and
+--             debug clients. A frame only carries the entities marked changed (tiny.markChanged)
+--             since the last frame the client acknowledged - its baseline - so a lost or late frame
+--             is covered by the next one. Clients without a baseline, or with one older than the
+--             world change history, get a full frame.
+--
+--             Transforms are quantized: pos to int32 (1 / pos_scale units), rot to the smallest
+--             three quaternion components (int16), scale to int16 (1 / scale_scale). Other
+--             components go as a msgpack map of just the changed ones (all of them for whole
+--             entity marks). Little endian, packed:
+--
+--                 header   "TR", u8 version, u8 flags (1: full), u32 tick, u32 base, u32 count,
+--                          u32 removed
+--                 count x  f64 id, u8 mask (1 pos, 2 rot, 4 scale, 8 props)
+--                          [i32 x, y, z] [u8 largest, i16 a, b, c] [i16 x, y, z] [u32 len, msgpack]
+--                 removed x f64 id
+--
+--             Components removed from an entity are listed in its props under the key "_unset"
+--             (string keys only, so decoders in other languages can read the map). Clients ack
+--             with the frame tick. repl.decode applies a frame to a Lua mirror table.
+--             Only the server side exists for now: no client in the repo (editor, www) speaks
+--             the "repl" websocket protocol yet, repl.decode is the reference for writing one.
+------------------------------------------------------------------------------------------------------------
+
+local ffi           = require("ffi")
+local msgpack       = require("lua.msgpack")
+
+local tinsert       = table.insert
+local floor         = math.floor
+local abs           = math.abs
+local sqrt          = math.sqrt
+
+------------------------------------------------------------------------------------------------------------
+
+ffi.cdef[[
+typedef struct __attribute__((packed)) repl_header {
+    uint8_t     magic[2];
+    uint8_t     version, flags;
+    uint32_t    tick, base, count, removed;
+} repl_header;
+typedef struct __attribute__((packed)) repl_record { double id; uint8_t mask; } repl_record;
+typedef struct __attribute__((packed)) repl_pos { int32_t x, y, z; } repl_pos;
+typedef struct __attribute__((packed)) repl_rot { uint8_t largest; int16_t a, b, c; } repl_rot;
+typedef struct __attribute__((packed)) repl_scale { int16_t x, y, z; } repl_scale;
+typedef struct __attribute__((packed)) repl_len { uint32_t len; } repl_len;
+typedef struct __attribute__((packed)) repl_id { double id; } repl_id;
+]]
+
+local header_ptr    = ffi.typeof("repl_header *")
+local record_ptr    = ffi.typeof("repl_record *")
+local pos_ptr       = ffi.typeof("repl_pos *")
+local rot_ptr       = ffi.typeof("repl_rot *")
+local scale_ptr     = ffi.typeof("repl_scale *")
+local len_ptr       = ffi.typeof("repl_len *")
+local id_ptr        = ffi.typeof("repl_id *")
+local byte_array    = ffi.typeof("uint8_t[?]")
+
+local HEADER_SIZE   = ffi.sizeof("repl_header")
+local RECORD_SIZE   = ffi.sizeof("repl_record")
+local POS_SIZE      = ffi.sizeof("repl_pos")
+local ROT_SIZE      = ffi.sizeof("repl_rot")
+local SCALE_SIZE    = ffi.sizeof("repl_scale")
+
+local VERSION       = 1
+local FULL          = 1
+
+local POS, ROT, SCALE, PROPS = 1, 2, 4, 8
+local transform_bits = { pos = POS, rot = ROT, scale = SCALE }
+
+local ROT_RANGE     = 32767 * sqrt(2.0)     -- smallest three are within +-1/sqrt(2)
+
+------------------------------------------------------------------------------------------------------------
+
+local repl = {
+    pos_scale       = 1000,     -- pos units per int (1mm)
+    scale_scale     = 1024,     -- scale units per int (+-32)
+
+    -- Entity fields never sent as props
+    skip            = { id = true, go = true, spatial_id = true },
+
+    stats           = { frames = 0, full = 0, bytes = 0, entities = 0 },
+}
+
+------------------------------------------------------------------------------------------------------------
+-- Replication state for a world. Clients are added with repl.client.
+repl.new = function(world)
+    return {
+        world       = world,
+        clients     = {},
+        removed     = { ids = {}, ticks = {}, first = 1, last = 0 },
+        buffer      = byte_array(64 * 1024),
+        size        = 64 * 1024,
+    }
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Switch to another world (world manager world swap). Every client gets a full frame next.
+repl.setWorld = function(state, world)
+
+    if(state.world == world) then return end
+    state.world = world
+    state.removed = { ids = {}, ticks = {}, first = 1, last = 0 }
+    for client in pairs(state.clients) do client.acked = -1 end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- A client (any key: a websocket, a name). acked -1 means it has no baseline yet.
+repl.client = function(state, key)
+
+    local client = state.clients[key]
+    if(client == nil) then
+        client = { key = key, acked = -1, sent = -1 }
+        state.clients[key] = client
+    end
+    return client
+end
+
+repl.drop = function(state, key)
+    state.clients[key] = nil
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Client acknowledged the frame with this tick. Acks only move forward (late acks are ignored).
+repl.ack = function(state, key, tick)
+
+    local client = state.clients[key]
+    tick = tonumber(tick)
+    if(client == nil or tick == nil) then return end
+    if(tick > client.acked and tick <= client.sent) then client.acked = tick end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Removals older than the world change history are dropped (those clients get a full frame)
+local function trim_removed(state)
+
+    local log = state.removed
+    local floor_tick = state.world.changeLog.floor
+    local first, last, ids, ticks = log.first, log.last, log.ids, log.ticks
+    while(first <= last and ticks[first] < floor_tick) do
+        ids[first], ticks[first] = nil, nil
+        first = first + 1
+    end
+    if(first > last) then first, last = 1, 0 end
+    log.first, log.last = first, last
+end
+
+-- Entity (id) removed from the world. Kept for as long as the world change history. Trimmed 
+--   here as well as in build, the log has to stay bounded while no client is connected.
+repl.removed = function(state, id)
+
+    local world, log = state.world, state.removed
+    if(world == nil or id == nil) then return end
+    trim_removed(state)
+    local n = log.last + 1
+    log.ids[n], log.ticks[n], log.last = id, world.tick, n
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Buffer writing
+
+local function reserve(state, at, bytes)
+
+    if(at + bytes <= state.size) then return end
+    local size = state.size
+    while(size < at + bytes) do size = size * 2 end
+    local buffer = byte_array(size)
+    ffi.copy(buffer, state.buffer, at)
+    state.buffer, state.size = buffer, size
+end
+
+local function clamp(v, lo, hi)
+    if(v < lo) then return lo elseif(v > hi) then return hi end
+    return v
+end
+
+local function qround(v)
+    return floor(v + 0.5)
+end
+
+-- Vector fields as x, y, z or 1, 2, 3 (scale is an array)
+local function vec3(v)
+    local x = v.x
+    if(x ~= nil) then return x, v.y, v.z end
+    return v[1], v[2], v[3]
+end
+
+-- Which transform bits an entity can send quantized (the rest go as props)
+local function transform_mask(e)
+
+    local mask = 0
+    local p, r, s = e.pos, e.rot, e.scale
+    if(type(p) == "table" and type(p.x or p[1]) == "number") then mask = mask + POS end
+    if(type(r) == "table" and type(r.w) == "number") then mask = mask + ROT end
+    if(type(s) == "table" and type(s.x or s[1]) == "number") then mask = mask + SCALE end
+    return mask
+end
+
+local function props_value(v)
+    local t = type(v)
+    return t == "number" or t == "string" or t == "boolean" or t == "table"
+end
+
+-- msgpack of the props (names: set of changed names, nil for all)
+local function pack_props(e, names, tmask)
+
+    local props, any = {}, false
+    if(names) then
+        local unset = nil
+        for name in pairs(names) do
+            local v = e[name]
+            if(v == nil) then
+                unset = unset or {}
+                tinsert(unset, name)
+                any = true
+            elseif(props_value(v)) then
+                props[name] = v
+                any = true
+            end
+        end
+        props._unset = unset
+    else
+        for name, v in pairs(e) do
+            local bit = transform_bits[name]
+            if(not repl.skip[name] and not (bit and tmask % (bit * 2) >= bit) and props_value(v)) then
+                props[name] = v
+                any = true
+            end
+        end
+    end
+    if(not any) then return nil end
+    local ok, data = pcall(msgpack.pack, props)
+    if(ok) then return data end
+    -- Something in there msgpack cannot take: pack what it can
+    for name, v in pairs(props) do
+        if(not pcall(msgpack.pack, v)) then props[name] = nil end
+    end
+    return msgpack.pack(props)
+end
+
+local function write_entity(state, at, e, mask, names)
+
+    local tmask = transform_mask(e)
+    local send = mask % PROPS
+    -- Transforms that cannot be quantized are props
+    for name, bit in pairs(transform_bits) do
+        if(send % (bit * 2) >= bit and tmask % (bit * 2) < bit) then
+            send = send - bit
+            if(e[name] ~= nil or names) then
+                names = names or {}
+                names[name] = true
+            end
+        end
+    end
+    local data = nil
+    if(mask >= PROPS) then data = pack_props(e, names, tmask)
+    elseif(names) then data = pack_props(e, names, tmask) end
+    if(data) then send = send + PROPS end
+    if(send == 0) then return at end
+
+    reserve(state, at, RECORD_SIZE + POS_SIZE + ROT_SIZE + SCALE_SIZE + 4 + (data and #data or 0))
+    local buffer = state.buffer
+    local rec = ffi.cast(record_ptr, buffer + at)
+    rec.id, rec.mask = e.id, send
+    at = at + RECORD_SIZE
+
+    if(send % 2 == 1) then
+        local x, y, z = vec3(e.pos)
+        local q, s = ffi.cast(pos_ptr, buffer + at), repl.pos_scale
+        q.x = clamp(qround(x * s), -2147483647, 2147483647)
+        q.y = clamp(qround(y * s), -2147483647, 2147483647)
+        q.z = clamp(qround(z * s), -2147483647, 2147483647)
+        at = at + POS_SIZE
+    end
+    if(send % 4 >= ROT) then
+        local r = e.rot
+        local c1, c2, c3, c4 = r.x, r.y, r.z, r.w
+        local len = sqrt(c1 * c1 + c2 * c2 + c3 * c3 + c4 * c4)
+        if(len > 0) then c1, c2, c3, c4 = c1 / len, c2 / len, c3 / len, c4 / len else c4 = 1 end
+        -- Drop the largest component (it comes back from unit length), keep it positive
+        local largest, big = 3, abs(c4)
+        if(abs(c1) > big) then largest, big = 0, abs(c1) end
+        if(abs(c2) > big) then largest, big = 1, abs(c2) end
+        if(abs(c3) > big) then largest, big = 2, abs(c3) end
+        local a, b, c, l
+        if(largest == 0) then a, b, c, l = c2, c3, c4, c1
+        elseif(largest == 1) then a, b, c, l = c1, c3, c4, c2
+        elseif(largest == 2) then a, b, c, l = c1, c2, c4, c3
+        else a, b, c, l = c1, c2, c3, c4 end
+        if(l < 0) then a, b, c = -a, -b, -c end
+        local q = ffi.cast(rot_ptr, buffer + at)
+        q.largest = largest
+        q.a = clamp(qround(a * ROT_RANGE), -32767, 32767)
+        q.b = clamp(qround(b * ROT_RANGE), -32767, 32767)
+        q.c = clamp(qround(c * ROT_RANGE), -32767, 32767)
+        at = at + ROT_SIZE
+    end
+    if(send % 8 >= SCALE) then
+        local x, y, z = vec3(e.scale)
+        local q, s = ffi.cast(scale_ptr, buffer + at), repl.scale_scale
+        q.x = clamp(qround(x * s), -32767, 32767)
+        q.y = clamp(qround(y * s), -32767, 32767)
+        q.z = clamp(qround(z * s), -32767, 32767)
+        at = at + SCALE_SIZE
+    end
+    if(data) then
+        ffi.cast(len_ptr, buffer + at).len = #data
+        ffi.copy(buffer + at + 4, data, #data)
+        at = at + 4 + #data
+    end
+    return at
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Changes after tick from the world change log: entity -> mask, entity -> changed prop names
+local function collect(world, tick)
+
+    local log = world.changeLog
+    local lts, les, lcs = log.ticks, log.entities, log.components
+    local lo, hi = log.first, log.last + 1
+    while(lo < hi) do
+        local mid = floor((lo + hi) / 2)
+        if(lts[mid] > tick) then hi = mid else lo = mid + 1 end
+    end
+
+    local masks, names, order, n = {}, {}, {}, 0
+    local all = POS + ROT + SCALE + PROPS
+    for i = lo, log.last do
+        local e, c = les[i], lcs[i]
+        local mask = masks[e]
+        if(mask == nil) then
+            mask = 0
+            n = n + 1
+            order[n] = e
+        end
+        if(mask ~= all) then
+            if(c == false) then
+                mask = all
+                names[e] = nil
+            else
+                local bit = transform_bits[c]
+                if(bit) then
+                    if(mask % (bit * 2) < bit) then mask = mask + bit end
+                else
+                    if(mask < PROPS) then mask = mask + PROPS end
+                    local set = names[e]
+                    if(set == nil) then set = {}; names[e] = set end
+                    set[c] = true
+                end
+            end
+            masks[e] = mask
+        end
+    end
+    return masks, names, order, n
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Frame for a client (a string), or nil when there is nothing new for it.
+--   Frames for clients on the same baseline are built once per tick.
+repl.encode = function(state, key, cache)
+
+    local world, client = state.world, state.clients[key]
+    if(world == nil or client == nil) then return nil end
+    -- Marks made at the current tick can still come after this frame, so it covers tick - 1
+    local tick = world.tick - 1
+    local base = client.acked
+    local full = base < 0 or base < world.changeLog.floor
+
+    if(not full and base >= tick) then return nil end
+    cache = cache or {}
+    local ckey = full and -1 or base
+    local data = cache[ckey]
+    if(data == nil) then
+        data = repl.build(state, tick, base, full)
+        cache[ckey] = data
+    end
+    if(data) then client.sent = tick end
+    return data
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Build one frame from base (exclusive) up to tick. nil if nothing changed.
+repl.build = function(state, tick, base, full)
+
+    local world = state.world
+    trim_removed(state)
+    local at, count = HEADER_SIZE, 0
+    reserve(state, at, 0)
+
+    if(full) then
+        local entities = world.entities
+        for i = 1, #entities do
+            local e = entities[i]
+            if(e.id) then
+                local nat = write_entity(state, at, e, POS + ROT + SCALE + PROPS, nil)
+                if(nat > at) then count = count + 1 end
+                at = nat
+            end
+        end
+    else
+        local masks, names, order, n = collect(world, base)
+        local members = world.entities
+        for i = 1, n do
+            local e = order[i]
+            if(e.id and members[e]) then
+                local nat = write_entity(state, at, e, masks[e], names[e])
+                if(nat > at) then count = count + 1 end
+                at = nat
+            end
+        end
+    end
+
+    local removed = 0
+    if(not full) then
+        local log = state.removed
+        local ids, ticks = log.ids, log.ticks
+        for i = log.first, log.last do
+            if(ticks[i] > base) then
+                reserve(state, at, 8)
+                ffi.cast(id_ptr, state.buffer + at).id = ids[i]
+                at = at + 8
+                removed = removed + 1
+            end
+        end
+        if(count == 0 and removed == 0) then return nil end
+    end
+
+    local h = ffi.cast(header_ptr, state.buffer)
+    h.magic[0], h.magic[1] = 84, 82     -- "TR"
+    h.version, h.flags = VERSION, full and FULL or 0
+    h.tick, h.base = tick, full and 0 or base
+    h.count, h.removed = count, removed
+
+    local stats = repl.stats
+    stats.frames, stats.bytes, stats.entities = stats.frames + 1, stats.bytes + at, stats.entities + count
+    if(full) then stats.full = stats.full + 1 end
+    return ffi.string(state.buffer, at)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Apply a frame to mirror (id -> { pos, rot, scale, props... }). Returns the tick to ack.
+repl.decode = function(data, mirror)
+
+    local ptr = ffi.cast("const uint8_t *", data)
+    local h = ffi.cast(header_ptr, ptr)
+    assert(h.magic[0] == 84 and h.magic[1] == 82 and h.version == VERSION, "Not a replication frame.")
+    if(h.flags % 2 == FULL) then
+        for id in pairs(mirror) do mirror[id] = nil end
+    end
+
+    local at = HEADER_SIZE
+    local ps, ss = 1.0 / repl.pos_scale, 1.0 / repl.scale_scale
+    for i = 1, h.count do
+        local rec = ffi.cast(record_ptr, ptr + at)
+        local id, mask = rec.id, rec.mask
+        at = at + RECORD_SIZE
+        local e = mirror[id]
+        if(e == nil) then e = { id = id }; mirror[id] = e end
+        if(mask % 2 == 1) then
+            local q = ffi.cast(pos_ptr, ptr + at)
+            e.pos = { x = q.x * ps, y = q.y * ps, z = q.z * ps }
+            at = at + POS_SIZE
+        end
+        if(mask % 4 >= ROT) then
+            local q = ffi.cast(rot_ptr, ptr + at)
+            local a, b, c = q.a / ROT_RANGE, q.b / ROT_RANGE, q.c / ROT_RANGE
+            local l = sqrt(math.max(0, 1 - a * a - b * b - c * c))
+            local largest = q.largest
+            if(largest == 0) then e.rot = { x = l, y = a, z = b, w = c }
+            elseif(largest == 1) then e.rot = { x = a, y = l, z = b, w = c }
+            elseif(largest == 2) then e.rot = { x = a, y = b, z = l, w = c }
+            else e.rot = { x = a, y = b, z = c, w = l } end
+            at = at + ROT_SIZE
+        end
+        if(mask % 8 >= SCALE) then
+            local q = ffi.cast(scale_ptr, ptr + at)
+            e.scale = { q.x * ss, q.y * ss, q.z * ss }
+            at = at + SCALE_SIZE
+        end
+        if(mask >= PROPS) then
+            local len = ffi.cast(len_ptr, ptr + at).len
+            local props = msgpack.unpack(string.sub(data, at + 5, at + 4 + len))
+            local unset = props._unset
+            props._unset = nil
+            for name, v in pairs(props) do e[name] = v end
+            if(unset) then
+                for j = 1, #unset do e[unset[j]] = nil end
+            end
+            at = at + 4 + len
+        end
+    end
+    for i = 1, h.removed do
+        mirror[ffi.cast(id_ptr, ptr + at).id] = nil
+        at = at + 8
+    end
+    return h.tick
+end
+
+------------------------------------------------------------------------------------------------------------
+
+return repl
+
+------------------------------------------------------------------------------------------------------------
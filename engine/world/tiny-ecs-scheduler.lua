@@ -0,0 +1,441 @@
+------------------------------------------------------------------------------------------------------------
+-- Parallel system scheduler (tiny-ecs companion)
+--
+-- Decription: Systems with a parallel body run on worker threads over the chunk store of their
+--             world (see tiny-ecs-chunks). They declare which hot components they read and write:
+--
+--                 local mover = tiny.system({
+--                     reads   = { "velocity" },
+--                     writes  = { "position" },
+--                     parallel = [[
+--                         return function(cols, count, dt)
+--                             local p, v = cols.position, cols.velocity
+--                             for i = 0, count - 1 do p[i].x = p[i].x + v[i].x * dt end
+--                         end
+--                     ]],
+--                 })
+--
+--             tiny.update hands each run of consecutive parallel systems to scheduler.update. It
+--             orders them into levels (a system goes after every earlier system it conflicts
+--             with: one writes what the other reads or writes), and each level runs as one batch
+--             of chunk tasks shared by the worker threads and the calling thread. The end of a
+--             level is a sync point: preProcess / postProcess of its systems run there, on the
+--             main state, and are where per frame results get merged back.
+--
+--             The parallel body is Lua source. Every worker has its own lua_State, so the body
+--             only sees ffi, plain Lua and cols (component name -> column pointer for one chunk).
+--             It must not touch the store or the world, and nothing may change the store
+--             structure (spawn, despawn, set, unset) while a level runs.
+--             Without threads (scheduler.threads 0, the default, or workers.available false) the
+--             same bodies run on the main state.
+--             Worlds own their threads: scheduler.shutdown(world) stops them (world-manager and
+--             tiny.clearSystems call it), and a world that is just dropped stops them when its
+--             pool is collected.
+------------------------------------------------------------------------------------------------------------
+
+local ffi           = require("ffi")
+local chunks        = require("engine.world.tiny-ecs-chunks")
+local workers       = require("lua.engine.workers")
+
+local tinsert       = table.insert
+local tconcat       = table.concat
+
+------------------------------------------------------------------------------------------------------------
+
+local scheduler = {
+    threads         = 0,        -- Worker threads per world. 0: run on the main state, "auto": one
+                                --   less than the online cpus (at most max_threads)
+    max_threads     = 4,
+    max_columns     = 8,        -- Components a parallel system can use
+    stats           = { batches = 0, levels = 0, tasks = 0 },
+}
+
+------------------------------------------------------------------------------------------------------------
+-- Shared between the main state and the worker states. The pthread types are opaque here, the
+--   buffers are larger than pthread_mutex_t / pthread_cond_t on Linux and macOS.
+local sched_cdefs = [[
+typedef struct sched_task {
+    int32_t         system;         // body id
+    int32_t         count;
+    const char      *source;        // body source (kept alive by the main state)
+    size_t          source_len;
+    double          dt;
+    void            *columns[8];
+} sched_task;
+
+typedef struct sched_pool {
+    int64_t         mutex[16];
+    int64_t         wake[16];       // workers wait here for a new generation
+    int64_t         done[16];       // the main thread waits here for pending == 0
+    int32_t         generation;
+    int32_t         quit;
+    int32_t         ntasks;
+    int32_t         next;
+    int32_t         pending;
+    int32_t         failed;
+    sched_task      *tasks;
+    char            error[256];
+} sched_pool;
+
+int sched_mutex_init(void *m, const void *attr) __asm__("pthread_mutex_init");
+int sched_mutex_destroy(void *m) __asm__("pthread_mutex_destroy");
+int sched_mutex_lock(void *m) __asm__("pthread_mutex_lock");
+int sched_mutex_unlock(void *m) __asm__("pthread_mutex_unlock");
+int sched_cond_init(void *c, const void *attr) __asm__("pthread_cond_init");
+int sched_cond_destroy(void *c) __asm__("pthread_cond_destroy");
+int sched_cond_wait(void *c, void *m) __asm__("pthread_cond_wait");
+int sched_cond_signal(void *c) __asm__("pthread_cond_signal");
+int sched_cond_broadcast(void *c) __asm__("pthread_cond_broadcast");
+]]
+
+ffi.cdef(sched_cdefs)
+ffi.cdef[[ long sched_sysconf(int name) __asm__("sysconf"); ]]
+
+------------------------------------------------------------------------------------------------------------
+-- Task runner, the same source runs in the worker states and in the main state. Bodies are
+--   compiled on first use and cached by id.
+local runner_source = [[
+local ffi = require("ffi")
+local C = ffi.C
+local bodies = {}
+
+local function call_body(task)
+    local id = task.system
+    local body = bodies[id]
+    if(body == nil) then
+        body = assert(loadstring(ffi.string(task.source, task.source_len)))()
+        bodies[id] = body
+    end
+    body(task)
+end
+
+local function run_task(pool, task)
+    local ok, err = pcall(call_body, task)
+    if(not ok) then
+        C.sched_mutex_lock(pool.mutex)
+        if(pool.failed == 0) then ffi.copy(pool.error, tostring(err):sub(1, 255)) end
+        pool.failed = pool.failed + 1
+        C.sched_mutex_unlock(pool.mutex)
+    end
+end
+
+-- Take tasks until the generation is used up. Called with the mutex held, returns with it held.
+local function drain(pool)
+    while(pool.next < pool.ntasks) do
+        local t = pool.next
+        pool.next = t + 1
+        C.sched_mutex_unlock(pool.mutex)
+        run_task(pool, pool.tasks[t])
+        C.sched_mutex_lock(pool.mutex)
+        pool.pending = pool.pending - 1
+        if(pool.pending == 0) then C.sched_cond_signal(pool.done) end
+    end
+end
+
+local function worker(arg)
+    local pool = ffi.cast("sched_pool *", arg)
+    local seen = 0
+    C.sched_mutex_lock(pool.mutex)
+    while(true) do
+        while(pool.generation == seen and pool.quit == 0) do C.sched_cond_wait(pool.wake, pool.mutex) end
+        if(pool.quit ~= 0) then break end
+        seen = pool.generation
+        drain(pool)
+    end
+    C.sched_mutex_unlock(pool.mutex)
+end
+
+-- Without threads: run the tasks here, errors go straight to the caller
+local function serial(pool)
+    for t = 0, pool.ntasks - 1 do call_body(pool.tasks[t]) end
+end
+
+return worker, drain, serial
+]]
+
+-- Worker thread body for workers.spawn (the worker function only)
+local worker_body = "return (assert(loadstring("..string.format("%q", runner_source).."))())"
+
+------------------------------------------------------------------------------------------------------------
+
+local function cpu_count()
+    if(ffi.os == "Windows") then return 1 end
+    local name = (ffi.os == "OSX") and 58 or 84     -- _SC_NPROCESSORS_ONLN
+    local ok, n = pcall(ffi.C.sched_sysconf, name)
+    if(ok and n > 0) then return tonumber(n) end
+    return 1
+end
+
+-- Components a system uses, in column order
+local function system_columns(system)
+
+    local names, seen = {}, {}
+    for i, list in ipairs({ system.components or {}, system.reads or {}, system.writes or {} }) do
+        for j, name in ipairs(list) do
+            if(seen[name] == nil) then
+                assert(chunks.components[name], "Unknown component: "..name)
+                seen[name] = true
+                tinsert(names, name)
+            end
+        end
+    end
+    assert(#names <= scheduler.max_columns, "Too many components in a parallel system.")
+    return names
+end
+
+-- Wrap the parallel source of a system into a task body: cdefs of its components, column
+--   pointers cast to their types and handed over as cols.
+local body_ids = 0
+local function compile_system(system)
+
+    local names = system_columns(system)
+    local code = { 'local ffi = require("ffi")' }
+    for i, name in ipairs(names) do
+        local comp = chunks.components[name]
+        tinsert(code, string.format('if(not pcall(ffi.typeof, "%s")) then ffi.cdef("typedef struct %s { %s } %s;") end',
+            comp.ctype, comp.ctype, comp.decl, comp.ctype))
+    end
+    tinsert(code, "local body = assert(loadstring("..string.format("%q", system.parallel).."))()")
+    tinsert(code, "local cols = {}")
+    tinsert(code, "local types = {")
+    for i, name in ipairs(names) do
+        tinsert(code, string.format('    ffi.typeof("%s *"),', chunks.components[name].ctype))
+    end
+    tinsert(code, "}")
+    tinsert(code, "return function(task)")
+    for i, name in ipairs(names) do
+        tinsert(code, string.format('    cols.%s = ffi.cast(types[%d], task.columns[%d])', name, i, i - 1))
+    end
+    tinsert(code, "    body(cols, task.count, task.dt)")
+    tinsert(code, "end")
+
+    body_ids = body_ids + 1
+    local compiled = {
+        id          = body_ids,
+        parallel    = system.parallel,
+        source      = tconcat(code, "\n"),
+        columns     = names,
+        required    = names,
+        rejected    = system.rejectComponents,
+    }
+    system.scheduled = compiled
+    return compiled
+end
+
+local function system_compiled(system)
+    local compiled = system.scheduled
+    if(compiled == nil or compiled.parallel ~= system.parallel) then compiled = compile_system(system) end
+    return compiled
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Per world pool: the shared struct, the threads and the main state runner.
+
+-- Tell the threads to quit and wait for them. The shared struct has to outlive them, so this
+--   runs before it is freed (shutdown, or its gc finalizer).
+local function stop_threads(shared, threads)
+
+    ffi.C.sched_mutex_lock(shared.mutex)
+    shared.quit = 1
+    ffi.C.sched_cond_broadcast(shared.wake)
+    ffi.C.sched_mutex_unlock(shared.mutex)
+    for i, thread in ipairs(threads) do workers.join(thread) end
+    ffi.C.sched_cond_destroy(shared.wake)
+    ffi.C.sched_cond_destroy(shared.done)
+    ffi.C.sched_mutex_destroy(shared.mutex)
+end
+
+local function thread_count()
+    local count = scheduler.threads or 0
+    if(count == "auto") then count = math.min(cpu_count() - 1, scheduler.max_threads) end
+    return count
+end
+
+local function new_pool(world)
+
+    local pool = {
+        shared      = ffi.new("sched_pool"),
+        tasks       = nil,
+        capacity    = 0,
+        threads     = {},
+    }
+    local runner, drain, serial = assert(loadstring(runner_source))()
+    pool.drain, pool.serial = drain, serial
+
+    local count = thread_count()
+    if(workers.available and count > 0) then
+        local shared, threads = pool.shared, pool.threads
+        ffi.C.sched_mutex_init(shared.mutex, nil)
+        ffi.C.sched_cond_init(shared.wake, nil)
+        ffi.C.sched_cond_init(shared.done, nil)
+        pool.synced = true
+        for i = 1, count do
+            local thread, err = workers.spawn(sched_cdefs, worker_body, shared)
+            if(thread == nil) then
+                pprint("[Error scheduler] "..err)
+                break
+            end
+            tinsert(threads, thread)
+        end
+        -- A dropped world: stop the threads before the struct they wait on goes away
+        ffi.gc(shared, function(s) stop_threads(s, threads) end)
+    end
+    world.scheduler = pool
+    return pool
+end
+
+-- Stop the worker threads of a world (they are started again on the next update).
+scheduler.shutdown = function(world)
+
+    local pool = world.scheduler
+    if(pool == nil) then return end
+    world.scheduler = nil
+    if(not pool.synced) then return end
+    local shared = pool.shared
+    ffi.gc(shared, nil)
+    stop_threads(shared, pool.threads)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Levels for systems in update order. A system goes one level after the latest earlier system
+--   it conflicts with.
+local function conflicts(a, b)
+
+    local function any(list, set)
+        for i, name in ipairs(list or {}) do
+            if(set[name]) then return true end
+        end
+        return false
+    end
+    return any(a.writes, b.touch) or any(b.writes, a.touch)
+end
+
+local function build_levels(batch)
+
+    local levels, nodes = {}, {}
+    for i, system in ipairs(batch) do
+        local writes = system.writes
+        -- No declared sets: treat it as writing everything it uses
+        if(system.reads == nil and writes == nil) then writes = system_compiled(system).columns end
+        local touch = {}
+        for j, name in ipairs(system.reads or {}) do touch[name] = true end
+        for j, name in ipairs(writes or {}) do touch[name] = true end
+        local node = { system = system, writes = writes, touch = touch, level = 1 }
+        for j = 1, i - 1 do
+            local other = nodes[j]
+            if(other.level >= node.level and conflicts(other, node)) then node.level = other.level + 1 end
+        end
+        nodes[i] = node
+        levels[node.level] = levels[node.level] or {}
+        tinsert(levels[node.level], system)
+    end
+    return levels
+end
+
+------------------------------------------------------------------------------------------------------------
+
+local function grow_tasks(pool, count)
+    if(count <= pool.capacity) then return end
+    local capacity = math.max(64, pool.capacity * 2, count)
+    pool.tasks = ffi.new("sched_task[?]", capacity)
+    pool.capacity = capacity
+    pool.shared.tasks = pool.tasks
+end
+
+-- Fill the task list for one level, one task per non empty chunk per system
+local function level_tasks(pool, store, level, dt)
+
+    local count = 0
+    for i, system in ipairs(level) do
+        local compiled = system_compiled(system)
+        local archetypes = chunks.query(store, compiled.required, compiled.rejected)
+        for a = 1, #archetypes do
+            local list = archetypes[a].chunks
+            for c = 1, #list do
+                if(list[c].count > 0) then count = count + 1 end
+            end
+        end
+    end
+    grow_tasks(pool, count)
+
+    local n = 0
+    for i, system in ipairs(level) do
+        local compiled = system_compiled(system)
+        local archetypes = chunks.query(store, compiled.required, compiled.rejected)
+        for a = 1, #archetypes do
+            local list = archetypes[a].chunks
+            for c = 1, #list do
+                local chunk = list[c]
+                if(chunk.count > 0) then
+                    local task = pool.tasks[n]
+                    task.system = compiled.id
+                    task.count = chunk.count
+                    task.source = compiled.source
+                    task.source_len = #compiled.source
+                    task.dt = dt
+                    for k, name in ipairs(compiled.columns) do task.columns[k - 1] = chunk.columns[name] end
+                    n = n + 1
+                end
+            end
+        end
+    end
+    return n
+end
+
+-- Run the tasks of one generation on the pool threads and this one, return when all are done.
+local function run_level(pool, ntasks)
+
+    local shared = pool.shared
+    if(#pool.threads == 0) then
+        shared.ntasks = ntasks
+        pool.serial(shared)
+        return
+    end
+    local C = ffi.C
+    C.sched_mutex_lock(shared.mutex)
+    shared.ntasks = ntasks
+    shared.next = 0
+    shared.pending = ntasks
+    shared.generation = shared.generation + 1
+    C.sched_cond_broadcast(shared.wake)
+    pool.drain(shared)
+    while(shared.pending > 0) do C.sched_cond_wait(shared.done, shared.mutex) end
+    local failed = shared.failed
+    shared.failed = 0
+    C.sched_mutex_unlock(shared.mutex)
+    if(failed > 0) then
+        error("[Error scheduler] "..failed.." tasks failed: "..ffi.string(shared.error))
+    end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Run a batch of parallel systems (update order) for one frame.
+scheduler.update = function(world, batch, dt)
+
+    local store = chunks.store(world)
+    local pool = world.scheduler or new_pool(world)
+    local levels = build_levels(batch)
+    local stats = scheduler.stats
+    stats.batches = stats.batches + 1
+
+    for l, level in ipairs(levels) do
+        for i, system in ipairs(level) do
+            if(system.preProcess) then system:preProcess(dt) end
+        end
+        local ntasks = level_tasks(pool, store, level, dt)
+        if(ntasks > 0) then run_level(pool, ntasks) end
+        -- Sync point
+        for i, system in ipairs(level) do
+            if(system.postProcess) then system:postProcess(dt) end
+        end
+        stats.levels = stats.levels + 1
+        stats.tasks = stats.tasks + ntasks
+    end
+    return #levels
+end
+
+------------------------------------------------------------------------------------------------------------
+
+return scheduler
+
+------------------------------------------------------------------------------------------------------------
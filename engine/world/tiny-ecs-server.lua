@@ -23,7 +23,10 @@ local dirtools      = require("tools.vfs.dirtools")
 local socket        = require("socket.core")
 local copas         = require("copas")
 local cmds          = require("engine.world.tiny-ecs-commands")
+local repl          = require("engine.world.tiny-ecs-replication")
+local msgpack       = require("lua.msgpack")
 local websocket     = require("websocket")
+local wsframe       = require("websocket.frame")
                       require("utf8")
 
 base_www_path       = "editor/www/"
@@ -40,6 +43,9 @@ local tinyserver	= {
     entities            = {},
     entities_lookup     = {},
     cameras_lookup      = {},
+    go_lookup           = {},   -- game object -> entity id
+    changed             = {},   -- entity id -> entity, changed since the last server update
+    replication         = repl.new(nil),    -- binary delta frames for "repl" websocket clients
     
     change_camera       = nil,
     current_camera      = "camera",
@@ -62,7 +68,7 @@ tinyserver.host            = "127.0.0.1"
 
 BACKLOG                        = 5
 
-tinyserver.updateRate     = 1.0  -- per second
+tinyserver.updateRate     = 1.0  -- replication frames per second
 tinyserver.lastUpdate     = 0.0 
 
 ------------------------------------------------------------------------------------------------------------
@@ -97,9 +103,14 @@ ws_create = function( port )
                 cmds = function(ws)
 
                     while true do
-                        local message = ws:receive()
+                        local message, opcode = ws:receive()
                         if message then
-                            local message = json.decode(message)
+                            -- Binary messages are msgpack, text is json
+                            if(opcode == wsframe.BINARY) then 
+                                message = msgpack.unpack(message)
+                            else
+                                message = json.decode(message)
+                            end
                             cmds.process_command(ws, message)
                             local outstr = json.encode({ Hello = "World"})
                             ws:send( outstr )
@@ -108,7 +119,40 @@ ws_create = function( port )
                             return
                         end
                     end
-                end
+                end,
+
+                -- Entity replication: the server pushes binary delta frames (see 
+                --   tiny-ecs-replication) at updateRate, the client answers each with its tick.
+                --   Server side only for now, no client in the repo connects to it yet.
+                repl = function(ws)
+
+                    local state = tinyserver.replication
+                    local client = repl.client(state, ws)
+                    -- Sleeps until replicate() hands it a frame (or the client goes)
+                    client.sender = copas.addthread(function()
+                        while state.clients[ws] == client do
+                            local frame = client.pending
+                            if(frame) then 
+                                client.pending = nil
+                                ws:send(frame, wsframe.BINARY)
+                            else
+                                copas.pauseforever()
+                            end
+                        end
+                    end)
+
+                    while true do
+                        local message = ws:receive()
+                        if message then
+                            repl.ack(state, ws, message)
+                        else
+                            repl.drop(state, ws)
+                            copas.wakeup(client.sender)
+                            ws:close()
+                            return
+                        end
+                    end
+                end,
             },
 
             on_error = function( err )
@@ -172,7 +216,7 @@ local function startServer( host, port )
 end 
 
 ------------------------------------------------------------------------------------------------------------
--- This occurs on every entity 
+-- This occurs on every changed entity (the world system is onlyChanged)
 tinyserver.entitySystemProc = function(self, e, dt)
 
     if(tinyserver.update == false) then return end 
@@ -183,6 +227,7 @@ tinyserver.entitySystemProc = function(self, e, dt)
         local idx = tinyserver.entities_lookup[e.id]
         if(idx) then 
             tinyserver.entities[idx] = e
+            tinyserver.changed[e.id] = e
             -- Check for pos/rot updates - check for gamne object 
             if(e.go) then 
                 local go = {} --gameobject.get_go(e.go)
@@ -208,19 +253,56 @@ end
 
 ------------------------------------------------------------------------------------------------------------
 
-tinyserver.setEntities = function(  entities, entities_lookup, cameras_lookup )
+tinyserver.setEntities = function(  entities, entities_lookup, cameras_lookup, go_lookup )
     tinyserver.entities = entities
     tinyserver.entities_lookup = entities_lookup
     tinyserver.cameras_lookup = cameras_lookup
+    tinyserver.go_lookup = go_lookup or {}
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Editor commands find entities by id and flag what they change (replication picks it up)
+cmds.find_entity = function( id )
+    local idx = tinyserver.entities_lookup[id]
+    return idx and tinyserver.entities[idx]
+end
+
+cmds.entity_changed = function( entity, component )
+    if(tinyserver.current_world) then 
+        tiny.markChanged(tinyserver.current_world, entity, component)
+    end
+end
+
+------------------------------------------------------------------------------------------------------------
+
+-- Entity removed from the world (replication clients drop it)
+tinyserver.entityRemoved = function( eid )
+    repl.removed(tinyserver.replication, eid)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Build this tick's replication frames. Clients on the same baseline share a frame.
+tinyserver.replicate = function( world )
+
+    local state = tinyserver.replication
+    repl.setWorld(state, world)
+    if(world == nil or next(state.clients) == nil) then return end
+    local cache = {}
+    for key, client in pairs(state.clients) do
+        local frame = repl.encode(state, key, cache)
+        if(frame) then 
+            client.pending = frame
+            if(client.sender) then copas.wakeup(client.sender) end
+        end
+    end
 end
 
 ------------------------------------------------------------------------------------------------------------
 
 tinyserver.findGo = function( go )
-    for k,v in pairs(tinyserver.entities) do 
-        if (v.go == go) then return v end 
-    end 
-    return nil
+    local id = tinyserver.go_lookup[go]
+    if(id == nil) then return nil end
+    return tinyserver.entities[tinyserver.entities_lookup[id]]
 end
 
 ------------------------------------------------------------------------------------------------------------
@@ -240,7 +322,7 @@ end
 
 ------------------------------------------------------------------------------------------------------------
 
-tinyserver.update = function ()
+tinyserver.update = function ( dt )
     if(tinyserver.change_camera) then 
         print('Changing camera to: '..tinyserver.change_camera)
         -- msg.post(tinyserver.current_camera, "release_camera_focus")
@@ -255,8 +337,16 @@ tinyserver.update = function ()
     tinyserver.deltas = fps.deltas()
 
     cmds.process_queue()
+
+    -- Replication is batched at updateRate, not sent every frame
+    tinyserver.lastUpdate = tinyserver.lastUpdate + (dt or 0)
+    if(tinyserver.lastUpdate >= 1.0 / tinyserver.updateRate) then 
+        tinyserver.lastUpdate = 0.0
+        tinyserver.replicate(tinyserver.current_world)
+    end
     
     http_server.update()
+    tinyserver.changed = {}
 end
 
 ------------------------------------------------------------------------------------------------------------
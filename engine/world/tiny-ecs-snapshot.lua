@@ -0,0 +1,598 @@
+------------------------------------------------------------------------------------------------------------
+-- World snapshots (tiny-ecs companion)
+--
+-- Decription: Saves the entities of a tiny world as columns instead of json. Every component field
+--             (path from the entity down nested tables, like pos.x) is a column with one value per
+--             entity: numbers are doubles, strings are indices into one string table, booleans and
+--             "is a table" markers are bytes. The file is
+--
+--                 header | string offsets | string bytes | column directory | column blocks
+--
+--             Each block is written with one fwrite straight from its FFI array, and snapshots are
+--             memory mapped back: snapshot.open gives typed pointers into the map with no parsing,
+--             snapshot.entities / snapshot.load rebuild the entity tables a column at a time.
+--
+--             Hot components kept in archetype chunks (tiny-ecs-chunks) are one block per component,
+--             the raw structs in entity order, and go back into a chunk store on load.
+--             Nested tables with numeric keys past snapshot.max_index (long arrays, sparse or float
+--             keys) would need a column per key, they are stored whole as msgpack strings instead.
+--
+--             Functions, userdata, cdata and keys starting with _ (runtime state like chunk slots)
+--             are not saved, and neither are the names in snapshot.skip. Tables nested deeper than
+--             snapshot.depth or seen twice in one entity (cycles) are cut off. Entities that refer
+--             to each other should do it by id, a table reference would be saved as a copy.
+--             Every offset in a file is checked against its size when it is opened.
+------------------------------------------------------------------------------------------------------------
+
+local ffi           = require("ffi")
+local vfs           = require("tools.vfs.vfs")
+local msgpack       = require("lua.msgpack")
+local chunks        = require("engine.world.tiny-ecs-chunks")
+
+local tinsert       = table.insert
+
+-- Presized tables for loading (plain tables when table.new is missing)
+local ok, tnew      = pcall(require, "table.new")
+if(not ok) then tnew = function() return {} end end
+
+------------------------------------------------------------------------------------------------------------
+
+ffi.cdef[[
+typedef struct snap_header {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    count;              // entities
+    uint32_t    columns;
+    uint32_t    strings;
+    uint32_t    pad;
+    uint64_t    strings_offset;     // uint32 offsets, strings + 1 of them
+    uint64_t    blob_offset;
+    uint64_t    blob_size;
+    uint64_t    columns_offset;     // snap_column directory
+    uint64_t    size;
+} snap_header;
+
+typedef struct snap_column {
+    double      key;                // numeric key (name is NO_NAME), struct size of a component
+    uint32_t    name;               // string index of the key
+    int32_t     parent;             // table column this field is in, -1 for the entity, -2 chunks
+    uint32_t    kind;
+    uint32_t    decl;               // string index of a component declaration
+    uint64_t    offset;             // count values
+    uint64_t    present;            // count bytes, numbers only, 0 when every entity has it
+} snap_column;
+
+void *snap_fopen(const char *path, const char *mode) __asm__("fopen");
+size_t snap_fwrite(const void *ptr, size_t size, size_t count, void *file) __asm__("fwrite");
+int snap_fclose(void *file) __asm__("fclose");
+]]
+
+local MAGIC         = "TSNP"
+local VERSION       = 2
+local NO_NAME       = 0xFFFFFFFF
+local ALIGN         = 8
+local ENTITY, CHUNKS = -1, -2
+
+-- PACKED: string index of a msgpack string, COMPONENT: raw structs of a chunk component
+local NUMBER, STRING, BOOL, TABLE, PACKED, COMPONENT = 1, 2, 3, 4, 5, 6
+local kinds         = { number = NUMBER, string = STRING, boolean = BOOL, table = TABLE }
+local kind_names    = { "number", "string", "boolean", "table", "packed", "component" }
+
+local double_array  = ffi.typeof("double[?]")
+local uint32_array  = ffi.typeof("uint32_t[?]")
+local uint8_array   = ffi.typeof("uint8_t[?]")
+local kind_ctype    = { "double", "uint32_t", "uint8_t", "uint8_t", "uint32_t" }
+local kind_ptr      = {
+    ffi.typeof("const double *"), ffi.typeof("const uint32_t *"),
+    ffi.typeof("const uint8_t *"), ffi.typeof("const uint8_t *"),
+    ffi.typeof("const uint32_t *"), ffi.typeof("const uint8_t *"),
+}
+
+------------------------------------------------------------------------------------------------------------
+
+local snapshot = {
+    depth           = 8,        -- Nested table levels saved
+    max_index       = 16,       -- Numeric keys above this (or not 1, 2, 3 ..) pack their table
+    skip            = { spatial_id = true },   -- Entity fields not saved (runtime handles)
+}
+
+------------------------------------------------------------------------------------------------------------
+-- Save
+
+local intern
+
+local function new_column(state, parent, key, kind)
+
+    local count = state.count
+    local col = {
+        index   = #state.columns,
+        parent  = parent,
+        key     = key,
+        kind    = kind,
+        filled  = 0,
+        name    = type(key) == "string" and intern(state, key) or NO_NAME,
+    }
+    if(kind == NUMBER) then
+        col.data = double_array(count)
+        col.present = uint8_array(count)
+    elseif(kind == STRING or kind == PACKED) then
+        col.data = uint32_array(count)
+        ffi.fill(col.data, count * 4, 0xFF)
+    elseif(kind == BOOL) then
+        col.data = uint8_array(count)
+        ffi.fill(col.data, count, 0xFF)
+    else
+        col.data = uint8_array(count)
+        col.kids = { {}, {}, {}, {}, {} }
+    end
+    tinsert(state.columns, col)
+    parent.kids[kind][key] = col
+    return col
+end
+
+intern = function(state, str)
+    local idx = state.lookup[str]
+    if(idx == nil) then
+        idx = #state.strings
+        state.strings[idx + 1] = str
+        state.lookup[str] = idx
+    end
+    return idx
+end
+
+-- Hot components of an entity in a chunk: a column of structs per component
+local function save_chunk(state, chunk, slot, i)
+
+    for name, src in pairs(chunk.columns) do
+        local col = state.components[name]
+        if(col == nil) then
+            local comp = chunks.components[name]
+            col = {
+                index   = #state.columns,
+                parent  = state.chunks,
+                key     = comp.size,
+                kind    = COMPONENT,
+                filled  = 0,
+                name    = intern(state, name),
+                decl    = intern(state, comp.decl),
+                size    = comp.size,
+                data    = comp.array(state.count),
+                present = uint8_array(state.count),
+            }
+            tinsert(state.columns, col)
+            state.components[name] = col
+        end
+        col.data[i] = src[slot]
+        col.present[i] = 1
+        col.filled = col.filled + 1
+    end
+end
+
+-- A table with numeric keys that would each need a column
+local function needs_packing(tbl)
+    local max = snapshot.max_index
+    for k in pairs(tbl) do
+        if(type(k) == "number" and (k < 1 or k > max or k % 1 ~= 0)) then return true end
+    end
+    return false
+end
+
+local function save_fields(state, node, tbl, i, depth, visiting)
+
+    local kids, root = node.kids, node == state.root
+    for k, v in pairs(tbl) do
+        local kind = kinds[type(v)]
+        local tk = type(k)
+        if(kind and (tk == "number" or (tk == "string"
+            and not (root and (snapshot.skip[k] or string.byte(k) == 95))))) then     -- 95: _
+            local packed = nil
+            if(kind == TABLE and needs_packing(v)) then
+                local ok, data = pcall(msgpack.pack, v)
+                kind, packed = PACKED, ok and data or nil
+            end
+            local col = kids[kind][k] or new_column(state, node, k, kind)
+            if(kind == NUMBER) then
+                col.data[i] = v
+                col.present[i] = 1
+                col.filled = col.filled + 1
+            elseif(kind == STRING) then
+                col.data[i] = intern(state, v)
+            elseif(kind == PACKED) then
+                if(packed) then col.data[i] = intern(state, packed) end
+            elseif(kind == BOOL) then
+                col.data[i] = v and 1 or 0
+            elseif(depth < snapshot.depth and not visiting[v]) then
+                col.data[i] = 1
+                visiting[v] = true
+                save_fields(state, col, v, i, depth + 1, visiting)
+                visiting[v] = nil
+            end
+        end
+    end
+end
+
+local function fwrite(state, ptr, bytes)
+    if(bytes > 0 and ffi.C.snap_fwrite(ptr, 1, bytes, state.file) ~= bytes) then state.failed = true end
+    state.pos = state.pos + bytes
+end
+
+local zeros = uint8_array(ALIGN)
+local function pad(state)
+    local rem = state.pos % ALIGN
+    if(rem > 0) then fwrite(state, zeros, ALIGN - rem) end
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Write the entities of a world (or a list of entities) to path, with their chunk components.
+--   Returns stats { count, columns, strings, size } or nil and an error.
+snapshot.save = function(path, source)
+
+    local entities = source.entities or source
+    local count = #entities
+    local state = {
+        count       = count,
+        columns     = {},
+        strings     = {},
+        lookup      = {},
+        root        = { kids = { {}, {}, {}, {}, {} } },
+        chunks      = { index = CHUNKS },
+        components  = {},
+        pos         = 0,
+    }
+    local visiting = {}
+    for i = 1, count do
+        local entity = entities[i]
+        save_fields(state, state.root, entity, i - 1, 1, visiting)
+        if(entity._chunk) then save_chunk(state, entity._chunk, entity._slot, i - 1) end
+    end
+
+    -- String table
+    local nstrings = #state.strings
+    local offsets = uint32_array(nstrings + 1)
+    local size = 0
+    for i = 1, nstrings do
+        offsets[i - 1] = size
+        size = size + #state.strings[i]
+    end
+    offsets[nstrings] = size
+    local blob = table.concat(state.strings)
+
+    -- Directory (block offsets are known up front, everything is written in order)
+    local columns = state.columns
+    local ncolumns = #columns
+    local header = ffi.new("snap_header")
+    local dir = ffi.new("snap_column[?]", math.max(ncolumns, 1))
+    local function aligned(n) return n + (ALIGN - n % ALIGN) % ALIGN end
+    local at = ffi.sizeof("snap_header")
+    header.strings_offset = at
+    at = at + (nstrings + 1) * 4
+    header.blob_offset, header.blob_size = at, #blob
+    at = aligned(at + #blob)
+    header.columns_offset = at
+    at = at + ncolumns * ffi.sizeof("snap_column")
+    for c = 1, ncolumns do
+        local col, d = columns[c], dir[c - 1]
+        d.key, d.name = type(col.key) == "number" and col.key or 0, col.name
+        d.parent = col.parent.index or ENTITY
+        d.kind = col.kind
+        d.decl = col.decl or 0
+        col.bytes = count * (col.size or ffi.sizeof(kind_ctype[col.kind]))
+        d.offset = at
+        at = aligned(at + col.bytes)
+        if((col.kind == NUMBER or col.kind == COMPONENT) and col.filled < count) then
+            d.present = at
+            at = aligned(at + count)
+        else
+            col.present = nil
+        end
+    end
+    ffi.copy(header.magic, MAGIC, 4)
+    header.version, header.count, header.columns, header.strings = VERSION, count, ncolumns, nstrings
+    header.size = at
+
+    state.file = ffi.C.snap_fopen(path, "wb")
+    if(state.file == nil) then return nil, "cannot create snapshot: "..path end
+    fwrite(state, header, ffi.sizeof("snap_header"))
+    fwrite(state, offsets, (nstrings + 1) * 4)
+    fwrite(state, blob, #blob)
+    pad(state)
+    fwrite(state, dir, ncolumns * ffi.sizeof("snap_column"))
+    for c = 1, ncolumns do
+        local col = columns[c]
+        fwrite(state, col.data, col.bytes)
+        pad(state)
+        if(col.present) then
+            fwrite(state, col.present, count)
+            pad(state)
+        end
+    end
+    ffi.C.snap_fclose(state.file)
+    if(state.failed) then return nil, "cannot write snapshot: "..path end
+
+    return { count = count, columns = ncolumns, strings = nstrings, size = state.pos }
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Load
+
+-- Everything the directory points at has to be inside the file. Returns an error or nil.
+local function validate(header, size)
+
+    local function inside(offset, bytes) return offset >= 0 and bytes >= 0 and offset + bytes <= size end
+    local count, nstrings, ncolumns = header.count, header.strings, header.columns
+    local base = ffi.cast("const uint8_t *", header)
+
+    local strings_offset = tonumber(header.strings_offset)
+    local blob_offset, blob_size = tonumber(header.blob_offset), tonumber(header.blob_size)
+    if(not inside(strings_offset, (nstrings + 1) * 4)) then return "string offsets outside the file" end
+    if(not inside(blob_offset, blob_size)) then return "strings outside the file" end
+    local offsets = ffi.cast("const uint32_t *", base + strings_offset)
+    for i = 0, nstrings - 1 do
+        if(offsets[i] > offsets[i + 1]) then return "bad string offsets" end
+    end
+    if(offsets[nstrings] > blob_size) then return "strings past the string table" end
+
+    local columns_offset = tonumber(header.columns_offset)
+    if(not inside(columns_offset, ncolumns * ffi.sizeof("snap_column"))) then return "columns outside the file" end
+    local columns = ffi.cast("const snap_column *", base + columns_offset)
+    for c = 0, ncolumns - 1 do
+        local d = columns[c]
+        local kind, parent = d.kind, d.parent
+        if(kind < NUMBER or kind > COMPONENT) then return "bad column kind" end
+        if(kind == COMPONENT) then
+            if(parent ~= CHUNKS or d.name >= nstrings or d.decl >= nstrings
+                or d.key < 1 or d.key % 1 ~= 0) then return "bad component column" end
+        elseif(parent ~= ENTITY and (parent < 0 or parent >= c or columns[parent].kind ~= TABLE)) then
+            return "bad column parent"
+        elseif(d.name ~= NO_NAME and d.name >= nstrings) then
+            return "bad column name"
+        end
+        local width = (kind == COMPONENT) and d.key or ffi.sizeof(kind_ctype[kind])
+        if(not inside(tonumber(d.offset), count * width)) then return "column outside the file" end
+        if(d.present ~= 0 and not inside(tonumber(d.present), count)) then return "column outside the file" end
+    end
+    return nil
+end
+
+-- Map a snapshot (read whole when it cannot be mapped). Returns it or nil and an error.
+--   Pointers from it stay valid until snapshot.close.
+snapshot.open = function(path)
+
+    local base, size, map = vfs.map_file(path)
+    local data = nil
+    if(base == nil) then
+        local fh = io.open(path, "rb")
+        if(fh == nil) then return nil, "cannot open snapshot: "..path end
+        data = fh:read("*a")
+        fh:close()
+        base, size = ffi.cast("const uint8_t *", data), #data
+    end
+
+    local header = ffi.cast("const snap_header *", base)
+    local err = nil
+    if(size < ffi.sizeof("snap_header") or ffi.string(header.magic, 4) ~= MAGIC
+        or header.version ~= VERSION or tonumber(header.size) ~= size) then
+        err = "not a valid snapshot"
+    else
+        err = validate(header, size)
+    end
+    if(err) then
+        vfs.unmap_file(base, size, map)
+        return nil, err..": "..path
+    end
+
+    local snap = {
+        path        = path,
+        base        = base,
+        size        = size,
+        map         = map,
+        data        = data,
+        count       = header.count,
+        ncolumns    = header.columns,
+        nstrings    = header.strings,
+        offsets     = ffi.cast("const uint32_t *", base + header.strings_offset),
+        blob        = ffi.cast("const char *", base + header.blob_offset),
+        columns     = ffi.cast("const snap_column *", base + header.columns_offset),
+        string_cache = {},
+    }
+    return snap
+end
+
+snapshot.close = function(snap)
+    vfs.unmap_file(snap.base, snap.size, snap.map)
+    snap.base, snap.columns, snap.offsets, snap.blob, snap.data = nil, nil, nil, nil, nil
+end
+
+-- String of a string table index (cached), nil for an index past the table
+local function get_string(snap, idx)
+    local cache = snap.string_cache
+    local s = cache[idx]
+    if(s == nil) then
+        if(idx >= snap.nstrings) then return nil end
+        local offsets = snap.offsets
+        local first = offsets[idx]
+        s = ffi.string(snap.blob + first, offsets[idx + 1] - first)
+        cache[idx] = s
+    end
+    return s
+end
+snapshot.string = get_string
+
+local function column_key(snap, d)
+    if(d.name == NO_NAME) then return d.key end
+    return get_string(snap, d.name)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Column of a field path, eg. snapshot.column(snap, "pos", "x"). Returns the values (typed pointer
+--   to snap.count of them, strings as string table indices, see snapshot.string), the kind name and
+--   the presence bytes of a number column (nil when every entity has the field). nil if no entity had it. When a field held different types the
+--   first value column wins over a table column.
+snapshot.column = function(snap, ...)
+
+    local path, n = { ... }, select("#", ...)
+    local parent = -1
+    for depth = 1, n do
+        local last = depth == n
+        local found = nil
+        for c = 0, snap.ncolumns - 1 do
+            local d = snap.columns[c]
+            if(d.parent == parent and (d.kind == TABLE or last) and column_key(snap, d) == path[depth]) then
+                found = c
+                if(not last or d.kind ~= TABLE) then break end
+            end
+        end
+        if(found == nil) then return nil end
+        parent = found
+    end
+    local d = snap.columns[parent]
+    local present = nil
+    if(d.present ~= 0) then present = snap.base + d.present end
+    return ffi.cast(kind_ptr[d.kind], snap.base + d.offset), kind_names[d.kind], present
+end
+
+-- Column of a chunk component: the structs (raw bytes when the component is not registered here)
+--   and the presence bytes (nil when every entity has it). nil if no entity had it.
+snapshot.component = function(snap, name)
+
+    for c = 0, snap.ncolumns - 1 do
+        local d = snap.columns[c]
+        if(d.kind == COMPONENT and get_string(snap, d.name) == name) then
+            local present = nil
+            if(d.present ~= 0) then present = snap.base + d.present end
+            local comp = chunks.components[name]
+            if(comp and comp.size == d.key) then
+                return ffi.cast(comp.ctype.." const *", snap.base + d.offset), present
+            end
+            return snap.base + d.offset, present
+        end
+    end
+    return nil
+end
+
+-- Spawn the entities with chunk components into store, registering components it does not know.
+--   Returns nil or an error.
+local function restore_chunks(snap, entities, store)
+
+    local count, hot = snap.count, {}
+    for c = 0, snap.ncolumns - 1 do
+        local d = snap.columns[c]
+        if(d.kind == COMPONENT) then
+            local name = get_string(snap, d.name)
+            local ok, comp = pcall(chunks.component, name, get_string(snap, d.decl))
+            if(not ok or comp.size ~= d.key) then return "component layout changed: "..name end
+            local values = ffi.cast(comp.ctype.." const *", snap.base + d.offset)
+            local present = (d.present ~= 0) and snap.base + d.present or nil
+            for i = 0, count - 1 do
+                if(present == nil or present[i] ~= 0) then
+                    local comps = hot[i + 1]
+                    if(comps == nil) then comps = {}; hot[i + 1] = comps end
+                    comps[name] = values[i]
+                end
+            end
+        end
+    end
+    -- Structs are copied into the chunks, the map can go after this
+    for i = 1, count do
+        if(hot[i]) then chunks.spawn(store, hot[i], entities[i]) end
+    end
+    return nil
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Entity tables of a snapshot, built a column at a time. Chunk components are spawned into store
+--   (a new one when nil and the snapshot has any). Returns the entities and the store, or nil and
+--   an error.
+snapshot.entities = function(snap, store)
+
+    local count = snap.count
+    local base, columns = snap.base, snap.columns
+
+    -- Fields per table, to presize them
+    local sizes = { [ENTITY] = 0 }
+    for c = 0, snap.ncolumns - 1 do
+        local parent = columns[c].parent
+        sizes[parent] = (sizes[parent] or 0) + 1
+    end
+    local entities = tnew(count, 0)
+    for i = 1, count do entities[i] = tnew(0, sizes[ENTITY]) end
+
+    -- Per entity tables of every table column, parents come before their fields
+    local targets = { [ENTITY] = entities }
+    for c = 0, snap.ncolumns - 1 do
+        local d = columns[c]
+        local kind = d.kind
+        local key = column_key(snap, d)
+        local parents = targets[d.parent]
+        local values = ffi.cast(kind_ptr[kind], base + d.offset)
+        if(kind == COMPONENT) then
+            store = store or chunks.new()
+        elseif(kind == NUMBER) then
+            if(d.present == 0) then
+                for i = 0, count - 1 do parents[i + 1][key] = values[i] end
+            else
+                local present = base + d.present
+                for i = 0, count - 1 do
+                    if(present[i] ~= 0) then parents[i + 1][key] = values[i] end
+                end
+            end
+        elseif(kind == STRING) then
+            for i = 0, count - 1 do
+                local idx = values[i]
+                if(idx ~= NO_NAME) then parents[i + 1][key] = get_string(snap, idx) end
+            end
+        elseif(kind == PACKED) then
+            for i = 0, count - 1 do
+                local packed = get_string(snap, values[i])
+                if(packed) then
+                    local ok, v = pcall(msgpack.unpack, packed)
+                    if(ok) then parents[i + 1][key] = v end
+                end
+            end
+        elseif(kind == BOOL) then
+            for i = 0, count - 1 do
+                local v = values[i]
+                if(v ~= 0xFF) then parents[i + 1][key] = (v == 1) end
+            end
+        else
+            local tables, size = {}, sizes[c] or 0
+            for i = 0, count - 1 do
+                if(values[i] ~= 0) then
+                    local t = tnew(0, size)
+                    parents[i + 1][key] = t
+                    tables[i + 1] = t
+                end
+            end
+            targets[c] = tables
+        end
+    end
+    if(store) then
+        local err = restore_chunks(snap, entities, store)
+        if(err) then return nil, err end
+    end
+    return entities, store
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Load a snapshot file into world (entities are added, the world manages them on its next update,
+--   chunk components go into its store). Returns the entities and the chunk store, or nil and an
+--   error.
+snapshot.load = function(path, world)
+
+    local snap, err = snapshot.open(path)
+    if(snap == nil) then return nil, err end
+    local entities, store = snapshot.entities(snap, world and world.store)
+    snapshot.close(snap)
+    if(entities == nil) then return nil, store end
+    if(world) then
+        world.store = store
+        for i = 1, #entities do world:addEntity(entities[i]) end
+    end
+    return entities, store
+end
+
+------------------------------------------------------------------------------------------------------------
+
+return snapshot
+
+------------------------------------------------------------------------------------------------------------
@@ -25,6 +25,16 @@ CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 -- @copyright 2016
 local tiny = {}
 
+--- Optional companions, set by whoever uses them (the engine's world manager).
+-- tiny-ecs does not load them itself and works without them.
+--
+-- `tiny.chunks` is the archetype chunk storage for hot components
+-- (tiny-ecs-chunks), needed for `processChunk` Systems and to despawn the chunk
+-- data of removed Entities. `tiny.scheduler` runs `parallel` Systems on worker
+-- threads (tiny-ecs-scheduler).
+tiny.chunks = nil
+tiny.scheduler = nil
+
 -- Local versions of standard lua functions
 local tinsert = table.insert
 local tremove = table.remove
@@ -32,6 +42,8 @@ local tsort = table.sort
 local setmetatable = setmetatable
 local type = type
 local select = select
+local band, bor, bnot, lshift, rshift = bit.band, bit.bor, bit.bnot, bit.lshift, bit.rshift
+local ffi = require("ffi")
 
 -- Local versions of the library functions
 local tiny_manageEntities
@@ -41,6 +53,9 @@ local tiny_addSystem
 local tiny_add
 local tiny_removeEntity
 local tiny_removeSystem
+local tiny_markChanged
+local tiny_changedSince
+local trimChangeLog
 
 --- Filter functions.
 -- A Filter is a function that selects which Entities apply to a System.
@@ -91,6 +106,39 @@ local filterJoin
 -- A helper function to filters from string
 local filterBuildString
 
+-- Component masks of filters that can be expressed as bitmasks (see
+-- Component Types). Filter function -> { all = {}, any = {}, none = {} }.
+local filterSpecs = setmetatable({}, { __mode = "k" })
+
+-- Mask spec of a filterJoin call, or nil if it needs the filter function.
+local function filterJoinSpec(prefix, seperator, ...)
+    local spec = { all = {}, any = {}, none = {} }
+    local n = select('#', ...)
+    for i = 1, n do
+        local item = select(i, ...)
+        local sub = type(item) == 'function' and filterSpecs[item]
+        if type(item) == 'string' then
+            if prefix == '' and seperator == ' and ' then
+                spec.all[#spec.all + 1] = item
+            elseif prefix == '' then
+                spec.any[#spec.any + 1] = item
+            elseif seperator == ' or ' or n == 1 then
+                spec.none[#spec.none + 1] = item
+            else
+                return nil
+            end
+        elseif sub and prefix == '' and (seperator == ' and ' or n == 1) and
+            #sub.any == 0 then
+            -- Nested requireAll / rejectAny merge into the same masks
+            for j = 1, #sub.all do spec.all[#spec.all + 1] = sub.all[j] end
+            for j = 1, #sub.none do spec.none[#spec.none + 1] = sub.none[j] end
+        else
+            return nil
+        end
+    end
+    return spec
+end
+
 do
 
     local loadstring = loadstring or load
@@ -128,7 +176,12 @@ do
 
     function filterJoin(...)
         local state, value = pcall(filterJoinRaw, ...)
-        if state then return value else return nil, value end
+        if state then
+            filterSpecs[value] = filterJoinSpec(...)
+            return value
+        else
+            return nil, value
+        end
     end
 
     local function buildPart(str)
@@ -203,7 +256,127 @@ end
 -- @param pattern
 function tiny.filter(pattern)
     local state, value = pcall(filterBuildString, pattern)
-    if state then return value else return nil, value end
+    if not state then return nil, value end
+    -- 'a&!b&c' and 'a|b|c' have bitmask forms, anything else uses the function
+    local spec = { all = {}, any = {}, none = {} }
+    if pattern:match('^[%w_!&]+$') then
+        for invert, token in pattern:gmatch('(%!?)([%w_]+)') do
+            local list = invert == '' and spec.all or spec.none
+            list[#list + 1] = token
+        end
+        filterSpecs[value] = spec
+    elseif pattern:match('^[%w_|]+$') then
+        for token in pattern:gmatch('[%w_]+') do
+            spec.any[#spec.any + 1] = token
+        end
+        filterSpecs[value] = spec
+    end
+    return value
+end
+
+--- Component Types.
+-- Filters made by `tiny.requireAll`, `tiny.requireAny`, `tiny.rejectAll`
+-- (single component), `tiny.rejectAny` and simple `tiny.filter` patterns
+-- ('a&!b', 'a|b') are also kept as component masks. Each component name used by
+-- them is registered as a component type with its own bit. When an Entity
+-- changes, its component bitset is built once (one field check per registered
+-- type) and every System is tested with a few bitwise ops, instead of calling
+-- every System's filter function.
+--
+-- Hand written filter functions, and combinations that have no mask form
+-- (`tiny.requireAny` of sub filters, for example), are still called as before.
+-- Set `tiny.bitmaskFilters = false` to call filter functions for all Systems.
+-- @section Component
+
+tiny.bitmaskFilters = true
+
+-- Registered component types, name -> bit (0 based) and bit + 1 -> name
+local componentBits = {}
+local componentNames = {}
+
+--- Registers component types and returns the bit of the last one. Components
+-- used by mask filters are registered when their System is added, so calling
+-- this is only needed to fix the bit order.
+function tiny.registerComponent(...)
+    local bitIndex
+    for i = 1, select('#', ...) do
+        local name = select(i, ...)
+        bitIndex = componentBits[name]
+        if not bitIndex then
+            bitIndex = #componentNames
+            componentBits[name] = bitIndex
+            componentNames[bitIndex + 1] = name
+        end
+    end
+    return bitIndex
+end
+local tiny_registerComponent = tiny.registerComponent
+
+-- Mask words (32 bits each) for a list of names
+local function namesToMask(names)
+    local mask = {}
+    for i = 1, #names do
+        local bitIndex = tiny_registerComponent(names[i])
+        local w = rshift(bitIndex, 5) + 1
+        for j = #mask + 1, w do mask[j] = 0 end
+        mask[w] = bor(mask[w], lshift(1, bitIndex))
+    end
+    return mask
+end
+
+-- Compiled masks for a System, or false when it has to call its filter.
+-- Rebuilt if the System's filter is swapped.
+local function systemMasks(system)
+    if not tiny.bitmaskFilters then
+        return false
+    end
+    local filter = system.filter
+    if system.maskFilter == filter then
+        return system.masks
+    end
+    local spec = filter and filterSpecs[filter]
+    local masks = false
+    if spec then
+        masks = {
+            all = namesToMask(spec.all),
+            any = #spec.any > 0 and namesToMask(spec.any) or nil,
+            none = namesToMask(spec.none)
+        }
+    end
+    system.maskFilter = filter
+    system.masks = masks
+    return masks
+end
+
+-- Builds the component bitset of an Entity into sig (a list of words).
+local function entitySignature(entity, sig)
+    local n = #componentNames
+    for w = 1, rshift(n + 31, 5) do sig[w] = 0 end
+    for i = 1, n do
+        if entity[componentNames[i]] ~= nil then
+            local w = rshift(i - 1, 5) + 1
+            sig[w] = bor(sig[w], lshift(1, i - 1))
+        end
+    end
+    return sig
+end
+
+local function masksMatch(masks, sig)
+    local all, none, any = masks.all, masks.none, masks.any
+    for w = 1, #all do
+        local m = all[w]
+        if band(sig[w] or 0, m) ~= m then return false end
+    end
+    for w = 1, #none do
+        if band(sig[w] or 0, none[w]) ~= 0 then return false end
+    end
+    if any then
+        for w = 1, #any do
+            if band(sig[w] or 0, any[w]) ~= 0 then return true end
+        end
+        return false
+    end
+    return true
 end
 
 --- System functions.
@@ -265,7 +438,7 @@ end
 --   * The `interval` field is an optional field that makes Systems update at
 -- certain intervals using buffered time, regardless of World update frequency.
 -- For example, to make a System update once a second, set the System's interval
--- to 1.
+-- to 1. Parallel Systems do not support `interval`.
 --   * The `index` field is the System's index in the World. Lower indexed
 -- Systems are processed before higher indices. The `index` is a read only
 -- field; to set the `index`, use `tiny.setSystemIndex(world, system)`.
@@ -301,13 +474,46 @@ end
 local function processingSystemUpdate(system, dt)
     local preProcess = system.preProcess
     local process = system.process
+    local processChunk = system.processChunk
     local postProcess = system.postProcess
 
     if preProcess then
         preProcess(system, dt)
     end
 
-    if process then
+    if processChunk then
+        local chunks = tiny.chunks
+        local store = system.world.store
+        if store and chunks then
+            local archetypes = chunks.query(store, system.components,
+                system.rejectComponents)
+            for i = 1, #archetypes do
+                local list = archetypes[i].chunks
+                for j = 1, #list do
+                    local chunk = list[j]
+                    local count = chunk.count
+                    if count > 0 then
+                        processChunk(system, chunk, count, dt)
+                    end
+                end
+            end
+        end
+        system.calls = system.calls + 1
+    elseif process and system.onlyChanged then
+        local world = system.world
+        local filter = system.filter
+        local indices = system.indices
+        local nocache = system.nocache
+        local watch = system.onlyChanged
+        if watch == true then watch = nil end
+        for entity in tiny_changedSince(world, system.lastTick or -1, watch) do
+            if (nocache and filter and filter(system, entity)) or
+                (not nocache and indices[entity]) then
+                process(system, entity, dt)
+            end
+        end
+        system.calls = system.calls + 1
+    elseif process then
         if system.nocache then
             local entities = system.world.entities
             local filter = system.filter
@@ -333,26 +539,208 @@ local function processingSystemUpdate(system, dt)
     end
 end
 
+-- Sorted Systems merge up to this many added or moved Entities by binary
+-- insertion, more are merged as a sorted batch.
+tiny.sortInsertLimit = 8
+
+-- A full resort of a Sorted System tries insertion sort first (the order from
+-- the last sort is usually close) and gives up on it after moving this many
+-- times the number of Entities.
+tiny.sortMoveBudget = 4
+
+-- Radix sort scratch, grown to the largest sorted System
+local radixSize = 0
+local radixKeys, radixKeys2, radixOrder, radixOrder2
+local radixCounts = ffi.new("uint32_t[2048]")
+local radixFloat = ffi.new("union { float f; int32_t i; }")
+
+-- Sorts the entities of a System by system:sortKey(entity) (ascending numbers,
+-- as float). LSD radix sort, three 11 bit passes over the float bits.
+local function radixSortEntities(system, entities, n)
+    if n > radixSize then
+        radixSize = n
+        radixKeys = ffi.new("uint32_t[?]", n)
+        radixKeys2 = ffi.new("uint32_t[?]", n)
+        radixOrder = ffi.new("uint32_t[?]", n)
+        radixOrder2 = ffi.new("uint32_t[?]", n)
+    end
+    local sortKey = system.sortKey
+    local keys, keys2, order, order2 = radixKeys, radixKeys2, radixOrder, radixOrder2
+    local conv = radixFloat
+    for i = 0, n - 1 do
+        conv.f = sortKey(system, entities[i + 1])
+        local k = conv.i
+        -- Flip so the unsigned order of the bits is the float order
+        if k < 0 then
+            k = bnot(k)
+        else
+            k = bor(k, 0x80000000)
+        end
+        keys[i] = k
+        order[i] = i + 1
+    end
+    local counts = radixCounts
+    for shift = 0, 22, 11 do
+        ffi.fill(counts, 2048 * 4)
+        for i = 0, n - 1 do
+            local d = band(rshift(keys[i], shift), 0x7FF)
+            counts[d] = counts[d] + 1
+        end
+        local sum = 0
+        for d = 0, 2047 do
+            local c = counts[d]
+            counts[d] = sum
+            sum = sum + c
+        end
+        for i = 0, n - 1 do
+            local k = keys[i]
+            local d = band(rshift(k, shift), 0x7FF)
+            local to = counts[d]
+            counts[d] = to + 1
+            keys2[to] = k
+            order2[to] = order[i]
+        end
+        keys, keys2 = keys2, keys
+        order, order2 = order2, order
+    end
+    -- order holds the old positions, rebuild the list from a copy
+    local copy = {}
+    for i = 1, n do
+        copy[i] = entities[i]
+    end
+    for i = 0, n - 1 do
+        entities[i + 1] = copy[order[i]]
+    end
+end
+
+-- Insertion sort, cheap when the list is nearly sorted already (keys that move
+-- a little from frame to frame). Falls back to table.sort when it has to move
+-- too many entities.
+local function insertionSortEntities(entities, n, sortDelegate)
+    local budget = tiny.sortMoveBudget * n + 64
+    local moves = 0
+    for i = 2, n do
+        local e = entities[i]
+        local j = i - 1
+        if sortDelegate(e, entities[j]) then
+            repeat
+                entities[j + 1] = entities[j]
+                j = j - 1
+            until j < 1 or not sortDelegate(e, entities[j])
+            entities[j + 1] = e
+            moves = moves + i - j
+            if moves > budget then
+                tsort(entities, sortDelegate)
+                return
+            end
+        end
+    end
+end
+
+-- Puts the entities added to (or moved inside) a sorted list back in order: the
+-- rest of the list is still sorted, so the changed ones are taken out, sorted,
+-- and inserted one by one (a few) or merged (more).
+local function mergeSortedDelta(system, entities, delta, sortDelegate)
+    local indices = system.indices
+    local dirty, batch = {}, {}
+    for i = 1, #delta do
+        local e = delta[i]
+        if indices[e] and not dirty[e] then
+            dirty[e] = true
+            batch[#batch + 1] = e
+        end
+    end
+    local n = #entities
+    local kept = 0
+    for i = 1, n do
+        local e = entities[i]
+        if not dirty[e] then
+            kept = kept + 1
+            entities[kept] = e
+        end
+    end
+    local b = #batch
+    tsort(batch, sortDelegate)
+    if b <= tiny.sortInsertLimit then
+        for k = 1, b do
+            local e = batch[k]
+            -- After any equal entities, like the merge below
+            local lo, hi = 1, kept + 1
+            while lo < hi do
+                local mid = math.floor((lo + hi) / 2)
+                if sortDelegate(e, entities[mid]) then
+                    hi = mid
+                else
+                    lo = mid + 1
+                end
+            end
+            for j = kept, lo, -1 do
+                entities[j + 1] = entities[j]
+            end
+            entities[lo] = e
+            kept = kept + 1
+        end
+    else
+        local i, w = kept, n
+        for k = b, 1, -1 do
+            local e = batch[k]
+            while i > 0 and sortDelegate(e, entities[i]) do
+                entities[w] = entities[i]
+                i = i - 1
+                w = w - 1
+            end
+            entities[w] = e
+            w = w - 1
+        end
+    end
+end
+
 -- Sorts Systems by a function system.sortDelegate(entity1, entity2) on modify.
+-- Entities added or moved since the last sort (system.sortDelta) are merged
+-- into the sorted list. A full sort happens when the System asks for it with
+-- `resort`, or was marked modified without any adds or removes.
 local function sortedSystemOnModify(system)
     local entities = system.entities
     local indices = system.indices
-    local sortDelegate = system.sortDelegate
-    if not sortDelegate then
-        local compare = system.compare
-        sortDelegate = function(e1, e2)
-            return compare(system, e1, e2)
+    local n = #entities
+    local delta = system.sortDelta
+    local full = system.resort or not delta or #delta == 0
+    if system.sortKey then
+        radixSortEntities(system, entities, n)
+    else
+        local sortDelegate = system.sortDelegate
+        if not sortDelegate then
+            local compare = system.compare
+            sortDelegate = function(e1, e2)
+                return compare(system, e1, e2)
+            end
+            system.sortDelegate = sortDelegate
+        end
+        if full then
+            insertionSortEntities(entities, n, sortDelegate)
+        else
+            mergeSortedDelta(system, entities, delta, sortDelegate)
         end
-        system.sortDelegate = sortDelegate
     end
-    tsort(entities, sortDelegate)
-    for i = 1, #entities do
+    for i = 1, n do
         indices[entities[i]] = i
     end
+    system.resort = nil
+    if delta then
+        for i = #delta, 1, -1 do
+            delta[i] = nil
+        end
+    end
 end
 
 --- Creates a new System or System class from the supplied table. If `table` is
 -- nil, creates a new table.
+--
+-- A System with a `parallel` field runs on worker threads over the FFI chunks
+-- of its World instead of through `update` (needs `tiny.scheduler`). It lists
+-- the components it reads and writes in `reads` and `writes`; consecutive
+-- parallel Systems that do not conflict on them run at the same time.
+-- Parallel Systems run once per `tiny.update`, `interval` is ignored for them.
 function tiny.system(table)
     table = table or {}
     table[systemTableKey] = true
@@ -368,6 +756,18 @@ end
 --     function system:process(entity, dt) -- Process each entity.
 --     function system:postProcess(dt) -- Called after iteration.
 --
+-- Instead of `process`, a Processing System can iterate hot components kept in
+-- FFI chunks (needs `tiny.chunks`). It names the components it needs in
+-- `components` (and optionally `rejectComponents`) and is called once per
+-- chunk, with `count` entities at indices 0 to count - 1 of each column.
+--
+--     function system:processChunk(chunk, count, dt)
+--
+-- With `onlyChanged` set, `process` is only called for the System's Entities
+-- that were marked changed (see `tiny.markChanged`) since its last update.
+-- `onlyChanged` is true for any change, or a component name (or a list of them)
+-- to only look at changes of those components.
+--
 -- Processing Systems have their own `update` method, so don't implement a
 -- a custom `update` callback for Processing Systems.
 -- @see system
@@ -384,6 +784,13 @@ end
 -- Sorted Systems also override the default System's `onModify` callback, so be
 -- careful if defining a custom callback. However, for processing the sorted
 -- entities, consider `tiny.sortedProcessingSystem(table)`.
+--
+-- Entities added or removed since the last sort are merged into the sorted
+-- list instead of sorting it again. When the keys themselves change (depth
+-- sorting as the camera moves), set `system.resort = true` and `modified`;
+-- that sort starts from the previous order, so it is cheap when few Entities
+-- moved. With `system:sortKey(e)` returning a number (a depth, an FFI field)
+-- instead of `compare`, the Entities are radix sorted by it in linear time.
 -- @see system
 function tiny.sortedSystem(table)
     table = table or {}
@@ -440,7 +847,17 @@ function tiny.world(...)
         entities = {},
 
         -- List of Systems
-        systems = {}
+        systems = {},
+
+        -- Change tick, see Change Detection
+        tick = 0,
+
+        -- Change log, marks in tick order from first to last
+        changeLog = { first = 1, last = 0, floor = 0,
+            entities = {}, components = {}, ticks = {} },
+
+        -- Component (or true for whole Entity) -> Entity -> last change tick
+        changeTicks = { [true] = setmetatable({}, { __mode = "k" }) }
 
     }, worldMetaTable)
 
@@ -578,6 +995,10 @@ function tiny_manageSystems(world)
             end
             system.modified = true
             system.world = world
+            -- Sorted Systems keep track of what needs sorting in
+            if system.onModify == sortedSystemOnModify and not system.nocache then
+                system.sortDelta = {}
+            end
             local index = #systems + 1
             system.index = index
             systems[index] = system
@@ -593,9 +1014,18 @@ function tiny_manageSystems(world)
                 local onAdd = system.onAdd
                 local filter = system.filter
                 if filter then
+                    local masks = systemMasks(system)
+                    local sig = {}
                     for j = 1, #worldEntityList do
                         local entity = worldEntityList[j]
-                        if filter(system, entity) then
+                        local accepted
+                        if masks then
+                            accepted = masksMatch(masks,
+                                entitySignature(entity, sig))
+                        else
+                            accepted = filter(system, entity)
+                        end
+                        if accepted then
                             local entityIndex = #entityList + 1
                             entityList[entityIndex] = entity
                             entityIndices[entity] = entityIndex
@@ -627,6 +1057,13 @@ function tiny_manageEntities(world)
 
     local entities = world.entities
     local systems = world.systems
+    local sig = {}
+
+    -- Compile masks first, so every component they use is in the signature
+    local systemMaskList = {}
+    for j = 1, #systems do
+        systemMaskList[j] = systemMasks(systems[j])
+    end
 
     -- Change Entities
     for i = 1, #e2c do
@@ -636,20 +1073,35 @@ function tiny_manageEntities(world)
             local index = #entities + 1
             entities[entity] = index
             entities[index] = entity
+            -- New Entities count as changed
+            tiny_markChanged(world, entity)
         end
+        -- Component bitset, built once for all Systems
+        entitySignature(entity, sig)
         for j = 1, #systems do
             local system = systems[j]
             if not system.nocache then
                 local ses = system.entities
                 local seis = system.indices
                 local index = seis[entity]
-                local filter = system.filter
-                if filter and filter(system, entity) then
+                local masks = systemMaskList[j]
+                local accepted
+                if masks then
+                    accepted = masksMatch(masks, sig)
+                else
+                    local filter = system.filter
+                    accepted = filter and filter(system, entity)
+                end
+                if accepted then
                     if not index then
                         system.modified = true
                         index = #ses + 1
                         ses[index] = entity
                         seis[entity] = index
+                        local delta = system.sortDelta
+                        if delta then
+                            delta[#delta + 1] = entity
+                        end
                         local onAdd = system.onAdd
                         if onAdd then
                             onAdd(system, entity)
@@ -662,6 +1114,10 @@ function tiny_manageEntities(world)
                     seis[tmpEntity] = index
                     seis[entity] = nil
                     ses[#ses] = nil
+                    local delta = system.sortDelta
+                    if delta and tmpEntity ~= entity then
+                        delta[#delta + 1] = tmpEntity
+                    end
                     local onRemove = system.onRemove
                     if onRemove then
                         onRemove(system, entity)
@@ -677,6 +1133,10 @@ function tiny_manageEntities(world)
         local entity = e2r[i]
         e2r[i] = nil
         local listIndex = entities[entity]
+        -- Hot components go with the entity
+        if entity._chunk and world.store and tiny.chunks then
+            tiny.chunks.despawn(world.store, entity)
+        end
         if listIndex then
             -- Remove Entity from world state
             local lastEntity = entities[#entities]
@@ -698,6 +1158,10 @@ function tiny_manageEntities(world)
                         seis[tmpEntity] = index
                         seis[entity] = nil
                         ses[#ses] = nil
+                        local delta = system.sortDelta
+                        if delta and tmpEntity ~= entity then
+                            delta[#delta + 1] = tmpEntity
+                        end
                         local onRemove = system.onRemove
                         if onRemove then
                             onRemove(system, entity)
@@ -757,13 +1221,39 @@ function tiny.update(world, dt, filter)
     end
 
     --  Iterate through Systems IN ORDER
-    for i = 1, #systems do
+    local i = 1
+    while i <= #systems do
         local system = systems[i]
         if system.active and ((not filter) or filter(world, system)) then
 
-            -- Update Systems that have an update method (most Systems)
+            -- Each System run gets its own change tick
+            local tick = world.tick + 1
+            world.tick = tick
             local update = system.update
-            if update then
+            if system.parallel then
+                -- Parallel Systems that follow each other go to the scheduler
+                -- together, it returns once all of them are done. They run
+                -- at the same time, so the whole batch shares this tick.
+                local batch = { system }
+                while systems[i + 1] and systems[i + 1].parallel do
+                    i = i + 1
+                    local other = systems[i]
+                    if other.active and ((not filter) or filter(world, other)) then
+                        batch[#batch + 1] = other
+                    end
+                end
+                local scheduler = tiny.scheduler
+                if not scheduler then
+                    error("parallel System needs tiny.scheduler to be set.")
+                end
+                scheduler.update(world, batch, dt)
+                for j = 2, #batch do
+                    local other = batch[j]
+                    other.lastTick = tick
+                    other.modified = false
+                end
+            -- Update Systems that have an update method (most Systems)
+            elseif update then
                 local interval = system.interval
                 if interval then
                     local bufferedTime = (system.bufferedTime or 0) + dt
@@ -777,10 +1267,16 @@ function tiny.update(world, dt, filter)
                 end
             end
 
+            system.lastTick = tick
             system.modified = false
         end
+        i = i + 1
     end
 
+    -- Changes made between updates get a tick of their own
+    world.tick = world.tick + 1
+    trimChangeLog(world)
+
     -- Iterate through Systems IN ORDER AGAIN
     for i = 1, #systems do
         local system = systems[i]
@@ -793,6 +1289,139 @@ function tiny.update(world, dt, filter)
 
 end
 
+--- Change Detection.
+-- Entities do not notice their components being written, so code that changes
+-- an Entity marks it with `tiny.markChanged(world, entity, component)`. Marks are
+-- stamped with the World's change tick, which goes up before every System
+-- update (and once more after the last one), and go into a change log.
+--
+-- `tiny.changedSince(world, tick)` iterates the Entities marked after `tick`,
+-- so a System (or the render sync, network replication, debug server) only
+-- touches what changed instead of every Entity. Each System keeps the tick of
+-- its last update in `system.lastTick`; Processing Systems with `onlyChanged`
+-- use it themselves. The log keeps `tiny.changeHistory` ticks, asking for
+-- older changes iterates all Entities.
+-- @section Change
+
+tiny.changeHistory = 1024
+
+-- Drops the marks that fell out of the history, compacting now and then.
+function trimChangeLog(world)
+    local log = world.changeLog
+    local floor = world.tick - tiny.changeHistory
+    if floor <= log.floor then
+        return
+    end
+    log.floor = floor
+    local first, last = log.first, log.last
+    local les, lcs, lts = log.entities, log.components, log.ticks
+    while first <= last and lts[first] < floor do
+        les[first], lcs[first], lts[first] = nil, nil, nil
+        first = first + 1
+    end
+    if first > 1024 and first > last - first then
+        local n = 0
+        for i = first, last do
+            n = n + 1
+            les[n], lcs[n], lts[n] = les[i], lcs[i], lts[i]
+            les[i], lcs[i], lts[i] = nil, nil, nil
+        end
+        first, last = 1, n
+    end
+    log.first, log.last = first, last
+end
+
+--- Marks an Entity as changed at the current tick. `component` is the name of
+-- the changed component, or nil when the whole Entity changed.
+function tiny.markChanged(world, entity, component)
+    local tick = world.tick
+    local changeTicks = world.changeTicks
+    local key = component or true
+    local ticks = changeTicks[key]
+    if not ticks then
+        ticks = setmetatable({}, { __mode = "k" })
+        changeTicks[key] = ticks
+    end
+    if ticks[entity] == tick then
+        return entity
+    end
+    ticks[entity] = tick
+    local log = world.changeLog
+    local n = log.last + 1
+    log.last = n
+    log.entities[n] = entity
+    log.components[n] = component or false
+    log.ticks[n] = tick
+    return entity
+end
+tiny_markChanged = tiny.markChanged
+
+--- Gets the tick of the last change of an Entity's component, or of the last
+-- whole Entity mark if `component` is nil. Nil if there was none.
+function tiny.changeTick(world, entity, component)
+    local ticks = world.changeTicks[component or true]
+    local tick = ticks and ticks[entity]
+    if component then
+        local whole = world.changeTicks[true][entity]
+        if whole and (not tick or whole > tick) then
+            tick = whole
+        end
+    end
+    return tick
+end
+
+-- Does a logged component match the watched component(s)?
+local function watches(watch, component)
+    if not watch or not component or watch == component then
+        return true
+    end
+    if type(watch) == 'table' then
+        for i = 1, #watch do
+            if watch[i] == component then
+                return true
+            end
+        end
+    end
+    return false
+end
+
+--- Iterates the Entities of the World marked changed after `tick`, each once.
+-- With `component` (a name or a list of names) only marks of those components
+-- and whole Entity marks count. If `tick` is older than the change history,
+-- iterates every Entity.
+function tiny.changedSince(world, tick, component)
+    local entities = world.entities
+    local log = world.changeLog
+    if tick < log.floor then
+        local i = 0
+        return function()
+            i = i + 1
+            return entities[i]
+        end
+    end
+    -- First mark after tick (ticks only grow along the log)
+    local lts = log.ticks
+    local lo, hi = log.first, log.last + 1
+    while lo < hi do
+        local mid = math.floor((lo + hi) / 2)
+        if lts[mid] > tick then hi = mid else lo = mid + 1 end
+    end
+    local i, last = lo, log.last
+    local les, lcs = log.entities, log.components
+    local seen = {}
+    return function()
+        while i <= last do
+            local entity, c = les[i], lcs[i]
+            i = i + 1
+            if not seen[entity] and entities[entity] and watches(component, c) then
+                seen[entity] = true
+                return entity
+            end
+        end
+    end
+end
+tiny_changedSince = tiny.changedSince
+
 --- Removes all Entities from the World.
 function tiny.clearEntities(world)
     local el = world.entities
@@ -807,6 +1436,10 @@ function tiny.clearSystems(world)
     for i = #systems, 1, -1 do
         tiny_removeSystem(world, systems[i])
     end
+    -- The scheduler threads of the World go with its Systems
+    if world.scheduler and tiny.scheduler then
+        tiny.scheduler.shutdown(world)
+    end
 end
 
 --- Gets number of Entities in the World.
@@ -856,7 +1489,10 @@ worldMetaTable = {
         clearSystems = tiny.clearSystems,
         getEntityCount = tiny.getEntityCount,
         getSystemCount = tiny.getSystemCount,
-        setSystemIndex = tiny.setSystemIndex
+        setSystemIndex = tiny.setSystemIndex,
+        markChanged = tiny.markChanged,
+        changedSince = tiny.changedSince,
+        changeTick = tiny.changeTick
     },
     __tostring = function()
         return "<tiny-ecs_World>"
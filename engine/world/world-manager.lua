@@ -4,7 +4,12 @@ local tinsert 	= table.insert
 
 local tiny 		= require('engine.world.tiny-ecs')
 local tinysrv	= require('engine.world.tiny-ecs-server')
+
+-- tiny-ecs stays standalone, the engine hands it chunk storage and the thread scheduler
+tiny.chunks 	= require('engine.world.tiny-ecs-chunks')
+tiny.scheduler 	= require('engine.world.tiny-ecs-scheduler')
 local assetmgr 	= require("engine.world.asset-manager")
+local handles 	= require("engine.world.entity-handles")
 local utils 	= require('lua.utils')
 local ffi 		= require("ffi")
 
@@ -18,13 +23,61 @@ local worldmanager = {
 
 	systems = {},
 	systems_lookup = {},
-	entities = {},
-	entities_lookup = {},
+	entities = {},			-- handle slot index -> entity (sparse, slots get reused)
+	entities_lookup = {},	-- entity id (handle) -> slot index
 	cameras_lookup = {},
+	go_lookup = {},			-- game object -> entity id
+
+	handles = handles.new(),
 
 	assetmgr 	= assetmgr,
 }
 
+------------------------------------------------------------------------------------------------------------
+-- Entity ids are generational handles (see entity-handles): O(1) to make, find and free, and an
+--   id of a removed entity never finds the entity that reuses its slot.
+local function registerEntity( self, obj )
+
+	local id = handles.create(self.handles, obj)
+	local index = handles.index(id)
+	obj.id = id
+	self.entities[index] = obj
+	self.entities_lookup[id] = index
+	if(obj.go) then self.go_lookup[obj.go] = id end
+	return id
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Entity for an id, nil if the id is stale (its entity was removed)
+worldmanager.getEntity = function( self, eid )
+	return handles.get(self.handles, eid)
+end
+
+------------------------------------------------------------------------------------------------------------
+-- Flag an entity (id or the entity) as changed so onlyChanged systems, the server and any
+--   sync code pick it up. component is the name of what changed, nil for the whole entity.
+worldmanager.markChanged = function( self, eid, component )
+
+	local ent = eid
+	if(type(eid) ~= "table") then ent = handles.get(self.handles, eid) end
+	if(ent == nil or self.current_world == nil) then return nil end
+	return tiny.markChanged(self.current_world, ent, component)
+end
+
+------------------------------------------------------------------------------------------------------------
+
+-- Transforms are kept as plain tables (x, y, z [, w]) so they can be json encoded and the 
+--   replication sends them quantized. Vectors and quaternions (vmath, hmm) are copied.
+local function transformTable( v, w )
+
+	if(v == nil) then return { x = 0, y = 0, z = 0, w = w } end
+	if(type(v) == "table" and v.x == nil and v[1] ~= nil) then 
+		return { x = v[1], y = v[2], z = v[3], w = v[4] or w }
+	end
+	if(type(v) == "string") then return v end
+	return { x = v.x, y = v.y, z = v.z, w = (w and v.w) or nil }
+end
+
 ------------------------------------------------------------------------------------------------------------
 
 worldmanager.addEntity = function( self, pos, rot, obj )
@@ -34,24 +87,14 @@ worldmanager.addEntity = function( self, pos, rot, obj )
 		return nil 
 	end 
 
-	local id = utils.tcount(self.entities)
-	if(obj.go) then 
-		local gostr = tostring(obj.go)
-		id = utils.crc(gostr, string.len(gostr)) 
-	end 
-
-	obj.id = id
+	registerEntity(self, obj)
 	obj.etype = obj.etype or "entity"
 	obj.created = socket.gettime()
 	obj.visible = obj.visible or 1
-	obj.pos = tostring(obj.pos or pos)
-	obj.rot = tostring(obj.rot or rot)
+	obj.pos = transformTable(obj.pos or pos)
+	obj.rot = transformTable(obj.rot or rot, 1)
 	obj.scale = { 1, 1, 1 }
 
-	-- Keep some handles so we can easily remove
-	tinsert(self.entities, obj)
-	self.entities_lookup[obj.id] = utils.tcount(self.entities)
-	
 	return tiny.addEntity(self.current_world, obj)
 end
 
@@ -66,9 +109,7 @@ worldmanager.addGameObject = function( self, name, objurl )
 	local pos = go.get_position(objurl)
 	local rot = go.get_rotation(objurl)
 
-	local id = hash_to_hex(hash(objurl))
 	local obj = {
-		id = id,
 		go = objurl,
 		name = name, 
 		etype = "gameobject",
@@ -80,8 +121,7 @@ worldmanager.addGameObject = function( self, name, objurl )
 	}
 
 	-- Keep some handles so we can easily remove
-	tinsert(self.entities, obj)
-	self.entities_lookup[obj.id] = utils.tcount(self.entities)
+	registerEntity(self, obj)
 	return tiny.addEntity(self.current_world, obj)
 end
 
@@ -101,9 +141,7 @@ worldmanager.addCamera = function( self, name, objurl )
 	local far = go.get(objurl, "far_z") -- get far z
 	local fov = go.get(objurl, "fov") -- get field of view
 
-	local id = hash_to_hex(hash(objurl))
 	local obj = {
-		id = id,
 		go = objurl,
 		name = name, 
 		etype = "camera",
@@ -120,9 +158,8 @@ worldmanager.addCamera = function( self, name, objurl )
 	}
 
 	-- Keep some handles so we can easily remove
-	tinsert(self.entities, obj)
-	self.entities_lookup[obj.id] = utils.tcount(self.entities)
-	self.cameras_lookup[obj.id] = utils.tcount(self.entities)
+	local id = registerEntity(self, obj)
+	self.cameras_lookup[id] = self.entities_lookup[id]
 	return tiny.addEntity(self.current_world, obj)
 end
 
@@ -134,19 +171,28 @@ worldmanager.removeEntity = function( self, eid )
 		print("[Error] removeEntity: Entity eid is nil?")
 		return nil 
 	end 
-	local ent = self.entities[self.entities_lookup[eid]]
+	local ent = handles.destroy(self.handles, eid)
 	if(ent == nil) then 
-		print("[Error] removeEntity: Entity not found?")
+		print("[Error] removeEntity: Entity not found (or already removed)?")
 		return nil 
 	end
-	if(eid) then go.delete(eid, true) end
+	tinysrv.entityRemoved(eid)
+	self.entities[handles.index(eid)] = nil
+	self.entities_lookup[eid] = nil
+	self.cameras_lookup[eid] = nil
+	if(ent.go) then 
+		self.go_lookup[ent.go] = nil
+		go.delete(ent.go, true) 
+	end
 	local oldent = tiny.removeEntity(self.current_world, ent)
     return oldent
 end
 
 ------------------------------------------------------------------------------------------------------------
 
-worldmanager.addSystem = function( self, systemname, filters, processFunc )
+-- With onlyChanged (true, or component names) processFunc only gets the entities marked changed
+--   since the system last ran (see markChanged).
+worldmanager.addSystem = function( self, systemname, filters, processFunc, onlyChanged )
 
 	if(self.systems_lookup[systemname]) then 
 		print("[Error] System already exists: "..systemname)
@@ -155,6 +201,7 @@ worldmanager.addSystem = function( self, systemname, filters, processFunc )
 		local new_system = tiny.processingSystem()
 		new_system.filter = tiny.requireAll( unpack(filters) )
 		new_system.process = processFunc
+		new_system.onlyChanged = onlyChanged
 		local out_system = tiny.addSystem(self.current_world, new_system)
 		self.current_world:update(0)
 
@@ -175,9 +222,19 @@ end
 -- Add an asset to the world - to be used by objects within the world
 --   This will be passed to the asset manager which determines the asset type and 
 --   populates with asset obj with the correct data.
-worldmanager.addAsset = function(self, assetFilename)
-
-
+--   Assets are tagged with the world name as their group unless opts.group says otherwise.
+--   Returns the asset uid (the data arrives later, see assetmgr.get).
+worldmanager.addAsset = function(self, assetFilename, opts)
+
+	local world = self.current_world
+	opts = opts or {}
+	opts.group = opts.group or (world and world.name)
+	local uid = assetmgr.load(assetFilename, opts)
+	if(uid and world) then 
+		world.assets = world.assets or {}
+		tinsert(world.assets, uid)
+	end
+	return uid
 end
 
 ------------------------------------------------------------------------------------------------------------
@@ -191,8 +248,8 @@ worldmanager.addWorld = function(self, worldname)
 		self.current_world = tiny.world()
 		self.current_world.name = worldname 
 
-		-- Add an updater for entities in the httpserver
-		self:addSystem( worldname.."_Entities", { "name", "etype" }, tinysrv.entitySystemProc )
+		-- Add an updater for entities in the httpserver (only changed ones)
+		self:addSystem( worldname.."_Entities", { "name", "etype" }, tinysrv.entitySystemProc, true )
 
 		tinsert(self.worlds, self.current_world)
 		self.systems_lookup[worldname] = utils.tcount(self.worlds)
@@ -232,7 +289,7 @@ worldmanager.init = function(self, options)
 	self:processOptions(options)
 	tinysrv.init()
 	tinysrv.setWorlds(self.worlds)
-	tinysrv.setEntities(self.entities, self.entities_lookup, self.cameras_lookup)
+	tinysrv.setEntities(self.entities, self.entities_lookup, self.cameras_lookup, self.go_lookup)
 	tinysrv.setSystems(self.systems)
 end
 
@@ -241,9 +298,10 @@ end
 worldmanager.final = function (self)
 
 	tinysrv.final()
-	if(self.current_world) then 
-		tiny.clearEntities(self.current_world)
-		tiny.clearSystems(self.current_world)
+	-- Every world, so their scheduler threads are stopped too
+	for k,v in pairs(self.worlds) do
+		tiny.clearEntities(v)
+		tiny.clearSystems(v)
 	end
 end
 
@@ -256,6 +314,7 @@ worldmanager.update = function(self, dt)
 		v:update(dt)
 	end
 	tinysrv.update(dt)
+	assetmgr.update()
 end
 
 ------------------------------------------------------------------------------------------------------------
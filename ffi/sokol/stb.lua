@@ -160,6 +160,9 @@ int stbi_write_hdr_to_func(stbi_write_func *func, void *context, int w, int h, i
 int stbi_write_jpg_to_func(stbi_write_func *func, void *context, int x, int y, int comp, const void  *data, int quality);
 
 void stbi_flip_vertically_on_write(int flip_boolean);
+
+// zlib stream (with header) in malloc'd memory, stbi_zlib_decode_* reads it back
+unsigned char *stbi_zlib_compress(unsigned char *data, int data_len, int *out_len, int quality);
 ]]
 
 return stb_lib
\ No newline at end of file
@@ -0,0 +1,212 @@
+package.path    = package.path..";../../?.lua"
+local dirtools  = require("tools.vfs.dirtools").init("sokol%-luajit")
+
+-- Stress sample for the bins automatic instancing.
+--   50k cubes are added to the opaque bin as separate geometry sharing one pipeline and
+--   bindings. The bins collapse them into a single instanced draw each frame.
+--   Run with: ./run_sample.sh instanced_cubes_sapp
+
+--_G.SOKOL_DLL    = "sokol_debug_dll"
+local sapp      = require("sokol_app")
+sg              = require("sokol_gfx")
+local slib      = require("sokol_libs") -- Warn - always after gfx!!
+
+local hmm       = require("hmm")
+local hutils    = require("hmm_utils")
+
+local utils     = require("utils")
+require("engine.platform")
+
+local ffi       = require("ffi")
+
+-- --------------------------------------------------------------------------------------
+
+local NUM_CUBES     = 50000
+local GRID          = math.ceil(math.pow(NUM_CUBES, 1/3))
+local SPACING       = 3.0
+
+local cammgr        = nil
+local bins          = nil
+local meshes        = nil
+
+local positions     = ffi.new("float[?]", NUM_CUBES * 3)
+local params        = {}
+local frame_count   = 0
+
+-- --------------------------------------------------------------------------------------
+
+local function make_cube_buffers()
+
+    local verts, uvs, normals, indices = {}, {}, {}, {}
+    local faces = {
+        { n = { 0, 0, 1 },  u = { 1, 0, 0 }, v = { 0, 1, 0 } },
+        { n = { 0, 0,-1 },  u = {-1, 0, 0 }, v = { 0, 1, 0 } },
+        { n = { 1, 0, 0 },  u = { 0, 0,-1 }, v = { 0, 1, 0 } },
+        { n = {-1, 0, 0 },  u = { 0, 0, 1 }, v = { 0, 1, 0 } },
+        { n = { 0, 1, 0 },  u = { 1, 0, 0 }, v = { 0, 0,-1 } },
+        { n = { 0,-1, 0 },  u = { 1, 0, 0 }, v = { 0, 0, 1 } },
+    }
+    local corners = { {-1,-1}, {1,-1}, {1,1}, {-1,1} }
+    for fi, f in ipairs(faces) do
+        local base = (fi - 1) * 4
+        for ci, c in ipairs(corners) do
+            for k = 1, 3 do
+                table.insert(verts, f.n[k] + f.u[k] * c[1] + f.v[k] * c[2])
+                table.insert(normals, f.n[k])
+            end
+            table.insert(uvs, (c[1] + 1) * 0.5)
+            table.insert(uvs, (c[2] + 1) * 0.5)
+        end
+        for _, idx in ipairs({ 0, 1, 2, 0, 2, 3 }) do table.insert(indices, base + idx) end
+    end
+
+    return {
+        vertices    = ffi.new("float[?]", #verts, verts),
+        uvs         = ffi.new("float[?]", #uvs, uvs),
+        normals     = ffi.new("float[?]", #normals, normals),
+        indices     = ffi.new("uint16_t[?]", #indices, indices),
+        vcount      = #verts / 3,
+        icount      = #indices,
+        itype       = sg.SG_INDEXTYPE_UINT16,
+    }
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function init()
+
+    local desc = ffi.new("sg_desc[1]")
+    desc[0].environment = slib.sglue_environment()
+    desc[0].logger.func = slib.slog_func
+    desc[0].disable_validation = false
+    -- Without storage buffers every cube falls back to its own draw and uniform apply
+    desc[0].uniform_buffer_size = 8 * 1024 * 1024
+    sg.sg_setup( desc )
+    print("Sokol Is Valid: "..tostring(sg.sg_isvalid()))
+    print("Storage buffers: "..tostring(sg.sg_query_features().storage_buffer))
+
+    cammgr  = require("lua.engine.camera_manager")
+    bins    = require("lua.geometry.bins")
+    meshes  = require("lua.geometry.meshes")
+    require("lua.loaders.image-utils").make_defaults()
+
+    bins.init()
+
+    local cam = cammgr.add_default("main")
+    cammgr.set_nearfar("main", 0.1, GRID * SPACING * 4)
+    local passid = bins.pass_add({ action = sg.SG_LOADACTION_CLEAR, clear = { 0.1, 0.1, 0.15, 1.0 } }, bins.BTYPE_OPAQUE)
+    cammgr.add_pass("main", passid)
+    bins.camera_add(cam.id)
+
+    local material = meshes.material("cube", "engine/core/shaders/base_texture_normals.glsl", {},
+                                     "engine/core/shaders/base_texture_instanced.glsl")
+
+    local buffs = meshes.create_buffer("cube", make_cube_buffers())
+    buffs.depth.write_enabled = true
+    buffs.depth.compare = sg.SG_COMPAREFUNC_LESS_EQUAL
+    local mesh  = meshes.make_mesh("cube", { buffs })
+    local model = meshes.model("cube", {}, mesh, material)
+
+    -- All cubes share one fs params block so they can be collapsed
+    local fs_params = ffi.new("fs_params_t[1]")
+    fs_params[0].alpha_cutoff = 0.0
+    fs_params[0].alpha_mode = 0
+
+    local half = GRID * SPACING * 0.5
+    for i = 0, NUM_CUBES - 1 do
+        local x = i % GRID
+        local y = math.floor(i / GRID) % GRID
+        local z = math.floor(i / (GRID * GRID))
+        positions[i * 3]     = x * SPACING - half
+        positions[i * 3 + 1] = y * SPACING - half
+        positions[i * 3 + 2] = z * SPACING - half
+
+        local vs_params = ffi.new("vs_params_t[1]")
+        vs_params[0].base_color_factor[0] = x / GRID
+        vs_params[0].base_color_factor[1] = y / GRID
+        vs_params[0].base_color_factor[2] = z / GRID
+        vs_params[0].base_color_factor[3] = 1.0
+
+        local geom = {
+            pip         = model.pip,
+            inst_pip    = model.inst_pip,
+            bind        = model.bind,
+            material    = material,
+            vs_params   = vs_params,
+            fs_params   = fs_params,
+            count       = buffs.icount,
+        }
+        local bin_slot, dstate = bins.bin_add_geom(geom)
+        dstate[0].state = 0x01
+        -- The bins keep the params in their uniform arena, update through the returned pointer
+        params[i] = geom.vs_params
+    end
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function frame()
+
+    local w         = sapp.sapp_widthf()
+    local h         = sapp.sapp_heightf()
+    local t         = tonumber(sapp.sapp_frame_count()) * 0.01
+    frame_count     = frame_count + 1
+
+    local dist      = GRID * SPACING * 1.2
+    cammgr.set_aspect("main", w/h)
+    cammgr.update_viewport("main", hmm.HMM_V4(0, 0, w, h))
+    cammgr.update_scissor("main", hmm.HMM_V4(0, 0, w, h))
+    cammgr.lookat("main", hmm.HMM_V3(math.sin(t * 0.3) * dist, dist * 0.5, math.cos(t * 0.3) * dist),
+                          hmm.HMM_V3(0, 0, 0), hmm.HMM_V3(0, 1, 0))
+    local vp        = cammgr.get_view_proj("main")
+
+    -- mvp = vp * translate(p) * rot. The first three columns are shared by every cube,
+    --   only the translation column needs computing per cube.
+    local rot       = hmm.HMM_Rotate_RH(t, hmm.HMM_V3(0.0, 1.0, 0.0))
+    local vpr       = hmm.HMM_MulM4(vp, rot)
+    local e         = vp.Elements
+    for i = 0, NUM_CUBES - 1 do
+        local px, py, pz = positions[i * 3], positions[i * 3 + 1], positions[i * 3 + 2]
+        local m = params[i][0].mvp
+        for c = 0, 2 do
+            m.Elements[c][0] = vpr.Elements[c][0]
+            m.Elements[c][1] = vpr.Elements[c][1]
+            m.Elements[c][2] = vpr.Elements[c][2]
+            m.Elements[c][3] = vpr.Elements[c][3]
+        end
+        for r = 0, 3 do
+            m.Elements[3][r] = e[0][r] * px + e[1][r] * py + e[2][r] * pz + e[3][r]
+        end
+    end
+
+    bins.render(w, h)
+
+    if(frame_count % 120 == 0) then
+        local stats = bins.get_pass_stats(1)
+        print(string.format("[Info] frame %.2fms  draws %d  instanced %d (%d instances)  pipelines %d  bindings %d",
+            sapp.sapp_frame_duration() * 1000.0, stats.draws, stats.instanced_draws, stats.instances,
+            stats.pipelines, stats.bindings))
+    end
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function cleanup()
+    sg.sg_shutdown()
+end
+
+-- --------------------------------------------------------------------------------------
+
+local app_desc = ffi.new("sapp_desc[1]")
+app_desc[0].init_cb     = init
+app_desc[0].frame_cb    = frame
+app_desc[0].cleanup_cb  = cleanup
+app_desc[0].width       = 1920
+app_desc[0].height      = 1080
+app_desc[0].window_title = "Instanced Cubes (sokol-app)"
+app_desc[0].icon.sokol_default = true
+app_desc[0].logger.func = slib.slog_func
+
+sapp.sapp_run( app_desc )
+
+-- --------------------------------------------------------------------------------------
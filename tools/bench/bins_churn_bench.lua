@@ -0,0 +1,151 @@
+-- --------------------------------------------------------------------------------------
+-- Bin add/remove churn check for engine/geometry/bins.lua
+--   Adds a set of geometry, then for a number of rounds removes and re-adds a random 
+--   half of it while writing params through geom.vs_params, the way threed.lua does.
+--   Reports the uniform arena footprint (it must stop growing once the first round has 
+--   warmed the free lists), live blocks and ranges (they must match the geometry in the 
+--   bins), and checks that every geometry still reads back its own params.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/bins_churn_bench.lua [geoms] [rounds]
+--   No renderer is needed, sokol and the camera manager are stubbed.
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+ffi             = require("ffi")
+ffi.cdef[[
+typedef struct sg_range { const void* ptr; size_t size; } sg_range;
+typedef struct sg_pipeline { uint32_t id; } sg_pipeline;
+typedef struct sg_bindings { uint32_t _start_canary; } sg_bindings;
+typedef struct bench_vs_params_t { float mvp[16]; float base_color_factor[4]; } bench_vs_params_t;
+typedef struct bench_fs_params_t { float alpha_cutoff; int alpha_mode; float pad[2]; } bench_fs_params_t;
+]]
+
+local stub      = function() return {} end
+-- bins.lua takes sg from sokol_nuklear (it re-exports sokol_gfx)
+local sg_stub   = function() return { sg_query_features = function() return { storage_buffer = false } end } end
+package.preload["sokol_app"]                    = stub
+package.preload["sokol_gfx"]                    = sg_stub
+package.preload["sokol_nuklear"]                = sg_stub
+package.preload["sokol_libs"]                   = stub
+package.preload["hmm"]                          = stub
+package.preload["hmm_utils"]                    = stub
+package.preload["lua.geometry.meshes"]          = stub
+package.preload["lua.engine.camera_manager"]    = stub
+package.preload["lua.geometry.culling"] = function() return dofile("engine/geometry/culling.lua") end
+package.preload["lua.utils"] = function() 
+    local utils = {}
+    utils.deepcopy = function(t)
+        if(type(t) ~= "table") then return t end
+        local c = {}
+        for k, v in pairs(t) do c[k] = utils.deepcopy(v) end
+        return c
+    end
+    return utils
+end
+
+local bins      = dofile("engine/geometry/bins.lua")
+
+local GEOMS     = tonumber(arg[1]) or 10000
+local ROUNDS    = tonumber(arg[2]) or 50
+
+-- --------------------------------------------------------------------------------------
+
+local pip       = ffi.new("sg_pipeline[1]")
+local bind      = ffi.new("sg_bindings[1]")
+local material  = {}
+
+local function make_geom(i)
+    local vs = ffi.new("bench_vs_params_t[1]")
+    local fs = ffi.new("bench_fs_params_t[1]")
+    vs[0].base_color_factor[0] = i
+    fs[0].alpha_cutoff = i
+    return {
+        id          = i,
+        pip         = pip[0],
+        bind        = bind,
+        material    = material,
+        vs_params   = vs,
+        fs_params   = fs,
+        count       = 36,
+    }
+end
+
+local function add(geom)
+    geom.bindid, geom.dstate, geom.binindex = bins.bin_add_geom(geom)
+    geom.dstate[0].state = 0x01
+end
+
+local function remove(geom)
+    bins.bin_remove(geom.bindid, geom.binindex)
+    geom.dstate = nil
+end
+
+-- Every geometry writes its own id through whatever vs_params points at now, a removed one 
+--   included. A stale arena pointer shows up as another geometry's id in its block.
+local function write_all(geoms, tick)
+    for i = 1, #geoms do 
+        local geom = geoms[i]
+        geom.vs_params[0].mvp[0] = geom.id
+        geom.vs_params[0].mvp[1] = tick
+    end
+end
+
+local function check_all(geoms, tick)
+    local bad = 0
+    for i = 1, #geoms do 
+        local geom = geoms[i]
+        local vs = geom.vs_params[0]
+        if(vs.mvp[0] ~= geom.id or vs.mvp[1] ~= tick or vs.base_color_factor[0] ~= geom.id) then bad = bad + 1 end
+        if(geom.fs_params[0].alpha_cutoff ~= geom.id) then bad = bad + 1 end
+        if(geom.dstate) then 
+            local ds = geom.dstate[0]
+            if(ffi.cast("bench_vs_params_t *", ds.vs_params.ptr).mvp[0] ~= geom.id) then bad = bad + 1 end
+        end
+    end
+    return bad
+end
+
+-- --------------------------------------------------------------------------------------
+
+bins.init()
+math.randomseed(1234)
+
+local geoms = {}
+for i = 1, GEOMS do 
+    geoms[i] = make_geom(i)
+    add(geoms[i])
+end
+
+local live = GEOMS
+local mismatches = 0
+local warm = nil
+local t0 = os.clock()
+
+for round = 1, ROUNDS do 
+    for i = 1, GEOMS do 
+        local geom = geoms[i]
+        if(math.random() < 0.5) then 
+            if(geom.dstate) then remove(geom); live = live - 1 else add(geom); live = live + 1 end
+        end
+    end
+    write_all(geoms, round)
+    mismatches = mismatches + check_all(geoms, round)
+
+    local stats = bins.get_uniform_stats()
+    if(stats.ranges ~= live * 2) then mismatches = mismatches + 1 end
+    if(round == 1) then warm = stats.chunks end
+end
+local elapsed = os.clock() - t0
+
+-- --------------------------------------------------------------------------------------
+
+local stats = bins.get_uniform_stats()
+local grew  = stats.chunks - warm
+
+print(string.format("geoms %d  rounds %d  live %d  time %.2fs", GEOMS, ROUNDS, live, elapsed))
+print(string.format("arena used %d bytes  ranges %d  chunks %d (grew %d after round 1)  range blocks %d", 
+    stats.used, stats.ranges, stats.chunks, grew, stats.range_blocks))
+print(string.format("mismatches %d", mismatches))
+print((mismatches == 0 and grew == 0) and "OK" or "FAILED")
@@ -0,0 +1,94 @@
+-- --------------------------------------------------------------------------------------
+-- Change detection benchmark for tiny-ecs (markChanged / onlyChanged)
+--   100k entities, 1% of them move each frame (a mover system changes and marks them).
+--   Three sync systems run after it - render sync (copies the transform into an FFI
+--   array), network replication (collects the changed ids) and the debug server
+--   entitySystemProc stand-in - once processing every entity and once with onlyChanged.
+--   Reports the frame cost of the whole world update.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_changes_bench.lua [entities] [changed %] [frames]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local ffi       = require("ffi")
+local tiny      = require("engine.world.tiny-ecs")
+local workers   = dofile("engine/core/workers.lua")
+
+local COUNT     = tonumber(arg[1]) or 100000
+local PERCENT   = tonumber(arg[2]) or 1
+local FRAMES    = tonumber(arg[3]) or 100
+
+-- --------------------------------------------------------------------------------------
+
+local function run(label, onlyChanged)
+
+    math.randomseed(1)
+    local world = tiny.world()
+    local entities = {}
+    for i = 1, COUNT do
+        local e = { id = i, name = "e"..i, etype = "entity", pos = { x = i, y = 0, z = 0 } }
+        entities[i] = e
+        world:addEntity(e)
+    end
+
+    -- Moves PERCENT of the entities each frame
+    local per_frame = math.floor(COUNT * PERCENT / 100)
+    local mover = tiny.system()
+    function mover:update(dt)
+        for k = 1, per_frame do
+            local e = entities[math.random(COUNT)]
+            e.pos.y = e.pos.y + 1
+            world:markChanged(e, "pos")
+        end
+    end
+    world:addSystem(mover)
+
+    local transforms = ffi.new("float[?]", COUNT * 3)
+    local render = tiny.processingSystem({ onlyChanged = onlyChanged and "pos" })
+    render.filter = tiny.requireAll("pos")
+    function render:process(e)
+        local o = (e.id - 1) * 3
+        transforms[o], transforms[o + 1], transforms[o + 2] = e.pos.x, e.pos.y, e.pos.z
+    end
+
+    local replicated = 0
+    local replicate = tiny.processingSystem({ onlyChanged = onlyChanged })
+    replicate.filter = tiny.requireAll("id", "pos")
+    local outbox = {}
+    function replicate:preProcess() outbox = {} end
+    function replicate:process(e) outbox[#outbox + 1] = e.id end
+    function replicate:postProcess() replicated = replicated + #outbox end
+
+    local server_entities, server_lookup = {}, {}
+    local debug = tiny.processingSystem({ onlyChanged = onlyChanged })
+    debug.filter = tiny.requireAll("name", "etype")
+    function debug:process(e)
+        local idx = server_lookup[e.id] or e.id
+        server_lookup[e.id] = idx
+        server_entities[idx] = e
+    end
+
+    world:addSystem(render)
+    world:addSystem(replicate)
+    world:addSystem(debug)
+
+    world:update(0)
+    replicated = 0
+    local start = workers.now()
+    for f = 1, FRAMES do world:update(1 / 60) end
+    local ms = (workers.now() - start) / FRAMES
+
+    local sum = 0
+    for i = 0, COUNT * 3 - 1 do sum = sum + transforms[i] end
+    print(string.format("  %-16s %8.3f ms / frame   replicated %7.1f / frame   checksum %.0f", label, ms, replicated / FRAMES, sum))
+    return ms
+end
+
+print(string.format("%d entities, %g%% changed per frame, %d frames", COUNT, PERCENT, FRAMES))
+local all_ms     = run("every entity", false)
+local changed_ms = run("onlyChanged", true)
+print(string.format("  speedup %.1fx", all_ms / changed_ms))
+
+-- --------------------------------------------------------------------------------------
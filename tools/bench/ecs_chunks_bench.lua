@@ -0,0 +1,123 @@
+-- --------------------------------------------------------------------------------------
+-- Chunk iteration benchmark for engine/world/tiny-ecs-chunks.lua
+--   100k moving entities (position += velocity * dt, bounced inside a box) updated by a
+--   tiny-ecs processingSystem over table entities, then by a processChunk system over
+--   the same data in FFI chunks. Reports ms per frame and the GC heap size.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_chunks_bench.lua [entities] [frames]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local ffi       = require("ffi")
+local tiny      = require("engine.world.tiny-ecs")
+local chunks    = require("engine.world.tiny-ecs-chunks")
+tiny.chunks     = chunks
+local workers   = dofile("engine/core/workers.lua")
+
+local COUNT     = tonumber(arg[1]) or 100000
+local FRAMES    = tonumber(arg[2]) or 200
+local DT        = 1.0 / 60.0
+local BOX       = 100.0
+
+-- --------------------------------------------------------------------------------------
+
+local function rnd(a, b) return a + math.random() * (b - a) end
+
+local function heap_mb()
+    collectgarbage("collect")
+    return collectgarbage("count") / 1024.0
+end
+
+local function run(world, label, checksum)
+    world:update(0)
+    for f = 1, 10 do world:update(DT) end
+    local start = workers.now()
+    for f = 1, FRAMES do world:update(DT) end
+    local ms = (workers.now() - start) / FRAMES
+    print(string.format("  %-22s %7.3f ms / frame   heap %6.1f MB   checksum %.3f", label, ms, heap_mb(), checksum()))
+    return ms
+end
+
+-- --------------------------------------------------------------------------------------
+-- Table entities
+
+math.randomseed(1)
+local base = heap_mb()
+local tworld = tiny.world()
+local tentities = {}
+for i = 1, COUNT do
+    local e = {
+        name = "e"..i,
+        position = { x = rnd(-BOX, BOX), y = rnd(-BOX, BOX), z = rnd(-BOX, BOX) },
+        velocity = { x = rnd(-5, 5), y = rnd(-5, 5), z = rnd(-5, 5) },
+    }
+    tentities[i] = e
+    tworld:addEntity(e)
+end
+
+local mover = tiny.processingSystem()
+mover.filter = tiny.requireAll("position", "velocity")
+function mover:process(e, dt)
+    local p, v = e.position, e.velocity
+    p.x = p.x + v.x * dt
+    p.y = p.y + v.y * dt
+    p.z = p.z + v.z * dt
+    if(p.x < -BOX or p.x > BOX) then v.x = -v.x end
+    if(p.y < -BOX or p.y > BOX) then v.y = -v.y end
+    if(p.z < -BOX or p.z > BOX) then v.z = -v.z end
+end
+tworld:addSystem(mover)
+
+print(string.format("%d entities, %d frames", COUNT, FRAMES))
+local table_ms = run(tworld, "processingSystem", function()
+    local s = 0
+    for i = 1, COUNT do s = s + tentities[i].position.x end
+    return s
+end)
+tworld, tentities, mover = nil, nil, nil
+
+-- --------------------------------------------------------------------------------------
+-- Chunk entities, same data (same seed)
+
+chunks.component("position", "float x, y, z;")
+chunks.component("velocity", "float x, y, z;")
+
+math.randomseed(1)
+local cworld = tiny.world()
+local store = chunks.store(cworld)
+local centities = {}
+for i = 1, COUNT do
+    local e = { name = "e"..i }
+    chunks.spawn(store, {
+        position = { rnd(-BOX, BOX), rnd(-BOX, BOX), rnd(-BOX, BOX) },
+        velocity = { rnd(-5, 5), rnd(-5, 5), rnd(-5, 5) },
+    }, e, cworld)
+    centities[i] = e
+end
+
+local cmover = tiny.processingSystem({ components = { "position", "velocity" } })
+function cmover:processChunk(chunk, count, dt)
+    local p, v = chunk.position, chunk.velocity
+    for i = 0, count - 1 do
+        local pi, vi = p[i], v[i]
+        pi.x = pi.x + vi.x * dt
+        pi.y = pi.y + vi.y * dt
+        pi.z = pi.z + vi.z * dt
+        if(pi.x < -BOX or pi.x > BOX) then vi.x = -vi.x end
+        if(pi.y < -BOX or pi.y > BOX) then vi.y = -vi.y end
+        if(pi.z < -BOX or pi.z > BOX) then vi.z = -vi.z end
+    end
+end
+cworld:addSystem(cmover)
+
+local chunk_ms = run(cworld, "processChunk", function()
+    local s = 0
+    for i = 1, COUNT do s = s + chunks.get(centities[i], "position").x end
+    return s
+end)
+
+print(string.format("  speedup %.1fx", table_ms / chunk_ms))
+
+-- --------------------------------------------------------------------------------------
@@ -0,0 +1,96 @@
+-- --------------------------------------------------------------------------------------
+-- Command queue benchmark for engine/world/tiny-ecs-commands.lua
+--   An editor session flooding the server: every frame 2000 commands arrive, 90% of
+--   them ENTITY_MOVE of 200 dragged entities (out of 5000), the rest PERF_STATS. Runs
+--   the old queue (table.insert, tdump of every message, the whole queue run every
+--   update and never cleared) and the ring buffer queue with coalescing, batching and
+--   its time budget. Reports ms per frame for queuing and processing and the depth.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_commands_bench.lua [frames] [commands]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+package.cpath   = package.cpath..";./bin/linux/?.so"
+
+local utils     = require("lua.utils")
+local socket    = require("socket.core")
+local cmds      = require("engine.world.tiny-ecs-commands")
+
+local FRAMES    = tonumber(arg[1]) or 30
+local COMMANDS  = tonumber(arg[2]) or 2000
+local ENTITIES  = 5000
+local DRAGGED   = 200
+
+local function now() return socket.gettime() * 1000.0 end
+
+-- --------------------------------------------------------------------------------------
+
+local entities = {}
+for i = 1, ENTITIES do entities[i] = { id = i, pos = { x = 0, y = 0, z = 0 } } end
+
+local function make_messages(frame)
+    math.randomseed(frame)
+    local msgs = {}
+    for i = 1, COMMANDS do
+        if(math.random() < 0.9) then
+            local id = math.random(DRAGGED)
+            msgs[i] = { cmd = "ENTITY_MOVE", id = id, pos = { x = frame, y = i, z = 0 } }
+        else
+            msgs[i] = { cmd = "PERF_STATS" }
+        end
+    end
+    return msgs
+end
+
+local moves = 0
+local function apply_move(msg)
+    local ent = entities[msg.id]
+    if(ent) then ent.pos = msg.pos; moves = moves + 1 end
+end
+
+-- --------------------------------------------------------------------------------------
+-- The queue as it was
+
+local old = { queue = {} }
+local OLD_CMDS = { ENTITY_MOVE = apply_move, PERF_STATS = function(msg) end }
+old.process_command = function(ws, msg)
+    if(type(msg) == "table" and msg.cmd and OLD_CMDS[msg.cmd]) then
+        local dump = utils.tdump(msg)   -- was printed
+        table.insert(old.queue, msg)
+    end
+end
+old.process_queue = function()
+    for k, msg in ipairs(old.queue) do OLD_CMDS[msg.cmd](msg) end
+end
+
+local function run(label, queue_fn, process_fn, depth_fn)
+    moves = 0
+    local qms, pms = 0, 0
+    for f = 1, FRAMES do
+        local msgs = make_messages(f)
+        local start = now()
+        for i = 1, #msgs do queue_fn(nil, msgs[i]) end
+        qms = qms + now() - start
+        start = now()
+        process_fn()
+        pms = pms + now() - start
+    end
+    print(string.format("  %-12s queue %7.3f ms / frame   process %8.3f ms / frame   moves applied %8d   depth %d",
+        label, qms / FRAMES, pms / FRAMES, moves, depth_fn()))
+end
+
+-- --------------------------------------------------------------------------------------
+
+print(string.format("%d frames, %d commands / frame, %d of %d entities dragged", FRAMES, COMMANDS, DRAGGED, ENTITIES))
+run("old queue", old.process_command, old.process_queue, function() return #old.queue end)
+
+cmds.find_entity = function(id) return entities[id] end
+cmds.entity_changed = function(ent, component) moves = moves + 1 end
+run("ring queue", cmds.process_command, function() cmds.process_queue() end, function() return cmds.queue.count end)
+
+local s = cmds.stats
+print(string.format("  ring queue   queued %d   coalesced %d   batches %d   processed %d   max depth %d   max %.3f ms",
+    s.queued, s.coalesced, s.batches, s.processed, s.max_depth, s.max_ms))
+
+-- --------------------------------------------------------------------------------------
@@ -0,0 +1,101 @@
+-- --------------------------------------------------------------------------------------
+-- Entity change benchmark for the tiny-ecs component masks
+--   A world with 64 systems (requireAll / rejectAny / tiny.filter filters over 24
+--   component types) and 20k entities. Every frame 2k entities gain or lose a component
+--   and are re-added, so tiny_manageEntities re-tests them against every system. Runs
+--   once calling the filter functions (tiny.bitmaskFilters = false) and once with masks,
+--   each in its own process so the traces of one run do not affect the other.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_filter_bench.lua [entities] [changes] [frames]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local tiny      = require("engine.world.tiny-ecs")
+local workers   = dofile("engine/core/workers.lua")
+
+local LUAJIT    = "./bin/linux/luajit"
+local SELF      = "tools/bench/ecs_filter_bench.lua"
+
+local COUNT     = tonumber(arg[1]) or 20000
+local CHANGES   = tonumber(arg[2]) or 2000
+local FRAMES    = tonumber(arg[3]) or 100
+local SYSTEMS   = 64
+local TYPES     = 24
+
+local names = {}
+for i = 1, TYPES do names[i] = "c"..i end
+
+-- --------------------------------------------------------------------------------------
+
+local function make_filter(i)
+    local a, b, c = names[(i % TYPES) + 1], names[((i * 7) % TYPES) + 1], names[((i * 13) % TYPES) + 1]
+    local kind = i % 3
+    if(kind == 0) then return tiny.requireAll(a, b) end
+    if(kind == 1) then return tiny.requireAll(a, tiny.rejectAny(b, c)) end
+    return tiny.filter(a.."&"..b.."&!"..c)
+end
+
+local function child(masks)
+
+    tiny.bitmaskFilters = masks
+    math.randomseed(1)
+    local world = tiny.world()
+    local systems = {}
+    for i = 1, SYSTEMS do
+        local system = tiny.system()
+        system.filter = make_filter(i)
+        systems[i] = system
+        world:addSystem(system)
+    end
+    local entities = {}
+    for i = 1, COUNT do
+        local e = {}
+        for j = 1, TYPES do
+            if(math.random() < 0.3) then e[names[j]] = true end
+        end
+        entities[i] = e
+        world:addEntity(e)
+    end
+    world:update(0)
+
+    local elapsed = 0
+    for f = 1, FRAMES do
+        for k = 1, CHANGES do
+            local e = entities[math.random(COUNT)]
+            local name = names[math.random(TYPES)]
+            if(e[name]) then e[name] = nil else e[name] = true end
+            world:addEntity(e)
+        end
+        local start = workers.now()
+        world:update(0)
+        elapsed = elapsed + workers.now() - start
+    end
+
+    local members = 0
+    for i = 1, SYSTEMS do members = members + #systems[i].entities end
+    print(string.format("%.3f %d", elapsed / FRAMES, members))
+end
+
+if(arg[4] == "--child") then
+    child(arg[5] == "masks")
+    return
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function run(label, mode)
+    local cmd = table.concat({ LUAJIT, SELF, COUNT, CHANGES, FRAMES, "--child", mode }, " ")
+    local ms, members = string.match(io.popen(cmd):read("*a"), "(%S+) (%S+)")
+    ms = tonumber(ms)
+    print(string.format("  %-18s %7.3f ms / frame   memberships %s", label, ms, members))
+    return ms
+end
+
+print(string.format("%d entities, %d changes / frame, %d systems, %d frames", COUNT, CHANGES, SYSTEMS, FRAMES))
+local fn_ms   = run("filter functions", "functions")
+local mask_ms = run("component masks", "masks")
+print(string.format("  speedup %.1fx", fn_ms / mask_ms))
+
+-- --------------------------------------------------------------------------------------
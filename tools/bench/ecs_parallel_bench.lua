@@ -0,0 +1,106 @@
+-- --------------------------------------------------------------------------------------
+-- Parallel system benchmark for engine/world/tiny-ecs-scheduler.lua
+--   200k entities in FFI chunks, each with a shared read only "velocity" and eight
+--   components of its own. Eight parallel systems each integrate one of them (a few
+--   sin / sqrt per entity), so none of them conflict and the scheduler puts all eight in
+--   one level. Every thread count runs in its own process. 0 threads runs the same bodies
+--   on the main state.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_parallel_bench.lua [entities] [frames] [max threads]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+package.preload["lua.engine.workers"] = function() return dofile("engine/core/workers.lua") end
+
+local tiny      = require("engine.world.tiny-ecs")
+local chunks    = require("engine.world.tiny-ecs-chunks")
+local scheduler = require("engine.world.tiny-ecs-scheduler")
+local workers   = require("lua.engine.workers")
+tiny.chunks, tiny.scheduler = chunks, scheduler
+
+local LUAJIT    = "./bin/linux/luajit"
+local SELF      = "tools/bench/ecs_parallel_bench.lua"
+
+local COUNT     = tonumber(arg[1]) or 200000
+local FRAMES    = tonumber(arg[2]) or 60
+local MAXTHREADS = tonumber(arg[3]) or 8
+local SYSTEMS   = 8
+local DT        = 1.0 / 60.0
+
+-- --------------------------------------------------------------------------------------
+
+local body = [[
+return function(cols, count, dt)
+    local v, s = cols.velocity, cols.state%d
+    for i = 0, count - 1 do
+        local vi, si = v[i], s[i]
+        local a = si.x + vi.x * dt
+        local b = si.y + vi.y * dt
+        si.x = a + math.sin(b) * 0.001
+        si.y = b + math.sin(a) * 0.001
+        si.z = math.sqrt(a * a + b * b)
+    end
+end
+]]
+
+local function child(threads)
+
+    scheduler.threads = threads
+    chunks.component("velocity", "float x, y, z;")
+    for k = 1, SYSTEMS do chunks.component("state"..k, "float x, y, z;") end
+
+    math.randomseed(1)
+    local world = tiny.world()
+    local store = chunks.store(world)
+    for i = 1, COUNT do
+        local comps = { velocity = { math.random(), math.random(), math.random() } }
+        for k = 1, SYSTEMS do comps["state"..k] = { math.random(), math.random(), 0 } end
+        chunks.spawn(store, comps, nil, world)
+    end
+    for k = 1, SYSTEMS do
+        world:addSystem(tiny.system({
+            reads       = { "velocity" },
+            writes      = { "state"..k },
+            parallel    = string.format(body, k),
+        }))
+    end
+
+    for f = 1, 5 do world:update(DT) end
+    local start = workers.now()
+    for f = 1, FRAMES do world:update(DT) end
+    local ms = (workers.now() - start) / FRAMES
+
+    -- Checksum over the first chunk, the same for every thread count
+    local sum = 0
+    local chunk = store.archetype_list[1].chunks[1]
+    for k = 1, SYSTEMS do
+        local col = chunk.columns["state"..k]
+        for i = 0, chunk.count - 1 do sum = sum + col[i].x end
+    end
+    local threads_used = world.scheduler and #world.scheduler.threads or 0
+    scheduler.shutdown(world)
+    print(string.format("%.3f %.4f %d", ms, sum, threads_used))
+end
+
+if(arg[4] == "--child") then
+    child(tonumber(arg[5]))
+    return
+end
+
+-- --------------------------------------------------------------------------------------
+
+print(string.format("%d entities, %d systems, %d frames, workers.available %s", COUNT, SYSTEMS, FRAMES, tostring(workers.available)))
+-- Total threads 1, 2, 4, 8 ... (workers plus the main thread)
+local base = nil
+local total = 1
+while(total <= MAXTHREADS) do
+    local cmd = table.concat({ LUAJIT, SELF, COUNT, FRAMES, MAXTHREADS, "--child", total - 1 }, " ")
+    local ms, sum, used = string.match(io.popen(cmd):read("*a"), "(%S+) (%S+) (%S+)")
+    ms = tonumber(ms)
+    base = base or ms
+    print(string.format("  %d worker threads + main   %8.3f ms / frame   speedup %.2fx   checksum %s", tonumber(used), ms, base / ms, sum))
+    total = total * 2
+end
+
+-- --------------------------------------------------------------------------------------
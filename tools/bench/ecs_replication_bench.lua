@@ -0,0 +1,147 @@
+-- --------------------------------------------------------------------------------------
+-- Replication benchmark for engine/world/tiny-ecs-replication.lua
+--   10k live entities shaped like world-manager game objects. Every replication tick 10%
+--   of them move (pos + rot) and 0.5% change a prop. Compares the bytes and server time
+--   per tick of json.encode over every entity table, json.encode over the changed entity
+--   tables, and the binary delta frame for a client that acks every frame. Every 8th
+--   frame is dropped (not acked) to exercise the baselines. The client mirror is checked
+--   against the world at the end.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_replication_bench.lua [entities] [ticks]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local tiny      = require("engine.world.tiny-ecs")
+local repl      = require("engine.world.tiny-ecs-replication")
+local json      = require("lua.json")
+local workers   = dofile("engine/core/workers.lua")
+
+local COUNT     = tonumber(arg[1]) or 10000
+local TICKS     = tonumber(arg[2]) or 60
+local MOVES     = math.floor(COUNT * 0.1)
+local PROPS     = math.floor(COUNT * 0.005)
+
+-- --------------------------------------------------------------------------------------
+
+local function rnd(a, b) return a + math.random() * (b - a) end
+
+local function random_rot()
+    local x, y, z, w = rnd(-1, 1), rnd(-1, 1), rnd(-1, 1), rnd(-1, 1)
+    local l = math.sqrt(x * x + y * y + z * z + w * w)
+    return { x = x / l, y = y / l, z = z / l, w = w / l }
+end
+
+math.randomseed(1)
+local world = tiny.world()
+local entities = {}
+for i = 1, COUNT do
+    local e = {
+        id = 16777216 + i,
+        name = "entity_"..i,
+        etype = "gameobject",
+        created = 1700000000 + i,
+        visible = 1,
+        pos = { x = rnd(-500, 500), y = rnd(-500, 500), z = rnd(-500, 500) },
+        rot = random_rot(),
+        scale = { 1, 1, 1 },
+    }
+    entities[i] = e
+    world:addEntity(e)
+end
+world:update(0)
+
+local state = repl.new(world)
+repl.client(state, "editor")
+local mirror = {}
+
+-- One replication tick of changes
+local function change()
+    local changed = {}
+    for k = 1, MOVES do
+        local e = entities[math.random(COUNT)]
+        local p = e.pos
+        p.x, p.y, p.z = p.x + rnd(-1, 1), p.y + rnd(-1, 1), p.z + rnd(-1, 1)
+        e.rot = random_rot()
+        world:markChanged(e, "pos")
+        world:markChanged(e, "rot")
+        changed[e] = true
+    end
+    for k = 1, PROPS do
+        local e = entities[math.random(COUNT)]
+        e.visible = 1 - e.visible
+        world:markChanged(e, "visible")
+        changed[e] = true
+    end
+    world:update(1 / 60)
+    return changed
+end
+
+-- --------------------------------------------------------------------------------------
+
+local times = { full = 0, changed = 0, delta = 0, decode = 0 }
+local bytes = { full = 0, changed = 0, delta = 0 }
+
+-- Initial full frame
+local first = repl.encode(state, "editor")
+repl.ack(state, "editor", repl.decode(first, mirror))
+local first_json = #json.encode(entities)
+
+for t = 1, TICKS do
+    local changed = change()
+
+    local start = workers.now()
+    local data = json.encode(entities)
+    times.full = times.full + workers.now() - start
+    bytes.full = bytes.full + #data
+
+    start = workers.now()
+    local list = {}
+    for e in pairs(changed) do list[#list + 1] = e end
+    data = json.encode(list)
+    times.changed = times.changed + workers.now() - start
+    bytes.changed = bytes.changed + #data
+
+    start = workers.now()
+    data = repl.encode(state, "editor") or ""
+    times.delta = times.delta + workers.now() - start
+    bytes.delta = bytes.delta + #data
+
+    if(#data > 0 and t % 8 ~= 0) then
+        start = workers.now()
+        repl.ack(state, "editor", repl.decode(data, mirror))
+        times.decode = times.decode + workers.now() - start
+    end
+end
+
+-- Last frame, then the mirror has to match the world to quantization precision
+local data = repl.encode(state, "editor")
+if(data) then repl.ack(state, "editor", repl.decode(data, mirror)) end
+local bad, count = 0, 0
+for i = 1, COUNT do
+    local e, m = entities[i], mirror[entities[i].id]
+    if(m == nil or math.abs(m.pos.x - e.pos.x) > 0.001 or math.abs(m.pos.z - e.pos.z) > 0.001
+        or math.abs(math.abs(m.rot.x * e.rot.x + m.rot.y * e.rot.y + m.rot.z * e.rot.z + m.rot.w * e.rot.w) - 1) > 0.001
+        or m.visible ~= e.visible or m.name ~= e.name) then
+        bad = bad + 1
+    end
+end
+for id in pairs(mirror) do count = count + 1 end
+
+-- --------------------------------------------------------------------------------------
+
+print(string.format("%d entities, %d ticks, %d moves + %d prop changes / tick", COUNT, TICKS, MOVES, PROPS))
+print(string.format("  initial state     json %9.1f KB   binary %9.1f KB", first_json / 1024, #first / 1024))
+local function line(label, key)
+    print(string.format("  %-16s %8.3f ms / tick %10.1f KB / tick", label, times[key] / TICKS, bytes[key] / TICKS / 1024))
+end
+line("json all", "full")
+line("json changed", "changed")
+line("binary delta", "delta")
+print(string.format("  client decode    %8.3f ms / tick", times.decode / TICKS))
+print(string.format("  bandwidth vs json changed %.1fx smaller, vs json all %.1fx smaller",
+    bytes.changed / bytes.delta, bytes.full / bytes.delta))
+print(string.format("  mirror %d entities, %d mismatches", count, bad))
+
+-- --------------------------------------------------------------------------------------
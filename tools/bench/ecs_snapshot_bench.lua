@@ -0,0 +1,144 @@
+-- --------------------------------------------------------------------------------------
+-- Snapshot benchmark for engine/world/tiny-ecs-snapshot.lua
+--   250k entities shaped like world-manager game objects (name, etype, pos, rot, scale,
+--   a few props, some with an inventory list or a long waypoint list, a quarter with a
+--   velocity in FFI chunks). Saves and loads them with json (the current path) and with
+--   a snapshot, reports times and file sizes and checks that the snapshot round trip
+--   gives back the same entities and chunk components. "open" is just mapping the file
+--   and getting the pos.x column, what a system reading columns directly would pay.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_snapshot_bench.lua [entities]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local tiny      = require("engine.world.tiny-ecs")
+local chunks    = require("engine.world.tiny-ecs-chunks")
+local snapshot  = require("engine.world.tiny-ecs-snapshot")
+local json      = require("lua.json")
+local workers   = dofile("engine/core/workers.lua")
+
+local COUNT     = tonumber(arg[1]) or 250000
+local JSON_FILE = os.tmpname()
+local SNAP_FILE = os.tmpname()
+
+-- --------------------------------------------------------------------------------------
+
+local function rnd(a, b) return a + math.random() * (b - a) end
+
+local function timed(func, ...)
+    collectgarbage("collect")
+    local start = workers.now()
+    local a, b = func(...)
+    return workers.now() - start, a, b
+end
+
+local function file_size(path)
+    local fh = io.open(path, "rb")
+    local size = fh:seek("end")
+    fh:close()
+    return size
+end
+
+chunks.component("velocity", "float x, y, z;")
+
+math.randomseed(1)
+local world = tiny.world()
+local store = chunks.store(world)
+for i = 1, COUNT do
+    local e = {
+        id = 16777216 + i,
+        name = "entity_"..i,
+        etype = (i % 10 == 0) and "camera" or "gameobject",
+        created = 1700000000 + i * 0.25,
+        visible = i % 7 ~= 0,
+        pos = { x = rnd(-500, 500), y = rnd(-500, 500), z = rnd(-500, 500) },
+        rot = { x = 0, y = rnd(-1, 1), z = 0, w = 1 },
+        scale = { 1, 1, 1 },
+        health = math.random(100),
+        script = "scripts/npc_"..(i % 16)..".lua",
+    }
+    if(i % 5 == 0) then e.inventory = { "sword", "shield", math.random(10) } end
+    if(i % 50 == 0) then
+        e.waypoints = {}
+        for k = 1, 40 do e.waypoints[k] = math.random(1000) end
+    end
+    if(i % 4 == 0) then
+        chunks.spawn(store, { velocity = { rnd(-1, 1), rnd(-1, 1), rnd(-1, 1) } }, e, world)
+    else
+        world:addEntity(e)
+    end
+end
+world:update(0)
+-- world.entities also maps entity -> index, json wants the plain list (and no chunk refs)
+local entities = {}
+for i = 1, #world.entities do
+    local e = {}
+    for k, v in pairs(world.entities[i]) do
+        if(string.byte(k) ~= 95) then e[k] = v end
+    end
+    entities[i] = e
+end
+
+-- --------------------------------------------------------------------------------------
+
+local json_save = timed(function()
+    local fh = io.open(JSON_FILE, "wb")
+    fh:write(json.encode(entities))
+    fh:close()
+end)
+local json_load, loaded_json = timed(function()
+    local fh = io.open(JSON_FILE, "rb")
+    local data = fh:read("*a")
+    fh:close()
+    return json.decode(data)
+end)
+loaded_json = nil
+
+local snap_save, stats = timed(snapshot.save, SNAP_FILE, world)
+local snap_open = timed(function()
+    local snap = snapshot.open(SNAP_FILE)
+    local xs = snapshot.column(snap, "pos", "x")
+    local sum = 0
+    for i = 0, snap.count - 1 do sum = sum + xs[i] end
+    snapshot.close(snap)
+    return sum
+end)
+local snap_load, loaded, loaded_store = timed(snapshot.load, SNAP_FILE, nil)
+
+-- Round trip check
+local bad = 0
+local function same(a, b, depth)
+    if(type(a) ~= "table") then return a == b end
+    if(type(b) ~= "table") then return false end
+    for k, v in pairs(a) do if(not same(v, b[k], depth + 1)) then return false end end
+    for k in pairs(b) do
+        if(a[k] == nil and not (depth == 0 and string.byte(k) == 95)) then return false end
+    end
+    return true
+end
+local function same_velocity(a, b)
+    local va, vb = chunks.get(a, "velocity"), chunks.get(b, "velocity")
+    if(va == nil or vb == nil) then return va == vb end
+    return va.x == vb.x and va.y == vb.y and va.z == vb.z
+end
+for i = 1, COUNT do
+    if(not same(entities[i], loaded[i], 0) or not same_velocity(world.entities[i], loaded[i])) then bad = bad + 1 end
+end
+
+-- --------------------------------------------------------------------------------------
+
+print(string.format("%d entities, %d columns, %d strings", COUNT, stats.columns, stats.strings))
+print(string.format("  json      save %8.1f ms   load %8.1f ms   file %7.1f MB",
+    json_save, json_load, file_size(JSON_FILE) / 1048576))
+print(string.format("  snapshot  save %8.1f ms   load %8.1f ms   file %7.1f MB   open + pos.x column %.2f ms",
+    snap_save, snap_load, stats.size / 1048576, snap_open))
+print(string.format("  speedup   save %.1fx   load %.1fx", json_save / snap_save, json_load / snap_load))
+print(string.format("  round trip mismatches %d / %d   chunk entities %d / %d", bad, COUNT,
+    loaded_store and loaded_store.count or 0, store.count))
+
+os.remove(JSON_FILE)
+os.remove(SNAP_FILE)
+
+-- --------------------------------------------------------------------------------------
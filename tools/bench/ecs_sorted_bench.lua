@@ -0,0 +1,124 @@
+-- --------------------------------------------------------------------------------------
+-- Sorted system benchmark for tiny-ecs
+--   A sorted system over entities with a depth, at 10k and 100k entities. Two loads per
+--   frame, each timed over a world update:
+--     churn   1% of the entities removed and 1% added (keys do not change)
+--     resort  1% of the entities move in depth, the system is marked for a resort
+--   Runs the old onModify (table.sort of the whole list every time), the incremental
+--   sort (compare) and the radix sort (sortKey), each in its own process so the
+--   traces of one do not affect the others, and checks the lists end up sorted.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/ecs_sorted_bench.lua [frames]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local ffi       = require("ffi")
+local tiny      = require("engine.world.tiny-ecs")
+local workers   = dofile("engine/core/workers.lua")
+
+local LUAJIT    = "./bin/linux/luajit"
+local SELF      = "tools/bench/ecs_sorted_bench.lua"
+
+local FRAMES    = tonumber(arg[1]) or 50
+local SIZES     = { 10000, 100000 }
+
+-- --------------------------------------------------------------------------------------
+
+-- The onModify tiny-ecs had before: sort everything with table.sort
+local function fullSortOnModify(system)
+    local entities, indices = system.entities, system.indices
+    local sortDelegate = system.sortDelegate
+    if not sortDelegate then
+        sortDelegate = function(e1, e2) return system:compare(e1, e2) end
+        system.sortDelegate = sortDelegate
+    end
+    table.sort(entities, sortDelegate)
+    for i = 1, #entities do indices[entities[i]] = i end
+end
+
+local function make_system(mode)
+    local system = tiny.sortedSystem({ filter = tiny.requireAll("depth") })
+    if(mode == "radix") then
+        system.sortKey = function(self, e) return e.depth end
+    else
+        system.compare = function(self, a, b) return a.depth < b.depth end
+    end
+    if(mode == "table.sort") then system.onModify = fullSortOnModify end
+    return system
+end
+
+local function child(count, mode)
+
+    math.randomseed(1)
+    local world = tiny.world()
+    local system = make_system(mode)
+    world:addSystem(system)
+    local live = {}
+    for i = 1, count do
+        live[i] = { depth = math.random() * 1000 }
+        world:addEntity(live[i])
+    end
+    world:update(0)
+
+    local churn, resort = 0, 0
+    local step = math.max(1, math.floor(count / 100))
+    for f = 1, FRAMES do
+        for k = 1, step do
+            local i = math.random(#live)
+            world:removeEntity(live[i])
+            live[i] = { depth = math.random() * 1000 }
+            world:addEntity(live[i])
+        end
+        local start = workers.now()
+        world:update(0)
+        churn = churn + workers.now() - start
+
+        for k = 1, step do
+            local e = live[math.random(#live)]
+            e.depth = e.depth + (math.random() - 0.5) * 2
+        end
+        system.resort = true
+        system.modified = true
+        start = workers.now()
+        world:update(0)
+        resort = resort + workers.now() - start
+    end
+
+    -- radix keys are floats, so compare at float precision there
+    local f = ffi.new("float[1]")
+    local function key(e)
+        if(mode ~= "radix") then return e.depth end
+        f[0] = e.depth
+        return f[0]
+    end
+    local entities, sorted = system.entities, system.indices[system.entities[1]] == 1
+    for i = 2, #entities do
+        if(key(entities[i]) < key(entities[i - 1]) or system.indices[entities[i]] ~= i) then sorted = false end
+    end
+    print(string.format("%.3f %.3f %s", churn / FRAMES, resort / FRAMES, tostring(sorted)))
+end
+
+if(arg[2] == "--child") then
+    child(tonumber(arg[3]), arg[4])
+    return
+end
+
+-- --------------------------------------------------------------------------------------
+
+print(string.format("%d frames, 1%% churn", FRAMES))
+for _, count in ipairs(SIZES) do
+    print(string.format("  %d entities", count))
+    local base = nil
+    for _, mode in ipairs({ "table.sort", "incremental", "radix" }) do
+        local cmd = table.concat({ LUAJIT, SELF, FRAMES, "--child", count, mode }, " ")
+        local churn, resort, sorted = string.match(io.popen(cmd):read("*a"), "(%S+) (%S+) (%S+)")
+        churn, resort = tonumber(churn), tonumber(resort)
+        base = base or { churn, resort }
+        print(string.format("    %-12s churn %8.3f ms (%5.1fx)   resort %8.3f ms (%5.1fx)   sorted %s",
+            mode, churn, base[1] / churn, resort, base[2] / resort, sorted))
+    end
+end
+
+-- --------------------------------------------------------------------------------------
@@ -0,0 +1,138 @@
+-- --------------------------------------------------------------------------------------
+-- Spawn / despawn churn benchmark for engine/world/entity-handles.lua
+--   Compares the old world-manager bookkeeping (id = tcount(entities), lookup index =
+--   tcount(entities), linear findGo) with generational handles:
+--     spawn    bulk spawn N entities
+--     churn    frames of despawning 1% random entities and spawning as many new ones
+--     lookup   id -> entity and game object -> entity for every live entity
+--   The old scheme is quadratic, so it only runs up to [old max] entities.
+--   Stale handles (ids of despawned entities) are checked to never resolve.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/entity_handles_bench.lua [old max] [frames]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local handles   = require("engine.world.entity-handles")
+local workers   = dofile("engine/core/workers.lua")
+
+local OLD_MAX   = tonumber(arg[1]) or 20000
+local FRAMES    = tonumber(arg[2]) or 100
+local SIZES     = { 5000, 20000, 50000, 200000 }
+
+local tinsert   = table.insert
+
+-- --------------------------------------------------------------------------------------
+-- Old world-manager bookkeeping (as it was before entity handles)
+
+local function tcount(tbl)
+    local cnt = 0
+    for k, v in pairs(tbl) do cnt = cnt + 1 end
+    return cnt
+end
+
+local old = {}
+old.new = function() return { entities = {}, entities_lookup = {} } end
+old.spawn = function(w, obj)
+    obj.id = tcount(w.entities)
+    tinsert(w.entities, obj)
+    w.entities_lookup[obj.id] = tcount(w.entities)
+    return obj.id
+end
+old.despawn = function(w, id)
+    -- The old removeEntity only dropped the entity from tiny, the tables kept growing
+    local ent = w.entities[w.entities_lookup[id]]
+    return ent
+end
+old.get = function(w, id) return w.entities[w.entities_lookup[id]] end
+old.findGo = function(w, go)
+    for k, v in pairs(w.entities) do
+        if(v.go == go) then return v end
+    end
+end
+
+-- --------------------------------------------------------------------------------------
+-- Handles, as world-manager uses them now
+
+local new = {}
+new.new = function() return { pool = handles.new(), entities = {}, entities_lookup = {}, go_lookup = {} } end
+new.spawn = function(w, obj)
+    local id = handles.create(w.pool, obj)
+    local index = handles.index(id)
+    obj.id = id
+    w.entities[index] = obj
+    w.entities_lookup[id] = index
+    w.go_lookup[obj.go] = id
+    return id
+end
+new.despawn = function(w, id)
+    local ent = handles.destroy(w.pool, id)
+    if(ent == nil) then return nil end
+    w.entities[handles.index(id)] = nil
+    w.entities_lookup[id] = nil
+    w.go_lookup[ent.go] = nil
+    return ent
+end
+new.get = function(w, id) return handles.get(w.pool, id) end
+new.findGo = function(w, go)
+    local id = w.go_lookup[go]
+    return id and w.entities[w.entities_lookup[id]]
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function run(impl, count)
+
+    math.randomseed(1)
+    local w = impl.new()
+    local ids, serial = {}, 0
+    local function make()
+        serial = serial + 1
+        return { name = "e"..serial, go = "/go"..serial }
+    end
+
+    local t0 = workers.now()
+    for i = 1, count do ids[i] = impl.spawn(w, make()) end
+    local spawn_ms = workers.now() - t0
+
+    local churn = math.max(1, math.floor(count / 100))
+    local stale = {}
+    t0 = workers.now()
+    for f = 1, FRAMES do
+        for k = 1, churn do
+            local i = math.random(count)
+            impl.despawn(w, ids[i])
+            if(#stale < 1000) then tinsert(stale, ids[i]) end
+            ids[i] = impl.spawn(w, make())
+        end
+    end
+    local churn_ms = (workers.now() - t0) / FRAMES
+
+    t0 = workers.now()
+    local found = 0
+    for i = 1, count do
+        local e = impl.get(w, ids[i])
+        if(e and impl.findGo(w, e.go) == e) then found = found + 1 end
+    end
+    local lookup_ms = workers.now() - t0
+
+    local stale_hits = 0
+    for i, id in ipairs(stale) do
+        if(impl.get(w, id) ~= nil) then stale_hits = stale_hits + 1 end
+    end
+    return spawn_ms, churn_ms, lookup_ms, found, stale_hits, #stale
+end
+
+print(string.format("churn %d frames of 1%% despawn + spawn", FRAMES))
+for i, count in ipairs(SIZES) do
+    for j, mode in ipairs({ { "old ids", old }, { "handles", new } }) do
+        if(mode[2] ~= old or count <= OLD_MAX) then
+            local spawn_ms, churn_ms, lookup_ms, found, stale_hits, stale = run(mode[2], count)
+            print(string.format("  %7d %-8s spawn %9.2f ms   churn %8.3f ms / frame   lookup %9.2f ms   found %d   stale hits %d / %d",
+                count, mode[1], spawn_ms, churn_ms, lookup_ms, found, stale_hits, stale))
+        end
+    end
+end
+
+-- --------------------------------------------------------------------------------------
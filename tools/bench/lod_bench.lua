@@ -0,0 +1,169 @@
+-- --------------------------------------------------------------------------------------
+-- LOD benchmark for engine/geometry/lod.lua
+--   Builds the LOD chain of a dense mesh, then flies a camera through a 10x10x10 grid of
+--   copies and reports per frame triangles and vertex shader invocations (FIFO-16 cache
+--   misses of the chosen level) with and without LOD, plus LOD switches with and without
+--   hysteresis.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/lod_bench.lua [model.obj]
+--   Without arguments it uses a 64k triangle uv sphere.
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+package.preload["lua.geometry.meshopt"] = function() return dofile("engine/geometry/meshopt.lua") end
+-- Selection math only, no renderer
+package.preload["lua.geometry.bins"]    = function() return {} end
+package.preload["lua.engine.camera_manager"] = function() return {} end
+
+local ffi       = require("ffi")
+local meshopt   = require("lua.geometry.meshopt")
+local lod       = dofile("engine/geometry/lod.lua")
+
+local tinsert   = table.insert
+
+local GRID      = 10
+local SPACING   = 4.0
+local FRAMES    = 240
+local HEIGHT    = 1080
+local VFOV      = 60.0
+
+-- --------------------------------------------------------------------------------------
+
+local function make_sphere(rings, segs)
+
+    local verts, indices = {}, {}
+    for r = 0, rings do
+        local phi = math.pi * r / rings
+        for s = 0, segs do
+            local theta = 2.0 * math.pi * s / segs
+            tinsert(verts, math.sin(phi) * math.cos(theta))
+            tinsert(verts, math.cos(phi))
+            tinsert(verts, math.sin(phi) * math.sin(theta))
+        end
+    end
+    for r = 0, rings - 1 do
+        for s = 0, segs - 1 do
+            local a = r * (segs + 1) + s
+            local b = a + segs + 1
+            tinsert(indices, a); tinsert(indices, b); tinsert(indices, a + 1)
+            tinsert(indices, a + 1); tinsert(indices, b); tinsert(indices, b + 1)
+        end
+    end
+    return verts, indices
+end
+
+local function load_obj(filename)
+
+    local fh = io.open(filename, "r")
+    if(fh == nil) then return nil end
+    local verts, indices = {}, {}
+    for line in fh:lines() do
+        if(line:sub(1, 2) == "v ") then
+            for n in line:sub(3):gmatch("%S+") do tinsert(verts, tonumber(n)) end
+        elseif(line:sub(1, 2) == "f ") then
+            local face = {}
+            for ref in line:sub(3):gmatch("%S+") do
+                local i = tonumber(ref:match("^(-?%d+)"))
+                if(i < 0) then i = #verts / 3 + i else i = i - 1 end
+                tinsert(face, i)
+            end
+            for k = 2, #face - 1 do
+                tinsert(indices, face[1]); tinsert(indices, face[k]); tinsert(indices, face[k + 1])
+            end
+        end
+    end
+    fh:close()
+    return verts, indices
+end
+
+-- --------------------------------------------------------------------------------------
+
+local verts, indices
+if(arg[1]) then
+    verts, indices = load_obj(arg[1])
+    if(verts == nil) then print("[Error] Cannot open: "..arg[1]); return end
+else
+    verts, indices = make_sphere(128, 256)
+end
+
+local primdata = {
+    verts   = ffi.new("float[?]", #verts, verts),
+    indices = ffi.new("uint32_t[?]", #indices, indices),
+    icount  = #indices,
+}
+meshopt.optimize(primdata)
+
+local start = os.clock()
+local lods = lod.build(primdata, 5)
+if(lods == nil) then print("[Error] Mesh did not simplify"); return end
+print(string.format("LOD chain built in %.1f ms", (os.clock() - start) * 1000.0))
+
+-- Mesh size (aabb diagonal) and vertex transforms per level
+local minx, miny, minz, maxx, maxy, maxz = math.huge, math.huge, math.huge, -math.huge, -math.huge, -math.huge
+for v = 0, primdata.vcount - 1 do
+    local x, y, z = primdata.verts[v * 3], primdata.verts[v * 3 + 1], primdata.verts[v * 3 + 2]
+    minx, maxx = math.min(minx, x), math.max(maxx, x)
+    miny, maxy = math.min(miny, y), math.max(maxy, y)
+    minz, maxz = math.min(minz, z), math.max(maxz, z)
+end
+local diag = math.sqrt((maxx - minx) ^ 2 + (maxy - miny) ^ 2 + (maxz - minz) ^ 2)
+local scale = SPACING * 0.5 / diag
+
+for l, level in ipairs(lods) do
+    local acmr, atvr, misses = meshopt.analyze_vertex_cache(primdata.indices + level.offset, level.count, primdata.vcount)
+    level.transforms = misses
+    print(string.format("  LOD%d  tris %7d  error %.5f  vertex transforms %7d", l - 1, level.count / 3, level.error, misses))
+end
+
+-- --------------------------------------------------------------------------------------
+-- Camera flies from outside the grid to its center along the diagonal
+
+local focal = HEIGHT * 0.5 / math.tan(math.rad(VFOV) * 0.5)
+local count = GRID * GRID * GRID
+
+local function run(hysteresis)
+
+    lod.hysteresis = hysteresis
+    local current = {}
+    for i = 1, count do current[i] = 1 end
+    local totals = { full = 0, tris = 0, full_vt = 0, vt = 0, switches = 0 }
+    local far = GRID * SPACING * 1.5
+
+    for f = 0, FRAMES - 1 do
+        -- Small back and forth wobble on top of the fly in, like a hand held camera
+        local t = f / (FRAMES - 1)
+        local d = far * (1.0 - t) + math.sin(f * 0.7) * 1.5
+        local cx, cy, cz = d, d, d
+        for i = 0, count - 1 do
+            local px = (i % GRID) * SPACING
+            local py = math.floor(i / GRID) % GRID * SPACING
+            local pz = math.floor(i / (GRID * GRID)) * SPACING
+            local dist = math.sqrt((px - cx) ^ 2 + (py - cy) ^ 2 + (pz - cz) ^ 2)
+            local depth = math.max(dist - diag * scale * 0.5, 0.1)
+            local pixels = diag * scale * focal / depth
+
+            local level = lod.pick(lods, current[i + 1], pixels)
+            -- The first frame only settles the starting levels
+            if(f > 0 and level ~= current[i + 1]) then totals.switches = totals.switches + 1 end
+            current[i + 1] = level
+            totals.full     = totals.full + lods[1].count / 3
+            totals.tris     = totals.tris + lods[level].count / 3
+            totals.full_vt  = totals.full_vt + lods[1].transforms
+            totals.vt       = totals.vt + lods[level].transforms
+        end
+    end
+    return totals
+end
+
+local plain = run(0.0)
+local hyst  = run(0.25)
+
+print(string.format("Scene: %d copies, %d frames at %dp", count, FRAMES, HEIGHT))
+print(string.format("  triangles / frame          full %10.0f   lod %10.0f   (%.1f%%)",
+    hyst.full / FRAMES, hyst.tris / FRAMES, hyst.tris / hyst.full * 100.0))
+print(string.format("  vertex transforms / frame  full %10.0f   lod %10.0f   (%.1f%%)",
+    hyst.full_vt / FRAMES, hyst.vt / FRAMES, hyst.vt / hyst.full_vt * 100.0))
+print(string.format("  lod switches               no hysteresis %d   hysteresis %d", plain.switches, hyst.switches))
+
+-- --------------------------------------------------------------------------------------
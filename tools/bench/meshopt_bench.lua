@@ -0,0 +1,137 @@
+-- --------------------------------------------------------------------------------------
+-- Vertex cache benchmark for engine/geometry/meshopt.lua
+--   Prints ACMR (cache misses per triangle) and ATVR (misses per vertex, 1.0 is ideal)
+--   for a FIFO cache of 16 before and after the optimize stage, plus the time it took.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/meshopt_bench.lua [model.obj ...]
+--   Without arguments it uses generated meshes (shuffled grid, uv sphere).
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+package.preload["lua.geometry.meshopt"] = function() return dofile("engine/geometry/meshopt.lua") end
+
+local ffi       = require("ffi")
+local meshopt   = require("lua.geometry.meshopt")
+
+local tinsert   = table.insert
+
+-- --------------------------------------------------------------------------------------
+-- Grid with triangles in random order, the worst case exporters produce
+local function make_grid(n)
+
+    local verts, indices = {}, {}
+    for y = 0, n do
+        for x = 0, n do
+            tinsert(verts, x); tinsert(verts, y); tinsert(verts, math.sin(x * 0.3) * math.cos(y * 0.3))
+        end
+    end
+    local tris = {}
+    for y = 0, n - 1 do
+        for x = 0, n - 1 do
+            local a = y * (n + 1) + x
+            tinsert(tris, { a, a + 1, a + n + 2 })
+            tinsert(tris, { a, a + n + 2, a + n + 1 })
+        end
+    end
+    math.randomseed(1234)
+    for i = #tris, 2, -1 do
+        local j = math.random(i)
+        tris[i], tris[j] = tris[j], tris[i]
+    end
+    for i, t in ipairs(tris) do
+        tinsert(indices, t[1]); tinsert(indices, t[2]); tinsert(indices, t[3])
+    end
+    return verts, indices
+end
+
+-- --------------------------------------------------------------------------------------
+-- Uv sphere in ring order (already fairly cache friendly)
+local function make_sphere(rings, segs)
+
+    local verts, indices = {}, {}
+    for r = 0, rings do
+        local phi = math.pi * r / rings
+        for s = 0, segs do
+            local theta = 2.0 * math.pi * s / segs
+            tinsert(verts, math.sin(phi) * math.cos(theta))
+            tinsert(verts, math.cos(phi))
+            tinsert(verts, math.sin(phi) * math.sin(theta))
+        end
+    end
+    for r = 0, rings - 1 do
+        for s = 0, segs - 1 do
+            local a = r * (segs + 1) + s
+            local b = a + segs + 1
+            tinsert(indices, a); tinsert(indices, b); tinsert(indices, a + 1)
+            tinsert(indices, a + 1); tinsert(indices, b); tinsert(indices, b + 1)
+        end
+    end
+    return verts, indices
+end
+
+-- --------------------------------------------------------------------------------------
+-- Positions and triangulated faces only, enough for the cache numbers
+local function load_obj(filename)
+
+    local fh = io.open(filename, "r")
+    if(fh == nil) then return nil end
+    local verts, indices = {}, {}
+    for line in fh:lines() do
+        if(line:sub(1, 2) == "v ") then
+            for n in line:sub(3):gmatch("%S+") do tinsert(verts, tonumber(n)) end
+        elseif(line:sub(1, 2) == "f ") then
+            local face = {}
+            local vc = #verts / 3
+            for ref in line:sub(3):gmatch("%S+") do
+                local i = tonumber(ref:match("^(-?%d+)"))
+                if(i < 0) then i = vc + i else i = i - 1 end
+                tinsert(face, i)
+            end
+            for k = 2, #face - 1 do
+                tinsert(indices, face[1]); tinsert(indices, face[k]); tinsert(indices, face[k + 1])
+            end
+        end
+    end
+    fh:close()
+    return verts, indices
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function bench(name, verts, indices)
+
+    local primdata = {
+        verts   = ffi.new("float[?]", #verts, verts),
+        indices = ffi.new("uint32_t[?]", #indices, indices),
+        icount  = #indices,
+    }
+    local vcount = #verts / 3
+    local acmr, atvr = meshopt.analyze_vertex_cache(primdata.indices, primdata.icount, vcount)
+
+    local start = os.clock()
+    meshopt.optimize(primdata)
+    local ms = (os.clock() - start) * 1000.0
+
+    local oacmr, oatvr = meshopt.analyze_vertex_cache(primdata.indices, primdata.icount, primdata.vcount)
+    print(string.format("%-24s tris %8d  verts %8d  ACMR %.3f -> %.3f  ATVR %.3f -> %.3f  (%.1f ms)",
+        name, primdata.icount / 3, primdata.vcount, acmr, oacmr, atvr, oatvr, ms))
+end
+
+-- --------------------------------------------------------------------------------------
+
+if(#arg > 0) then
+    for i, filename in ipairs(arg) do
+        local verts, indices = load_obj(filename)
+        if(verts) then
+            bench(filename:match("[^/\\]+$"), verts, indices)
+        else
+            print("[Error] Cannot open: "..filename)
+        end
+    end
+else
+    bench("grid 256 shuffled", make_grid(256))
+    bench("sphere 128x256", make_sphere(128, 256))
+end
+
+-- --------------------------------------------------------------------------------------
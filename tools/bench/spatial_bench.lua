@@ -0,0 +1,161 @@
+-- --------------------------------------------------------------------------------------
+-- Spatial index benchmark for engine/geometry/spatial.lua
+--   100k entities in a 2000 x 200 x 2000 world: 80% dynamic (grid), 20% static (octree),
+--   half extents 0.5 to 2. Each frame 10% of the dynamic ones move. Then radius, aabb,
+--   k nearest and ray queries, each against brute force over the same data.
+--   Results are compared with brute force so the counts must match.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/spatial_bench.lua [entities] [queries]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua"
+
+local ffi       = require("ffi")
+local spatial   = require("engine.geometry.spatial")
+local workers   = dofile("engine/core/workers.lua")
+
+local COUNT     = tonumber(arg[1]) or 100000
+local QUERIES   = tonumber(arg[2]) or 1000
+local FRAMES    = 20
+local W, H      = 1000.0, 100.0
+
+local abs, max, sqrt = math.abs, math.max, math.sqrt
+
+-- --------------------------------------------------------------------------------------
+
+math.randomseed(7)
+local function rnd(a, b) return a + math.random() * (b - a) end
+
+-- Brute force data, SoA like the index
+local cx, cy, cz = ffi.new("float[?]", COUNT), ffi.new("float[?]", COUNT), ffi.new("float[?]", COUNT)
+local ex = ffi.new("float[?]", COUNT)
+local objects, ids = {}, {}
+
+local index = spatial.new({ cell = 8.0, size = 1024.0, capacity = COUNT })
+local t0 = workers.now()
+for i = 0, COUNT - 1 do
+    cx[i], cy[i], cz[i], ex[i] = rnd(-W, W), rnd(-H, H), rnd(-W, W), rnd(0.5, 2.0)
+    objects[i] = { i = i }
+    local kind = (i % 5 == 0) and spatial.STATIC or spatial.DYNAMIC
+    ids[i] = spatial.insert(index, objects[i], cx[i], cy[i], cz[i], ex[i], ex[i], ex[i], kind)
+end
+print(string.format("%d entities (%d dynamic, %d octree nodes), %d queries of each kind", COUNT, index.dynamic, index.node_count, QUERIES))
+print(string.format("  insert            %8.2f ms", workers.now() - t0))
+
+-- Movement, through spatial.move (only dynamic ones)
+local moved = 0
+t0 = workers.now()
+for f = 1, FRAMES do
+    for k = 1, COUNT / 10 do
+        local i = math.random(0, COUNT - 1)
+        if(i % 5 ~= 0) then
+            cx[i], cy[i], cz[i] = cx[i] + rnd(-1, 1), cy[i] + rnd(-1, 1), cz[i] + rnd(-1, 1)
+            spatial.move(index, ids[i], cx[i], cy[i], cz[i])
+            moved = moved + 1
+        end
+    end
+end
+print(string.format("  move 10%% / frame  %8.3f ms / frame (%d moves)", (workers.now() - t0) / FRAMES, moved / FRAMES))
+
+-- --------------------------------------------------------------------------------------
+
+local function brute_radius(x, y, z, r)
+    local n, r2 = 0, r * r
+    for i = 0, COUNT - 1 do
+        local dx = max(abs(cx[i] - x) - ex[i], 0.0)
+        local dy = max(abs(cy[i] - y) - ex[i], 0.0)
+        local dz = max(abs(cz[i] - z) - ex[i], 0.0)
+        if(dx * dx + dy * dy + dz * dz <= r2) then n = n + 1 end
+    end
+    return n
+end
+
+local function brute_aabb(x0, y0, z0, x1, y1, z1)
+    local n = 0
+    for i = 0, COUNT - 1 do
+        local e = ex[i]
+        if(cx[i] + e >= x0 and cx[i] - e <= x1 and cy[i] + e >= y0 and cy[i] - e <= y1 and cz[i] + e >= z0 and cz[i] - e <= z1) then n = n + 1 end
+    end
+    return n
+end
+
+local function brute_nearest(x, y, z, k)
+    local d = {}
+    for i = 0, COUNT - 1 do
+        local dx, dy, dz = cx[i] - x, cy[i] - y, cz[i] - z
+        d[i + 1] = dx * dx + dy * dy + dz * dz
+    end
+    table.sort(d)
+    return sqrt(d[k])
+end
+
+local function brute_ray(ox, oy, oz, dx, dy, dz, tmax)
+    local best = tmax
+    local ix, iy, iz = 1 / dx, 1 / dy, 1 / dz
+    for i = 0, COUNT - 1 do
+        local e = ex[i]
+        local a, b = (cx[i] - e - ox) * ix, (cx[i] + e - ox) * ix
+        if(a > b) then a, b = b, a end
+        local t0, t1 = max(0, a), math.min(best, b)
+        a, b = (cy[i] - e - oy) * iy, (cy[i] + e - oy) * iy
+        if(a > b) then a, b = b, a end
+        t0, t1 = max(t0, a), math.min(t1, b)
+        a, b = (cz[i] - e - oz) * iz, (cz[i] + e - oz) * iz
+        if(a > b) then a, b = b, a end
+        t0, t1 = max(t0, a), math.min(t1, b)
+        if(t0 <= t1 and t0 < best) then best = t0 end
+    end
+    return best
+end
+
+-- --------------------------------------------------------------------------------------
+
+local function bench(label, make, indexed, brute, compare)
+    local args = {}
+    for q = 1, QUERIES do args[q] = make() end
+    local t = workers.now()
+    local r1 = {}
+    for q = 1, QUERIES do r1[q] = indexed(unpack(args[q])) end
+    local ims = workers.now() - t
+    -- Brute force is slow, a tenth of the queries are timed and compared
+    local bq = math.max(1, math.floor(QUERIES / 10))
+    t = workers.now()
+    local mismatches = 0
+    for q = 1, bq do
+        if(not compare(r1[q], brute(unpack(args[q])))) then mismatches = mismatches + 1 end
+    end
+    local bms = (workers.now() - t) / bq * QUERIES
+    print(string.format("  %-16s index %8.2f ms   brute force %9.1f ms   speedup %6.0fx   mismatches %d / %d",
+        label, ims, bms, bms / ims, mismatches, bq))
+end
+
+local out, dist = {}, {}
+local function same(a, b) return a == b end
+local function close(a, b) return abs(a - b) <= 1e-3 * max(1, abs(b)) end
+
+bench("radius 10",
+    function() return { rnd(-W, W), rnd(-H, H), rnd(-W, W), 10.0 } end,
+    function(x, y, z, r) return spatial.radius(index, x, y, z, r, out) end,
+    brute_radius, same)
+
+bench("aabb 20",
+    function() local x, y, z = rnd(-W, W), rnd(-H, H), rnd(-W, W); return { x - 10, y - 10, z - 10, x + 10, y + 10, z + 10 } end,
+    function(...) return spatial.aabb(index, select(1, ...), select(2, ...), select(3, ...), select(4, ...), select(5, ...), select(6, ...), out) end,
+    brute_aabb, same)
+
+bench("nearest 8",
+    function() return { rnd(-W, W), rnd(-H, H), rnd(-W, W), 8 } end,
+    function(x, y, z, k) local n = spatial.nearest(index, x, y, z, k, out, dist); return dist[n] end,
+    brute_nearest, close)
+
+bench("ray 500",
+    function()
+        local dx, dy, dz = rnd(-1, 1), rnd(-0.2, 0.2), rnd(-1, 1)
+        local len = sqrt(dx * dx + dy * dy + dz * dz)
+        return { rnd(-W, W), rnd(-H, H), rnd(-W, W), dx / len, dy / len, dz / len, 500.0 }
+    end,
+    function(ox, oy, oz, dx, dy, dz, tmax) local obj, t = spatial.ray(index, ox, oy, oz, dx, dy, dz, tmax); return t or tmax end,
+    brute_ray, close)
+
+-- --------------------------------------------------------------------------------------
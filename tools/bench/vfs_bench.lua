@@ -0,0 +1,175 @@
+-- --------------------------------------------------------------------------------------
+-- Cold start benchmark for tools/vfs/vfs.lua
+--   Packs the repo lua sources (engine, lua, ffi/sokol) and png images into an archive,
+--   then starts a fresh process per run that compiles every lua file and decodes every
+--   image, once from loose files and then through the mounted archive (default packing,
+--   nothing compressed, lua stored as bytecode). The page cache for the loose files and archives is dropped
+--   before each run (posix_fadvise), so every run reads from disk.
+--
+--   Run from the repo root:
+--      ./bin/linux/luajit tools/bench/vfs_bench.lua [runs]
+-- --------------------------------------------------------------------------------------
+
+package.path    = package.path..";./?.lua;./ffi/sokol/?.lua"
+
+local ffi       = require("ffi")
+local vfs       = require("tools.vfs.vfs")
+local workers   = dofile("engine/core/workers.lua")
+
+local tinsert   = table.insert
+
+ffi.cdef[[
+int bench_open(const char *path, int flags, ...) __asm__("open");
+int bench_close(int fd) __asm__("close");
+int bench_fadvise(int fd, int64_t offset, int64_t len, int advice) __asm__("posix_fadvise");
+]]
+
+local LUAJIT    = "./bin/linux/luajit"
+local SELF      = "tools/bench/vfs_bench.lua"
+
+-- --------------------------------------------------------------------------------------
+
+local function list(cmd)
+    local files = {}
+    local fh = io.popen(cmd, "r")
+    for line in fh:lines() do tinsert(files, line) end
+    fh:close()
+    return files
+end
+
+local function read_list(listfile)
+    local files = {}
+    for line in io.lines(listfile) do tinsert(files, line) end
+    return files
+end
+
+-- Drop the cached pages of a file (Linux, a no-op where posix_fadvise is missing)
+local function evict(path)
+    local ok, fd = pcall(ffi.C.bench_open, path, 0)
+    if(not ok or fd < 0) then return false end
+    ffi.C.bench_fadvise(fd, 0, 0, 4)   -- POSIX_FADV_DONTNEED
+    ffi.C.bench_close(fd)
+    return true
+end
+
+-- --------------------------------------------------------------------------------------
+-- Child: compile all lua, decode all images, print the times
+
+local function child(mode, listfile, archive)
+
+    local start = workers.now()
+    local stb = require("stb")
+    local files = read_list(listfile)
+    if(mode ~= "loose") then
+        assert(vfs.mount(archive))
+        vfs.install(true)
+    end
+    local mounted = workers.now()
+
+    local lua_ms, img_ms, bytes = 0, 0, 0
+    local x, y, n = ffi.new("int[1]"), ffi.new("int[1]"), ffi.new("int[1]")
+    for i, path in ipairs(files) do
+        local t = workers.now()
+        if(string.match(path, "%.lua$")) then
+            assert(loadfile(path), path)
+            lua_ms = lua_ms + workers.now() - t
+        else
+            local buf, size = vfs.load_file(path)
+            if(buf == nil) then
+                local fh = io.open(path, "rb")
+                buf = fh:read("*a")
+                fh:close()
+                size = #buf
+            end
+            local pixels = stb.stbi_load_from_memory(ffi.cast("const uint8_t *", buf), size, x, y, n, 4)
+            assert(pixels ~= nil, path)
+            stb.stbi_image_free(pixels)
+            bytes = bytes + size
+            img_ms = img_ms + workers.now() - t
+        end
+    end
+    print(string.format("%.3f %.3f %.3f %.3f", mounted - start, lua_ms, img_ms, workers.now() - start))
+end
+
+if(arg[1] == "--child") then
+    child(arg[2], arg[3], arg[4])
+    return
+end
+
+-- --------------------------------------------------------------------------------------
+-- Parent
+
+local runs = tonumber(arg[1]) or 5
+
+-- Only the sources that compile (a few files in the tree are work in progress)
+local luafiles = {}
+for i, f in ipairs(list([[find engine lua ffi/sokol -type f -name "*.lua" | sort]])) do
+    if(loadfile(f)) then tinsert(luafiles, f) end
+end
+local images   = list([[find data projects media -type f -name "*.png" | sort]])
+local files = {}
+for i, f in ipairs(luafiles) do tinsert(files, f) end
+for i, f in ipairs(images) do tinsert(files, f) end
+
+local listfile = os.tmpname()
+local fh = io.open(listfile, "w")
+fh:write(table.concat(files, "\n").."\n")
+fh:close()
+
+local packs, stored_packs = {}, {}
+for i, f in ipairs(files) do
+    tinsert(packs, { name = f, path = f })
+    tinsert(stored_packs, { name = f, path = f, compress = false })
+end
+local archive       = os.tmpname()
+local archive_st    = os.tmpname()
+local archive_bc    = os.tmpname()
+local plain     = assert(vfs.pack(archive, packs))
+local stored    = assert(vfs.pack(archive_st, stored_packs))
+local bc        = assert(vfs.pack(archive_bc, packs, { bytecode = true }))
+
+local loose_bytes = 0
+for i, f in ipairs(files) do
+    local h = io.open(f, "rb")
+    loose_bytes = loose_bytes + h:seek("end")
+    h:close()
+end
+
+print(string.format("%d lua files, %d images, %.1f MB loose", #luafiles, #images, loose_bytes / 1048576))
+print(string.format("  archive           %.1f MB (%d compressed, %d stored)", plain.archive / 1048576, plain.compressed, plain.stored))
+print(string.format("  archive stored    %.1f MB", stored.archive / 1048576))
+print(string.format("  archive bytecode  %.1f MB", bc.archive / 1048576))
+
+local cold = evict(listfile)
+if(not cold) then print("  posix_fadvise not available, runs are warm") end
+
+local modes = {
+    { name = "loose files",       mode = "loose", pak = "" },
+    { name = "archive",           mode = "pak",   pak = archive },
+    { name = "archive stored",    mode = "pak",   pak = archive_st },
+    { name = "archive bytecode",  mode = "pak",   pak = archive_bc },
+}
+
+for m, mode in ipairs(modes) do
+    local sum = { 0, 0, 0, 0, 0 }
+    for r = 1, runs do
+        for i, f in ipairs(files) do evict(f) end
+        evict(archive); evict(archive_st); evict(archive_bc); evict(LUAJIT)
+
+        local start = workers.now()
+        local out = io.popen(table.concat({ LUAJIT, SELF, "--child", mode.mode, listfile, mode.pak }, " ")):read("*a")
+        local wall = workers.now() - start
+        local i = 1
+        for v in string.gmatch(out, "%S+") do sum[i] = sum[i] + tonumber(v); i = i + 1 end
+        sum[5] = sum[5] + wall
+    end
+    print(string.format("  %-18s process %7.1f ms   in script %7.1f ms  (mount %.2f  lua %.1f  images %.1f)",
+        mode.name, sum[5] / runs, sum[4] / runs, sum[1] / runs, sum[2] / runs, sum[3] / runs))
+end
+
+os.remove(listfile)
+os.remove(archive)
+os.remove(archive_st)
+os.remove(archive_bc)
+
+-- --------------------------------------------------------------------------------------
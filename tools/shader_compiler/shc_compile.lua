@@ -43,7 +43,9 @@ end
 -- --------------------------------------------------------------------------------------
 -- Process the shader header file for use in the lua scripts
 --   returns a lua table that can then be used in the soko shader methods
-sh_compiler.process_shader = function( filename, shader_src, program_name )
+sh_compiler.process_shader = function( filename, shader_src, program_name, target_lang )
+
+    target_lang = target_lang or sh_compiler.target_lang
 
     if(program_name) then 
         program_name = program_name.."_"
@@ -84,14 +86,14 @@ sh_compiler.process_shader = function( filename, shader_src, program_name )
 
     local vs_source_count, vs_source = string.match(body_section, "static const uint8_t vs_"..program_name.."source_.-(%[.-%]) = (%{.-%});")
     if(vs_source) then 
-        ffi_str = ffi_str..[[local vs_]]..program_name..[[source_]]..sh_compiler.target_lang..[[ = ffi.new("uint8_t]]..vs_source_count..[[",]]..vs_source..")\n\n"
+        ffi_str = ffi_str..[[local vs_]]..program_name..[[source_]]..target_lang..[[ = ffi.new("uint8_t]]..vs_source_count..[[",]]..vs_source..")\n\n"
         --ffi_str = ffi_str..[[vs_]]..program_name..[[source_]]..sh_compiler.target_lang..[[ = ffi.string(vs_]]..program_name..[[source_]]..sh_compiler.target_lang..")\n\n"
     end
 
     -- get vs_source 
     local fs_source_count, fs_source = string.match(body_section, "static const uint8_t fs_"..program_name.."source_.-(%[.-%]) = (%{.-%});")
     if(fs_source) then 
-        ffi_str = ffi_str..[[local fs_]]..program_name..[[source_]]..sh_compiler.target_lang..[[ = ffi.new("uint8_t]]..fs_source_count..[[",]]..fs_source..")\n\n"
+        ffi_str = ffi_str..[[local fs_]]..program_name..[[source_]]..target_lang..[[ = ffi.new("uint8_t]]..fs_source_count..[[",]]..fs_source..")\n\n"
         --ffi_str = ffi_str..[[fs_]]..program_name..[[source_]]..sh_compiler.target_lang..[[ = ffi.string(fs_]]..program_name..[[source_]]..sh_compiler.target_lang..")\n\n"
     end
 
@@ -136,9 +138,18 @@ end
 sh_compiler.compile = function( glslfile, program_name )
 
     program_name = program_name or ""
+
+    -- Storage buffers need at least glsl430. Only bump shaders that use them.
+    local target_lang = sh_compiler.target_lang
+    local fh = io.open(glslfile, "r")
+    if(fh) then 
+        local src = fh:read("*a")
+        fh:close()
+        if(string.match(src, "readonly%s+buffer")) then target_lang = "glsl430" end
+    end
    
     local command = exec..' -i '..glslfile.." -o "..sh_compiler.console_out
-    command = command.." -l "..sh_compiler.target_lang.." -f "..sh_compiler.target_output
+    command = command.." -l "..target_lang.." -f "..sh_compiler.target_output
     -- print(command)
 
     local runner = io.popen(command, "r")
@@ -155,7 +166,7 @@ sh_compiler.compile = function( glslfile, program_name )
 
     -- Load in the generated file
     if(shader_src) then 
-        local res, err = sh_compiler.process_shader(glslfile, shader_src, program_name)
+        local res, err = sh_compiler.process_shader(glslfile, shader_src, program_name, target_lang)
         if(err) then 
             print("[sh_compiler.lua] Process Shader error: ", err)
             return nil 
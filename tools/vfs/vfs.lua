@@ -1,35 +1,518 @@
+local ffi       = require("ffi")
+local bit       = require("bit")
 
--- This is a stub of how to make a virtual file system append a loader to the package loader system
--- Not sure why other loaders are throw away. I think an insert would be nicer (ie, higher prioerity or similar)
+local tinsert   = table.insert
+local tconcat   = table.concat
+local sbyte     = string.byte
 
-loadfile = function(name, mode, ...)
-    local file = load_file(name) -- native function returning data blob
-    if file then
-        -- :as_chunk() method will do "lua_loadbuffer" and set environment if asked
-        return file:as_chunk(name, ...)
+---------------------------------------------------------------------------------------
+-- Packed asset archive for packaged builds.
+--
+--  Format: A header, then every entry's data at an align (4K) boundary, then the index
+--         (one vfs_entry per file sorted by name hash) and the name table at the end.
+--         Entries are stored as is, or as a zlib stream when that saves enough (text).
+--
+--  Runtime: An archive is memory mapped on mount. Lookups binary search the hash index
+--         in the map, so mounting does no per file work. load_file gives stored entries
+--         as a pointer into the map (zero copy), compressed ones are inflated into a new
+--         buffer. Mapped pointers stay valid until the archive is unmounted.
+--
+--  Require: install() puts the archive in front of the loose files for require, loadfile
+--         and dofile. Lua source still has to become a Lua string to be loaded, that is
+--         the only copy on the module path.
+---------------------------------------------------------------------------------------
+
+local vfs = {
+    align           = 4096,     -- Entry data alignment in the archive (page size)
+    compress_ratio  = 0.9,      -- Keep a compressed entry only if it is this size or smaller
+    quality         = 8,        -- zlib quality passed to stbi_zlib_compress
+    root            = nil,      -- Path prefix stripped from lookups (the packaged root folder)
+    archives        = {},       -- Mounted archives, the last mounted is searched first
+    stats = {
+        hits        = 0,        -- Files served from an archive
+        misses      = 0,        -- Lookups that fell through to loose files
+        inflated    = 0,        -- Bytes decompressed
+    },
+}
+
+-- Extensions compressed by default when packing. Images and binary meshes are left
+--   stored so they can be used straight from the map.
+vfs.compress_exts = {
+    lua = true, glsl = true, shc = true, gltf = true, json = true, obj = true,
+    mtl = true, txt = true, csv = true, xml = true, ini = true, cfg = true,
+}
+
+local MAGIC     = "SLPK"
+local VERSION   = 1
+local FLAG_ZLIB = 1
+
+---------------------------------------------------------------------------------------
+-- Platform calls are bound under vfs_ names so they never clash with other cdefs of
+--   the same functions (dasm_mm, uv-ffi, windows.lua).
+
+ffi.cdef[[
+typedef struct vfs_header {
+    char        magic[4];
+    uint32_t    version;
+    uint32_t    count;
+    uint32_t    align;
+    uint64_t    index_offset;
+    uint64_t    names_offset;
+    uint64_t    names_size;
+    uint64_t    size;
+} vfs_header;
+
+typedef struct vfs_entry {
+    int32_t     hash;
+    uint32_t    flags;
+    uint32_t    name_offset;
+    uint32_t    name_size;
+    uint64_t    offset;
+    uint64_t    size;
+    uint64_t    packed;
+} vfs_entry;
+
+void vfs_free(void *ptr) __asm__("free");
+]]
+
+local mapper = nil
+
+if(ffi.os == "Windows") then
+    ffi.cdef[[
+    void *vfs_CreateFileA(const char *name, uint32_t access, uint32_t share, void *sec, uint32_t disposition, uint32_t flags, void *tmpl) __asm__("CreateFileA");
+    int vfs_GetFileSizeEx(void *file, int64_t *size) __asm__("GetFileSizeEx");
+    void *vfs_CreateFileMappingA(void *file, void *sec, uint32_t protect, uint32_t size_hi, uint32_t size_lo, const char *name) __asm__("CreateFileMappingA");
+    void *vfs_MapViewOfFile(void *map, uint32_t access, uint32_t offset_hi, uint32_t offset_lo, size_t size) __asm__("MapViewOfFile");
+    int vfs_UnmapViewOfFile(const void *addr) __asm__("UnmapViewOfFile");
+    int vfs_CloseHandle(void *handle) __asm__("CloseHandle");
+    ]]
+    local INVALID_HANDLE = ffi.cast("void *", -1)
+
+    mapper = {
+        map = function(path)
+            local file = ffi.C.vfs_CreateFileA(path, 0x80000000, 1, nil, 3, 0x80, nil)
+            if(file == INVALID_HANDLE) then return nil end
+            local size = ffi.new("int64_t[1]")
+            local map = nil
+            if(ffi.C.vfs_GetFileSizeEx(file, size) ~= 0 and size[0] > 0) then
+                map = ffi.C.vfs_CreateFileMappingA(file, nil, 0x02, 0, 0, nil)
+            end
+            ffi.C.vfs_CloseHandle(file)
+            if(map == nil) then return nil end
+            local base = ffi.C.vfs_MapViewOfFile(map, 0x04, 0, 0, 0)
+            if(base == nil) then ffi.C.vfs_CloseHandle(map); return nil end
+            return ffi.cast("const uint8_t *", base), tonumber(size[0]), map
+        end,
+        unmap = function(base, size, map)
+            ffi.C.vfs_UnmapViewOfFile(base)
+            ffi.C.vfs_CloseHandle(map)
+        end,
+    }
+else
+    ffi.cdef[[
+    int vfs_open(const char *path, int flags, ...) __asm__("open");
+    int vfs_close(int fd) __asm__("close");
+    int64_t vfs_lseek(int fd, int64_t offset, int whence) __asm__("lseek");
+    void *vfs_mmap(void *addr, size_t len, int prot, int flags, int fd, int64_t offset) __asm__("mmap");
+    int vfs_munmap(void *addr, size_t len) __asm__("munmap");
+    ]]
+    local MAP_FAILED = ffi.cast("void *", -1)
+
+    mapper = {
+        map = function(path)
+            local fd = ffi.C.vfs_open(path, 0)     -- O_RDONLY
+            if(fd < 0) then return nil end
+            local size = tonumber(ffi.C.vfs_lseek(fd, 0, 2))     -- SEEK_END
+            local base = nil
+            if(size > 0) then
+                -- PROT_READ, MAP_PRIVATE. Entries are read only, writers must copy first.
+                base = ffi.C.vfs_mmap(nil, size, 1, 2, fd, 0)
+            end
+            -- The mapping keeps the file referenced after the descriptor is closed
+            ffi.C.vfs_close(fd)
+            if(base == nil or base == MAP_FAILED) then return nil end
+            return ffi.cast("const uint8_t *", base), size, true
+        end,
+        unmap = function(base, size, map)
+            ffi.C.vfs_munmap(ffi.cast("void *", base), size)
+        end,
+    }
+end
+
+-- Read only file map for other binary formats (world snapshots): base, size, map or nil.
+--   unmap_file takes the three values back.
+vfs.map_file = function(path) return mapper.map(path) end
+vfs.unmap_file = function(base, size, map) if(map) then mapper.unmap(base, size, map) end end
+
+-- Only needed for compressed entries (and packing them), so a missing stb is not fatal
+local stb = nil
+local function get_stb()
+    if(stb == nil) then
+        local ok, lib = pcall(require, "stb")
+        -- Packaged builds carry it under its path name
+        if(not ok) then ok, lib = pcall(require, "ffi.sokol.stb") end
+        stb = ok and lib or false
+    end
+    return stb or nil
+end
+
+---------------------------------------------------------------------------------------
+-- FNV-1a (32 bit). The multiply by 16777619 is split into (h << 24) + h * 403 so it
+--   stays exact in a double before wrapping.
+local function hash(name)
+    local h = bit.tobit(0x811c9dc5)
+    for i = 1, #name do
+        h = bit.bxor(h, sbyte(name, i))
+        h = bit.tobit(bit.lshift(h, 24) + h * 403)
+    end
+    return h
+end
+vfs.hash = hash
+
+---------------------------------------------------------------------------------------
+-- Archive names are relative, forward slashed and without ./ or .. segments.
+local function normalize(name)
+    name = string.gsub(name, "\\", "/")
+    name = string.gsub(name, "//+", "/")
+    name = string.gsub(name, "/%./", "/")
+    name = string.gsub(name, "^%./", "")
+    local prev = nil
+    while(prev ~= name) do
+        prev = name
+        name = string.gsub(name, "([^/]+)/%.%./", function(seg)
+            if(seg == "..") then return nil end
+            return ""
+        end)
+    end
+    local root = vfs.root
+    if(root and string.sub(name, 1, #root) == root) then name = string.sub(name, #root + 1) end
+    return name
+end
+vfs.normalize = normalize
+
+vfs.set_root = function(path)
+    if(path == nil) then vfs.root = nil; return end
+    local root = vfs.root
+    vfs.root = nil
+    root = normalize(path)
+    if(string.sub(root, -1) ~= "/") then root = root.."/" end
+    vfs.root = root
+end
+
+---------------------------------------------------------------------------------------
+-- Binary search for the first entry with the hash, then check names of equal hashes.
+local function find_entry(archive, name)
+
+    local h = hash(name)
+    local index = archive.index
+    local lo, hi = 0, archive.count
+    while(lo < hi) do
+        local mid = bit.rshift(lo + hi, 1)
+        if(index[mid].hash < h) then lo = mid + 1 else hi = mid end
+    end
+    while(lo < archive.count and index[lo].hash == h) do
+        local e = index[lo]
+        if(e.name_size == #name and ffi.string(archive.names + e.name_offset, e.name_size) == name) then
+            return e
+        end
+        lo = lo + 1
+    end
+    return nil
+end
+
+---------------------------------------------------------------------------------------
+-- Map an archive and check its header. Falls back to reading the whole file when it
+--   cannot be mapped. Returns the archive or nil and an error.
+vfs.mount = function(path)
+
+    local base, size, map = mapper.map(path)
+    local data = nil
+    if(base == nil) then
+        local fh = io.open(path, "rb")
+        if(fh == nil) then return nil, "cannot open archive: "..path end
+        data = fh:read("*a")
+        fh:close()
+        base, size = ffi.cast("const uint8_t *", data), #data
+    end
+
+    local archive = { path = path, base = base, size = size, map = map, data = data }
+    local header = ffi.cast("const vfs_header *", base)
+    if(size < ffi.sizeof("vfs_header") or ffi.string(header.magic, 4) ~= MAGIC
+        or header.version ~= VERSION or tonumber(header.size) ~= size
+        or tonumber(header.index_offset) + tonumber(header.count) * ffi.sizeof("vfs_entry") > size
+        or tonumber(header.names_offset) + tonumber(header.names_size) > size) then
+        if(map) then mapper.unmap(base, size, map) end
+        return nil, "not a valid archive: "..path
+    end
+
+    archive.header  = header
+    archive.count   = tonumber(header.count)
+    archive.index   = ffi.cast("const vfs_entry *", base + header.index_offset)
+    archive.names   = ffi.cast("const char *", base + header.names_offset)
+    tinsert(vfs.archives, 1, archive)
+    return archive
+end
+
+---------------------------------------------------------------------------------------
+-- Pointers from load_file into this archive are invalid afterwards.
+vfs.unmount = function(archive)
+
+    for i, a in ipairs(vfs.archives) do
+        if(a == archive) then table.remove(vfs.archives, i); break end
+    end
+    if(archive.map) then mapper.unmap(archive.base, archive.size, archive.map) end
+    archive.base, archive.index, archive.names, archive.data = nil, nil, nil, nil
+end
+
+---------------------------------------------------------------------------------------
+-- Returns the archive and entry holding the file, or nil.
+vfs.find = function(name)
+
+    if(#vfs.archives == 0 or name == nil) then return nil end
+    name = normalize(name)
+    for i, archive in ipairs(vfs.archives) do
+        local entry = find_entry(archive, name)
+        if(entry) then return archive, entry end
+    end
+    return nil
+end
+
+vfs.exists = function(name)
+    return vfs.find(name) ~= nil
+end
+
+---------------------------------------------------------------------------------------
+-- Returns a byte pointer and size for a file in a mounted archive, nil if it is not in one.
+--   Stored entries point into the map, compressed entries are inflated into a new buffer
+--   (the returned cdata owns it, keep it referenced while using the data).
+vfs.load_file = function(name)
+
+    local archive, entry = vfs.find(name)
+    if(archive == nil) then
+        vfs.stats.misses = vfs.stats.misses + 1
+        return nil
+    end
+    local size, packed = tonumber(entry.size), tonumber(entry.packed)
+    if(tonumber(entry.offset) + packed > archive.size) then
+        print("[Error] vfs.load_file | Entry outside of archive: "..name)
+        return nil
     end
-    return nil, "cannot open '"..name.."': No such file or directory"
+    local src = archive.base + entry.offset
+    vfs.stats.hits = vfs.stats.hits + 1
+    if(bit.band(entry.flags, FLAG_ZLIB) == 0) then return src, size end
+
+    local zlib = get_stb()
+    if(zlib == nil) then
+        print("[Error] vfs.load_file | No zlib to inflate: "..name)
+        return nil
+    end
+    local out = ffi.new("uint8_t[?]", math.max(size, 1))
+    local len = zlib.stbi_zlib_decode_buffer(ffi.cast("char *", out), size, ffi.cast("const char *", src), packed)
+    if(len ~= size) then
+        print("[Error] vfs.load_file | Cannot inflate: "..name)
+        return nil
+    end
+    vfs.stats.inflated = vfs.stats.inflated + size
+    return out, size
+end
+
+---------------------------------------------------------------------------------------
+-- The file as a Lua string, from an archive or from disk.
+vfs.read = function(name)
+
+    local data, size = vfs.load_file(name)
+    if(data) then return ffi.string(data, size) end
+    local fh = io.open(name, "rb")
+    if(fh == nil) then return nil end
+    local res = fh:read("*a")
+    fh:close()
+    return res
+end
+
+---------------------------------------------------------------------------------------
+-- loadfile/dofile/require over the archives. Loose files are the fallback unless
+--   install() was asked for exclusive loading.
+
+local io_loadfile   = loadfile
+local io_dofile     = dofile
+local exclusive     = false
+
+vfs.loadfile = function(name, mode, env)
+
+    if(name == nil) then return io_loadfile(name, mode, env) end
+    local data, size = vfs.load_file(name)
+    if(data) then return load(ffi.string(data, size), "@"..name, mode, env) end
+    if(exclusive) then return nil, "cannot open "..name.." (not in archive)" end
+    return io_loadfile(name, mode, env)
 end
 
-dofile = function(name, ...)
-    local chunk, err = loadfile(name)
+vfs.dofile = function(name, ...)
+    local chunk, err = vfs.loadfile(name)
     if not chunk then error(err, 2) end
     return chunk(...)
 end
 
-local function vfs_loader(modname, file)
-    local chunk, err = file:as_chunk(modname)
-    if not chunk then error(err,2) end
-    return chunk()
+local templates     = {}
+local templates_src = nil
+
+vfs.searcher = function(modname)
+
+    if(package.path ~= templates_src) then
+        templates = {}
+        templates_src = package.path
+        for t in string.gmatch(package.path, "[^;]+") do
+            if(string.find(t, "?", 1, true)) then tinsert(templates, t) end
+        end
+    end
+
+    local modpath = string.gsub(modname, "%.", "/")
+    local tried = { modpath..".lua", modpath.."/init.lua" }
+    for i, t in ipairs(templates) do tinsert(tried, (string.gsub(t, "%?", modpath))) end
+
+    for i, filename in ipairs(tried) do
+        local data, size = vfs.load_file(filename)
+        if(data) then
+            local chunk, err = load(ffi.string(data, size), "@"..normalize(filename))
+            if(chunk == nil) then error(err, 2) end
+            return chunk
+        end
+    end
+    return "\n\tno file '"..modpath..".lua' in archive"
 end
 
-local function vfs_searcher(fname)
-    local file = load_file(gsub(fname,"%.","/")..".lua")
-    if file then
-        return vfs_loader, file
+---------------------------------------------------------------------------------------
+-- Route loadfile, dofile and require through the archives. The searcher goes in after
+--   preload, ahead of the loose file searchers. With only = true the loose file
+--   searchers are dropped as well, so a packaged build cannot pick up stray files.
+vfs.install = function(only)
+
+    exclusive   = (only == true)
+    loadfile    = vfs.loadfile
+    dofile      = vfs.dofile
+    for i, s in ipairs(package.loaders) do
+        if(s == vfs.searcher) then table.remove(package.loaders, i); break end
+    end
+    if(exclusive) then
+        local loaders = package.loaders
+        for i = #loaders, 2, -1 do loaders[i] = nil end
     end
+    tinsert(package.loaders, 2, vfs.searcher)
 end
 
--- not just insert our searcher, but drop all the rest to disable
--- loading of external files
-package.searchers = { package.loaders[1], vfs_searcher }
\ No newline at end of file
+---------------------------------------------------------------------------------------
+-- Build an archive. files is a list of { name = archive name, path = source file,
+--   compress = true/false (default by extension) }. Lua files are stored as stripped
+--   bytecode when opts.bytecode is set.
+--   Returns stats { count, size, stored, packed, compressed } or nil and an error.
+vfs.pack = function(outfile, files, opts)
+
+    opts = opts or {}
+    local align = opts.align or vfs.align
+    local zlib = get_stb()
+
+    local fh = io.open(outfile, "wb")
+    if(fh == nil) then return nil, "cannot create archive: "..outfile end
+
+    local stats = { count = 0, size = 0, stored = 0, packed = 0, compressed = 0 }
+    local entries, byname = {}, {}
+    local pos = 0
+    local function write(str)
+        fh:write(str)
+        pos = pos + #str
+    end
+    local function pad()
+        local rem = pos % align
+        if(rem > 0) then write(string.rep("\0", align - rem)) end
+    end
+
+    write(string.rep("\0", ffi.sizeof("vfs_header")))
+    for i, file in ipairs(files) do
+        local name = normalize(file.name or file.path)
+        local src = io.open(file.path, "rb")
+        if(src == nil) then
+            print("[Error] vfs.pack | Cannot open: "..file.path)
+        else
+            local data = src:read("*a")
+            src:close()
+            local ext = string.lower(string.match(name, "%.([^%./]+)$") or "")
+            if(opts.bytecode and ext == "lua") then
+                local chunk = loadstring(data, "@"..name)
+                if(chunk) then data = string.dump(chunk, true) end
+            end
+
+            local flags, packed = 0, data
+            local compress = file.compress
+            if(compress == nil) then compress = (vfs.compress_exts[ext] == true) end
+            if(compress and zlib and #data > 0) then
+                local outlen = ffi.new("int[1]")
+                local z = zlib.stbi_zlib_compress(ffi.cast("unsigned char *", data), #data, outlen, vfs.quality)
+                if(z ~= nil) then
+                    if(outlen[0] <= #data * vfs.compress_ratio) then
+                        flags, packed = FLAG_ZLIB, ffi.string(z, outlen[0])
+                    end
+                    ffi.C.vfs_free(z)
+                end
+            end
+
+            pad()
+            local entry = { name = name, hash = hash(name), flags = flags, offset = pos,
+                size = #data, packed = #packed }
+            write(packed)
+            -- A repeated name replaces the earlier entry (its data is left unused)
+            if(byname[name]) then
+                entries[byname[name]] = entry
+            else
+                tinsert(entries, entry)
+                byname[name] = #entries
+            end
+            stats.size = stats.size + #data
+            stats.packed = stats.packed + #packed
+            if(flags == FLAG_ZLIB) then stats.compressed = stats.compressed + 1 else stats.stored = stats.stored + 1 end
+        end
+    end
+
+    table.sort(entries, function(a, b)
+        if(a.hash ~= b.hash) then return a.hash < b.hash end
+        return a.name < b.name
+    end)
+
+    pad()
+    local count = #entries
+    local index = ffi.new("vfs_entry[?]", math.max(count, 1))
+    local names, names_size = {}, 0
+    for i, e in ipairs(entries) do
+        local ie = index[i - 1]
+        ie.hash, ie.flags = e.hash, e.flags
+        ie.name_offset, ie.name_size = names_size, #e.name
+        ie.offset, ie.size, ie.packed = e.offset, e.size, e.packed
+        tinsert(names, e.name)
+        names_size = names_size + #e.name
+    end
+    local index_offset = pos
+    write(ffi.string(index, count * ffi.sizeof("vfs_entry")))
+    local names_offset = pos
+    write(tconcat(names))
+
+    local header = ffi.new("vfs_header[1]")
+    ffi.copy(header[0].magic, MAGIC, 4)
+    header[0].version       = VERSION
+    header[0].count         = count
+    header[0].align         = align
+    header[0].index_offset  = index_offset
+    header[0].names_offset  = names_offset
+    header[0].names_size    = names_size
+    header[0].size          = pos
+    fh:seek("set", 0)
+    fh:write(ffi.string(header, ffi.sizeof("vfs_header")))
+    fh:close()
+
+    stats.count = count
+    stats.archive = pos
+    return stats
+end
+
+---------------------------------------------------------------------------------------
+
+return vfs
+
+---------------------------------------------------------------------------------------